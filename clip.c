@@ -0,0 +1,418 @@
+/*
+ * UVC gadget test application - memory mapped video clips
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clip.h"
+
+#define JPEG_SOI 0xd8
+#define JPEG_EOI 0xd9
+#define JPEG_SOS 0xda
+#define JPEG_SOF0 0xc0
+#define JPEG_SOF2 0xc2
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME"
+
+static int clip_map(struct clip *clip, const char *filename)
+{
+    struct stat st;
+    int fd;
+
+    memset(clip, 0, sizeof *clip);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("CLIP: Unable to open '%s': %s (%d).\n", filename, strerror(errno), errno);
+        return -errno;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("CLIP: '%s' is empty or unreadable\n", filename);
+        close(fd);
+        return -EINVAL;
+    }
+
+    clip->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (clip->map == MAP_FAILED) {
+        printf("CLIP: Unable to map '%s': %s (%d).\n", filename, strerror(errno), errno);
+        clip->map = NULL;
+        return -errno;
+    }
+
+    clip->size = st.st_size;
+    madvise(clip->map, clip->size, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+static int clip_add_frame(struct clip *clip, const uint8_t *data, unsigned int size, unsigned int *alloc)
+{
+    struct clip_frame *frames;
+
+    if (clip->nframes == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 64;
+        frames = realloc(clip->frames, *alloc * sizeof *frames);
+        if (frames == NULL)
+            return -ENOMEM;
+        clip->frames = frames;
+    }
+
+    clip->frames[clip->nframes].data = data;
+    clip->frames[clip->nframes].size = size;
+    clip->nframes++;
+
+    if (size > clip->max_frame_size)
+        clip->max_frame_size = size;
+
+    return 0;
+}
+
+/*
+ * Walk the marker segments of the JPEG image starting at p, and return its
+ * size including the EOI marker, or 0 if it is not a complete image. Walking
+ * segments rather than searching for an EOI marker skips the thumbnails
+ * embedded in EXIF headers.
+ */
+static size_t jpeg_image_size(const uint8_t *p, const uint8_t *end, unsigned int *width, unsigned int *height)
+{
+    const uint8_t *start = p;
+    int scan = 0;
+
+    p += 2;
+    while (p + 2 <= end) {
+        uint8_t marker;
+        unsigned int length;
+
+        if (p[0] != 0xff)
+            return 0;
+
+        marker = p[1];
+        if (marker == 0xff) {
+            /* Fill byte. */
+            p++;
+            continue;
+        }
+
+        if (marker == JPEG_EOI)
+            return scan ? (size_t)(p + 2 - start) : 0;
+
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            p += 2;
+            continue;
+        }
+
+        if (p + 4 > end)
+            return 0;
+
+        length = (p[2] << 8) | p[3];
+        if (length < 2 || p + 2 + length > end)
+            return 0;
+
+        if ((marker == JPEG_SOF0 || marker == JPEG_SOF2 || marker == 0xc1) && length >= 7) {
+            *height = (p[5] << 8) | p[6];
+            *width = (p[7] << 8) | p[8];
+        }
+
+        p += 2 + length;
+
+        if (marker != JPEG_SOS)
+            continue;
+
+        /*
+         * Skip the entropy coded data, up to the next marker that is
+         * neither a stuffed 0xff nor a restart marker.
+         */
+        scan = 1;
+        for (; p + 1 < end; ++p) {
+            if (p[0] == 0xff && p[1] != 0x00 && !(p[1] >= 0xd0 && p[1] <= 0xd7))
+                break;
+        }
+    }
+
+    return 0;
+}
+
+int clip_open_mjpeg(struct clip *clip, const char *filename)
+{
+    const uint8_t *end;
+    const uint8_t *p;
+    unsigned int alloc = 0;
+    unsigned int width = 0, height = 0;
+    int ret;
+
+    ret = clip_map(clip, filename);
+    if (ret < 0)
+        return ret;
+
+    clip->format = CLIP_FORMAT_MJPEG;
+    p = clip->map;
+    end = p + clip->size;
+
+    while (p + 4 <= end) {
+        const uint8_t *soi = memchr(p, 0xff, end - p - 1);
+        size_t size;
+
+        if (soi == NULL)
+            break;
+
+        if (soi[1] != JPEG_SOI || soi + 4 > end || soi[2] != 0xff) {
+            p = soi + 1;
+            continue;
+        }
+
+        size = jpeg_image_size(soi, end, &width, &height);
+        if (!size) {
+            p = soi + 2;
+            continue;
+        }
+
+        if (!clip->nframes) {
+            clip->width = width;
+            clip->height = height;
+        }
+
+        ret = clip_add_frame(clip, soi, size, &alloc);
+        if (ret < 0) {
+            clip_close(clip);
+            return ret;
+        }
+
+        p = soi + size;
+    }
+
+    if (!clip->nframes) {
+        printf("CLIP: No JPEG image found in '%s'\n", filename);
+        clip_close(clip);
+        return -EINVAL;
+    }
+
+    printf("CLIP: '%s' indexed, %u MJPEG frame(s) of %ux%u, largest %u bytes\n", filename, clip->nframes,
+           clip->width, clip->height, clip->max_frame_size);
+
+    return 0;
+}
+
+static unsigned int clip_raw_frame_size(const struct clip *clip)
+{
+    unsigned int luma = clip->width * clip->height;
+
+    switch (clip->format) {
+    case CLIP_FORMAT_YUV420P:
+        return luma + 2 * ((clip->width + 1) / 2) * ((clip->height + 1) / 2);
+    case CLIP_FORMAT_YUV422P:
+    case CLIP_FORMAT_YUYV:
+        return luma * 2;
+    case CLIP_FORMAT_GREY:
+        return luma;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Parse the Y4M stream header ending at the first newline, and return a
+ * pointer to the first frame header, or NULL if the header is invalid.
+ */
+static const uint8_t *y4m_parse_header(struct clip *clip, const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *eol;
+
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+        return NULL;
+
+    clip->format = CLIP_FORMAT_YUV420P;
+    p += strlen(Y4M_MAGIC);
+
+    while (p < eol) {
+        const uint8_t *token = p;
+        size_t len;
+
+        while (p < eol && *p != ' ')
+            p++;
+        len = p - token;
+
+        switch (token[0]) {
+        case 'W':
+            clip->width = strtoul((const char *)token + 1, NULL, 10);
+            break;
+        case 'H':
+            clip->height = strtoul((const char *)token + 1, NULL, 10);
+            break;
+        case 'C':
+            if (len >= 4 && !memcmp(token, "C420", 4))
+                clip->format = CLIP_FORMAT_YUV420P;
+            else if (len == 4 && !memcmp(token, "C422", 4))
+                clip->format = CLIP_FORMAT_YUV422P;
+            else if (len == 5 && !memcmp(token, "Cmono", 5))
+                clip->format = CLIP_FORMAT_GREY;
+            else {
+                printf("CLIP: Unsupported Y4M colorspace '%.*s'\n", (int)len, token);
+                return NULL;
+            }
+            break;
+        default:
+            /* Frame rate, interlacing, aspect ratio and extensions. */
+            break;
+        }
+
+        while (p < eol && *p == ' ')
+            p++;
+    }
+
+    if (!clip->width || !clip->height || clip->width % 2) {
+        printf("CLIP: Invalid Y4M frame size %ux%u\n", clip->width, clip->height);
+        return NULL;
+    }
+
+    return eol + 1;
+}
+
+int clip_open_raw(struct clip *clip, const char *filename, unsigned int width, unsigned int height)
+{
+    const uint8_t *end;
+    const uint8_t *p;
+    unsigned int alloc = 0;
+    unsigned int frame_size;
+    int ret;
+
+    ret = clip_map(clip, filename);
+    if (ret < 0)
+        return ret;
+
+    p = clip->map;
+    end = p + clip->size;
+
+    if (clip->size > strlen(Y4M_MAGIC) && !memcmp(p, Y4M_MAGIC, strlen(Y4M_MAGIC))) {
+        p = y4m_parse_header(clip, p, end);
+        if (p == NULL) {
+            clip_close(clip);
+            return -EINVAL;
+        }
+    } else {
+        clip->format = CLIP_FORMAT_YUYV;
+        clip->width = width;
+        clip->height = height;
+    }
+
+    frame_size = clip_raw_frame_size(clip);
+
+    while (p < end) {
+        if (clip->format != CLIP_FORMAT_YUYV) {
+            /* Each Y4M frame starts with a FRAME line. */
+            const uint8_t *eol = memchr(p, '\n', end - p);
+
+            if (eol == NULL || memcmp(p, Y4M_FRAME, strlen(Y4M_FRAME)))
+                break;
+            p = eol + 1;
+        }
+
+        if ((size_t)(end - p) < frame_size)
+            break;
+
+        ret = clip_add_frame(clip, p, frame_size, &alloc);
+        if (ret < 0) {
+            clip_close(clip);
+            return ret;
+        }
+
+        p += frame_size;
+    }
+
+    if (!clip->nframes) {
+        printf("CLIP: No complete %ux%u frame found in '%s'\n", clip->width, clip->height, filename);
+        clip_close(clip);
+        return -EINVAL;
+    }
+
+    if (p != end)
+        printf("CLIP: Ignoring %zu trailing bytes in '%s'\n", (size_t)(end - p), filename);
+
+    printf("CLIP: '%s' indexed, %u %s frame(s) of %ux%u\n", filename, clip->nframes,
+           clip->format == CLIP_FORMAT_YUYV ? "YUYV" : "Y4M", clip->width, clip->height);
+
+    return 0;
+}
+
+/* Interleave planar rows into YUYV, using a neutral chroma for mono clips. */
+static void clip_pack_yuyv(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width)
+{
+    unsigned int x;
+
+    for (x = 0; x < width / 2; ++x) {
+        dst[4 * x + 0] = y[2 * x];
+        dst[4 * x + 1] = u ? u[x] : 0x80;
+        dst[4 * x + 2] = y[2 * x + 1];
+        dst[4 * x + 3] = v ? v[x] : 0x80;
+    }
+}
+
+unsigned int clip_read_frame(const struct clip *clip, unsigned int index, void *mem, unsigned int bytesperline)
+{
+    const struct clip_frame *frame = clip_frame(clip, index);
+    unsigned int cwidth = (clip->width + 1) / 2;
+    unsigned int cheight = (clip->height + 1) / 2;
+    const uint8_t *y = frame->data;
+    const uint8_t *u = NULL;
+    const uint8_t *v = NULL;
+    uint8_t *dst = mem;
+    unsigned int row;
+
+    switch (clip->format) {
+    case CLIP_FORMAT_MJPEG:
+        memcpy(mem, frame->data, frame->size);
+        return frame->size;
+
+    case CLIP_FORMAT_YUYV:
+        for (row = 0; row < clip->height; ++row)
+            memcpy(dst + row * bytesperline, y + row * clip->width * 2, clip->width * 2);
+        return bytesperline * clip->height;
+
+    case CLIP_FORMAT_YUV420P:
+        u = y + clip->width * clip->height;
+        v = u + cwidth * cheight;
+        break;
+
+    case CLIP_FORMAT_YUV422P:
+        u = y + clip->width * clip->height;
+        v = u + cwidth * clip->height;
+        break;
+
+    case CLIP_FORMAT_GREY:
+        break;
+    }
+
+    for (row = 0; row < clip->height; ++row) {
+        unsigned int crow = clip->format == CLIP_FORMAT_YUV420P ? row / 2 : row;
+
+        clip_pack_yuyv(y + row * clip->width, u ? u + crow * cwidth : NULL, v ? v + crow * cwidth : NULL,
+                       dst + row * bytesperline, clip->width);
+    }
+
+    return bytesperline * clip->height;
+}
+
+void clip_close(struct clip *clip)
+{
+    if (clip->map)
+        munmap(clip->map, clip->size);
+    free(clip->frames);
+    memset(clip, 0, sizeof *clip);
+}
@@ -0,0 +1,73 @@
+/*
+ * UVC gadget test application - memory mapped video clips
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _CLIP_H_
+#define _CLIP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum clip_format {
+    CLIP_FORMAT_MJPEG,
+    CLIP_FORMAT_YUYV,
+    CLIP_FORMAT_YUV420P,
+    CLIP_FORMAT_YUV422P,
+    CLIP_FORMAT_GREY,
+};
+
+struct clip_frame {
+    const uint8_t *data;
+    unsigned int size;
+};
+
+/*
+ * A video file mapped read-only in memory, with an index of the frames it
+ * contains. Frames are read straight from the page cache, so clips of any
+ * length can be streamed without holding them in heap memory.
+ */
+struct clip {
+    void *map;
+    size_t size;
+
+    enum clip_format format;
+
+    struct clip_frame *frames;
+    unsigned int nframes;
+    unsigned int max_frame_size;
+
+    /* Dimensions of the first frame, 0 if unknown for MJPEG. */
+    unsigned int width;
+    unsigned int height;
+};
+
+/*
+ * Map a file containing concatenated JPEG images (a raw MJPEG stream or an
+ * AVI with MJPEG video) and index every complete frame in it.
+ */
+int clip_open_mjpeg(struct clip *clip, const char *filename);
+
+/*
+ * Map an uncompressed clip, either a Y4M file (4:2:0, 4:2:2 or mono) or raw
+ * YUYV frames of the given size, and index its frames.
+ */
+int clip_open_raw(struct clip *clip, const char *filename, unsigned int width, unsigned int height);
+void clip_close(struct clip *clip);
+
+/*
+ * Copy a frame into mem, converting uncompressed frames to YUYV. Returns the
+ * number of bytes written.
+ */
+unsigned int clip_read_frame(const struct clip *clip, unsigned int index, void *mem, unsigned int bytesperline);
+
+static inline const struct clip_frame *clip_frame(const struct clip *clip, unsigned int index)
+{
+    return &clip->frames[index % clip->nframes];
+}
+
+#endif /* _CLIP_H_ */
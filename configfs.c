@@ -0,0 +1,486 @@
+/*
+ * UVC gadget test application - configfs function descriptors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <linux/videodev2.h>
+
+#include "configfs.h"
+#include "format.h"
+
+/* ---------------------------------------------------------------------------
+ * Attributes
+ */
+
+static int configfs_path(char *path, size_t size, const char *dir, const char *name)
+{
+    return snprintf(path, size, "%s/%s", dir, name) < (int)size ? 0 : -ENAMETOOLONG;
+}
+
+/* Read an attribute into a NUL-terminated buffer, returns its length. */
+static int configfs_read_attr(const char *dir, const char *name, void *buf, size_t size)
+{
+    char path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    if (configfs_path(path, sizeof path, dir, name) < 0)
+        return -ENAMETOOLONG;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    len = read(fd, buf, size - 1);
+    if (len < 0)
+        len = -errno;
+    else
+        ((char *)buf)[len] = '\0';
+
+    close(fd);
+    return len;
+}
+
+static int configfs_read_uint(const char *dir, const char *name, unsigned int *value)
+{
+    char buf[32];
+    char *end;
+    int ret;
+
+    ret = configfs_read_attr(dir, name, buf, sizeof buf);
+    if (ret < 0)
+        return ret;
+
+    *value = strtoul(buf, &end, 0);
+    return end == buf ? -EINVAL : 0;
+}
+
+/* Frame intervals are written one per line. */
+static int configfs_read_intervals(const char *dir, unsigned int **intervals)
+{
+    unsigned int *values = NULL;
+    unsigned int count = 0;
+    char buf[4096];
+    char *p, *end;
+    int ret;
+
+    ret = configfs_read_attr(dir, "dwFrameInterval", buf, sizeof buf);
+    if (ret < 0)
+        return ret;
+
+    for (p = buf;; p = end) {
+        unsigned long value = strtoul(p, &end, 0);
+        unsigned int *tmp;
+
+        if (end == p)
+            break;
+
+        if (!value)
+            continue;
+
+        tmp = realloc(values, (count + 1) * sizeof *values);
+        if (!tmp) {
+            free(values);
+            return -ENOMEM;
+        }
+
+        values = tmp;
+        values[count++] = value;
+    }
+
+    *intervals = values;
+    return count;
+}
+
+static int configfs_is_dir(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (name[0] == '.')
+        return 0;
+
+    if (configfs_path(path, sizeof path, dir, name) < 0)
+        return 0;
+
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/* ---------------------------------------------------------------------------
+ * Function lookup
+ */
+
+static void configfs_mount_point(char *path, size_t size)
+{
+    char type[64], dir[PATH_MAX];
+    FILE *mounts;
+
+    snprintf(path, size, "/sys/kernel/config");
+
+    mounts = fopen("/proc/mounts", "re");
+    if (!mounts)
+        return;
+
+    while (fscanf(mounts, "%*s %4095s %63s %*[^\n]", dir, type) == 2) {
+        if (!strcmp(type, "configfs")) {
+            snprintf(path, size, "%s", dir);
+            break;
+        }
+    }
+
+    fclose(mounts);
+}
+
+char *configfs_find_function(const char *devname)
+{
+    char path[PATH_MAX], gadgets[PATH_MAX], gadget[PATH_MAX], dir[PATH_MAX];
+    char udc[NAME_MAX + 1], bound[NAME_MAX + 1], name[NAME_MAX + 1];
+    char *function = NULL;
+    char *node;
+    struct dirent *entry;
+    unsigned int count = 0;
+    DIR *dirp;
+
+    /*
+     * The video node is a child of the gadget device, itself a child of
+     * the UDC the gadget is bound to.
+     */
+    node = realpath(devname, NULL);
+    if (!node)
+        return NULL;
+
+    snprintf(path, sizeof path, "/sys/class/video4linux/%s/device", strrchr(node, '/') + 1);
+    free(node);
+
+    node = realpath(path, NULL);
+    if (!node)
+        return NULL;
+
+    *strrchr(node, '/') = '\0';
+    snprintf(udc, sizeof udc, "%s", strrchr(node, '/') + 1);
+    free(node);
+
+    configfs_mount_point(path, sizeof path);
+    if (configfs_path(gadgets, sizeof gadgets, path, "usb_gadget") < 0)
+        return NULL;
+
+    dirp = opendir(gadgets);
+    if (!dirp)
+        return NULL;
+
+    gadget[0] = '\0';
+    while ((entry = readdir(dirp))) {
+        if (!configfs_is_dir(gadgets, entry->d_name) || configfs_path(dir, sizeof dir, gadgets, entry->d_name) < 0 ||
+            configfs_read_attr(dir, "UDC", bound, sizeof bound) <= 0)
+            continue;
+
+        bound[strcspn(bound, "\n")] = '\0';
+        if (!strcmp(bound, udc)) {
+            if (configfs_path(gadget, sizeof gadget, dir, "functions") < 0)
+                gadget[0] = '\0';
+            break;
+        }
+    }
+
+    closedir(dirp);
+
+    if (!gadget[0])
+        return NULL;
+
+    dirp = opendir(gadget);
+    if (!dirp)
+        return NULL;
+
+    while ((entry = readdir(dirp))) {
+        if (strncmp(entry->d_name, "uvc.", 4))
+            continue;
+
+        if (count++ == 0)
+            snprintf(name, sizeof name, "%s", entry->d_name);
+    }
+
+    closedir(dirp);
+
+    if (count == 1 && !configfs_path(path, sizeof path, gadget, name))
+        function = strdup(path);
+    else if (count > 1)
+        printf("configfs: %u UVC functions in %s, select one explicitly\n", count, gadget);
+
+    return function;
+}
+
+/* ---------------------------------------------------------------------------
+ * Descriptors
+ */
+
+/*
+ * Formats and frames are sorted by descriptor index. Kernels without index
+ * attributes assign them in the header link order, which isn't visible
+ * from configfs, directory names order is the best guess.
+ */
+struct configfs_entry {
+    char name[NAME_MAX + 1];
+    unsigned int order;
+    unsigned int index;
+};
+
+static int configfs_entry_compare(const void *a, const void *b)
+{
+    const struct configfs_entry *ea = a;
+    const struct configfs_entry *eb = b;
+
+    if (ea->index != eb->index)
+        return ea->index < eb->index ? -1 : 1;
+    if (ea->order != eb->order)
+        return ea->order < eb->order ? -1 : 1;
+    return strcmp(ea->name, eb->name);
+}
+
+/*
+ * List the subdirectories of dir with their index attribute. Entries with
+ * a zero index aren't part of the descriptors and are skipped.
+ */
+static int configfs_list(const char *dir, const char *attr, unsigned int order, struct configfs_entry **entries,
+                         unsigned int *count)
+{
+    char path[PATH_MAX];
+    struct configfs_entry *entry;
+    struct dirent *dent;
+    unsigned int index;
+    DIR *dirp;
+    int ret;
+
+    dirp = opendir(dir);
+    if (!dirp)
+        return errno == ENOENT ? 0 : -errno;
+
+    while ((dent = readdir(dirp))) {
+        if (!configfs_is_dir(dir, dent->d_name))
+            continue;
+
+        if (configfs_path(path, sizeof path, dir, dent->d_name) < 0)
+            continue;
+
+        ret = configfs_read_uint(path, attr, &index);
+        if (ret == -ENOENT)
+            index = UINT_MAX;
+        else if (ret < 0 || index == 0)
+            continue;
+
+        entry = realloc(*entries, (*count + 1) * sizeof *entry);
+        if (!entry) {
+            closedir(dirp);
+            return -ENOMEM;
+        }
+
+        *entries = entry;
+        entry = &entry[(*count)++];
+        snprintf(entry->name, sizeof entry->name, "%s", dent->d_name);
+        entry->order = order;
+        entry->index = index;
+    }
+
+    closedir(dirp);
+    return 0;
+}
+
+static int configfs_parse_frames(const char *dir, struct uvc_function_format *format)
+{
+    struct configfs_entry *entries = NULL;
+    struct uvc_function_frame *frames;
+    unsigned int count = 0;
+    unsigned int i;
+    char path[PATH_MAX];
+    int ret;
+
+    ret = configfs_list(dir, "bFrameIndex", 0, &entries, &count);
+    if (ret < 0 || count == 0) {
+        free(entries);
+        return ret < 0 ? ret : -ENOENT;
+    }
+
+    qsort(entries, count, sizeof *entries, configfs_entry_compare);
+
+    frames = calloc(count, sizeof *frames);
+    if (!frames) {
+        free(entries);
+        return -ENOMEM;
+    }
+
+    format->frames = frames;
+    format->num_frames = count;
+
+    for (i = 0; i < count; ++i) {
+        struct uvc_function_frame *frame = &frames[i];
+        unsigned int *intervals;
+
+        if (configfs_path(path, sizeof path, dir, entries[i].name) < 0) {
+            ret = -ENAMETOOLONG;
+            break;
+        }
+
+        frame->index = i + 1;
+        if (entries[i].index != UINT_MAX && entries[i].index != frame->index)
+            printf("configfs: %s: unexpected frame index %u\n", path, entries[i].index);
+
+        if (configfs_read_uint(path, "wWidth", &frame->width) < 0 ||
+            configfs_read_uint(path, "wHeight", &frame->height) < 0 || !frame->width || !frame->height) {
+            printf("configfs: %s: invalid frame size\n", path);
+            ret = -EINVAL;
+            break;
+        }
+
+        if (configfs_read_uint(path, "dwMaxVideoFrameBufferSize", &frame->max_size) < 0)
+            frame->max_size = 0;
+
+        ret = configfs_read_intervals(path, &intervals);
+        if (ret <= 0) {
+            printf("configfs: %s: no frame interval\n", path);
+            ret = -EINVAL;
+            break;
+        }
+
+        frame->intervals = intervals;
+        frame->num_intervals = ret;
+        ret = 0;
+    }
+
+    free(entries);
+    return ret;
+}
+
+static const char *const configfs_format_types[] = {
+    "uncompressed",
+    "mjpeg",
+};
+
+struct uvc_function_config *configfs_parse_function(const char *path)
+{
+    struct uvc_function_config *fc;
+    struct uvc_function_format *formats;
+    struct configfs_entry *entries = NULL;
+    unsigned int count = 0;
+    unsigned int num_formats = 0;
+    unsigned int i;
+    char dir[PATH_MAX];
+    int ret = 0;
+
+    for (i = 0; i < sizeof configfs_format_types / sizeof configfs_format_types[0]; ++i) {
+        snprintf(dir, sizeof dir, "%s/streaming/%s", path, configfs_format_types[i]);
+        ret = configfs_list(dir, "bFormatIndex", i, &entries, &count);
+        if (ret < 0)
+            break;
+    }
+
+    if (ret < 0 || count == 0) {
+        printf("configfs: %s: no streaming format\n", path);
+        free(entries);
+        return NULL;
+    }
+
+    qsort(entries, count, sizeof *entries, configfs_entry_compare);
+
+    fc = calloc(1, sizeof *fc);
+    formats = calloc(count, sizeof *formats);
+    if (!fc || !formats) {
+        free(formats);
+        free(fc);
+        free(entries);
+        return NULL;
+    }
+
+    fc->path = strdup(path);
+    fc->formats = formats;
+
+    configfs_read_uint(path, "streaming_maxpacket", &fc->streaming_maxpacket);
+    configfs_read_uint(path, "streaming_maxburst", &fc->streaming_maxburst);
+    configfs_read_uint(path, "streaming_interval", &fc->streaming_interval);
+
+    for (i = 0; i < count; ++i) {
+        struct uvc_function_format *format = &formats[num_formats];
+        const char *type = configfs_format_types[entries[i].order];
+
+        snprintf(dir, sizeof dir, "%s/streaming/%s/%s", path, type, entries[i].name);
+
+        format->index = i + 1;
+        if (entries[i].index != UINT_MAX && entries[i].index != format->index)
+            printf("configfs: %s: unexpected format index %u\n", dir, entries[i].index);
+
+        if (!strcmp(type, "mjpeg")) {
+            format->fcc = V4L2_PIX_FMT_MJPEG;
+        } else {
+            const struct format_info *info;
+            uint8_t guid[17];
+
+            ret = configfs_read_attr(dir, "guidFormat", guid, sizeof guid);
+            info = ret == 16 ? format_by_guid(guid) : NULL;
+            if (!info) {
+                /* The host still sees the format, but can't get it negotiated. */
+                printf("configfs: %s: unsupported format GUID, skipped\n", dir);
+                ret = 0;
+                continue;
+            }
+
+            format->fcc = info->fourcc;
+        }
+
+        fc->num_formats = ++num_formats;
+
+        ret = configfs_parse_frames(dir, format);
+        if (ret < 0) {
+            printf("configfs: %s: no usable frame\n", dir);
+            break;
+        }
+    }
+
+    free(entries);
+
+    if (ret == 0 && !num_formats) {
+        printf("configfs: %s: no supported streaming format\n", path);
+        ret = -EINVAL;
+    }
+
+    if (ret < 0) {
+        configfs_free_function(fc);
+        return NULL;
+    }
+
+    return fc;
+}
+
+void configfs_free_function(struct uvc_function_config *fc)
+{
+    unsigned int i, j;
+
+    if (!fc)
+        return;
+
+    for (i = 0; i < fc->num_formats; ++i) {
+        const struct uvc_function_format *format = &fc->formats[i];
+
+        for (j = 0; j < format->num_frames; ++j)
+            free((void *)format->frames[j].intervals);
+
+        free((void *)format->frames);
+    }
+
+    free((void *)fc->formats);
+    free(fc->path);
+    free(fc);
+}
@@ -0,0 +1,72 @@
+/*
+ * UVC gadget test application - configfs function descriptors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _CONFIGFS_H_
+#define _CONFIGFS_H_
+
+/*
+ * Streaming formats and frames of a UVC function, as the host sees them in
+ * the descriptors. Formats and frames are sorted by their descriptor index,
+ * starting at 1. Formats the application can't stream are left out, so
+ * formats are looked up by index, while the probe and commit frame indices
+ * map directly to array entries. Frame intervals are in 100 ns units, in
+ * descriptor order.
+ */
+struct uvc_function_frame {
+    unsigned int index;
+    unsigned int width;
+    unsigned int height;
+
+    /* dwMaxVideoFrameBufferSize, 0 when unknown. */
+    unsigned int max_size;
+
+    unsigned int num_intervals;
+    const unsigned int *intervals;
+};
+
+struct uvc_function_format {
+    unsigned int index;
+    unsigned int fcc;
+
+    unsigned int num_frames;
+    const struct uvc_function_frame *frames;
+};
+
+struct uvc_function_config {
+    /* configfs function directory, NULL for built-in tables. */
+    char *path;
+
+    unsigned int num_formats;
+    const struct uvc_function_format *formats;
+
+    /*
+     * Isochronous streaming endpoint settings, the kernel derives the
+     * endpoint descriptors of each speed from them. 0 when unknown.
+     */
+    unsigned int streaming_maxpacket;
+    unsigned int streaming_maxburst;
+    unsigned int streaming_interval;
+};
+
+/*
+ * Find the configfs directory of the UVC function exposed as the video
+ * node devname, from the UDC the gadget is bound to. Returns a newly
+ * allocated path, or NULL if the function can't be told apart.
+ */
+char *configfs_find_function(const char *devname);
+
+/*
+ * Parse the streaming formats of the UVC function at path, skipping
+ * uncompressed formats of an unknown GUID. Returns NULL with an error
+ * message printed if the function has no usable format.
+ */
+struct uvc_function_config *configfs_parse_function(const char *path);
+void configfs_free_function(struct uvc_function_config *fc);
+
+#endif /* _CONFIGFS_H_ */
@@ -0,0 +1,339 @@
+/*
+ * UVC gadget test application - pixel format conversion
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "convert.h"
+#include "format.h"
+
+/* ---------------------------------------------------------------------------
+ * Line kernels
+ *
+ * The SSE2 kernels write the destination with non-temporal stores, as the
+ * UVC buffers are not read back by the CPU. Stores are aligned by handling
+ * a scalar head first; YUYV lines always start on a 4 bytes boundary.
+ */
+
+static inline unsigned int convert_head(const uint8_t *dst, unsigned int size)
+{
+    unsigned int head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    return head < size ? head : size;
+}
+
+static void convert_line_copy(uint8_t *dst, const uint8_t *src, unsigned int size)
+{
+#if defined(__SSE2__)
+    unsigned int head = convert_head(dst, size);
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 16; size -= 16, src += 16, dst += 16)
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#endif
+
+    memcpy(dst, src, size);
+}
+
+/* Swap the bytes of every 16-bit word, turning UYVY into YUYV and back. */
+static void convert_line_uyvy(uint8_t *dst, const uint8_t *src, unsigned int size)
+{
+    unsigned int i;
+
+#if defined(__SSE2__)
+    unsigned int head = convert_head(dst, size);
+
+    for (i = 0; i < head; i += 2) {
+        dst[i] = src[i + 1];
+        dst[i + 1] = src[i];
+    }
+
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 16; size -= 16, src += 16, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+        _mm_stream_si128((__m128i *)dst, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for (; size >= 16; size -= 16, src += 16, dst += 16)
+        vst1q_u8(dst, vrev16q_u8(vld1q_u8(src)));
+#endif
+
+    for (i = 0; i < size; i += 2) {
+        dst[i] = src[i + 1];
+        dst[i + 1] = src[i];
+    }
+}
+
+/*
+ * Interleave a luma line with a line of CbCr pairs. NV12 chroma pairs are
+ * already in YUYV order, so this is a plain byte interleave.
+ */
+static void convert_line_nv12(uint8_t *dst, const uint8_t *luma, const uint8_t *chroma, unsigned int width)
+{
+    unsigned int i;
+
+#if defined(__SSE2__)
+    unsigned int head = convert_head(dst, width * 2) / 2;
+
+    for (i = 0; i < head; ++i) {
+        dst[2 * i] = luma[i];
+        dst[2 * i + 1] = chroma[i];
+    }
+
+    dst += head * 2;
+    luma += head;
+    chroma += head;
+    width -= head;
+
+    for (; width >= 16; width -= 16, luma += 16, chroma += 16, dst += 32) {
+        __m128i y = _mm_loadu_si128((const __m128i *)luma);
+        __m128i c = _mm_loadu_si128((const __m128i *)chroma);
+
+        _mm_stream_si128((__m128i *)dst, _mm_unpacklo_epi8(y, c));
+        _mm_stream_si128((__m128i *)(dst + 16), _mm_unpackhi_epi8(y, c));
+    }
+#elif defined(__ARM_NEON)
+    for (; width >= 16; width -= 16, luma += 16, chroma += 16, dst += 32) {
+        uint8x16x2_t v = {{vld1q_u8(luma), vld1q_u8(chroma)}};
+
+        vst2q_u8(dst, v);
+    }
+#endif
+
+    for (i = 0; i < width; ++i) {
+        dst[2 * i] = luma[i];
+        dst[2 * i + 1] = chroma[i];
+    }
+}
+
+/* Extract the luma bytes of a YUYV line. */
+static void convert_line_luma(uint8_t *dst, const uint8_t *src, unsigned int width)
+{
+    unsigned int i;
+
+#if defined(__SSE2__)
+    unsigned int head = convert_head(dst, width);
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+
+    for (i = 0; i < head; ++i)
+        dst[i] = src[2 * i];
+
+    dst += head;
+    src += head * 2;
+    width -= head;
+
+    for (; width >= 16; width -= 16, src += 32, dst += 16) {
+        __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i *)src), mask);
+        __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 16)), mask);
+
+        _mm_stream_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    for (; width >= 16; width -= 16, src += 32, dst += 16)
+        vst1q_u8(dst, vld2q_u8(src).val[0]);
+#endif
+
+    for (i = 0; i < width; ++i)
+        dst[i] = src[2 * i];
+}
+
+/* Widen the luma bytes of a YUYV line to little endian 16-bit samples. */
+static void convert_line_y16(uint8_t *dst, const uint8_t *src, unsigned int width)
+{
+    unsigned int i;
+
+#if defined(__SSE2__)
+    unsigned int head = convert_head(dst, width * 2) / 2;
+
+    for (i = 0; i < head; ++i) {
+        dst[2 * i] = 0;
+        dst[2 * i + 1] = src[2 * i];
+    }
+
+    dst += head * 2;
+    src += head * 2;
+    width -= head;
+
+    for (; width >= 8; width -= 8, src += 16, dst += 16)
+        _mm_stream_si128((__m128i *)dst, _mm_slli_epi16(_mm_loadu_si128((const __m128i *)src), 8));
+#endif
+
+    for (i = 0; i < width; ++i) {
+        dst[2 * i] = 0;
+        dst[2 * i + 1] = src[2 * i];
+    }
+}
+
+/*
+ * Extract the CbCr pairs of a YUYV line, averaged with the next line when
+ * there is one, into a line of the NV12 chroma plane.
+ */
+static void convert_line_chroma(uint8_t *dst, const uint8_t *src, const uint8_t *next, unsigned int width)
+{
+    unsigned int i;
+
+#if defined(__SSE2__)
+    unsigned int head = convert_head(dst, width);
+
+    for (i = 0; i < head; ++i)
+        dst[i] = (src[2 * i + 1] + next[2 * i + 1] + 1) / 2;
+
+    dst += head;
+    src += head * 2;
+    next += head * 2;
+    width -= head;
+
+    for (; width >= 16; width -= 16, src += 32, next += 32, dst += 16) {
+        __m128i a = _mm_packus_epi16(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)src), 8),
+                                     _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + 16)), 8));
+        __m128i b = _mm_packus_epi16(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)next), 8),
+                                     _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(next + 16)), 8));
+
+        _mm_stream_si128((__m128i *)dst, _mm_avg_epu8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; width >= 16; width -= 16, src += 32, next += 32, dst += 16)
+        vst1q_u8(dst, vrhaddq_u8(vld2q_u8(src).val[1], vld2q_u8(next).val[1]));
+#endif
+
+    for (i = 0; i < width; ++i)
+        dst[i] = (src[2 * i + 1] + next[2 * i + 1] + 1) / 2;
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame conversion
+ */
+
+static inline const uint8_t *convert_src_line(const struct convert_frame *frame, unsigned int line)
+{
+    return (const uint8_t *)frame->mem + line * frame->bytesperline;
+}
+
+static inline uint8_t *convert_dst_line(const struct convert_frame *frame, unsigned int line)
+{
+    return (uint8_t *)frame->mem + line * frame->bytesperline;
+}
+
+/* Copy a line of any uncompressed format, along with its chroma line. */
+static void convert_copy(const struct convert_frame *src, const struct convert_frame *dst, unsigned int line)
+{
+    const struct format_info *info = format_info(src->fourcc);
+
+    convert_line_copy(convert_dst_line(dst, line), convert_src_line(src, line), format_stride(info, src->width));
+
+    if (info->chroma_vsub && line % info->chroma_vsub == 0)
+        convert_line_copy(convert_dst_line(dst, dst->height + line / info->chroma_vsub),
+                          convert_src_line(src, src->height + line / info->chroma_vsub),
+                          format_stride(info, src->width));
+}
+
+static void convert_swap16(const struct convert_frame *src, const struct convert_frame *dst, unsigned int line)
+{
+    convert_line_uyvy(convert_dst_line(dst, line), convert_src_line(src, line), src->width * 2);
+}
+
+static void convert_nv12_to_yuyv(const struct convert_frame *src, const struct convert_frame *dst,
+                                 unsigned int line)
+{
+    convert_line_nv12(convert_dst_line(dst, line), convert_src_line(src, line),
+                      convert_src_line(src, src->height + line / 2), src->width);
+}
+
+static void convert_yuyv_to_nv12(const struct convert_frame *src, const struct convert_frame *dst,
+                                 unsigned int line)
+{
+    convert_line_luma(convert_dst_line(dst, line), convert_src_line(src, line), src->width);
+
+    if (line % 2 == 0)
+        convert_line_chroma(convert_dst_line(dst, dst->height + line / 2), convert_src_line(src, line),
+                            convert_src_line(src, line + 1 < src->height ? line + 1 : line), src->width);
+}
+
+static void convert_yuyv_to_grey(const struct convert_frame *src, const struct convert_frame *dst,
+                                 unsigned int line)
+{
+    convert_line_luma(convert_dst_line(dst, line), convert_src_line(src, line), src->width);
+}
+
+static void convert_yuyv_to_y16(const struct convert_frame *src, const struct convert_frame *dst,
+                                unsigned int line)
+{
+    convert_line_y16(convert_dst_line(dst, line), convert_src_line(src, line), src->width);
+}
+
+static const struct convert_kernel {
+    unsigned int from;
+    unsigned int to;
+    void (*line)(const struct convert_frame *src, const struct convert_frame *dst, unsigned int line);
+} convert_kernels[] = {
+    {V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_YUYV, convert_swap16},
+    {V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV, convert_nv12_to_yuyv},
+    {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, convert_swap16},
+    {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, convert_yuyv_to_nv12},
+    {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_GREY, convert_yuyv_to_grey},
+    {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_Y16, convert_yuyv_to_y16},
+};
+
+static const struct convert_kernel *convert_kernel(unsigned int from, unsigned int to)
+{
+    static const struct convert_kernel copy = {0, 0, convert_copy};
+    const struct format_info *info;
+    unsigned int i;
+
+    if (from == to) {
+        info = format_info(from);
+        return info && !format_is_compressed(info) ? &copy : NULL;
+    }
+
+    for (i = 0; i < sizeof convert_kernels / sizeof convert_kernels[0]; ++i) {
+        if (convert_kernels[i].from == from && convert_kernels[i].to == to)
+            return &convert_kernels[i];
+    }
+
+    return NULL;
+}
+
+int convert_supported(unsigned int from, unsigned int to)
+{
+    return convert_kernel(from, to) != NULL;
+}
+
+void convert_lines(const struct convert_frame *src, const struct convert_frame *dst, unsigned int first,
+                   unsigned int last)
+{
+    const struct convert_kernel *kernel = convert_kernel(src->fourcc, dst->fourcc);
+    unsigned int line;
+
+    if (!kernel)
+        return;
+
+    for (line = first; line < last; ++line)
+        kernel->line(src, dst, line);
+
+#if defined(__SSE2__)
+    /* Order the non-temporal stores before the buffer is handed over. */
+    _mm_sfence();
+#endif
+}
@@ -0,0 +1,42 @@
+/*
+ * UVC gadget test application - pixel format conversion
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+/*
+ * A single planar frame in memory. Semi-planar formats use the same line
+ * stride for all planes, with the chroma plane right after the luma plane,
+ * as described by the format layer.
+ */
+struct convert_frame {
+    unsigned int fourcc;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bytesperline;
+    void *mem;
+};
+
+/*
+ * Whether frames in the from format can be converted to the to format. Any
+ * uncompressed format can be copied, and YUYV can be converted from UYVY and
+ * NV12 and to UYVY, NV12, GREY and Y16.
+ */
+int convert_supported(unsigned int from, unsigned int to);
+
+/*
+ * Convert lines [first, last) of src into dst, which must have the same
+ * dimensions. Lines are converted in a single pass with vectorized (SSE2 or
+ * NEON, scalar otherwise) kernels and non-temporal stores, and disjoint line
+ * ranges can be converted concurrently.
+ */
+void convert_lines(const struct convert_frame *src, const struct convert_frame *dst, unsigned int first,
+                   unsigned int last);
+
+#endif /* _CONVERT_H_ */
@@ -0,0 +1,102 @@
+/*
+ * UVC gadget test application - adaptive queue depth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "depth.h"
+
+void depth_init(struct depth_control *ctl, unsigned int min, unsigned int max, unsigned int start)
+{
+    memset(ctl, 0, sizeof *ctl);
+
+    ctl->min = min;
+    ctl->max = max > min ? max : min;
+    ctl->depth = start < ctl->min ? ctl->min : start > ctl->max ? ctl->max : start;
+}
+
+unsigned int depth_needed(const struct depth_control *ctl)
+{
+    unsigned long long needed;
+
+    if (!ctl->interval)
+        return ctl->depth;
+
+    needed = 1 + (3 * ctl->jitter + ctl->interval - 1) / ctl->interval;
+    if (needed < ctl->min)
+        return ctl->min;
+    if (needed > ctl->max)
+        return ctl->max;
+
+    return needed;
+}
+
+/* Raise the depth to at least depth, and restart the calm period. */
+static void depth_raise(struct depth_control *ctl, unsigned int depth)
+{
+    ctl->calm = 0;
+
+    if (depth <= ctl->depth)
+        return;
+
+    ctl->depth = depth;
+    ctl->raised++;
+}
+
+unsigned int depth_dequeue(struct depth_control *ctl, unsigned long long now)
+{
+    unsigned long long delta, deviation;
+    unsigned int needed;
+
+    if (!ctl->last) {
+        ctl->last = now;
+        return ctl->depth;
+    }
+
+    delta = now - ctl->last;
+    ctl->last = now;
+
+    /* Weights of 1/16, as for the RFC 3550 interarrival jitter. */
+    if (!ctl->interval)
+        ctl->interval = delta;
+    else if (delta > ctl->interval)
+        ctl->interval += (delta - ctl->interval) / 16;
+    else
+        ctl->interval -= (ctl->interval - delta) / 16;
+
+    deviation = delta > ctl->interval ? delta - ctl->interval : ctl->interval - delta;
+    if (deviation > ctl->jitter)
+        ctl->jitter += (deviation - ctl->jitter) / 16;
+    else
+        ctl->jitter -= (ctl->jitter - deviation) / 16;
+
+    needed = depth_needed(ctl);
+    if (needed > ctl->depth) {
+        depth_raise(ctl, needed);
+        return ctl->depth;
+    }
+
+    if (++ctl->calm < DEPTH_CALM)
+        return ctl->depth;
+
+    ctl->calm = 0;
+    if (needed < ctl->depth) {
+        ctl->depth--;
+        ctl->lowered++;
+    }
+
+    return ctl->depth;
+}
+
+unsigned int depth_underrun(struct depth_control *ctl)
+{
+    ctl->underruns++;
+    depth_raise(ctl, ctl->depth < ctl->max ? ctl->depth + 1 : ctl->max);
+
+    return ctl->depth;
+}
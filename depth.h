@@ -0,0 +1,55 @@
+/*
+ * UVC gadget test application - adaptive queue depth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _DEPTH_H_
+#define _DEPTH_H_
+
+/*
+ * Queue depth controller. It picks how many buffers a queue keeps in flight,
+ * between min and max, from the timing of its dequeues. The mean dequeue
+ * interval and the mean deviation from it (the jitter) are tracked as
+ * exponentially weighted averages, and the depth needed is one buffer plus
+ * enough to cover three times the jitter.
+ *
+ * The depth goes up at once when more is needed or when the queue underruns,
+ * and comes down one buffer at a time after a calm period, DEPTH_CALM
+ * dequeues without an underrun or a raise.
+ */
+#define DEPTH_CALM 16
+
+struct depth_control {
+    unsigned int min;
+    unsigned int max;
+    unsigned int depth;
+
+    /* Dequeue timing in nanoseconds, last is 0 before the first dequeue. */
+    unsigned long long last;
+    unsigned long long interval;
+    unsigned long long jitter;
+    unsigned int calm;
+
+    unsigned long long underruns;
+    unsigned long long raised;
+    unsigned long long lowered;
+};
+
+/* Start at depth start, clamped to the bounds. */
+void depth_init(struct depth_control *ctl, unsigned int min, unsigned int max, unsigned int start);
+
+/* Depth needed for the jitter measured so far, within the bounds. */
+unsigned int depth_needed(const struct depth_control *ctl);
+
+/*
+ * Account for a dequeue at time now, in CLOCK_MONOTONIC ns, and for an
+ * underrun of the queue. Both return the new depth.
+ */
+unsigned int depth_dequeue(struct depth_control *ctl, unsigned long long now);
+unsigned int depth_underrun(struct depth_control *ctl);
+
+#endif /* _DEPTH_H_ */
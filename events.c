@@ -0,0 +1,249 @@
+/*
+ * UVC gadget test application - epoll based event engine
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "events.h"
+
+#define EVENTS_MAX_BATCH 16
+
+struct event_handler {
+    void (*callback)(void *priv);
+    void *priv;
+};
+
+/*
+ * One entry per watched file descriptor. The entry is stored in the epoll
+ * data pointer, so dispatching an event is a direct lookup with no per-wakeup
+ * setup. Entries released while a batch of events is being dispatched are
+ * parked on the dead list and freed once the batch completes.
+ */
+struct event_fd {
+    struct event_fd *next;
+    int fd;
+    unsigned int types;
+    struct event_handler read;
+    struct event_handler write;
+    struct event_handler except;
+};
+
+static uint32_t events_to_epoll(unsigned int types)
+{
+    uint32_t mask = 0;
+
+    if (types & EVENT_READ)
+        mask |= EPOLLIN;
+    if (types & EVENT_WRITE)
+        mask |= EPOLLOUT;
+    if (types & EVENT_EXCEPTION)
+        mask |= EPOLLPRI;
+
+    return mask;
+}
+
+static struct event_fd *events_find(struct events *events, int fd)
+{
+    struct event_fd *efd;
+
+    for (efd = events->fds; efd; efd = efd->next) {
+        if (efd->fd == fd)
+            return efd;
+    }
+
+    return NULL;
+}
+
+static struct event_handler *events_handler(struct event_fd *efd, enum event_type type)
+{
+    switch (type) {
+    case EVENT_READ:
+        return &efd->read;
+    case EVENT_WRITE:
+        return &efd->write;
+    case EVENT_EXCEPTION:
+    default:
+        return &efd->except;
+    }
+}
+
+int events_init(struct events *events)
+{
+    memset(events, 0, sizeof *events);
+
+    events->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (events->epoll_fd < 0) {
+        printf("EVENTS: epoll_create1 failed: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void events_free_list(struct event_fd *efd)
+{
+    struct event_fd *next;
+
+    for (; efd; efd = next) {
+        next = efd->next;
+        free(efd);
+    }
+}
+
+void events_cleanup(struct events *events)
+{
+    events_free_list(events->fds);
+    events_free_list(events->dead);
+    events->fds = NULL;
+    events->dead = NULL;
+
+    if (events->epoll_fd >= 0)
+        close(events->epoll_fd);
+    events->epoll_fd = -1;
+}
+
+int events_watch_fd(struct events *events, int fd, enum event_type type, void (*callback)(void *priv), void *priv)
+{
+    struct epoll_event ev;
+    struct event_handler *handler;
+    struct event_fd *efd;
+    int op;
+    int ret;
+
+    efd = events_find(events, fd);
+    if (efd == NULL) {
+        efd = calloc(1, sizeof *efd);
+        if (efd == NULL)
+            return -ENOMEM;
+
+        efd->fd = fd;
+        efd->next = events->fds;
+        events->fds = efd;
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    handler = events_handler(efd, type);
+    handler->callback = callback;
+    handler->priv = priv;
+
+    if (op == EPOLL_CTL_MOD && (efd->types & type))
+        return 0;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = events_to_epoll(efd->types | type);
+    ev.data.ptr = efd;
+
+    ret = epoll_ctl(events->epoll_fd, op, fd, &ev);
+    if (ret < 0) {
+        printf("EVENTS: unable to watch fd %d: %s (%d).\n", fd, strerror(errno), errno);
+        ret = -errno;
+        if (op == EPOLL_CTL_ADD) {
+            events->fds = efd->next;
+            free(efd);
+        }
+        return ret;
+    }
+
+    efd->types |= type;
+
+    return 0;
+}
+
+void events_unwatch_fd(struct events *events, int fd, enum event_type type)
+{
+    struct epoll_event ev;
+    struct event_fd **prev;
+    struct event_fd *efd;
+
+    for (prev = &events->fds; *prev; prev = &(*prev)->next) {
+        if ((*prev)->fd == fd)
+            break;
+    }
+
+    efd = *prev;
+    if (efd == NULL || !(efd->types & type))
+        return;
+
+    efd->types &= ~type;
+    memset(events_handler(efd, type), 0, sizeof(struct event_handler));
+
+    if (efd->types) {
+        memset(&ev, 0, sizeof ev);
+        ev.events = events_to_epoll(efd->types);
+        ev.data.ptr = efd;
+        epoll_ctl(events->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        return;
+    }
+
+    epoll_ctl(events->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    /* The entry may still be referenced by the batch being dispatched. */
+    *prev = efd->next;
+    efd->next = events->dead;
+    events->dead = efd;
+}
+
+static void events_dispatch(struct event_fd *efd, uint32_t mask)
+{
+    /*
+     * Errors and hangups are reported to the read and write handlers, the
+     * same way select() flags them in the read and write fd sets. Each
+     * handler is re-checked as a previous one may have unwatched it.
+     */
+    if (mask & (EPOLLERR | EPOLLHUP))
+        mask |= EPOLLIN | EPOLLOUT;
+
+    if ((mask & EPOLLPRI) && (efd->types & EVENT_EXCEPTION))
+        efd->except.callback(efd->except.priv);
+    if ((mask & EPOLLOUT) && (efd->types & EVENT_WRITE))
+        efd->write.callback(efd->write.priv);
+    if ((mask & EPOLLIN) && (efd->types & EVENT_READ))
+        efd->read.callback(efd->read.priv);
+}
+
+int events_loop(struct events *events)
+{
+    struct epoll_event evs[EVENTS_MAX_BATCH];
+    int nevents;
+    int i;
+
+    events->done = 0;
+
+    while (!events->done) {
+        nevents = epoll_wait(events->epoll_fd, evs, EVENTS_MAX_BATCH, -1);
+        if (nevents < 0) {
+            if (errno == EINTR)
+                continue;
+
+            printf("EVENTS: epoll_wait failed: %s (%d).\n", strerror(errno), errno);
+            return -errno;
+        }
+
+        for (i = 0; i < nevents; ++i)
+            events_dispatch(evs[i].data.ptr, evs[i].events);
+
+        events_free_list(events->dead);
+        events->dead = NULL;
+    }
+
+    return 0;
+}
+
+void events_stop(struct events *events)
+{
+    events->done = 1;
+}
@@ -0,0 +1,58 @@
+/*
+ * UVC gadget test application - epoll based event engine
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+/*
+ * Event types a file descriptor can be watched for. They map directly onto
+ * POLLIN, POLLOUT and POLLPRI: V4L2 capture devices signal filled buffers
+ * with POLLIN, the UVC output device signals free buffers with POLLOUT and
+ * pending UVC events with POLLPRI.
+ *
+ * Only the requested types are polled for, so a device whose buffer queue is
+ * idle can stay registered for its events without waking the loop up.
+ */
+enum event_type {
+    EVENT_READ = 1,
+    EVENT_WRITE = 2,
+    EVENT_EXCEPTION = 4,
+};
+
+struct event_fd;
+
+struct events {
+    int epoll_fd;
+    int done;
+
+    /* Registered file descriptors, and those released during a dispatch. */
+    struct event_fd *fds;
+    struct event_fd *dead;
+};
+
+int events_init(struct events *events);
+void events_cleanup(struct events *events);
+
+/*
+ * Register a handler for one event type on a file descriptor. A file
+ * descriptor can carry one handler per event type; registering a type that
+ * is already watched replaces its handler. Handlers can be added and removed
+ * at any time, including from within a handler.
+ */
+int events_watch_fd(struct events *events, int fd, enum event_type type, void (*callback)(void *priv), void *priv);
+void events_unwatch_fd(struct events *events, int fd, enum event_type type);
+
+/*
+ * Dispatch events until events_stop() is called or epoll_wait() fails.
+ * Returns 0 when stopped and a negative error code otherwise.
+ */
+int events_loop(struct events *events);
+void events_stop(struct events *events);
+
+#endif /* _EVENTS_H_ */
@@ -0,0 +1,67 @@
+/*
+ * UVC gadget test application - pixel format descriptors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#include "format.h"
+
+/* UVC GUIDs are the format fourcc followed by a common suffix. */
+#define UVC_GUID(a, b, c, d) {a, b, c, d, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}
+
+static const struct format_info formats[] = {
+    {V4L2_PIX_FMT_YUYV, "YUYV 4:2:2", UVC_GUID('Y', 'U', 'Y', '2'), 16, 2, 0, 0},
+    {V4L2_PIX_FMT_UYVY, "UYVY 4:2:2", UVC_GUID('U', 'Y', 'V', 'Y'), 16, 2, 1, 0},
+    {V4L2_PIX_FMT_NV12, "NV12 4:2:0", UVC_GUID('N', 'V', '1', '2'), 12, 1, 0, 2},
+    {V4L2_PIX_FMT_GREY, "Greyscale 8-bit", UVC_GUID('Y', '8', '0', '0'), 8, 1, 0, 0},
+    /* Little endian, the luma byte is the most significant one. */
+    {V4L2_PIX_FMT_Y16, "Greyscale 16-bit", UVC_GUID('Y', '1', '6', ' '), 16, 2, 1, 0},
+    {V4L2_PIX_FMT_MJPEG, "Motion-JPEG", {0}, 0, 0, 0, 0},
+};
+
+const struct format_info *format_info(unsigned int fourcc)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof formats / sizeof formats[0]; ++i) {
+        if (formats[i].fourcc == fourcc)
+            return &formats[i];
+    }
+
+    return NULL;
+}
+
+const struct format_info *format_by_guid(const uint8_t guid[16])
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof formats / sizeof formats[0]; ++i) {
+        if (formats[i].bpp && !memcmp(formats[i].guid, guid, sizeof formats[i].guid))
+            return &formats[i];
+    }
+
+    return NULL;
+}
+
+unsigned int format_stride(const struct format_info *info, unsigned int width)
+{
+    return width * info->cpp;
+}
+
+unsigned int format_frame_size(const struct format_info *info, unsigned int bytesperline, unsigned int height)
+{
+    unsigned int size = bytesperline * height;
+
+    if (info->chroma_vsub)
+        size += bytesperline * ((height + info->chroma_vsub - 1) / info->chroma_vsub);
+
+    return size;
+}
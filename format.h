@@ -0,0 +1,56 @@
+/*
+ * UVC gadget test application - pixel format descriptors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Memory layout of a pixel format. Uncompressed formats are stored as a
+ * packed plane, optionally followed by an interleaved chroma plane with the
+ * same line stride (NV12). Compressed formats have no layout, their frame
+ * size is only bounded by the buffer size.
+ */
+struct format_info {
+    unsigned int fourcc;
+    const char *name;
+
+    /* UVC uncompressed format GUID, all zeros for compressed formats. */
+    uint8_t guid[16];
+
+    /* Bits per pixel averaged over all planes, 0 for compressed formats. */
+    unsigned int bpp;
+
+    /* Bytes per pixel, and offset of the luma byte, in the first plane. */
+    unsigned int cpp;
+    unsigned int luma_offset;
+
+    /* Vertical subsampling of the chroma plane, 0 without a chroma plane. */
+    unsigned int chroma_vsub;
+};
+
+/* Look a format up by fourcc, returns NULL for unknown formats. */
+const struct format_info *format_info(unsigned int fourcc);
+
+/* Look an uncompressed format up by UVC GUID, returns NULL if unknown. */
+const struct format_info *format_by_guid(const uint8_t guid[16]);
+
+static inline int format_is_compressed(const struct format_info *info)
+{
+    return info->bpp == 0;
+}
+
+/* Line stride of the first plane, 0 for compressed formats. */
+unsigned int format_stride(const struct format_info *info, unsigned int width);
+
+/* Size of a frame with the given line stride, 0 for compressed formats. */
+unsigned int format_frame_size(const struct format_info *info, unsigned int bytesperline, unsigned int height);
+
+#endif /* _FORMAT_H_ */
@@ -0,0 +1,101 @@
+/*
+ * UVC gadget test application - latency histograms
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+static inline unsigned int histogram_index(uint64_t value)
+{
+    unsigned int exp;
+
+    if (value < HISTOGRAM_SUB_COUNT)
+        return value;
+
+    exp = 63 - __builtin_clzll(value);
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + (value >> (exp - HISTOGRAM_SUB_BITS))
+           - HISTOGRAM_SUB_COUNT;
+}
+
+/* Largest value falling in a bucket. */
+static uint64_t histogram_bucket_limit(unsigned int index)
+{
+    unsigned int shift;
+    uint64_t base;
+
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+
+    shift = index / HISTOGRAM_SUB_COUNT - 1;
+    base = (uint64_t)(HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT) << shift;
+
+    return base + ((1ULL << shift) - 1);
+}
+
+void histogram_reset(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof *histogram);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[histogram_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+    while (value > max) {
+        if (__atomic_compare_exchange_n(&histogram->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+uint64_t histogram_count(const struct histogram *histogram)
+{
+    return __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_max(const struct histogram *histogram)
+{
+    return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_sum(const struct histogram *histogram)
+{
+    return __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram, double p)
+{
+    uint64_t count = histogram_count(histogram);
+    uint64_t max = histogram_max(histogram);
+    uint64_t target;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (!count)
+        return 0;
+
+    target = p * count;
+    if (target < p * count || !target)
+        target++;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target)
+            break;
+    }
+
+    if (i == HISTOGRAM_BUCKETS)
+        return max;
+
+    return histogram_bucket_limit(i) < max ? histogram_bucket_limit(i) : max;
+}
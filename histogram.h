@@ -0,0 +1,48 @@
+/*
+ * UVC gadget test application - latency histograms
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram of 64-bit values. Each power of two range is split
+ * in HISTOGRAM_SUB_COUNT linear buckets, which bounds the relative error of
+ * any percentile to 1 / HISTOGRAM_SUB_COUNT over the whole value range.
+ *
+ * Recording is lock-free, any number of threads can record values and read
+ * percentiles concurrently. Readers see each counter atomically, but not a
+ * consistent snapshot of all of them.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1U << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+void histogram_reset(struct histogram *histogram);
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+uint64_t histogram_count(const struct histogram *histogram);
+uint64_t histogram_max(const struct histogram *histogram);
+uint64_t histogram_sum(const struct histogram *histogram);
+
+/*
+ * Value below which a fraction p of the recorded values falls, rounded up to
+ * the end of its bucket. Returns 0 for an empty histogram.
+ */
+uint64_t histogram_percentile(const struct histogram *histogram, double p);
+
+#endif /* _HISTOGRAM_H_ */
@@ -0,0 +1,481 @@
+/*
+ * UVC gadget test application - baseline JPEG encoder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeg.h"
+
+typedef float v8f __attribute__((vector_size(32)));
+typedef int32_t v8i __attribute__((vector_size(32)));
+typedef uint8_t v8u8 __attribute__((vector_size(8)));
+typedef uint8_t v32u8 __attribute__((vector_size(32)));
+
+/* Worst case size of an entropy coded MCU, including byte stuffing. */
+#define JPEG_MCU_MAX 2048
+
+/* Offsets and gains expanding BT.601 video range YCbCr to full range. */
+#define JPEG_LUMA_OFFSET (16.0f + 128.0f * 219.0f / 255.0f)
+#define JPEG_LUMA_GAIN (255.0f / 219.0f)
+#define JPEG_CHROMA_OFFSET 128.0f
+#define JPEG_CHROMA_GAIN (255.0f / 224.0f)
+
+/* ---------------------------------------------------------------------------
+ * Tables from ITU-T T.81 Annex K
+ */
+
+static const uint8_t jpeg_luma_quant[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+static const uint8_t jpeg_chroma_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99,
+    99, 99, 47, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+/* Natural (row major) index of the coefficients in zigzag order. */
+static const uint8_t jpeg_zigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+    41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+    30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static const uint8_t jpeg_dc_luma_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t jpeg_dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t jpeg_dc_values[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t jpeg_ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t jpeg_ac_luma_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22,
+    0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33,
+    0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34,
+    0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55,
+    0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76,
+    0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5,
+    0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1,
+    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+static const uint8_t jpeg_ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t jpeg_ac_chroma_values[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13,
+    0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62,
+    0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29,
+    0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54,
+    0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94,
+    0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3,
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+/* Scale factors of the AAN DCT outputs, cos(k * pi / 16) * sqrt(2). */
+static const float jpeg_aan_scale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+/*
+ * The 2D DCT leaves its output transposed, coefficient (u, v) at index
+ * v * 8 + u. Map natural order indices to DCT output order.
+ */
+static inline unsigned int jpeg_transposed(unsigned int n)
+{
+    return (n % 8) * 8 + n / 8;
+}
+
+/* ---------------------------------------------------------------------------
+ * Initialization
+ */
+
+static void jpeg_build_huffman(struct jpeg_huffman *huff, const uint8_t *bits, const uint8_t *values)
+{
+    unsigned int code = 0;
+    unsigned int len, i, k = 0;
+
+    for (len = 1; len <= 16; ++len) {
+        for (i = 0; i < bits[len - 1]; ++i, ++k) {
+            huff->code[values[k]] = code++;
+            huff->size[values[k]] = len;
+        }
+        code <<= 1;
+    }
+}
+
+static void jpeg_build_quant(uint8_t *quant, const uint8_t *base, unsigned int quality)
+{
+    unsigned int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    unsigned int i;
+
+    for (i = 0; i < 64; ++i) {
+        unsigned int q = (base[i] * scale + 50) / 100;
+
+        quant[i] = q < 1 ? 1 : q > 255 ? 255 : q;
+    }
+}
+
+static void jpeg_build_recip(float *recip, const uint8_t *quant, float gain)
+{
+    unsigned int u, v;
+
+    for (u = 0; u < 8; ++u) {
+        for (v = 0; v < 8; ++v)
+            recip[jpeg_transposed(u * 8 + v)] =
+                gain / (quant[u * 8 + v] * jpeg_aan_scale[u] * jpeg_aan_scale[v] * 8.0f);
+    }
+}
+
+static uint8_t *jpeg_put_marker(uint8_t *p, uint8_t marker, unsigned int length)
+{
+    *p++ = 0xff;
+    *p++ = marker;
+    *p++ = length >> 8;
+    *p++ = length & 0xff;
+    return p;
+}
+
+static uint8_t *jpeg_put_dht(uint8_t *p, uint8_t class_id, const uint8_t *bits, const uint8_t *values)
+{
+    unsigned int nvalues = 0;
+    unsigned int i;
+
+    for (i = 0; i < 16; ++i)
+        nvalues += bits[i];
+
+    *p++ = class_id;
+    memcpy(p, bits, 16);
+    memcpy(p + 16, values, nvalues);
+    return p + 16 + nvalues;
+}
+
+int jpeg_encoder_init(struct jpeg_encoder *enc, unsigned int width, unsigned int height, unsigned int quality)
+{
+    static const uint8_t jfif[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    uint8_t luma_quant[64];
+    uint8_t chroma_quant[64];
+    uint8_t *p, *dht;
+    unsigned int i;
+
+    if (!width || !height || width % 2 || width > 65535 || height > 65535 || quality < 1 || quality > 100)
+        return -EINVAL;
+
+    memset(enc, 0, sizeof *enc);
+    enc->width = width;
+    enc->height = height;
+    enc->quality = quality;
+
+    jpeg_build_quant(luma_quant, jpeg_luma_quant, quality);
+    jpeg_build_quant(chroma_quant, jpeg_chroma_quant, quality);
+    jpeg_build_recip(enc->luma_recip, luma_quant, JPEG_LUMA_GAIN);
+    jpeg_build_recip(enc->chroma_recip, chroma_quant, JPEG_CHROMA_GAIN);
+
+    jpeg_build_huffman(&enc->dc[0], jpeg_dc_luma_bits, jpeg_dc_values);
+    jpeg_build_huffman(&enc->dc[1], jpeg_dc_chroma_bits, jpeg_dc_values);
+    jpeg_build_huffman(&enc->ac[0], jpeg_ac_luma_bits, jpeg_ac_luma_values);
+    jpeg_build_huffman(&enc->ac[1], jpeg_ac_chroma_bits, jpeg_ac_chroma_values);
+
+    p = enc->header;
+    *p++ = 0xff;
+    *p++ = 0xd8;
+
+    p = jpeg_put_marker(p, 0xe0, 2 + sizeof jfif);
+    memcpy(p, jfif, sizeof jfif);
+    p += sizeof jfif;
+
+    p = jpeg_put_marker(p, 0xdb, 2 + 2 * 65);
+    *p++ = 0x00;
+    for (i = 0; i < 64; ++i)
+        *p++ = luma_quant[jpeg_zigzag[i]];
+    *p++ = 0x01;
+    for (i = 0; i < 64; ++i)
+        *p++ = chroma_quant[jpeg_zigzag[i]];
+
+    /* Y is subsampled 2x1 relative to the MCU, Cb and Cr 1x1. */
+    p = jpeg_put_marker(p, 0xc0, 17);
+    *p++ = 8;
+    *p++ = height >> 8;
+    *p++ = height & 0xff;
+    *p++ = width >> 8;
+    *p++ = width & 0xff;
+    *p++ = 3;
+    *p++ = 1, *p++ = 0x21, *p++ = 0;
+    *p++ = 2, *p++ = 0x11, *p++ = 1;
+    *p++ = 3, *p++ = 0x11, *p++ = 1;
+
+    dht = p;
+    p = jpeg_put_marker(p, 0xc4, 0);
+    p = jpeg_put_dht(p, 0x00, jpeg_dc_luma_bits, jpeg_dc_values);
+    p = jpeg_put_dht(p, 0x10, jpeg_ac_luma_bits, jpeg_ac_luma_values);
+    p = jpeg_put_dht(p, 0x01, jpeg_dc_chroma_bits, jpeg_dc_values);
+    p = jpeg_put_dht(p, 0x11, jpeg_ac_chroma_bits, jpeg_ac_chroma_values);
+    dht[2] = (p - dht - 2) >> 8;
+    dht[3] = (p - dht - 2) & 0xff;
+
+    p = jpeg_put_marker(p, 0xda, 12);
+    *p++ = 3;
+    *p++ = 1, *p++ = 0x00;
+    *p++ = 2, *p++ = 0x11;
+    *p++ = 3, *p++ = 0x11;
+    *p++ = 0;
+    *p++ = 63;
+    *p++ = 0;
+
+    enc->header_size = p - enc->header;
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Transform
+ */
+
+/*
+ * YUYV to planar unpacking for one 16x8 MCU row, with the level shift and
+ * range expansion offsets applied.
+ */
+static inline void jpeg_unpack_yuyv(const uint8_t *src, v8f *y0, v8f *y1, v8f *cb, v8f *cr)
+{
+    v32u8 px;
+
+    memcpy(&px, src, sizeof px);
+
+    *y0 = __builtin_convertvector(__builtin_shufflevector(px, px, 0, 2, 4, 6, 8, 10, 12, 14), v8f) - JPEG_LUMA_OFFSET;
+    *y1 = __builtin_convertvector(__builtin_shufflevector(px, px, 16, 18, 20, 22, 24, 26, 28, 30), v8f) -
+          JPEG_LUMA_OFFSET;
+    *cb = __builtin_convertvector(__builtin_shufflevector(px, px, 1, 5, 9, 13, 17, 21, 25, 29), v8f) -
+          JPEG_CHROMA_OFFSET;
+    *cr = __builtin_convertvector(__builtin_shufflevector(px, px, 3, 7, 11, 15, 19, 23, 27, 31), v8f) -
+          JPEG_CHROMA_OFFSET;
+}
+
+/*
+ * One dimensional AAN forward DCT across the 8 rows, transforming the 8
+ * columns at once. Outputs are scaled by the AAN factors.
+ */
+static inline void jpeg_fdct_columns(v8f *d)
+{
+    v8f tmp0 = d[0] + d[7], tmp7 = d[0] - d[7];
+    v8f tmp1 = d[1] + d[6], tmp6 = d[1] - d[6];
+    v8f tmp2 = d[2] + d[5], tmp5 = d[2] - d[5];
+    v8f tmp3 = d[3] + d[4], tmp4 = d[3] - d[4];
+    v8f tmp10, tmp11, tmp12, tmp13;
+    v8f z1, z2, z3, z4, z5, z11, z13;
+
+    /* Even part. */
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp1 + tmp2;
+    tmp12 = tmp1 - tmp2;
+
+    d[0] = tmp10 + tmp11;
+    d[4] = tmp10 - tmp11;
+
+    z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2] = tmp13 + z1;
+    d[6] = tmp13 - z1;
+
+    /* Odd part. */
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+
+    z5 = (tmp10 - tmp12) * 0.382683433f;
+    z2 = tmp10 * 0.541196100f + z5;
+    z4 = tmp12 * 1.306562965f + z5;
+    z3 = tmp11 * 0.707106781f;
+
+    z11 = tmp7 + z3;
+    z13 = tmp7 - z3;
+
+    d[5] = z13 + z2;
+    d[3] = z13 - z2;
+    d[1] = z11 + z4;
+    d[7] = z11 - z4;
+}
+
+static inline void jpeg_transpose(v8f *d)
+{
+    float t[64];
+    float *out = (float *)d;
+    unsigned int i, j;
+
+    memcpy(t, d, sizeof t);
+    for (i = 0; i < 8; ++i) {
+        for (j = 0; j < 8; ++j)
+            out[i * 8 + j] = t[j * 8 + i];
+    }
+}
+
+/* Transform and quantize a block, leaving coefficients in DCT output order. */
+static void jpeg_transform(v8f *d, const float *recip, int32_t *coef)
+{
+    const v8i limit = {1023, 1023, 1023, 1023, 1023, 1023, 1023, 1023};
+    unsigned int i;
+
+    jpeg_fdct_columns(d);
+    jpeg_transpose(d);
+    jpeg_fdct_columns(d);
+
+    for (i = 0; i < 8; ++i) {
+        v8f r;
+        v8i q, mask;
+
+        memcpy(&r, recip + i * 8, sizeof r);
+
+        /* Round to nearest, the bias keeps the conversion truncating up. */
+        q = __builtin_convertvector(d[i] * r + 16384.5f, v8i) - 16384;
+
+        /* Baseline AC coefficients are limited to 10 bits. */
+        mask = q > limit;
+        q = (q & ~mask) | (limit & mask);
+        mask = q < -limit;
+        q = (q & ~mask) | (-limit & mask);
+
+        memcpy(coef + i * 8, &q, sizeof q);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Entropy coding
+ */
+
+struct jpeg_writer {
+    uint8_t *p;
+    uint64_t bits;
+    unsigned int nbits;
+};
+
+static inline void jpeg_put_bits(struct jpeg_writer *w, uint32_t code, unsigned int size)
+{
+    w->bits = (w->bits << size) | code;
+    w->nbits += size;
+
+    while (w->nbits >= 8) {
+        uint8_t byte = w->bits >> (w->nbits - 8);
+
+        *w->p++ = byte;
+        if (byte == 0xff)
+            *w->p++ = 0x00;
+        w->nbits -= 8;
+    }
+}
+
+static inline void jpeg_put_symbol(struct jpeg_writer *w, const struct jpeg_huffman *huff, unsigned int run,
+                                   int value)
+{
+    unsigned int magnitude = value < 0 ? -value : value;
+    unsigned int nbits = magnitude ? 32 - __builtin_clz(magnitude) : 0;
+    unsigned int symbol = (run << 4) | nbits;
+
+    jpeg_put_bits(w, huff->code[symbol], huff->size[symbol]);
+    if (nbits)
+        jpeg_put_bits(w, (value < 0 ? value - 1 : value) & ((1U << nbits) - 1), nbits);
+}
+
+static void jpeg_encode_block(struct jpeg_writer *w, const int32_t *coef, int32_t *dc, const struct jpeg_huffman *dc_huff,
+                              const struct jpeg_huffman *ac_huff)
+{
+    unsigned int run = 0;
+    unsigned int k;
+
+    jpeg_put_symbol(w, dc_huff, 0, coef[0] - *dc);
+    *dc = coef[0];
+
+    for (k = 1; k < 64; ++k) {
+        int32_t value = coef[jpeg_transposed(jpeg_zigzag[k])];
+
+        if (!value) {
+            run++;
+            continue;
+        }
+
+        for (; run > 15; run -= 16)
+            jpeg_put_bits(w, ac_huff->code[0xf0], ac_huff->size[0xf0]);
+
+        jpeg_put_symbol(w, ac_huff, run, value);
+        run = 0;
+    }
+
+    /* End of block. */
+    if (run)
+        jpeg_put_bits(w, ac_huff->code[0x00], ac_huff->size[0x00]);
+}
+
+unsigned int jpeg_encode_yuyv(const struct jpeg_encoder *enc, const void *src, unsigned int bytesperline, void *dst,
+                              unsigned int size)
+{
+    struct jpeg_writer w = {0};
+    uint8_t *end = (uint8_t *)dst + size;
+    int32_t dc[3] = {0, 0, 0};
+    unsigned int x, y, i;
+
+    if (size < enc->header_size + JPEG_MCU_MAX)
+        return 0;
+
+    memcpy(dst, enc->header, enc->header_size);
+    w.p = (uint8_t *)dst + enc->header_size;
+
+    for (y = 0; y < enc->height; y += 8) {
+        const uint8_t *rows[8];
+
+        /* Replicate the last line to pad the last MCU row. */
+        for (i = 0; i < 8; ++i)
+            rows[i] = (const uint8_t *)src + (y + i < enc->height ? y + i : enc->height - 1) * bytesperline;
+
+        for (x = 0; x < enc->width; x += 16) {
+            v8f luma0[8], luma1[8], cb[8], cr[8];
+            int32_t coef[64] __attribute__((aligned(32)));
+
+            if (end - w.p < JPEG_MCU_MAX)
+                return 0;
+
+            for (i = 0; i < 8; ++i) {
+                const uint8_t *line = rows[i] + x * 2;
+                uint8_t pad[32];
+
+                /* Replicate the last pixel pair to pad the last MCU. */
+                if (x + 16 > enc->width) {
+                    unsigned int j, last = enc->width / 2 - 1;
+
+                    for (j = 0; j < 8; ++j)
+                        memcpy(pad + j * 4, rows[i] + (x / 2 + j < last ? x / 2 + j : last) * 4, 4);
+                    line = pad;
+                }
+
+                jpeg_unpack_yuyv(line, &luma0[i], &luma1[i], &cb[i], &cr[i]);
+            }
+
+            jpeg_transform(luma0, enc->luma_recip, coef);
+            jpeg_encode_block(&w, coef, &dc[0], &enc->dc[0], &enc->ac[0]);
+            jpeg_transform(luma1, enc->luma_recip, coef);
+            jpeg_encode_block(&w, coef, &dc[0], &enc->dc[0], &enc->ac[0]);
+            jpeg_transform(cb, enc->chroma_recip, coef);
+            jpeg_encode_block(&w, coef, &dc[1], &enc->dc[1], &enc->ac[1]);
+            jpeg_transform(cr, enc->chroma_recip, coef);
+            jpeg_encode_block(&w, coef, &dc[2], &enc->dc[1], &enc->ac[1]);
+        }
+    }
+
+    /* Pad the last byte with 1 bits and terminate the image. */
+    if (w.nbits)
+        jpeg_put_bits(&w, (1U << (8 - w.nbits)) - 1, 8 - w.nbits);
+
+    *w.p++ = 0xff;
+    *w.p++ = 0xd9;
+
+    return w.p - (uint8_t *)dst;
+}
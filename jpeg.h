@@ -0,0 +1,59 @@
+/*
+ * UVC gadget test application - baseline JPEG encoder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _JPEG_H_
+#define _JPEG_H_
+
+#include <stdint.h>
+
+#define JPEG_HEADER_MAX 1024
+
+struct jpeg_huffman {
+    uint16_t code[256];
+    uint8_t size[256];
+};
+
+/*
+ * Baseline 4:2:2 JPEG encoder for YUYV frames. The DCT, quantization and
+ * YUYV unpacking run on 8 columns at a time with GCC vector extensions,
+ * which map to SSE on x86 and NEON on ARM.
+ *
+ * The encoder is read-only once initialized, so any number of threads can
+ * encode frames with it concurrently.
+ */
+struct jpeg_encoder {
+    unsigned int width;
+    unsigned int height;
+    unsigned int quality;
+
+    /*
+     * Reciprocal quantization steps in DCT output order, with the AAN
+     * DCT scaling and the video to full range expansion folded in.
+     */
+    float luma_recip[64] __attribute__((aligned(32)));
+    float chroma_recip[64] __attribute__((aligned(32)));
+
+    struct jpeg_huffman dc[2];
+    struct jpeg_huffman ac[2];
+
+    /* Markers from SOI up to and including SOS. */
+    uint8_t header[JPEG_HEADER_MAX];
+    unsigned int header_size;
+};
+
+int jpeg_encoder_init(struct jpeg_encoder *enc, unsigned int width, unsigned int height, unsigned int quality);
+
+/*
+ * Encode a YUYV frame into dst, and return the size of the JPEG image, or 0
+ * if it doesn't fit in size bytes.
+ */
+unsigned int jpeg_encode_yuyv(const struct jpeg_encoder *enc, const void *src, unsigned int bytesperline, void *dst,
+                              unsigned int size);
+
+#endif /* _JPEG_H_ */
@@ -0,0 +1,139 @@
+/*
+ * UVC gadget test application - frame interval pacing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+#include "pacer.h"
+
+int pacer_init(struct pacer *pacer)
+{
+    memset(pacer, 0, sizeof *pacer);
+
+    pacer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pacer->fd < 0) {
+        printf("PACER: Unable to create timer: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+void pacer_cleanup(struct pacer *pacer)
+{
+    if (pacer->fd >= 0)
+        close(pacer->fd);
+    pacer->fd = -1;
+}
+
+unsigned long long pacer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long pacer_deadline(const struct pacer *pacer, unsigned long long seq)
+{
+    return pacer->start + seq * pacer->interval;
+}
+
+void pacer_start(struct pacer *pacer, unsigned long long interval)
+{
+    pacer->interval = interval;
+    pacer->start = pacer_now();
+    pacer->seq = 1;
+    pacer->released = 1;
+    pacer->missed = 0;
+    pacer->late = 0;
+    pacer->dropped = 0;
+}
+
+void pacer_stop(struct pacer *pacer)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+    timerfd_settime(pacer->fd, 0, &its, NULL);
+    pacer->interval = 0;
+}
+
+int pacer_arm(struct pacer *pacer)
+{
+    unsigned long long deadline = pacer_deadline(pacer, pacer->seq);
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+
+    if (timerfd_settime(pacer->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        printf("PACER: Unable to arm timer: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* Move to the deadline following the last one reached at time now. */
+static void pacer_advance(struct pacer *pacer, unsigned long long now)
+{
+    unsigned long long last = (now - pacer->start) / pacer->interval;
+
+    if (last > pacer->seq)
+        pacer->missed += last - pacer->seq;
+
+    pacer->seq = last + 1;
+}
+
+int pacer_expired(struct pacer *pacer)
+{
+    unsigned long long now;
+    uint64_t expirations;
+
+    if (read(pacer->fd, &expirations, sizeof expirations) != sizeof expirations)
+        return 0;
+
+    if (!pacer->interval)
+        return 0;
+
+    now = pacer_now();
+    if (now < pacer_deadline(pacer, pacer->seq)) {
+        pacer_arm(pacer);
+        return 0;
+    }
+
+    pacer_advance(pacer, now);
+    pacer_arm(pacer);
+
+    return 1;
+}
+
+int pacer_admit(struct pacer *pacer, unsigned long long now)
+{
+    if (now + pacer->interval / 4 < pacer_deadline(pacer, pacer->seq)) {
+        pacer->dropped++;
+        return 0;
+    }
+
+    if (now < pacer_deadline(pacer, pacer->seq))
+        pacer->seq++;
+    else
+        pacer_advance(pacer, now);
+
+    pacer->released++;
+    return 1;
+}
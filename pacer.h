@@ -0,0 +1,65 @@
+/*
+ * UVC gadget test application - frame interval pacing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _PACER_H_
+#define _PACER_H_
+
+/*
+ * Frame interval pacer. Deadlines are absolute CLOCK_MONOTONIC times, start
+ * + n * interval, so timer wake-up latency never accumulates into drift.
+ * Deadlines that have been overrun entirely are skipped and counted as
+ * missed instead of being caught up with a burst of frames.
+ *
+ * The pacer either drives a timerfd that expires at every deadline, for
+ * sources that can produce a frame on demand, or gates frames from a free
+ * running source down to the interval with pacer_admit().
+ */
+struct pacer {
+    int fd;
+
+    /* Schedule in nanoseconds, the interval is 0 when stopped. */
+    unsigned long long interval;
+    unsigned long long start;
+    unsigned long long seq;
+
+    unsigned long long released;
+    unsigned long long missed;
+    unsigned long long late;
+    unsigned long long dropped;
+};
+
+int pacer_init(struct pacer *pacer);
+void pacer_cleanup(struct pacer *pacer);
+
+unsigned long long pacer_now(void);
+
+/*
+ * Start a schedule at the current time. Deadline 0 is considered served by
+ * the caller's first frame, the next deadline is deadline 1.
+ */
+void pacer_start(struct pacer *pacer, unsigned long long interval);
+void pacer_stop(struct pacer *pacer);
+
+/* Arm the timer for the next deadline. */
+int pacer_arm(struct pacer *pacer);
+
+/*
+ * Consume a timer expiration. Returns 1 and re-arms the timer for the next
+ * deadline when a deadline has been reached, and 0 otherwise.
+ */
+int pacer_expired(struct pacer *pacer);
+
+/*
+ * Whether a frame produced at time now can be released. Frames are admitted
+ * up to a quarter interval ahead of their deadline to absorb source jitter,
+ * earlier frames are counted as dropped.
+ */
+int pacer_admit(struct pacer *pacer, unsigned long long now);
+
+#endif /* _PACER_H_ */
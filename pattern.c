@@ -0,0 +1,543 @@
+/*
+ * UVC gadget test application - test pattern generator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "convert.h"
+#include "format.h"
+#include "pattern.h"
+
+#define GRADIENT_PERIOD 256
+#define CHECKER_SIZE 32
+#define COUNTER_SCALE 4
+#define COUNTER_DIGITS 8
+
+struct yuv {
+    uint8_t y;
+    uint8_t u;
+    uint8_t v;
+};
+
+/* ---------------------------------------------------------------------------
+ * Row kernels
+ */
+
+/*
+ * Copy one row. Frame buffers are written once and then handed to the UDC,
+ * so non-temporal stores keep them from evicting the row templates.
+ */
+static void pattern_copy_row(uint8_t *dst, const uint8_t *src, unsigned int size)
+{
+#if defined(__SSE2__)
+    unsigned int head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (head > size)
+        head = size;
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, src += 64, dst += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+
+    for (; size >= 16; size -= 16, src += 16, dst += 16)
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+
+    memcpy(dst, src, size);
+#elif defined(__ARM_NEON)
+    for (; size >= 64; size -= 64, src += 64, dst += 64) {
+        uint8x16x4_t v = vld1q_u8_x4(src);
+
+        vst1q_u8_x4(dst, v);
+    }
+
+    for (; size >= 16; size -= 16, src += 16, dst += 16)
+        vst1q_u8(dst, vld1q_u8(src));
+
+    memcpy(dst, src, size);
+#else
+    memcpy(dst, src, size);
+#endif
+}
+
+static inline uint32_t xorshift32(uint32_t x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static void pattern_noise_bytes(uint8_t *dst, unsigned int size, uint32_t seed[4])
+{
+    while (size) {
+        uint32_t r = seed[0] = xorshift32(seed[0]);
+        unsigned int n = size < 4 ? size : 4;
+
+        memcpy(dst, &r, n);
+        dst += n;
+        size -= n;
+    }
+}
+
+/*
+ * Fill one row with noise, using four independent xorshift32 generators
+ * stepped in parallel, 16 bytes per step.
+ */
+static void pattern_noise_row(uint8_t *dst, unsigned int size, uint32_t seed[4])
+{
+#if defined(__SSE2__)
+    unsigned int head = (16 - ((uintptr_t)dst & 15)) & 15;
+    __m128i x;
+
+    if (head > size)
+        head = size;
+
+    pattern_noise_bytes(dst, head, seed);
+    dst += head;
+    size -= head;
+
+    x = _mm_loadu_si128((const __m128i *)seed);
+    for (; size >= 16; size -= 16, dst += 16) {
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        _mm_stream_si128((__m128i *)dst, x);
+    }
+    _mm_storeu_si128((__m128i *)seed, x);
+#elif defined(__ARM_NEON)
+    uint32x4_t x = vld1q_u32(seed);
+
+    for (; size >= 16; size -= 16, dst += 16) {
+        x = veorq_u32(x, vshlq_n_u32(x, 13));
+        x = veorq_u32(x, vshrq_n_u32(x, 17));
+        x = veorq_u32(x, vshlq_n_u32(x, 5));
+        vst1q_u8(dst, vreinterpretq_u8_u32(x));
+    }
+
+    vst1q_u32(seed, x);
+#else
+    uint32_t tmp[4];
+    unsigned int i;
+
+    for (; size >= 16; size -= 16, dst += 16) {
+        for (i = 0; i < 4; ++i)
+            tmp[i] = seed[i] = xorshift32(seed[i]);
+        memcpy(dst, tmp, 16);
+    }
+#endif
+
+    pattern_noise_bytes(dst, size, seed);
+}
+
+/* ---------------------------------------------------------------------------
+ * Row templates
+ */
+
+static struct yuv rgb_to_yuv(int r, int g, int b)
+{
+    struct yuv yuv;
+
+    /* ITU-R BT.601, limited range. */
+    yuv.y = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+    yuv.u = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+    yuv.v = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+
+    return yuv;
+}
+
+static void put_pair(uint8_t *row, unsigned int x, struct yuv yuv)
+{
+    uint8_t *p = row + x * 2;
+
+    p[0] = yuv.y;
+    p[1] = yuv.u;
+    p[2] = yuv.y;
+    p[3] = yuv.v;
+}
+
+/* SMPTE style color bars: 75% bars, castellations and a PLUGE row. */
+static void pattern_init_bars(struct pattern *pattern, uint8_t *rows, unsigned int row_size)
+{
+    static const int bars[7][3] = {
+        {191, 191, 191}, {191, 191, 0}, {0, 191, 191}, {0, 191, 0}, {191, 0, 191}, {191, 0, 0}, {0, 0, 191},
+    };
+    static const int castellations[7][3] = {
+        {0, 0, 191}, {0, 0, 0}, {191, 0, 191}, {0, 0, 0}, {0, 191, 191}, {0, 0, 0}, {191, 191, 191},
+    };
+    static const int pluge[8][3] = {
+        {0, 58, 98}, {255, 255, 255}, {65, 0, 126}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {10, 10, 10}, {0, 0, 0},
+    };
+    unsigned int width = pattern->width;
+    uint8_t *row;
+    unsigned int x;
+    unsigned int i;
+
+    for (x = 0; x < width; x += 2) {
+        i = x * 7 / width;
+        put_pair(rows, x, rgb_to_yuv(bars[i][0], bars[i][1], bars[i][2]));
+
+        row = rows + row_size;
+        put_pair(row, x, rgb_to_yuv(castellations[i][0], castellations[i][1], castellations[i][2]));
+
+        /* Simplified PLUGE row: -I, white, +Q and black level steps. */
+        i = x * 8 / width;
+        row = rows + 2 * row_size;
+        put_pair(row, x, rgb_to_yuv(pluge[i][0], pluge[i][1], pluge[i][2]));
+    }
+}
+
+/* A luma ramp repeated every GRADIENT_PERIOD pixels, read at a moving offset. */
+static void pattern_init_gradient(uint8_t *rows, unsigned int row_size)
+{
+    unsigned int npixels = row_size / 2;
+    struct yuv yuv;
+    unsigned int x;
+
+    for (x = 0; x < npixels; x += 2) {
+        unsigned int phase = x % GRADIENT_PERIOD;
+
+        yuv.y = 16 + phase * 219 / (GRADIENT_PERIOD - 1);
+        yuv.u = 128 + (phase < GRADIENT_PERIOD / 2 ? phase : GRADIENT_PERIOD - phase) / 4;
+        yuv.v = 128 - (phase < GRADIENT_PERIOD / 2 ? phase : GRADIENT_PERIOD - phase) / 4;
+        put_pair(rows, x, yuv);
+    }
+}
+
+/* Two phases of a checkerboard row, scrolled horizontally over time. */
+static void pattern_init_checkerboard(uint8_t *rows, unsigned int row_size)
+{
+    struct yuv white = rgb_to_yuv(235, 235, 235);
+    struct yuv black = rgb_to_yuv(20, 20, 20);
+    unsigned int npixels = row_size / 2;
+    unsigned int x;
+
+    for (x = 0; x < npixels; x += 2) {
+        int odd = (x / CHECKER_SIZE) & 1;
+
+        put_pair(rows, x, odd ? black : white);
+        put_pair(rows + row_size, x, odd ? white : black);
+    }
+}
+
+/*
+ * Render the row templates in YUYV, and convert them to the pattern format
+ * one row at a time.
+ */
+static int pattern_init_rows(struct pattern *pattern, unsigned int npixels)
+{
+    unsigned int yuyv_size = npixels * 2;
+    struct convert_frame src = {V4L2_PIX_FMT_YUYV, npixels, 1, yuyv_size, NULL};
+    struct convert_frame dst = {pattern->format->fourcc, npixels, 1, pattern->line_size, NULL};
+    uint8_t *yuyv;
+    unsigned int i;
+
+    pattern->rows = malloc(pattern->row_size * pattern->nrows);
+    yuyv = malloc(yuyv_size * pattern->nrows);
+    if (pattern->rows == NULL || yuyv == NULL) {
+        free(yuyv);
+        return -ENOMEM;
+    }
+
+    switch (pattern->type) {
+    case PATTERN_BARS:
+        pattern_init_bars(pattern, yuyv, yuyv_size);
+        break;
+    case PATTERN_GRADIENT:
+        pattern_init_gradient(yuyv, yuyv_size);
+        break;
+    case PATTERN_CHECKERBOARD:
+        pattern_init_checkerboard(yuyv, yuyv_size);
+        break;
+    default:
+        break;
+    }
+
+    for (i = 0; i < pattern->nrows; ++i) {
+        src.mem = yuyv + i * yuyv_size;
+        dst.mem = pattern->rows + i * pattern->row_size;
+        convert_lines(&src, &dst, 0, 1);
+    }
+
+    free(yuyv);
+    return 0;
+}
+
+int pattern_init(struct pattern *pattern, enum pattern_type type, unsigned int fourcc, unsigned int width,
+                 unsigned int height)
+{
+    const struct format_info *format = format_info(fourcc);
+    unsigned int extra = 0;
+    unsigned int nrows = 1;
+
+    pattern_cleanup(pattern);
+
+    if (type >= PATTERN_COUNT || width < 2 || !height)
+        return -EINVAL;
+
+    if (!format || !convert_supported(V4L2_PIX_FMT_YUYV, fourcc))
+        return -EINVAL;
+
+    switch (type) {
+    case PATTERN_BARS:
+        nrows = 3;
+        break;
+    case PATTERN_GRADIENT:
+        extra = GRADIENT_PERIOD;
+        break;
+    case PATTERN_CHECKERBOARD:
+        extra = 2 * CHECKER_SIZE;
+        nrows = 2;
+        break;
+    case PATTERN_NOISE:
+    default:
+        nrows = 0;
+        break;
+    }
+
+    pattern->type = type;
+    pattern->format = format;
+    pattern->width = width & ~1;
+    pattern->height = height;
+    pattern->frame = 0;
+    pattern->line_size = format_stride(format, pattern->width + extra);
+    pattern->row_size = pattern->line_size * (format->chroma_vsub ? 2 : 1);
+    pattern->nrows = nrows;
+    pattern->seed[0] = 0x9e3779b9;
+    pattern->seed[1] = 0x7f4a7c15;
+    pattern->seed[2] = 0x85ebca6b;
+    pattern->seed[3] = 0xc2b2ae35;
+
+    if (nrows)
+        return pattern_init_rows(pattern, pattern->width + extra);
+
+    return 0;
+}
+
+void pattern_cleanup(struct pattern *pattern)
+{
+    free(pattern->rows);
+    memset(pattern, 0, sizeof *pattern);
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame counter
+ */
+
+static const uint8_t counter_font[10][7] = {
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e},
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e},
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e},
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c},
+};
+
+/*
+ * Stamp the frame number in the top left corner, as black digits on a white
+ * box. Dropped, repeated or torn frames show up directly on the host. Only
+ * luma is written, the checkerboard chroma underneath is already neutral.
+ */
+static void pattern_draw_counter(struct pattern *pattern, uint8_t *mem, unsigned int bytesperline)
+{
+    const unsigned int cpp = pattern->format->cpp;
+    const unsigned int cell = 6 * COUNTER_SCALE;
+    const unsigned int box_w = COUNTER_DIGITS * cell + 2 * COUNTER_SCALE;
+    const unsigned int box_h = 9 * COUNTER_SCALE;
+    char digits[COUNTER_DIGITS + 1];
+    unsigned int x, y;
+
+    if (box_w + 2 * COUNTER_SCALE > pattern->width || box_h + 2 * COUNTER_SCALE > pattern->height)
+        return;
+
+    snprintf(digits, sizeof digits, "%0*u", COUNTER_DIGITS, pattern->frame % 100000000);
+
+    for (y = 0; y < box_h; ++y) {
+        uint8_t *row = mem + (y + 2 * COUNTER_SCALE) * bytesperline + 2 * COUNTER_SCALE * cpp
+                     + pattern->format->luma_offset;
+        int fy = (int)y / COUNTER_SCALE - 1;
+
+        for (x = 0; x < box_w; ++x) {
+            int on = 0;
+            int fx = ((int)x - COUNTER_SCALE) / COUNTER_SCALE;
+
+            if (fy >= 0 && fy < 7 && fx >= 0 && (unsigned int)fx / 6 < COUNTER_DIGITS && fx % 6 < 5) {
+                unsigned int digit = digits[fx / 6] - '0';
+
+                on = counter_font[digit][fy] & (0x10 >> (fx % 6));
+            }
+
+            row[x * cpp] = on ? 16 : 235;
+        }
+    }
+}
+
+/*
+ * Read the frame number back from a received frame, by sampling the centre of
+ * each glyph cell. Returns -1 when the counter box can't be read, which is a
+ * sign of a corrupted frame.
+ */
+long pattern_read_counter(const struct format_info *format, unsigned int width, unsigned int height,
+                          const void *mem, unsigned int bytesperline)
+{
+    const unsigned int cpp = format->cpp;
+    const unsigned int box_w = COUNTER_DIGITS * 6 * COUNTER_SCALE + 2 * COUNTER_SCALE;
+    const unsigned int box_h = 9 * COUNTER_SCALE;
+    const uint8_t *base = (const uint8_t *)mem + 2 * COUNTER_SCALE * bytesperline + 2 * COUNTER_SCALE * cpp
+                        + format->luma_offset;
+    unsigned long value = 0;
+    unsigned int d, fx, fy;
+
+    if (box_w + 2 * COUNTER_SCALE > width || box_h + 2 * COUNTER_SCALE > height)
+        return -1;
+
+    for (d = 0; d < COUNTER_DIGITS; ++d) {
+        uint8_t glyph[7];
+        unsigned int digit;
+
+        for (fy = 0; fy < 7; ++fy) {
+            const uint8_t *row = base + ((fy + 1) * COUNTER_SCALE + COUNTER_SCALE / 2) * bytesperline;
+
+            glyph[fy] = 0;
+            for (fx = 0; fx < 5; ++fx) {
+                unsigned int x = (1 + d * 6 + fx) * COUNTER_SCALE + COUNTER_SCALE / 2;
+
+                if (row[x * cpp] < 128)
+                    glyph[fy] |= 0x10 >> fx;
+            }
+        }
+
+        for (digit = 0; digit < 10; ++digit) {
+            if (!memcmp(glyph, counter_font[digit], sizeof glyph))
+                break;
+        }
+
+        if (digit == 10)
+            return -1;
+
+        value = value * 10 + digit;
+    }
+
+    return value;
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame generation
+ */
+
+/*
+ * Copy a row template to line y, along with its chroma line for semi-planar
+ * formats. Chroma lines share the byte layout of the first plane, so the
+ * same template offset applies to both.
+ */
+static void pattern_copy_template(struct pattern *pattern, uint8_t *mem, unsigned int bytesperline, unsigned int y,
+                                  const uint8_t *tmpl, unsigned int size)
+{
+    unsigned int vsub = pattern->format->chroma_vsub;
+
+    pattern_copy_row(mem + y * bytesperline, tmpl, size);
+
+    if (vsub && y % vsub == 0)
+        pattern_copy_row(mem + (pattern->height + y / vsub) * bytesperline, tmpl + pattern->line_size, size);
+}
+
+unsigned int pattern_fill(struct pattern *pattern, void *mem, unsigned int bytesperline)
+{
+    const unsigned int cpp = pattern->format->cpp;
+    unsigned int frame_size = format_frame_size(pattern->format, bytesperline, pattern->height);
+    unsigned int size = format_stride(pattern->format, pattern->width);
+    uint8_t *row = mem;
+    unsigned int offset;
+    unsigned int y;
+
+    switch (pattern->type) {
+    case PATTERN_BARS:
+        for (y = 0; y < pattern->height; ++y) {
+            unsigned int band = y < pattern->height * 2 / 3 ? 0 : y < pattern->height * 3 / 4 ? 1 : 2;
+
+            pattern_copy_template(pattern, mem, bytesperline, y, pattern->rows + band * pattern->row_size, size);
+        }
+        break;
+
+    case PATTERN_GRADIENT:
+        for (y = 0; y < pattern->height; ++y) {
+            offset = ((pattern->frame * 4 + y) % GRADIENT_PERIOD) & ~1;
+            pattern_copy_template(pattern, mem, bytesperline, y, pattern->rows + offset * cpp, size);
+        }
+        break;
+
+    case PATTERN_CHECKERBOARD:
+        offset = (pattern->frame * 2) % (2 * CHECKER_SIZE);
+        for (y = 0; y < pattern->height; ++y) {
+            unsigned int phase = (y / CHECKER_SIZE) & 1;
+
+            pattern_copy_template(pattern, mem, bytesperline, y,
+                                  pattern->rows + phase * pattern->row_size + offset * cpp, size);
+        }
+        pattern_draw_counter(pattern, mem, bytesperline);
+        break;
+
+    case PATTERN_NOISE:
+        /* All planes at once, chroma lines follow the luma lines. */
+        for (y = 0; y < frame_size / bytesperline; ++y, row += bytesperline)
+            pattern_noise_row(row, size, pattern->seed);
+        break;
+
+    default:
+        return 0;
+    }
+
+#if defined(__SSE2__)
+    /* Order the non-temporal stores before the buffer is queued. */
+    _mm_sfence();
+#endif
+
+    pattern->frame++;
+
+    return frame_size;
+}
+
+int pattern_is_static(const struct pattern *pattern)
+{
+    return pattern->type == PATTERN_BARS;
+}
+
+const char *pattern_name(enum pattern_type type)
+{
+    static const char *const names[PATTERN_COUNT] = {
+        "SMPTE color bars",
+        "moving gradient",
+        "checkerboard with frame counter",
+        "noise",
+    };
+
+    return type < PATTERN_COUNT ? names[type] : "unknown";
+}
@@ -0,0 +1,72 @@
+/*
+ * UVC gadget test application - test pattern generator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stdint.h>
+
+enum pattern_type {
+    PATTERN_BARS,
+    PATTERN_GRADIENT,
+    PATTERN_CHECKERBOARD,
+    PATTERN_NOISE,
+    PATTERN_COUNT,
+};
+
+struct format_info;
+
+/*
+ * Test pattern generator for uncompressed formats. Frames are assembled from
+ * precomputed row templates with vectorized (SSE2 or NEON, scalar otherwise)
+ * row kernels and non-temporal stores, so that generating a 4K frame costs
+ * little more than writing it to memory once.
+ */
+struct pattern {
+    enum pattern_type type;
+    const struct format_info *format;
+    unsigned int width;
+    unsigned int height;
+    unsigned int frame;
+
+    /*
+     * Row templates, rendered in YUYV and converted to the pattern format.
+     * Each template holds a line of the first plane, followed by a line of
+     * the chroma plane for semi-planar formats.
+     */
+    uint8_t *rows;
+    unsigned int line_size;
+    unsigned int row_size;
+    unsigned int nrows;
+
+    /* Noise generator state. */
+    uint32_t seed[4];
+};
+
+int pattern_init(struct pattern *pattern, enum pattern_type type, unsigned int fourcc, unsigned int width,
+                 unsigned int height);
+void pattern_cleanup(struct pattern *pattern);
+
+/* Render the next frame into mem, returns the number of bytes written. */
+unsigned int pattern_fill(struct pattern *pattern, void *mem, unsigned int bytesperline);
+
+/*
+ * Read the frame counter stamped by PATTERN_CHECKERBOARD from a frame in the
+ * given uncompressed format. Returns the frame number modulo 10^8, or -1 if
+ * the counter is unreadable.
+ */
+long pattern_read_counter(const struct format_info *format, unsigned int width, unsigned int height,
+                          const void *mem, unsigned int bytesperline);
+
+/* Whether all frames of the pattern are identical. */
+int pattern_is_static(const struct pattern *pattern);
+
+const char *pattern_name(enum pattern_type type);
+
+#endif /* _PATTERN_H_ */
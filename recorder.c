@@ -0,0 +1,207 @@
+/*
+ * UVC gadget test application - file recorder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+/* Completion record sent through the pipe, small enough to be atomic. */
+struct recorder_done {
+    unsigned int id;
+    int result; /* bytes written, or a negative error code */
+};
+
+static int recorder_write(int fd, const void *data, unsigned int size)
+{
+    const char *p = data;
+    ssize_t ret;
+
+    while (size) {
+        ret = write(fd, p, size);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        p += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static void *recorder_thread(void *arg)
+{
+    struct recorder *rec = arg;
+    struct recorder_frame frame;
+    struct recorder_done done;
+
+    pthread_mutex_lock(&rec->lock);
+
+    while (1) {
+        while (!rec->count && !rec->stop)
+            pthread_cond_wait(&rec->cond, &rec->lock);
+
+        if (!rec->count)
+            break;
+
+        /* The frame stays queued until written, for recorder_flush(). */
+        frame = rec->queue[rec->head];
+
+        pthread_mutex_unlock(&rec->lock);
+        done.id = frame.id;
+        done.result = recorder_write(rec->fd, frame.data, frame.size);
+        if (!done.result)
+            done.result = frame.size;
+        pthread_mutex_lock(&rec->lock);
+
+        rec->head = (rec->head + 1) % RECORDER_QUEUE;
+        rec->count--;
+        pthread_cond_broadcast(&rec->cond);
+
+        if (write(rec->done[1], &done, sizeof done) != sizeof done)
+            printf("RECORDER: Unable to signal completion: %s (%d).\n", strerror(errno), errno);
+    }
+
+    pthread_mutex_unlock(&rec->lock);
+
+    return NULL;
+}
+
+int recorder_init(struct recorder *rec, const char *path)
+{
+    int ret;
+
+    memset(rec, 0, sizeof *rec);
+    rec->done[0] = -1;
+    rec->done[1] = -1;
+
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec->fd < 0) {
+        ret = -errno;
+        printf("RECORDER: Unable to open '%s': %s (%d).\n", path, strerror(errno), errno);
+        return ret;
+    }
+
+    if (pipe(rec->done) < 0) {
+        ret = -errno;
+        printf("RECORDER: Unable to create pipe: %s (%d).\n", strerror(errno), errno);
+        goto err_file;
+    }
+
+    fcntl(rec->done[0], F_SETFL, fcntl(rec->done[0], F_GETFL) | O_NONBLOCK);
+    fcntl(rec->done[0], F_SETFD, FD_CLOEXEC);
+    fcntl(rec->done[1], F_SETFD, FD_CLOEXEC);
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+
+    ret = pthread_create(&rec->thread, NULL, recorder_thread, rec);
+    if (ret) {
+        printf("RECORDER: Unable to create thread: %s (%d).\n", strerror(ret), ret);
+        ret = -ret;
+        goto err_lock;
+    }
+
+    rec->path = strdup(path);
+    printf("RECORDER: Recording frames to %s\n", path);
+
+    return 0;
+
+err_lock:
+    pthread_cond_destroy(&rec->cond);
+    pthread_mutex_destroy(&rec->lock);
+    close(rec->done[0]);
+    close(rec->done[1]);
+err_file:
+    close(rec->fd);
+    rec->fd = -1;
+    return ret;
+}
+
+void recorder_cleanup(struct recorder *rec)
+{
+    if (rec->fd < 0)
+        return;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->stop = 1;
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+
+    pthread_join(rec->thread, NULL);
+
+    pthread_cond_destroy(&rec->cond);
+    pthread_mutex_destroy(&rec->lock);
+    close(rec->done[0]);
+    close(rec->done[1]);
+    close(rec->fd);
+    free(rec->path);
+    rec->path = NULL;
+    rec->fd = -1;
+}
+
+int recorder_submit(struct recorder *rec, const void *data, unsigned int size, unsigned int id)
+{
+    struct recorder_frame *frame;
+
+    pthread_mutex_lock(&rec->lock);
+
+    if (rec->count == RECORDER_QUEUE) {
+        pthread_mutex_unlock(&rec->lock);
+        rec->skipped++;
+        return -ENOSPC;
+    }
+
+    frame = &rec->queue[(rec->head + rec->count) % RECORDER_QUEUE];
+    frame->data = data;
+    frame->size = size;
+    frame->id = id;
+    rec->count++;
+
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+
+    return 0;
+}
+
+int recorder_complete(struct recorder *rec)
+{
+    struct recorder_done done;
+
+    if (read(rec->done[0], &done, sizeof done) != sizeof done)
+        return -1;
+
+    if (done.result < 0) {
+        if (!rec->errors)
+            printf("RECORDER: Unable to write to '%s': %s (%d).\n", rec->path, strerror(-done.result),
+                   -done.result);
+        rec->errors++;
+    } else {
+        rec->frames++;
+        rec->bytes += done.result;
+    }
+
+    return done.id;
+}
+
+void recorder_flush(struct recorder *rec)
+{
+    pthread_mutex_lock(&rec->lock);
+    while (rec->count)
+        pthread_cond_wait(&rec->cond, &rec->lock);
+    pthread_mutex_unlock(&rec->lock);
+}
@@ -0,0 +1,69 @@
+/*
+ * UVC gadget test application - file recorder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <pthread.h>
+
+/*
+ * Frames queued for writing at most. A recorder that falls behind skips
+ * frames rather than keeping more buffers away from the capture device.
+ */
+#define RECORDER_QUEUE 4
+
+struct recorder_frame {
+    const void *data;
+    unsigned int size;
+    unsigned int id;
+};
+
+/*
+ * File recorder. Frames are appended to the file in submission order by a
+ * thread of its own, straight from the caller's memory, which must stay
+ * valid until the frame completes. Completed frames are reported through a
+ * pipe, whose read end done[0] the caller watches, and collected with
+ * recorder_complete(). Only the queue is shared with the writer thread,
+ * under lock, the counters belong to the caller.
+ */
+struct recorder {
+    int fd;
+    char *path;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct recorder_frame queue[RECORDER_QUEUE];
+    unsigned int head;
+    unsigned int count;
+    int stop;
+    int done[2];
+
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long skipped;
+    unsigned long long errors;
+};
+
+/* Create or truncate the file at path, and start the writer thread. */
+int recorder_init(struct recorder *rec, const char *path);
+
+/* Frames still queued are written before the writer thread exits. */
+void recorder_cleanup(struct recorder *rec);
+
+/* Queue a frame for writing, or skip it with -ENOSPC if the queue is full. */
+int recorder_submit(struct recorder *rec, const void *data, unsigned int size, unsigned int id);
+
+/* Return the id of the next completed frame, or -1 if there is none yet. */
+int recorder_complete(struct recorder *rec);
+
+/* Wait until all queued frames have been written. */
+void recorder_flush(struct recorder *rec);
+
+#endif /* _RECORDER_H_ */
@@ -0,0 +1,317 @@
+/*
+ * UVC gadget test application - shared frame subscribers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "share.h"
+
+struct share_client {
+    struct share *share;
+    struct share_client *next;
+    int fd;
+
+    /* Got the FORMAT message of the current session. */
+    int started;
+
+    /* Bitmask of the buffers the subscriber holds. */
+    unsigned long long held;
+};
+
+static int share_send(struct share_client *client, const struct share_message *msg, const int *fds,
+                      unsigned int nfds)
+{
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int) * SHARE_MAX_BUFFERS)];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+
+    memset(&mh, 0, sizeof mh);
+    iov.iov_base = (void *)msg;
+    iov.iov_len = sizeof *msg;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (nfds) {
+        memset(&control, 0, sizeof control);
+        mh.msg_control = control.data;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    return sendmsg(client->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+static void share_client_start(struct share_client *client)
+{
+    struct share *share = client->share;
+
+    client->started = share_send(client, &share->format, share->fds, share->format.count) == 0;
+}
+
+/* Disconnect a subscriber and release the buffers it held. */
+static void share_client_drop(struct share_client *client)
+{
+    struct share *share = client->share;
+    struct share_client **prev;
+    unsigned int index;
+
+    for (prev = &share->clients; *prev; prev = &(*prev)->next) {
+        if (*prev == client) {
+            *prev = client->next;
+            break;
+        }
+    }
+
+    share->nclients--;
+    events_unwatch_fd(share->events, client->fd, EVENT_READ);
+    close(client->fd);
+
+    while (client->held) {
+        index = __builtin_ctzll(client->held);
+        client->held &= ~(1ULL << index);
+        share->release(share->priv, index);
+    }
+
+    printf("SHARE: Subscriber disconnected, %u left\n", share->nclients);
+    free(client);
+}
+
+static void share_client_handler(void *priv)
+{
+    struct share_client *client = priv;
+    struct share *share = client->share;
+    struct share_message msg;
+    ssize_t ret;
+
+    while (1) {
+        ret = recv(client->fd, &msg, sizeof msg, MSG_DONTWAIT);
+        if (ret < 0 && errno == EAGAIN)
+            return;
+
+        if (ret <= 0) {
+            share_client_drop(client);
+            return;
+        }
+
+        /* Ignore anything but the release of a buffer the subscriber holds. */
+        if (ret != sizeof msg || msg.type != SHARE_MSG_RELEASE || msg.index >= SHARE_MAX_BUFFERS ||
+            !(client->held & (1ULL << msg.index)))
+            continue;
+
+        client->held &= ~(1ULL << msg.index);
+        share->release(share->priv, msg.index);
+    }
+}
+
+static void share_accept_handler(void *priv)
+{
+    struct share *share = priv;
+    struct share_client *client;
+    int fd;
+
+    while ((fd = accept(share->fd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        client = calloc(1, sizeof *client);
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+
+        client->share = share;
+        client->fd = fd;
+
+        if (events_watch_fd(share->events, fd, EVENT_READ, share_client_handler, client) < 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+
+        client->next = share->clients;
+        share->clients = client;
+        share->nclients++;
+        printf("SHARE: Subscriber connected, %u in total\n", share->nclients);
+
+        share_client_start(client);
+    }
+}
+
+int share_init(struct share *share, const char *path, void (*release)(void *priv, unsigned int index), void *priv)
+{
+    struct sockaddr_un addr;
+    int ret;
+
+    memset(share, 0, sizeof *share);
+    share->fd = -1;
+    share->release = release;
+    share->priv = priv;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        printf("SHARE: Socket path '%s' is too long\n", path);
+        return -ENAMETOOLONG;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    share->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (share->fd < 0) {
+        ret = -errno;
+        printf("SHARE: Unable to create socket: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    unlink(path);
+
+    if (bind(share->fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(share->fd, 8) < 0) {
+        ret = -errno;
+        printf("SHARE: Unable to listen on '%s': %s (%d).\n", path, strerror(errno), errno);
+        close(share->fd);
+        share->fd = -1;
+        return ret;
+    }
+
+    share->path = strdup(path);
+    printf("SHARE: Sharing frames with subscribers on %s\n", path);
+
+    return 0;
+}
+
+/*
+ * The events engine of the last session may be gone already, closing the
+ * sockets is enough to remove them from it.
+ */
+void share_cleanup(struct share *share)
+{
+    struct share_client *client;
+
+    while ((client = share->clients) != NULL) {
+        share->clients = client->next;
+        close(client->fd);
+        free(client);
+    }
+
+    if (share->fd >= 0) {
+        close(share->fd);
+        unlink(share->path);
+    }
+
+    free(share->path);
+    share->path = NULL;
+    share->fd = -1;
+    share->nclients = 0;
+}
+
+int share_start(struct share *share, struct events *events, const struct share_message *format, const int *fds)
+{
+    struct share_client *client, *next;
+    int ret;
+
+    if (format->count > SHARE_MAX_BUFFERS)
+        return -EINVAL;
+
+    share->events = events;
+    share->format = *format;
+    share->format.type = SHARE_MSG_FORMAT;
+    memcpy(share->fds, fds, sizeof(int) * format->count);
+
+    ret = events_watch_fd(events, share->fd, EVENT_READ, share_accept_handler, share);
+    if (ret < 0)
+        return ret;
+
+    share->active = 1;
+
+    /*
+     * Subscribers that went away between sessions are only noticed now,
+     * when their sockets are watched again.
+     */
+    for (client = share->clients; client; client = next) {
+        next = client->next;
+
+        if (events_watch_fd(events, client->fd, EVENT_READ, share_client_handler, client) < 0) {
+            share_client_drop(client);
+            continue;
+        }
+
+        share_client_start(client);
+    }
+
+    return 0;
+}
+
+void share_stop(struct share *share)
+{
+    struct share_message msg;
+    struct share_client *client;
+
+    if (!share->active)
+        return;
+
+    memset(&msg, 0, sizeof msg);
+    msg.type = SHARE_MSG_STOP;
+
+    for (client = share->clients; client; client = client->next) {
+        if (client->started)
+            share_send(client, &msg, NULL, 0);
+
+        events_unwatch_fd(share->events, client->fd, EVENT_READ);
+        client->started = 0;
+        client->held = 0;
+    }
+
+    events_unwatch_fd(share->events, share->fd, EVENT_READ);
+    share->active = 0;
+}
+
+unsigned int share_frame(struct share *share, const struct share_message *frame)
+{
+    struct share_client *client;
+    unsigned int taken = 0;
+
+    if (frame->index >= share->format.count)
+        return 0;
+
+    for (client = share->clients; client; client = client->next) {
+        if (!client->started)
+            continue;
+
+        /*
+         * A subscriber that can't keep up, or whose socket is full, misses
+         * the frame. Broken sockets are dropped by the read handler.
+         */
+        if (__builtin_popcountll(client->held) >= SHARE_MAX_HELD || share_send(client, frame, NULL, 0) < 0) {
+            share->skipped++;
+            continue;
+        }
+
+        client->held |= 1ULL << frame->index;
+        share->frames++;
+        taken++;
+    }
+
+    return taken;
+}
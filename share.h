@@ -0,0 +1,95 @@
+/*
+ * UVC gadget test application - shared frame subscribers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _SHARE_H_
+#define _SHARE_H_
+
+#include <stdint.h>
+
+#include "events.h"
+
+/*
+ * Protocol, over a SOCK_SEQPACKET Unix socket with one share_message per
+ * packet. When a stream session starts, or when it connects during one, a
+ * subscriber gets a FORMAT message with the DMABUF file descriptors of the
+ * frame buffers attached in index order, which it maps once. Each frame is
+ * then announced by a FRAME message, and the buffer stays untouched until
+ * the subscriber sends it back in a RELEASE message. A STOP message ends
+ * the session, the buffers of its FORMAT message must not be used anymore.
+ *
+ * Subscribers holding SHARE_MAX_HELD frames already miss the next ones, so
+ * a stalled subscriber never keeps the capture device short of buffers.
+ */
+#define SHARE_MAX_BUFFERS 64
+#define SHARE_MAX_HELD 2
+
+enum share_message_type {
+    SHARE_MSG_FORMAT = 1,
+    SHARE_MSG_FRAME,
+    SHARE_MSG_STOP,
+    SHARE_MSG_RELEASE,
+};
+
+struct share_message {
+    uint32_t type;
+    uint32_t index;    /* FRAME and RELEASE: buffer index */
+    uint32_t count;    /* FORMAT: number of buffers */
+    uint32_t fourcc;   /* FORMAT: pixel format and frame size */
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesperline;
+    uint32_t size;     /* FORMAT: buffer size, FRAME: bytes used */
+    uint32_t sequence; /* FRAME: capture sequence number */
+    uint32_t reserved;
+    uint64_t timestamp; /* FRAME: capture time, CLOCK_MONOTONIC ns, 0 if unknown */
+};
+
+struct share_client;
+
+/*
+ * Subscriber server. Its sockets are watched on the events engine given to
+ * share_start() while a session runs, and all calls are made from the
+ * thread of that engine. Buffers released by a subscriber, or held by one
+ * that goes away, are handed back through the release callback.
+ */
+struct share {
+    int fd;
+    char *path;
+
+    struct events *events;
+    struct share_client *clients;
+    unsigned int nclients;
+
+    int active;
+    struct share_message format;
+    int fds[SHARE_MAX_BUFFERS];
+
+    void (*release)(void *priv, unsigned int index);
+    void *priv;
+
+    unsigned long long frames;
+    unsigned long long skipped;
+};
+
+/* Listen for subscribers on a Unix socket at path, replacing any stale one. */
+int share_init(struct share *share, const char *path, void (*release)(void *priv, unsigned int index), void *priv);
+void share_cleanup(struct share *share);
+
+/*
+ * Start a session with the buffers of format, whose DMABUF file descriptors
+ * are fds, and stop it. Buffers held by subscribers when the session stops
+ * are not released, the caller takes them all back.
+ */
+int share_start(struct share *share, struct events *events, const struct share_message *format, const int *fds);
+void share_stop(struct share *share);
+
+/* Announce a frame, and return the number of subscribers holding it. */
+unsigned int share_frame(struct share *share, const struct share_message *frame);
+
+#endif /* _SHARE_H_ */
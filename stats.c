@@ -0,0 +1,205 @@
+/*
+ * UVC gadget test application - statistics export
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stats.h"
+
+#define STATS_RATE_WINDOW 1000000000ULL
+
+void stats_init(struct stats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+    stats->fd = -1;
+}
+
+void stats_cleanup(struct stats *stats)
+{
+    if (stats->fd >= 0) {
+        close(stats->fd);
+        unlink(stats->path);
+    }
+
+    free(stats->path);
+    stats->path = NULL;
+    stats->fd = -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Snapshot
+ */
+
+void stats_publish(struct stats *stats, const struct stats_data *data, unsigned long long now)
+{
+    unsigned int seq = stats->seq;
+    double rates[2] = {stats->data.frame_rate, stats->data.byte_rate};
+    unsigned long long elapsed = now - stats->window_start;
+
+    if (!data->streaming) {
+        rates[0] = 0;
+        rates[1] = 0;
+        stats->window_start = 0;
+    } else if (!stats->window_start || data->frames < stats->window_frames) {
+        stats->window_start = now;
+        stats->window_frames = data->frames;
+        stats->window_bytes = data->bytes;
+    } else if (elapsed >= STATS_RATE_WINDOW) {
+        rates[0] = (data->frames - stats->window_frames) * 1e9 / elapsed;
+        rates[1] = (data->bytes - stats->window_bytes) * 1e9 / elapsed;
+        stats->window_start = now;
+        stats->window_frames = data->frames;
+        stats->window_bytes = data->bytes;
+    }
+
+    __atomic_store_n(&stats->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    stats->data = *data;
+    stats->data.frame_rate = rates[0];
+    stats->data.byte_rate = rates[1];
+
+    __atomic_store_n(&stats->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void stats_read(const struct stats *stats, struct stats_data *data)
+{
+    unsigned int seq;
+
+    while (1) {
+        seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        *data = stats->data;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&stats->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Unix socket
+ */
+
+int stats_listen(struct stats *stats, const char *path)
+{
+    struct sockaddr_un addr;
+    int ret;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        printf("STATS: Socket path '%s' is too long\n", path);
+        return -ENAMETOOLONG;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    stats->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stats->fd < 0) {
+        ret = -errno;
+        printf("STATS: Unable to create socket: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    unlink(path);
+
+    if (bind(stats->fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(stats->fd, 8) < 0) {
+        ret = -errno;
+        printf("STATS: Unable to listen on '%s': %s (%d).\n", path, strerror(errno), errno);
+        close(stats->fd);
+        stats->fd = -1;
+        return ret;
+    }
+
+    stats->path = strdup(path);
+    printf("STATS: Serving statistics on %s\n", path);
+
+    return 0;
+}
+
+int stats_accept(struct stats *stats)
+{
+    int fd;
+
+    fd = accept(stats->fd, NULL, NULL);
+    if (fd < 0)
+        return -errno;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/* ---------------------------------------------------------------------------
+ * Text exposition
+ */
+
+void stats_text_init(struct stats_text *text)
+{
+    memset(text, 0, sizeof *text);
+}
+
+void stats_text_free(struct stats_text *text)
+{
+    free(text->data);
+    memset(text, 0, sizeof *text);
+}
+
+void stats_printf(struct stats_text *text, const char *fmt, ...)
+{
+    va_list ap;
+    size_t size;
+    char *data;
+    int len;
+
+    while (1) {
+        va_start(ap, fmt);
+        len = vsnprintf(text->data + text->len, text->size - text->len, fmt, ap);
+        va_end(ap);
+
+        if (len < 0)
+            return;
+
+        if (text->len + len < text->size) {
+            text->len += len;
+            return;
+        }
+
+        size = text->size ? text->size * 2 : 4096;
+        while (size <= text->len + len)
+            size *= 2;
+
+        data = realloc(text->data, size);
+        if (data == NULL)
+            return;
+
+        text->data = data;
+        text->size = size;
+    }
+}
+
+void stats_family(struct stats_text *text, const char *name, const char *type, const char *help)
+{
+    stats_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
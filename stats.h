@@ -0,0 +1,97 @@
+/*
+ * UVC gadget test application - statistics export
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Data path counters, published as a whole. */
+struct stats_data {
+    int streaming;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t superseded;
+    uint64_t stale;
+    uint64_t errors;
+    unsigned int uvc_queued;
+    unsigned int capture_queued;
+
+    /* Adaptive queue depth, limits are 0 when not enabled. */
+    unsigned int uvc_depth;
+    unsigned int capture_depth;
+    uint64_t uvc_underruns;
+    uint64_t capture_underruns;
+
+    /* Local sinks, frames shared are counted once per subscriber. */
+    uint64_t recorded;
+    uint64_t record_skipped;
+    uint64_t shared;
+    uint64_t share_skipped;
+    unsigned int subscribers;
+
+    /* Time to first frame of the stream session in ns, 0 until sent. */
+    uint64_t ttff;
+
+    /* Rates over the last second or so, computed by stats_publish(). */
+    double frame_rate;
+    double byte_rate;
+};
+
+/*
+ * Statistics snapshot shared between the data path and readers. The data
+ * path publishes under a sequence lock: the writer never waits, and readers
+ * retry on the rare occasion a publication overlaps their copy. There must
+ * be a single writer at a time.
+ */
+struct stats {
+    unsigned int seq;
+    struct stats_data data;
+
+    /* Rate window, private to the writer. */
+    unsigned long long window_start;
+    uint64_t window_frames;
+    uint64_t window_bytes;
+
+    /* Listening Unix socket, or -1. */
+    int fd;
+    char *path;
+};
+
+void stats_init(struct stats *stats);
+void stats_cleanup(struct stats *stats);
+
+/* Publish new counters at time now, in CLOCK_MONOTONIC ns. */
+void stats_publish(struct stats *stats, const struct stats_data *data, unsigned long long now);
+void stats_read(const struct stats *stats, struct stats_data *data);
+
+/*
+ * Listen for scrapes on a Unix socket at path, replacing any stale socket.
+ * Accepted connections are non-blocking.
+ */
+int stats_listen(struct stats *stats, const char *path);
+int stats_accept(struct stats *stats);
+
+/* Growable text buffer for Prometheus text exposition. */
+struct stats_text {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+void stats_text_init(struct stats_text *text);
+void stats_text_free(struct stats_text *text);
+void stats_printf(struct stats_text *text, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Emit the HELP and TYPE lines of a metric family. */
+void stats_family(struct stats_text *text, const char *name, const char *type, const char *help);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# UVC gadget test application - streaming loop benchmark
+#
+# Runs uvc-gadget against the uvc-mock.so ioctl mock for each IO method
+# combination and reports per-frame CPU cost, intercepted system calls per
+# frame and time to first frame. No USB device controller is needed. A last
+# run streams in the default mode, paced to the committed frame interval with
+# the host and sensor at 30 fps.
+#
+# Environment:
+#   BENCH_FRAMES        Frames streamed per run (1000)
+#   BENCH_PACED_FRAMES  Frames streamed by the paced run (60)
+#   BENCH_ARGS          Extra uvc-gadget options, e.g. "-T" or "-e 80"
+#
+# The UVC_MOCK_* variables documented in uvc-mock.c are passed through, set
+# UVC_MOCK_FPS and UVC_MOCK_CAPTURE_FPS to benchmark at a fixed frame rate
+# instead of as fast as the loop goes.
+
+dir=$(dirname "$0")
+frames=${BENCH_FRAMES:-1000}
+
+run() {
+	name=$1
+	shift
+
+	report=$(UVC_MOCK_FRAMES=$frames LD_PRELOAD="$dir/uvc-mock.so" \
+		"$dir/uvc-gadget" "$@" $BENCH_ARGS 2>&1 >/dev/null | grep '^uvc-mock: frames=')
+
+	if [ -z "$report" ] ; then
+		printf '%-34s failed\n' "$name"
+		status=1
+		return
+	fi
+
+	echo "$report" | awk -v name="$name" '{
+		for (i = 2; i <= NF; i++) {
+			split($i, kv, "=")
+			v[kv[1]] = kv[2]
+		}
+		printf "%-34s %10s %10s %10s %10s\n", name, v["cpu_us_per_frame"],
+		       v["syscalls_per_frame"], v["ttff_us"], v["errors"]
+	}'
+}
+
+status=0
+
+printf '%-34s %10s %10s %10s %10s\n' "IO methods ($frames frames)" "cpu us/f" "syscalls/f" "ttff us" "errors"
+run "pattern -> UVC MMAP" -F -d -o 0
+run "pattern -> UVC USERPTR" -F -d -o 1
+run "capture USERPTR -> UVC MMAP" -F -o 0
+run "capture MMAP -> UVC USERPTR" -F -o 1
+run "capture MMAP -> UVC DMABUF" -F -o 2
+
+frames=${BENCH_PACED_FRAMES:-60}
+UVC_MOCK_FPS=30 UVC_MOCK_CAPTURE_FPS=30
+export UVC_MOCK_FPS UVC_MOCK_CAPTURE_FPS
+run "paced capture MMAP -> UVC USERPTR" -o 1
+
+exit $status
@@ -0,0 +1,424 @@
+/*
+ * UVC gadget test application - host side capture and verification tool
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Streams from a V4L2 capture device, typically the uvcvideo node of a UVC
+ * gadget seen from the host, and reports the sustained frame rate and
+ * throughput, frame integrity errors and the latency from the first USB
+ * packet of a frame (the uvcvideo buffer timestamp) to its dequeue.
+ *
+ * With -c the frame counter stamped by the checkerboard test pattern
+ * (uvc-gadget -d -p 2) is read back from every frame, to detect dropped,
+ * repeated and corrupted frames end to end.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/videodev2.h>
+
+#include "format.h"
+#include "histogram.h"
+#include "pattern.h"
+
+#define CAPTURE_MAX_BUFFERS 32
+#define CAPTURE_TIMEOUT_MS 5000
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+#define pixfmtstr(x) (x) & 0xff, ((x) >> 8) & 0xff, ((x) >> 16) & 0xff, ((x) >> 24) & 0xff
+
+struct capture {
+    int fd;
+    struct v4l2_pix_format format;
+    const struct format_info *info;
+
+    unsigned int nbufs;
+    void *mem[CAPTURE_MAX_BUFFERS];
+    size_t length[CAPTURE_MAX_BUFFERS];
+
+    /* Measurements, after the warm-up frames. */
+    unsigned long long start;
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long errors;
+    unsigned long long corrupt;
+    unsigned long long dropped;
+    unsigned long long repeated;
+    struct histogram latency;
+
+    int check_counter;
+    long counter;
+    long sequence;
+};
+
+static unsigned long long capture_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int capture_open(struct capture *cap, const char *devname, unsigned int fourcc, unsigned int width,
+                        unsigned int height, unsigned int fps)
+{
+    struct v4l2_capability caps;
+    struct v4l2_streamparm parm;
+    struct v4l2_format fmt;
+
+    cap->fd = open(devname, O_RDWR | O_NONBLOCK);
+    if (cap->fd < 0) {
+        printf("CAPTURE: Unable to open %s: %s (%d).\n", devname, strerror(errno), errno);
+        return -errno;
+    }
+
+    if (ioctl(cap->fd, VIDIOC_QUERYCAP, &caps) < 0 || !(caps.device_caps & V4L2_CAP_VIDEO_CAPTURE)) {
+        printf("CAPTURE: %s is no video capture device\n", devname);
+        return -EINVAL;
+    }
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+
+    if (ioctl(cap->fd, VIDIOC_S_FMT, &fmt) < 0) {
+        printf("CAPTURE: Unable to set format: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    if (fmt.fmt.pix.pixelformat != fourcc || fmt.fmt.pix.width != width || fmt.fmt.pix.height != height) {
+        printf("CAPTURE: %c%c%c%c %ux%u not supported, device offers %c%c%c%c %ux%u\n", pixfmtstr(fourcc), width,
+               height, pixfmtstr(fmt.fmt.pix.pixelformat), fmt.fmt.pix.width, fmt.fmt.pix.height);
+        return -EINVAL;
+    }
+
+    cap->format = fmt.fmt.pix;
+    cap->info = format_info(fourcc);
+
+    if (fps) {
+        CLEAR(parm);
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        parm.parm.capture.timeperframe.numerator = 1;
+        parm.parm.capture.timeperframe.denominator = fps;
+        if (ioctl(cap->fd, VIDIOC_S_PARM, &parm) < 0)
+            printf("CAPTURE: Unable to set frame rate: %s (%d).\n", strerror(errno), errno);
+    }
+
+    printf("CAPTURE: %s streaming %c%c%c%c %ux%u, %u bytes per frame\n", devname, pixfmtstr(fourcc), width, height,
+           cap->format.sizeimage);
+
+    return 0;
+}
+
+static int capture_start(struct capture *cap, unsigned int nbufs)
+{
+    struct v4l2_requestbuffers rb;
+    struct v4l2_buffer buf;
+    unsigned int i;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    CLEAR(rb);
+    rb.count = nbufs;
+    rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    rb.memory = V4L2_MEMORY_MMAP;
+
+    if (ioctl(cap->fd, VIDIOC_REQBUFS, &rb) < 0) {
+        printf("CAPTURE: Unable to allocate buffers: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    cap->nbufs = rb.count < CAPTURE_MAX_BUFFERS ? rb.count : CAPTURE_MAX_BUFFERS;
+
+    for (i = 0; i < cap->nbufs; ++i) {
+        CLEAR(buf);
+        buf.index = i;
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (ioctl(cap->fd, VIDIOC_QUERYBUF, &buf) < 0)
+            return -errno;
+
+        cap->mem[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, buf.m.offset);
+        if (cap->mem[i] == MAP_FAILED) {
+            printf("CAPTURE: Unable to map buffer %u: %s (%d).\n", i, strerror(errno), errno);
+            return -errno;
+        }
+
+        cap->length[i] = buf.length;
+
+        if (ioctl(cap->fd, VIDIOC_QBUF, &buf) < 0)
+            return -errno;
+    }
+
+    if (ioctl(cap->fd, VIDIOC_STREAMON, &type) < 0) {
+        printf("CAPTURE: Unable to start streaming: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void capture_stop(struct capture *cap)
+{
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int i;
+
+    ioctl(cap->fd, VIDIOC_STREAMOFF, &type);
+
+    for (i = 0; i < cap->nbufs; ++i)
+        munmap(cap->mem[i], cap->length[i]);
+
+    close(cap->fd);
+}
+
+/* Check a frame and account for it, returns 0 if it's intact. */
+static int capture_verify(struct capture *cap, const struct v4l2_buffer *buf)
+{
+    const uint8_t *mem = cap->mem[buf->index];
+    long counter;
+
+    if (buf->flags & V4L2_BUF_FLAG_ERROR)
+        return -1;
+
+    if (!cap->info || format_is_compressed(cap->info)) {
+        /* JPEG frames start with SOI and end with EOI. */
+        if (buf->bytesused < 4 || mem[0] != 0xff || mem[1] != 0xd8 || mem[buf->bytesused - 2] != 0xff ||
+            mem[buf->bytesused - 1] != 0xd9)
+            return -1;
+        return 0;
+    }
+
+    if (buf->bytesused != cap->format.sizeimage)
+        return -1;
+
+    if (!cap->check_counter)
+        return 0;
+
+    counter = pattern_read_counter(cap->info, cap->format.width, cap->format.height, mem, cap->format.bytesperline);
+    if (counter < 0)
+        return -1;
+
+    if (cap->counter >= 0) {
+        if (counter == cap->counter)
+            cap->repeated++;
+        else if (counter > cap->counter + 1)
+            cap->dropped += counter - cap->counter - 1;
+    }
+
+    cap->counter = counter;
+    return 0;
+}
+
+static int capture_frame(struct capture *cap, int measure)
+{
+    unsigned long long now;
+    unsigned long long ts;
+    struct v4l2_buffer buf;
+
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if (ioctl(cap->fd, VIDIOC_DQBUF, &buf) < 0)
+        return errno == EAGAIN ? 0 : -errno;
+
+    now = capture_now();
+
+    if (measure) {
+        cap->frames++;
+        cap->bytes += buf.bytesused;
+
+        if (buf.flags & V4L2_BUF_FLAG_ERROR)
+            cap->errors++;
+        else if (capture_verify(cap, &buf) < 0)
+            cap->corrupt++;
+
+        /* Without the counter, sequence gaps are the best drop estimate. */
+        if (!cap->check_counter && cap->sequence >= 0 && buf.sequence > cap->sequence + 1)
+            cap->dropped += buf.sequence - cap->sequence - 1;
+
+        if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+            ts = buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL;
+            if (now > ts)
+                histogram_record(&cap->latency, now - ts);
+        }
+    } else if (cap->check_counter) {
+        /* Track the counter through the warm-up to start from a known value. */
+        capture_verify(cap, &buf);
+    }
+
+    cap->sequence = buf.sequence;
+
+    if (ioctl(cap->fd, VIDIOC_QBUF, &buf) < 0)
+        return -errno;
+
+    return 1;
+}
+
+static void capture_report(struct capture *cap)
+{
+    double seconds = (capture_now() - cap->start) / 1e9;
+
+    printf("uvc-capture: frames=%llu fps=%.2f mb_per_s=%.2f errors=%llu corrupt=%llu dropped=%llu repeated=%llu "
+           "latency_p50_us=%llu latency_p99_us=%llu latency_max_us=%llu\n",
+           cap->frames, seconds > 0 ? cap->frames / seconds : 0.0, seconds > 0 ? cap->bytes / seconds / 1e6 : 0.0,
+           cap->errors, cap->corrupt, cap->dropped, cap->repeated,
+           (unsigned long long)histogram_percentile(&cap->latency, 0.50) / 1000,
+           (unsigned long long)histogram_percentile(&cap->latency, 0.99) / 1000,
+           (unsigned long long)histogram_max(&cap->latency) / 1000);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] device\n", argv0);
+    fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -b buffers	Number of buffers (default 4)\n");
+    fprintf(stderr, " -c		Check the frame counter of the checkerboard test pattern\n");
+    fprintf(stderr, " -f fourcc	Pixel format (default YUYV)\n");
+    fprintf(stderr, " -h		Print this help screen and exit\n");
+    fprintf(stderr, " -n frames	Number of frames to measure (default 300)\n");
+    fprintf(stderr, " -r fps		Frame rate to request\n");
+    fprintf(stderr, " -s WxH		Frame size (default 640x360)\n");
+    fprintf(stderr, " -w frames	Warm-up frames excluded from the measurements (default 10)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct capture cap;
+    struct pollfd pfd;
+    unsigned int fourcc = V4L2_PIX_FMT_YUYV;
+    unsigned int width = 640;
+    unsigned int height = 360;
+    unsigned int nframes = 300;
+    unsigned int warmup = 10;
+    unsigned int nbufs = 4;
+    unsigned int fps = 0;
+    unsigned int seen = 0;
+    char fcc[4];
+    int ret, opt;
+
+    memset(&cap, 0, sizeof cap);
+    cap.counter = -1;
+    cap.sequence = -1;
+
+    while ((opt = getopt(argc, argv, "b:cf:hn:r:s:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            nbufs = atoi(optarg);
+            break;
+
+        case 'c':
+            cap.check_counter = 1;
+            break;
+
+        case 'f':
+            if (strlen(optarg) > 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            /* Short fourccs such as "Y16" are padded with spaces. */
+            memset(fcc, ' ', sizeof fcc);
+            memcpy(fcc, optarg, strlen(optarg));
+            fourcc = v4l2_fourcc(fcc[0], fcc[1], fcc[2], fcc[3]);
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            return 0;
+
+        case 'n':
+            nframes = atoi(optarg);
+            break;
+
+        case 'r':
+            fps = atoi(optarg);
+            break;
+
+        case 's':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ret = capture_open(&cap, argv[optind], fourcc, width, height, fps);
+    if (ret < 0)
+        return 1;
+
+    if (cap.check_counter && (!cap.info || format_is_compressed(cap.info))) {
+        printf("CAPTURE: Frame counters can only be checked in uncompressed formats\n");
+        cap.check_counter = 0;
+    }
+
+    histogram_reset(&cap.latency);
+
+    ret = capture_start(&cap, nbufs);
+    if (ret < 0) {
+        close(cap.fd);
+        return 1;
+    }
+
+    pfd.fd = cap.fd;
+    pfd.events = POLLIN;
+
+    if (!warmup)
+        cap.start = capture_now();
+
+    while (cap.frames < nframes) {
+        ret = poll(&pfd, 1, CAPTURE_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            printf("CAPTURE: No frame received for %u ms\n", CAPTURE_TIMEOUT_MS);
+            break;
+        }
+
+        ret = capture_frame(&cap, seen >= warmup);
+        if (ret < 0) {
+            printf("CAPTURE: Unable to dequeue buffer: %s (%d).\n", strerror(-ret), -ret);
+            break;
+        }
+
+        if (ret && ++seen == warmup)
+            cap.start = capture_now();
+    }
+
+    capture_report(&cap);
+    capture_stop(&cap);
+
+    return cap.frames < nframes ? 1 : 0;
+}
@@ -19,30 +19,50 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/usb/ch9.h>
 #include <linux/usb/video.h>
 #include <linux/videodev2.h>
 
+#include "clip.h"
+#include "configfs.h"
+#include "convert.h"
+#include "depth.h"
+#include "events.h"
+#include "format.h"
+#include "histogram.h"
+#include "jpeg.h"
+#include "pacer.h"
+#include "pattern.h"
+#include "recorder.h"
+#include "share.h"
+#include "stats.h"
 #include "uvc.h"
+#include "workers.h"
 
 /* Enable debug prints. */
 #undef ENABLE_BUFFER_DEBUG
 #undef ENABLE_USB_REQUEST_DEBUG
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 
 #define clamp(val, min, max)                                                                                           \
@@ -91,6 +111,7 @@
 enum io_method {
     IO_METHOD_MMAP,
     IO_METHOD_USERPTR,
+    IO_METHOD_DMABUF,
 };
 
 /* Buffer representing one video frame */
@@ -98,77 +119,218 @@ struct buffer {
     struct v4l2_buffer buf;
     void *start;
     size_t length;
+    int dmabuf_fd;
+
+    /* Payload generation held by the buffer, 0 if unknown. */
+    unsigned int content;
+    unsigned int bytesused;
+
+    /*
+     * CLOCK_MONOTONIC times in ns of the frame held by the buffer: capture
+     * timestamp (0 without a capture device), capture or standalone
+     * dequeue, and UVC queue (0 when not queued).
+     */
+    unsigned long long origin;
+    unsigned long long dequeued;
+    unsigned long long queued;
+};
+
+/*
+ * Buffer identity tracking for the UVC - V4L2 integrated path.
+ *
+ * Each slot is one piece of frame memory, allocated by whichever side
+ * exports it (the V4L2 side for UVC USERPTR and DMABUF, the UVC side for UVC
+ * MMAP). On the exporting side queue indices are bound to slots. On the
+ * importing side any free index can carry any slot, which lets the two
+ * queues have different depths. Both directions are constant time lookups.
+ */
+#define BUFFER_MAX_INDEX 64
+
+enum buffer_owner {
+    BUFFER_OWNER_APP,
+    BUFFER_OWNER_V4L2,
+    BUFFER_OWNER_UVC,
+};
+
+struct buffer_slot {
+    struct buffer *mem;
+    enum buffer_owner owner;
+
+    /* Queue index currently or last used on each side. */
+    int v4l2_index;
+    int uvc_index;
+
+    /* Frame currently held. */
+    unsigned int sequence;
+    unsigned int bytesused;
+    struct timeval timestamp;
+
+    /*
+     * Consumers holding the frame, the UVC side and the local sinks. The
+     * slot goes back to the V4L2 side when the last one releases it.
+     */
+    unsigned int refs;
+};
+
+struct buffer_side {
+    int *slots;              /* queue index -> slot */
+    unsigned int count;
+    unsigned long long free; /* bitmask of free queue indices */
+    int bound;
+};
+
+struct buffer_fifo {
+    unsigned int *slots;
+    unsigned int head;
+    unsigned int count;
+    unsigned int size;
+};
+
+struct buffer_table {
+    struct buffer_slot *slots;
+    unsigned int nslots;
+
+    struct buffer_side v4l2;
+    struct buffer_side uvc;
+
+    /* Slots waiting for a free queue index on the V4L2 and UVC sides. */
+    struct buffer_fifo to_v4l2;
+    struct buffer_fifo to_uvc;
+
+    /*
+     * Slots in flight on each side at most: queued to the UVC side, and
+     * queued to the V4L2 side or holding a captured frame that waits for a
+     * UVC queue index. Slots over the limits wait in the fifos too. No
+     * limit by default.
+     */
+    unsigned int v4l2_depth;
+    unsigned int uvc_depth;
 };
 
 /* ---------------------------------------------------------------------------
  * UVC specific stuff
  */
 
-struct uvc_frame_info {
-    unsigned int width;
-    unsigned int height;
-    unsigned int intervals[8];
+/* Latency of each hop of a frame, and from capture to USB. */
+enum latency_stage {
+    LATENCY_CAPTURE,
+    LATENCY_PROCESS,
+    LATENCY_TRANSFER,
+    LATENCY_TOTAL,
+    LATENCY_COUNT,
 };
 
-struct uvc_format_info {
-    unsigned int fcc;
-    const struct uvc_frame_info *frames;
+static const char *const latency_names[LATENCY_COUNT] = {
+    "capture",
+    "process",
+    "transfer",
+    "total",
 };
 
-static const struct uvc_frame_info uvc_frames_yuyv[] = {
-    {
-        640,
-        360,
-        {666666, 10000000, 50000000, 0},
-    },
-    {
-        1280,
-        720,
-        {50000000, 0},
-    },
-    {
-        0,
-        0,
-        {
-            0,
-        },
-    },
+#define UVC_EVENT_COUNT (UVC_EVENT_LAST - UVC_EVENT_FIRST + 1)
+
+static const char *const uvc_event_names[UVC_EVENT_COUNT] = {
+    "connect", "disconnect", "streamon", "streamoff", "setup", "data",
+};
+
+/*
+ * Built-in streaming formats, used when the descriptors can't be read from
+ * the configfs function. They must then match what configfs declares.
+ */
+static const unsigned int uvc_intervals_360p[] = {666666, 10000000, 50000000};
+static const unsigned int uvc_intervals_720p[] = {50000000};
+
+static const struct uvc_function_frame uvc_frames_default[] = {
+    {1, 640, 360, 0, ARRAY_SIZE(uvc_intervals_360p), uvc_intervals_360p},
+    {2, 1280, 720, 0, ARRAY_SIZE(uvc_intervals_720p), uvc_intervals_720p},
 };
 
-static const struct uvc_frame_info uvc_frames_mjpeg[] = {
-    {
-        640,
-        360,
-        {666666, 10000000, 50000000, 0},
-    },
-    {
-        1280,
-        720,
-        {50000000, 0},
-    },
-    {
-        0,
-        0,
-        {
-            0,
-        },
-    },
+static const struct uvc_function_format uvc_formats_default[] = {
+    {1, V4L2_PIX_FMT_YUYV, ARRAY_SIZE(uvc_frames_default), uvc_frames_default},
+    {2, V4L2_PIX_FMT_MJPEG, ARRAY_SIZE(uvc_frames_default), uvc_frames_default},
+    {3, V4L2_PIX_FMT_NV12, ARRAY_SIZE(uvc_frames_default), uvc_frames_default},
+    {4, V4L2_PIX_FMT_UYVY, ARRAY_SIZE(uvc_frames_default), uvc_frames_default},
+    {5, V4L2_PIX_FMT_GREY, ARRAY_SIZE(uvc_frames_default), uvc_frames_default},
+    {6, V4L2_PIX_FMT_Y16, ARRAY_SIZE(uvc_frames_default), uvc_frames_default},
 };
 
-static const struct uvc_format_info uvc_formats[] = {
-    {V4L2_PIX_FMT_YUYV, uvc_frames_yuyv},
-    {V4L2_PIX_FMT_MJPEG, uvc_frames_mjpeg},
+static const struct uvc_function_config uvc_config_default = {
+    NULL,
+    ARRAY_SIZE(uvc_formats_default),
+    uvc_formats_default,
+    0,
+    0,
+    0,
 };
 
 /* ---------------------------------------------------------------------------
  * V4L2 and UVC device instances
  */
 
+#define ENCODE_MAX_STRIPES 16
+
+/* Frames above this size are converted by several workers in parallel. */
+#define ENCODE_STRIPE_SIZE (512 * 1024)
+
+/*
+ * Frames queued to UVC under the latest-frame policy, one being sent and
+ * the next one, unless the adaptive queue depth sets the limit. Later frames
+ * wait where a newer one can still replace them.
+ */
+#define LATEST_UVC_DEPTH 2
+
+enum encode_mode {
+    ENCODE_CONVERT,
+    ENCODE_MJPEG,
+};
+
+struct encode_job;
+
+/* A band of lines of a frame, processed by one worker thread. */
+struct encode_stripe {
+    struct work work;
+    struct encode_job *job;
+    unsigned int first;
+    unsigned int last;
+};
+
+/*
+ * Encoder stage job, turning a captured frame into the payload of a UVC
+ * buffer on the worker threads. MJPEG frames are encoded as a single stripe,
+ * format conversions are split in up to ENCODE_MAX_STRIPES stripes.
+ */
+struct encode_job {
+    struct encode_stripe stripes[ENCODE_MAX_STRIPES];
+    unsigned int nstripes;
+    unsigned int pending;
+    struct uvc_device *dev;
+
+    unsigned int v4l2_index;
+    unsigned int uvc_index;
+    struct convert_frame src;
+    struct convert_frame dst;
+    unsigned int dstsize;
+
+    unsigned int bytesused;
+    int done;
+};
+
+/*
+ * Data path thread of threaded mode, shared by all the streams of the
+ * process. It runs an event engine of its own, the streams hand their
+ * commands to it through wakeup pipes of their own.
+ */
+struct data_thread {
+    pthread_t thread;
+    struct events events;
+};
+
 /* Represents a V4L2 based video capture device */
 struct v4l2_device {
     /* v4l2 device specific */
     int v4l2_fd;
     int is_streaming;
+    int capturing;
     char *v4l2_devname;
 
     /* v4l2 buffer specific */
@@ -191,11 +353,16 @@ struct uvc_device {
     int is_streaming;
     int run_standalone;
     char *uvc_devname;
+    /* Prefix of the stream reports, UVC<n> when serving several streams. */
+    char name[8];
 
     /* uvc control request specific */
 
     struct uvc_streaming_control probe;
     struct uvc_streaming_control commit;
+    unsigned int default_format;
+    unsigned int default_frame;
+    unsigned int default_interval;
     int control;
     struct uvc_request_data request_error_code;
     unsigned int brightness_val;
@@ -205,261 +372,807 @@ struct uvc_device {
     struct buffer *mem;
     struct buffer *dummy_buf;
     unsigned int nbufs;
+
+    /*
+     * The buffers outlive stream sessions, pool_size is the largest frame
+     * they hold.
+     */
+    int pool_allocated;
+    unsigned int pool_size;
+
+    /* Streaming formats declared to the host, and the committed one. */
+    const struct uvc_function_config *fc;
     unsigned int fcc;
     unsigned int width;
     unsigned int height;
 
     unsigned int bulk;
-    uint8_t color;
+    enum pattern_type pattern_type;
+    struct pattern pattern;
+
+    /*
+     * Generation of the standalone payload, bumped whenever it changes,
+     * or 0 when every frame differs. Buffers tagged with the current
+     * generation already hold the payload and are not rewritten.
+     */
+    unsigned int content;
+    unsigned int content_gen;
     unsigned int imgsize;
-    void *imgdata;
+    struct clip clip;
+    int clip_active;
+    int clip_zero_copy;
+    unsigned int clip_index;
+    unsigned int clip_content;
+    struct timespec stream_start;
+
+    /*
+     * Pacing to the committed frame interval, unless free running. The
+     * standalone path parks free buffers in pace_idle and releases one
+     * per timer deadline, the integrated path drops capture frames that
+     * come in ahead of the schedule.
+     */
+    int free_run;
+    int pace;
+    int pace_due;
+    struct pacer pacer;
+    struct buffer_fifo pace_idle;
+
+    /*
+     * Latest-frame policy for the integrated path. Only the freshest
+     * captured frame goes on to UVC, and no more than LATEST_UVC_DEPTH
+     * frames are queued there. The older ones it supersedes before they
+     * are queued go straight back to the capture device, as do frames
+     * older than max_age (in ns, 0 for no limit). The session counters are
+     * folded into the totals by uvc_stats_stop().
+     */
+    int latest;
+    unsigned long long max_age;
+    unsigned long long latest_superseded;
+    unsigned long long latest_stale;
+    unsigned long long superseded;
+    unsigned long long stale;
+
+    /*
+     * Adaptive queue depth for the integrated path, enabled when depth_min
+     * is set. Each stream session starts with the whole pool in flight,
+     * and the controllers bring the buffer table limits down to what the
+     * jitter of each side's dequeues needs. The capture side underruns
+     * when the driver skips sequence numbers for lack of buffers while the
+     * UVC side has room. The UVC side underruns when its queue runs empty
+     * after frames have been turned away for lack of room there
+     * (uvc_turned_away), which more depth would have kept. The session
+     * underruns are folded into the totals by uvc_stats_stop().
+     */
+    unsigned int depth_min;
+    unsigned int depth_max;
+    struct depth_control uvc_depth;
+    struct depth_control capture_depth;
+    unsigned int capture_sequence;
+    int uvc_turned_away;
+    unsigned long long uvc_underruns;
+    unsigned long long capture_underruns;
 
     /* USB speed specific */
     int mult;
     int burst;
     int maxpkt;
+    unsigned int isoc_interval;
     enum usb_device_speed speed;
 
     /* uvc specific flags */
     int first_buffer_queued;
     int uvc_shutdown_requested;
 
+    /*
+     * The UVC side isn't polled while the last queued buffer is held back,
+     * as a completed buffer keeps POLLOUT asserted. Queuing a frame to UVC
+     * polls it again.
+     */
+    int uvc_held_back;
+
+    /*
+     * Warm start. The last committed format is remembered in warm_state,
+     * and the pipeline is prepared for it before the host streams, at
+     * start up and after each stream session. warm_ready is set while the
+     * prepared pipeline waits for STREAMON, with the capture device kept
+     * running if warm_capture is set. Time to first frame is measured from
+     * the STREAMON event to the first buffer sent.
+     */
+    const char *warm_state;
+    int warm_capture;
+    int warm_ready;
+    int warm_session;
+    unsigned int warm_fcc;
+    unsigned int warm_width;
+    unsigned int warm_height;
+    unsigned long long streamon_time;
+    unsigned long long ttff;
+
     /* uvc buffer queue and dequeue counters */
     unsigned long long int qbuf_count;
     unsigned long long int dqbuf_count;
 
+    /* Per stream session latency, recorded when UVC buffers complete. */
+    struct histogram latency[LATENCY_COUNT];
+
+    /*
+     * Statistics. The frame, byte and error counters are owned by the data
+     * path and published in stats after every frame; the event counters
+     * belong to the control loop, which serves the stats socket.
+     */
+    struct stats stats;
+    struct events *control_events;
+    unsigned long long frames_sent;
+    unsigned long long bytes_sent;
+    unsigned long long errors;
+    unsigned long long dropped;
+    unsigned long long uvc_events[UVC_EVENT_COUNT];
+
+    /* buffer identity table for the integrated path */
+    struct buffer_table buffers;
+
+    /*
+     * Local sinks sharing the captured frames with the UVC side on the
+     * integrated path, NULL when not enabled: a file recorder, and the
+     * subscribers of a Unix socket, who map the capture buffers. Both get
+     * the frames that go on to UVC, zero-copy, and hold their slots until
+     * they are done with them. Their counters belong to the data path.
+     */
+    struct recorder *recorder;
+    struct share *share;
+
+    /*
+     * Encoder stage between the capture device and the UVC queue, for
+     * MJPEG encoding of YUYV frames or pixel format conversion. It is
+     * enabled when workers is set. Jobs complete in any order on the
+     * worker threads, and are handed to the UVC side in capture order
+     * from the jobs ring. Only the job completion state is shared with
+     * the workers, under encode_lock.
+     */
+    unsigned int encode_quality;
+    struct workers *workers;
+    enum encode_mode encode_mode;
+    unsigned int encode_stripes;
+    struct jpeg_encoder jpeg;
+    struct v4l2_pix_format capture_fmt;
+    struct encode_job *jobs;
+    unsigned int njobs;
+    unsigned int job_head;
+    unsigned int job_count;
+    unsigned long long uvc_free;
+    unsigned long long encode_dropped;
+    int encode_done[2];
+    pthread_mutex_t encode_lock;
+    pthread_cond_t encode_cond;
+
+    /*
+     * Event engine driving the data path. This is the main event loop,
+     * or the data path thread's own loop in threaded mode. Both are shared
+     * by all the streams of the process.
+     */
+    struct events *events;
+
+    /*
+     * Threaded mode: the data path thread owns buffer shuttling between
+     * the V4L2 and UVC queues, including all the streaming flags above,
+     * from DATA_CMD_START until DATA_CMD_STOP is acknowledged. The
+     * control thread only changes ownership through uvc_data_command().
+     */
+    int threaded;
+    int data_wakeup[2];
+    pthread_mutex_t data_lock;
+    pthread_cond_t data_cond;
+    int data_cmd;
+    unsigned int data_cmd_seq;
+    unsigned int data_ack_seq;
+
     /* v4l2 device hook */
     struct v4l2_device *vdev;
 };
 
 /* forward declarations */
 static int uvc_video_stream(struct uvc_device *dev, int enable);
+static int v4l2_process_data(struct v4l2_device *dev);
+static int uvc_video_process(struct uvc_device *dev);
+static int uvc_video_pace_admit(struct uvc_device *dev);
+static void uvc_events_process(struct uvc_device *dev);
 
 /* ---------------------------------------------------------------------------
- * V4L2 streaming related
+ * Event handlers
  */
 
-static int v4l2_uninit_device(struct v4l2_device *dev)
+static void v4l2_data_handler(void *priv)
 {
-    unsigned int i;
-    int ret;
+    v4l2_process_data(priv);
+}
 
-    switch (dev->io) {
-    case IO_METHOD_MMAP:
-        for (i = 0; i < dev->nbufs; ++i) {
-            ret = munmap(dev->mem[i].start, dev->mem[i].length);
-            if (ret < 0) {
-                printf("V4L2: munmap failed\n");
-                return ret;
-            }
-        }
+static void uvc_video_handler(void *priv)
+{
+    uvc_video_process(priv);
+}
 
-        free(dev->mem);
-        break;
+static void uvc_events_handler(void *priv)
+{
+    uvc_events_process(priv);
+}
 
-    case IO_METHOD_USERPTR:
-    default:
-        break;
-    }
+/* ---------------------------------------------------------------------------
+ * Frame sizes
+ */
 
-    return 0;
+static int uvc_format_compressed(unsigned int fcc)
+{
+    const struct format_info *info = format_info(fcc);
+
+    return !info || format_is_compressed(info);
 }
 
-static int v4l2_reqbufs_mmap(struct v4l2_device *dev, int nbufs)
+/* Line stride of uncompressed frames, 0 for compressed formats. */
+static unsigned int uvc_bytesperline(unsigned int fcc, unsigned int width)
 {
-    struct v4l2_requestbuffers req;
-    unsigned int i = 0;
-    int ret;
+    const struct format_info *info = format_info(fcc);
 
-    CLEAR(req);
+    return info ? format_stride(info, width) : 0;
+}
 
-    req.count = nbufs;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+/* Size of a complete frame, compressed frames are bounded by imgsize. */
+static unsigned int uvc_frame_size(struct uvc_device *dev, unsigned int fcc, unsigned int width, unsigned int height)
+{
+    const struct format_info *info = format_info(fcc);
 
-    ret = ioctl(dev->v4l2_fd, VIDIOC_REQBUFS, &req);
-    if (ret < 0) {
-        if (ret == -EINVAL)
-            printf("V4L2: does not support memory mapping\n");
-        else
-            printf("V4L2: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
-        goto err;
-    }
+    if (uvc_format_compressed(fcc))
+        return dev->imgsize;
 
-    if (!req.count)
-        return 0;
+    return format_frame_size(info, format_stride(info, width), height);
+}
 
-    if (req.count < 2) {
-        printf("V4L2: Insufficient buffer memory.\n");
-        ret = -EINVAL;
-        goto err;
-    }
+/*
+ * Frame size announced to the host in probe and commit. The frame descriptor
+ * bounds compressed frames, the host sizes its buffers accordingly.
+ */
+static unsigned int
+uvc_max_frame_size(struct uvc_device *dev, const struct uvc_function_format *format, const struct uvc_function_frame *frame)
+{
+    if (uvc_format_compressed(format->fcc) && frame->max_size)
+        return frame->max_size;
 
-    /* Map the buffers. */
-    dev->mem = calloc(req.count, sizeof dev->mem[0]);
-    if (!dev->mem) {
-        printf("V4L2: Out of memory\n");
-        ret = -ENOMEM;
-        goto err;
-    }
+    return uvc_frame_size(dev, format->fcc, frame->width, frame->height);
+}
 
-    for (i = 0; i < req.count; ++i) {
-        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+/*
+ * Find the format at a descriptor index. Formats left out of the function
+ * config leave gaps, an index not found falls back to the closest format
+ * below it, or to the first one.
+ */
+static const struct uvc_function_format *uvc_find_format(const struct uvc_function_config *fc, unsigned int index)
+{
+    const struct uvc_function_format *format = &fc->formats[0];
+    unsigned int i;
 
-        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index = i;
+    for (i = 1; i < fc->num_formats && fc->formats[i].index <= index; ++i)
+        format = &fc->formats[i];
 
-        ret = ioctl(dev->v4l2_fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf(
-                "V4L2: VIDIOC_QUERYBUF failed for buf %d: "
-                "%s (%d).\n",
-                i, strerror(errno), errno);
-            ret = -EINVAL;
-            goto err_free;
-        }
+    return format;
+}
 
-        dev->mem[i].start =
-            mmap(NULL /* start anywhere */, dev->mem[i].buf.length, PROT_READ | PROT_WRITE /* required */,
-                 MAP_SHARED /* recommended */, dev->v4l2_fd, dev->mem[i].buf.m.offset);
+/* Find a format and frame, returns the frame or NULL if not declared. */
+static const struct uvc_function_frame *uvc_find_frame(const struct uvc_function_config *fc, unsigned int fcc,
+                                                       unsigned int width, unsigned int height,
+                                                       const struct uvc_function_format **format)
+{
+    unsigned int i, j;
 
-        if (MAP_FAILED == dev->mem[i].start) {
-            printf("V4L2: Unable to map buffer %u: %s (%d).\n", i, strerror(errno), errno);
-            dev->mem[i].length = 0;
-            ret = -EINVAL;
-            goto err_free;
-        }
+    for (i = 0; i < fc->num_formats; ++i) {
+        const struct uvc_function_format *f = &fc->formats[i];
 
-        dev->mem[i].length = dev->mem[i].buf.length;
-        printf("V4L2: Buffer %u mapped at address %p.\n", i, dev->mem[i].start);
+        if (f->fcc != fcc)
+            continue;
+
+        for (j = 0; j < f->num_frames; ++j) {
+            if (f->frames[j].width == width && f->frames[j].height == height) {
+                *format = f;
+                return &f->frames[j];
+            }
+        }
     }
 
-    dev->nbufs = req.count;
-    printf("V4L2: %u buffers allocated.\n", req.count);
+    return NULL;
+}
 
-    return 0;
+/* ---------------------------------------------------------------------------
+ * Frame latency
+ *
+ * Frames are stamped when dequeued from the capture device, with the capture
+ * timestamp as origin when the driver uses the monotonic clock, and when
+ * queued to the UVC side. Latencies are recorded once the UVC side returns
+ * the buffer, which is when the frame has been sent over USB.
+ */
 
-err_free:
-    free(dev->mem);
-err:
-    return ret;
+/* Capture time of a frame dequeued at now, 0 when unknown. */
+static unsigned long long uvc_capture_origin(const struct v4l2_buffer *vbuf, unsigned long long now)
+{
+    unsigned long long origin = 0;
+
+    if ((vbuf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        origin = vbuf->timestamp.tv_sec * 1000000000ULL + vbuf->timestamp.tv_usec * 1000ULL;
+
+    return origin <= now ? origin : 0;
 }
 
-static int v4l2_reqbufs_userptr(struct v4l2_device *dev, int nbufs)
+static void uvc_latency_capture(struct buffer *mem, const struct v4l2_buffer *vbuf, unsigned long long dequeued)
 {
-    struct v4l2_requestbuffers req;
-    int ret;
-
-    CLEAR(req);
+    mem->origin = uvc_capture_origin(vbuf, dequeued);
+    mem->dequeued = dequeued;
+    mem->queued = 0;
+}
 
-    req.count = nbufs;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_USERPTR;
+static void uvc_latency_complete(struct uvc_device *dev, struct buffer *mem)
+{
+    unsigned long long now = pacer_now();
 
-    ret = ioctl(dev->v4l2_fd, VIDIOC_REQBUFS, &req);
-    if (ret < 0) {
-        if (ret == -EINVAL)
-            printf("V4L2: does not support user pointer i/o\n");
-        else
-            printf("V4L2: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
-        return ret;
-    }
+    if (!mem->queued)
+        return;
 
-    dev->nbufs = req.count;
-    printf("V4L2: %u buffers allocated.\n", req.count);
+    if (mem->origin)
+        histogram_record(&dev->latency[LATENCY_CAPTURE], mem->dequeued - mem->origin);
 
-    return 0;
+    histogram_record(&dev->latency[LATENCY_PROCESS], mem->queued - mem->dequeued);
+    histogram_record(&dev->latency[LATENCY_TRANSFER], now - mem->queued);
+    histogram_record(&dev->latency[LATENCY_TOTAL], now - (mem->origin ? mem->origin : mem->dequeued));
+    mem->queued = 0;
 }
 
-static int v4l2_reqbufs(struct v4l2_device *dev, int nbufs)
+static void uvc_latency_report(struct uvc_device *dev)
 {
-    int ret = 0;
+    const struct histogram *histogram;
+    unsigned int i;
 
-    switch (dev->io) {
-    case IO_METHOD_MMAP:
-        ret = v4l2_reqbufs_mmap(dev, nbufs);
-        break;
+    if (dev->ttff)
+        printf("%s: time to first frame %llu us, %s start\n", dev->name, dev->ttff / 1000,
+               dev->warm_session ? "warm" : "cold");
+    if (dev->latest)
+        printf("%s: %llu superseded and %llu stale frame(s) dropped\n", dev->name, dev->latest_superseded,
+               dev->latest_stale);
+    if (dev->uvc_depth.max)
+        printf("%s: queue depth %u on UVC and %u on capture, %llu and %llu underrun(s), %llu and %llu raise(s)\n",
+               dev->name, dev->uvc_depth.depth, dev->capture_depth.depth, dev->uvc_depth.underruns,
+               dev->capture_depth.underruns, dev->uvc_depth.raised, dev->capture_depth.raised);
+    if (dev->recorder)
+        printf("%s: %llu frame(s) recorded and %llu skipped so far\n", dev->name, dev->recorder->frames,
+               dev->recorder->skipped + dev->recorder->errors);
+    if (dev->share)
+        printf("%s: %llu frame(s) shared and %llu skipped so far, %u subscriber(s)\n", dev->name, dev->share->frames,
+               dev->share->skipped, dev->share->nclients);
+
+    for (i = 0; i < LATENCY_COUNT; ++i) {
+        histogram = &dev->latency[i];
+        if (!histogram_count(histogram))
+            continue;
+
+        printf("%s: %s latency p50 %llu us, p99 %llu us, max %llu us over %llu frame(s)\n", dev->name,
+               latency_names[i], (unsigned long long)histogram_percentile(histogram, 0.50) / 1000,
+               (unsigned long long)histogram_percentile(histogram, 0.99) / 1000,
+               (unsigned long long)histogram_max(histogram) / 1000, (unsigned long long)histogram_count(histogram));
+    }
+}
 
-    case IO_METHOD_USERPTR:
-        ret = v4l2_reqbufs_userptr(dev, nbufs);
-        break;
+/* ---------------------------------------------------------------------------
+ * Statistics
+ */
 
-    default:
-        ret = -EINVAL;
-        break;
+static void uvc_stats_publish(struct uvc_device *dev)
+{
+    struct stats_data data;
+
+    memset(&data, 0, sizeof data);
+    data.streaming = dev->is_streaming;
+    data.frames = dev->frames_sent;
+    data.bytes = dev->bytes_sent;
+    data.dropped = dev->dropped + dev->encode_dropped + dev->pacer.dropped + dev->latest_superseded + dev->latest_stale;
+    data.superseded = dev->superseded + dev->latest_superseded;
+    data.stale = dev->stale + dev->latest_stale;
+    data.errors = dev->errors;
+    data.uvc_queued = dev->qbuf_count - dev->dqbuf_count;
+    if (dev->vdev)
+        data.capture_queued = dev->vdev->qbuf_count - dev->vdev->dqbuf_count;
+    data.uvc_depth = dev->uvc_depth.depth;
+    data.capture_depth = dev->capture_depth.depth;
+    data.uvc_underruns = dev->uvc_underruns + dev->uvc_depth.underruns;
+    data.capture_underruns = dev->capture_underruns + dev->capture_depth.underruns;
+    if (dev->recorder) {
+        data.recorded = dev->recorder->frames;
+        data.record_skipped = dev->recorder->skipped + dev->recorder->errors;
     }
+    if (dev->share) {
+        data.shared = dev->share->frames;
+        data.share_skipped = dev->share->skipped;
+        data.subscribers = dev->share->nclients;
+    }
+    data.ttff = dev->ttff;
 
-    return ret;
+    stats_publish(&dev->stats, &data, pacer_now());
 }
 
-static int v4l2_qbuf_mmap(struct v4l2_device *dev)
+/* Account for a buffer returned by the UVC side. */
+static void uvc_stats_frame(struct uvc_device *dev, const struct v4l2_buffer *ubuf)
 {
-    unsigned int i;
-    int ret;
+    if (ubuf->flags & V4L2_BUF_FLAG_ERROR) {
+        dev->errors++;
+    } else {
+        dev->frames_sent++;
+        dev->bytes_sent += ubuf->bytesused;
+        if (!dev->ttff)
+            dev->ttff = pacer_now() - dev->streamon_time;
+    }
 
-    for (i = 0; i < dev->nbufs; ++i) {
-        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+    uvc_stats_publish(dev);
+}
 
-        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index = i;
+/*
+ * Fold the session drop counters into the totals once the data path has
+ * been stopped, and publish the final counters of the session.
+ */
+static void uvc_stats_stop(struct uvc_device *dev)
+{
+    dev->dropped += dev->encode_dropped + dev->pacer.dropped + dev->latest_superseded + dev->latest_stale;
+    dev->superseded += dev->latest_superseded;
+    dev->stale += dev->latest_stale;
+    dev->encode_dropped = 0;
+    dev->pacer.dropped = 0;
+    dev->latest_superseded = 0;
+    dev->latest_stale = 0;
+    dev->uvc_underruns += dev->uvc_depth.underruns;
+    dev->capture_underruns += dev->capture_depth.underruns;
+    dev->uvc_depth.underruns = 0;
+    dev->capture_depth.underruns = 0;
+    uvc_stats_publish(dev);
+}
 
-        ret = ioctl(dev->v4l2_fd, VIDIOC_QBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf("V4L2: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
-            return ret;
+static void uvc_stats_format(struct uvc_device *dev, struct stats_text *text)
+{
+    const struct histogram *histogram;
+    struct stats_data data;
+    unsigned int i;
+
+    stats_read(&dev->stats, &data);
+
+    stats_family(text, "uvc_gadget_streaming", "gauge", "Whether a stream is running");
+    stats_printf(text, "uvc_gadget_streaming %d\n", data.streaming);
+    stats_family(text, "uvc_gadget_frames_total", "counter", "Frames sent over USB");
+    stats_printf(text, "uvc_gadget_frames_total %llu\n", (unsigned long long)data.frames);
+    stats_family(text, "uvc_gadget_bytes_total", "counter", "Payload bytes sent over USB");
+    stats_printf(text, "uvc_gadget_bytes_total %llu\n", (unsigned long long)data.bytes);
+    stats_family(text, "uvc_gadget_frame_rate", "gauge", "Frames sent per second");
+    stats_printf(text, "uvc_gadget_frame_rate %.3f\n", data.frame_rate);
+    stats_family(text, "uvc_gadget_throughput_bytes", "gauge", "Payload bytes sent per second");
+    stats_printf(text, "uvc_gadget_throughput_bytes %.0f\n", data.byte_rate);
+    stats_family(text, "uvc_gadget_queue_depth", "gauge", "Buffers queued to the driver");
+    stats_printf(text, "uvc_gadget_queue_depth{queue=\"uvc\"} %u\n", data.uvc_queued);
+    stats_printf(text, "uvc_gadget_queue_depth{queue=\"capture\"} %u\n", data.capture_queued);
+    stats_family(text, "uvc_gadget_queue_depth_limit", "gauge",
+                 "Buffers the adaptive queue depth keeps in flight, 0 when not enabled");
+    stats_printf(text, "uvc_gadget_queue_depth_limit{queue=\"uvc\"} %u\n", data.uvc_depth);
+    stats_printf(text, "uvc_gadget_queue_depth_limit{queue=\"capture\"} %u\n", data.capture_depth);
+    stats_family(text, "uvc_gadget_queue_underruns_total", "counter", "Queue underruns seen by the adaptive queue depth");
+    stats_printf(text, "uvc_gadget_queue_underruns_total{queue=\"uvc\"} %llu\n", (unsigned long long)data.uvc_underruns);
+    stats_printf(text, "uvc_gadget_queue_underruns_total{queue=\"capture\"} %llu\n",
+                 (unsigned long long)data.capture_underruns);
+    stats_family(text, "uvc_gadget_sink_frames_total", "counter", "Frames taken by the local sinks, once per subscriber");
+    stats_printf(text, "uvc_gadget_sink_frames_total{sink=\"recorder\"} %llu\n", (unsigned long long)data.recorded);
+    stats_printf(text, "uvc_gadget_sink_frames_total{sink=\"subscribers\"} %llu\n", (unsigned long long)data.shared);
+    stats_family(text, "uvc_gadget_sink_skipped_frames_total", "counter",
+                 "Frames the local sinks missed for lack of room or a write error");
+    stats_printf(text, "uvc_gadget_sink_skipped_frames_total{sink=\"recorder\"} %llu\n",
+                 (unsigned long long)data.record_skipped);
+    stats_printf(text, "uvc_gadget_sink_skipped_frames_total{sink=\"subscribers\"} %llu\n",
+                 (unsigned long long)data.share_skipped);
+    stats_family(text, "uvc_gadget_subscribers", "gauge", "Subscribers connected to the frame sharing socket");
+    stats_printf(text, "uvc_gadget_subscribers %u\n", data.subscribers);
+    stats_family(text, "uvc_gadget_dropped_frames_total", "counter", "Frames dropped before reaching the UVC queue");
+    stats_printf(text, "uvc_gadget_dropped_frames_total %llu\n", (unsigned long long)data.dropped);
+    stats_family(text, "uvc_gadget_superseded_frames_total", "counter",
+                 "Frames dropped by the latest-frame policy for a newer one");
+    stats_printf(text, "uvc_gadget_superseded_frames_total %llu\n", (unsigned long long)data.superseded);
+    stats_family(text, "uvc_gadget_stale_frames_total", "counter",
+                 "Frames dropped by the latest-frame policy for being too old");
+    stats_printf(text, "uvc_gadget_stale_frames_total %llu\n", (unsigned long long)data.stale);
+    stats_family(text, "uvc_gadget_errored_buffers_total", "counter", "Buffers returned with V4L2_BUF_FLAG_ERROR");
+    stats_printf(text, "uvc_gadget_errored_buffers_total %llu\n", (unsigned long long)data.errors);
+    stats_family(text, "uvc_gadget_time_to_first_frame_seconds", "gauge",
+                 "Time from STREAMON to the first frame sent in the current stream session");
+    stats_printf(text, "uvc_gadget_time_to_first_frame_seconds %.9f\n", data.ttff / 1e9);
+
+    stats_family(text, "uvc_gadget_events_total", "counter", "UVC events and control requests handled");
+    for (i = 0; i < UVC_EVENT_COUNT; ++i)
+        stats_printf(text, "uvc_gadget_events_total{event=\"%s\"} %llu\n", uvc_event_names[i], dev->uvc_events[i]);
+
+    stats_family(text, "uvc_gadget_latency_seconds", "summary", "Frame latency per stage in the current stream session");
+    for (i = 0; i < LATENCY_COUNT; ++i) {
+        histogram = &dev->latency[i];
+
+        stats_printf(text, "uvc_gadget_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n", latency_names[i],
+                     histogram_percentile(histogram, 0.50) / 1e9);
+        stats_printf(text, "uvc_gadget_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n", latency_names[i],
+                     histogram_percentile(histogram, 0.99) / 1e9);
+        stats_printf(text, "uvc_gadget_latency_seconds{stage=\"%s\",quantile=\"1\"} %.9f\n", latency_names[i],
+                     histogram_max(histogram) / 1e9);
+        stats_printf(text, "uvc_gadget_latency_seconds_sum{stage=\"%s\"} %.9f\n", latency_names[i],
+                     histogram_sum(histogram) / 1e9);
+        stats_printf(text, "uvc_gadget_latency_seconds_count{stage=\"%s\"} %llu\n", latency_names[i],
+                     (unsigned long long)histogram_count(histogram));
+    }
+}
+
+struct stats_client {
+    struct uvc_device *dev;
+    int fd;
+};
+
+/*
+ * Answer a scrape. Clients speak just enough HTTP to be scraped with
+ * curl --unix-socket: any request gets the metrics, and the connection is
+ * closed. Writes never block, a client that can't take the whole response
+ * at once gets a truncated one.
+ */
+static void uvc_stats_client_handler(void *priv)
+{
+    struct stats_client *client = priv;
+    struct stats_text body;
+    struct stats_text text;
+    char request[1024];
+    ssize_t ret;
+
+    ret = read(client->fd, request, sizeof request);
+    if (ret < 0 && errno == EAGAIN)
+        return;
+
+    if (ret > 0) {
+        stats_text_init(&body);
+        stats_text_init(&text);
+        uvc_stats_format(client->dev, &body);
+
+        stats_printf(&text,
+                     "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n\r\n%.*s",
+                     body.len, (int)body.len, body.data ? body.data : "");
+
+        if (write(client->fd, text.data, text.len) < 0)
+            printf("STATS: Unable to send statistics: %s (%d).\n", strerror(errno), errno);
+
+        stats_text_free(&text);
+        stats_text_free(&body);
+    }
+
+    events_unwatch_fd(client->dev->control_events, client->fd, EVENT_READ);
+    close(client->fd);
+    free(client);
+}
+
+static void uvc_stats_accept_handler(void *priv)
+{
+    struct uvc_device *dev = priv;
+    struct stats_client *client;
+    int fd;
+
+    while ((fd = stats_accept(&dev->stats)) >= 0) {
+        client = malloc(sizeof *client);
+        if (client == NULL) {
+            close(fd);
+            continue;
         }
 
-        dev->qbuf_count++;
+        client->dev = dev;
+        client->fd = fd;
+
+        if (events_watch_fd(dev->control_events, fd, EVENT_READ, uvc_stats_client_handler, client) < 0) {
+            close(fd);
+            free(client);
+        }
     }
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffer identity tracking
+ */
+
+static int buffer_side_init(struct buffer_side *side, unsigned int count, int bound)
+{
+    unsigned int i;
+
+    if (count > BUFFER_MAX_INDEX)
+        return -EINVAL;
+
+    side->slots = calloc(count, sizeof side->slots[0]);
+    if (side->slots == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < count; ++i)
+        side->slots[i] = -1;
+
+    side->count = count;
+    side->free = count == BUFFER_MAX_INDEX ? ~0ULL : (1ULL << count) - 1;
+    side->bound = bound;
 
     return 0;
 }
 
-static int v4l2_qbuf(struct v4l2_device *dev)
+/*
+ * Pick a queue index for a slot. Bound sides always use the slot's own
+ * index. Other sides prefer the index the slot used last, which lets the
+ * driver reuse its cached USERPTR pinning or DMABUF attachment.
+ */
+static int buffer_side_acquire(struct buffer_side *side, unsigned int slot, int preferred)
 {
-    int ret = 0;
+    int index;
+
+    if (side->bound)
+        index = slot;
+    else if (preferred >= 0 && (side->free & (1ULL << preferred)))
+        index = preferred;
+    else if (side->free)
+        index = __builtin_ctzll(side->free);
+    else
+        return -1;
 
-    switch (dev->io) {
-    case IO_METHOD_MMAP:
-        ret = v4l2_qbuf_mmap(dev);
-        break;
+    if (index >= (int)side->count || !(side->free & (1ULL << index)))
+        return -1;
 
-    case IO_METHOD_USERPTR:
-        /* Empty. */
-        ret = 0;
-        break;
+    side->free &= ~(1ULL << index);
+    side->slots[index] = slot;
 
-    default:
-        ret = -EINVAL;
-        break;
+    return index;
+}
+
+static unsigned int buffer_side_busy(const struct buffer_side *side)
+{
+    return side->count - __builtin_popcountll(side->free);
+}
+
+static int buffer_side_release(struct buffer_side *side, unsigned int index)
+{
+    int slot;
+
+    if (index >= side->count)
+        return -1;
+
+    slot = side->slots[index];
+    side->slots[index] = -1;
+    side->free |= 1ULL << index;
+
+    return slot;
+}
+
+static int buffer_fifo_init(struct buffer_fifo *fifo, unsigned int size)
+{
+    fifo->slots = calloc(size, sizeof fifo->slots[0]);
+    if (fifo->slots == NULL)
+        return -ENOMEM;
+
+    fifo->head = 0;
+    fifo->count = 0;
+    fifo->size = size;
+
+    return 0;
+}
+
+static void buffer_fifo_push(struct buffer_fifo *fifo, unsigned int slot)
+{
+    fifo->slots[(fifo->head + fifo->count) % fifo->size] = slot;
+    fifo->count++;
+}
+
+static int buffer_fifo_pop(struct buffer_fifo *fifo)
+{
+    unsigned int slot;
+
+    if (!fifo->count)
+        return -1;
+
+    slot = fifo->slots[fifo->head];
+    fifo->head = (fifo->head + 1) % fifo->size;
+    fifo->count--;
+
+    return slot;
+}
+
+static void buffer_table_cleanup(struct buffer_table *table)
+{
+    free(table->slots);
+    free(table->v4l2.slots);
+    free(table->uvc.slots);
+    free(table->to_v4l2.slots);
+    free(table->to_uvc.slots);
+    memset(table, 0, sizeof *table);
+}
+
+static int buffer_table_init(struct buffer_table *table, struct buffer *mem, unsigned int nslots,
+                             unsigned int nv4l2, int v4l2_bound, unsigned int nuvc, int uvc_bound)
+{
+    unsigned int i;
+    int ret;
+
+    buffer_table_cleanup(table);
+
+    table->slots = calloc(nslots, sizeof table->slots[0]);
+    if (table->slots == NULL)
+        return -ENOMEM;
+
+    table->nslots = nslots;
+    for (i = 0; i < nslots; ++i) {
+        table->slots[i].mem = &mem[i];
+        table->slots[i].owner = BUFFER_OWNER_APP;
+        table->slots[i].v4l2_index = -1;
+        table->slots[i].uvc_index = -1;
     }
 
+    ret = buffer_side_init(&table->v4l2, nv4l2, v4l2_bound);
+    if (ret < 0)
+        goto err;
+
+    ret = buffer_side_init(&table->uvc, nuvc, uvc_bound);
+    if (ret < 0)
+        goto err;
+
+    ret = buffer_fifo_init(&table->to_v4l2, nslots);
+    if (ret < 0)
+        goto err;
+
+    ret = buffer_fifo_init(&table->to_uvc, nslots);
+    if (ret < 0)
+        goto err;
+
+    table->v4l2_depth = nslots;
+    table->uvc_depth = nuvc;
+
+    printf("BUFFERS: %u slots, %u V4L2 and %u UVC queue indices\n", nslots, nv4l2, nuvc);
+
+    return 0;
+
+err:
+    printf("BUFFERS: unable to create buffer table (%d)\n", ret);
+    buffer_table_cleanup(table);
     return ret;
 }
 
-static int v4l2_process_data(struct v4l2_device *dev)
+/* Whether a slot can be queued to the V4L2 and UVC sides now. */
+static int buffer_v4l2_room(const struct buffer_table *table)
 {
-    int ret;
+    return table->v4l2.free && buffer_side_busy(&table->v4l2) + table->to_uvc.count < table->v4l2_depth;
+}
+
+static int buffer_uvc_room(const struct buffer_table *table)
+{
+    return table->uvc.free && buffer_side_busy(&table->uvc) < table->uvc_depth;
+}
+
+/*
+ * Queue a slot to the V4L2 capture side, or park it until a V4L2 queue
+ * index is released.
+ */
+static int buffer_queue_v4l2(struct v4l2_device *dev, unsigned int slot)
+{
+    struct buffer_table *table = &dev->udev->buffers;
+    struct buffer_slot *bs = &table->slots[slot];
     struct v4l2_buffer vbuf;
-    struct v4l2_buffer ubuf;
+    int index;
+    int ret;
 
-    /* Return immediately if V4l2 streaming has not yet started. */
-    if (!dev->is_streaming)
+    index = buffer_v4l2_room(table) ? buffer_side_acquire(&table->v4l2, slot, bs->v4l2_index) : -1;
+    if (index < 0) {
+        bs->owner = BUFFER_OWNER_APP;
+        buffer_fifo_push(&table->to_v4l2, slot);
         return 0;
+    }
 
-    if (dev->udev->first_buffer_queued)
-        if (dev->dqbuf_count >= dev->qbuf_count)
-            return 0;
-
-    /* Dequeue spent buffer rom V4L2 domain. */
     CLEAR(vbuf);
-
     vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.index = index;
     switch (dev->io) {
     case IO_METHOD_USERPTR:
         vbuf.memory = V4L2_MEMORY_USERPTR;
+        vbuf.m.userptr = (unsigned long)bs->mem->start;
+        vbuf.length = bs->mem->length;
         break;
 
     case IO_METHOD_MMAP:
@@ -468,335 +1181,580 @@ static int v4l2_process_data(struct v4l2_device *dev)
         break;
     }
 
-    ret = ioctl(dev->v4l2_fd, VIDIOC_DQBUF, &vbuf);
+    ret = ioctl(dev->v4l2_fd, VIDIOC_QBUF, &vbuf);
     if (ret < 0) {
+        printf("V4L2: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+        buffer_side_release(&table->v4l2, index);
+        bs->owner = BUFFER_OWNER_APP;
         return ret;
     }
 
-    dev->dqbuf_count++;
+    bs->owner = BUFFER_OWNER_V4L2;
+    bs->v4l2_index = index;
+    dev->qbuf_count++;
 
 #ifdef ENABLE_BUFFER_DEBUG
-    printf("Dequeueing buffer at V4L2 side = %d\n", vbuf.index);
+    printf("Queueing buffer at V4L2 side = %d (slot %u)\n", index, slot);
 #endif
 
-    /* Queue video buffer to UVC domain. */
-    CLEAR(ubuf);
+    return 0;
+}
+
+/*
+ * Queue a slot holding a captured frame to the UVC side, or park it until a
+ * UVC queue index is released. Returns 1 when the frame has been queued.
+ */
+static int buffer_queue_uvc(struct uvc_device *dev, unsigned int slot)
+{
+    struct buffer_table *table = &dev->buffers;
+    struct buffer_slot *bs = &table->slots[slot];
+    struct v4l2_buffer ubuf;
+    int index;
+    int ret;
+
+    index = buffer_uvc_room(table) ? buffer_side_acquire(&table->uvc, slot, bs->uvc_index) : -1;
+    if (index < 0) {
+        bs->owner = BUFFER_OWNER_APP;
+        buffer_fifo_push(&table->to_uvc, slot);
+        return 0;
+    }
 
+    CLEAR(ubuf);
     ubuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    switch (dev->udev->io) {
+    ubuf.index = index;
+    ubuf.bytesused = bs->bytesused;
+    switch (dev->io) {
     case IO_METHOD_MMAP:
         ubuf.memory = V4L2_MEMORY_MMAP;
-        ubuf.length = vbuf.length;
-        ubuf.index = vbuf.index;
-        ubuf.bytesused = vbuf.bytesused;
+        break;
+
+    case IO_METHOD_DMABUF:
+        ubuf.memory = V4L2_MEMORY_DMABUF;
+        ubuf.m.fd = bs->mem->dmabuf_fd;
+        ubuf.length = bs->mem->length;
         break;
 
     case IO_METHOD_USERPTR:
     default:
         ubuf.memory = V4L2_MEMORY_USERPTR;
-        ubuf.m.userptr = (unsigned long)dev->mem[vbuf.index].start;
-        ubuf.length = dev->mem[vbuf.index].length;
-        ubuf.index = vbuf.index;
-        ubuf.bytesused = vbuf.bytesused;
+        ubuf.m.userptr = (unsigned long)bs->mem->start;
+        ubuf.length = bs->mem->length;
         break;
     }
 
-    ret = ioctl(dev->udev->uvc_fd, VIDIOC_QBUF, &ubuf);
+    ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &ubuf);
     if (ret < 0) {
+        buffer_side_release(&table->uvc, index);
+        bs->owner = BUFFER_OWNER_APP;
+
         /* Check for a USB disconnect/shutdown event. */
         if (errno == ENODEV) {
-            dev->udev->uvc_shutdown_requested = 1;
+            dev->uvc_shutdown_requested = 1;
             printf(
                 "UVC: Possible USB shutdown requested from "
                 "Host, seen during VIDIOC_QBUF\n");
             return 0;
-        } else {
-            return ret;
         }
+
+        return ret;
     }
 
-    dev->udev->qbuf_count++;
+    bs->owner = BUFFER_OWNER_UVC;
+    bs->uvc_index = index;
+    bs->mem->queued = pacer_now();
+    dev->qbuf_count++;
+
+    if (dev->uvc_held_back) {
+        events_watch_fd(dev->events, dev->uvc_fd, EVENT_WRITE, uvc_video_handler, dev);
+        dev->uvc_held_back = 0;
+    }
 
 #ifdef ENABLE_BUFFER_DEBUG
-    printf("Queueing buffer at UVC side = %d\n", ubuf.index);
+    printf("Queueing buffer at UVC side = %d (slot %u)\n", index, slot);
 #endif
 
-    if (!dev->udev->first_buffer_queued && !dev->udev->run_standalone) {
-        uvc_video_stream(dev->udev, 1);
-        dev->udev->first_buffer_queued = 1;
-        dev->udev->is_streaming = 1;
+    return 1;
+}
+
+/*
+ * Drop a consumer's reference to the frame held by a slot, the last one
+ * hands the slot back to the V4L2 side.
+ */
+static int buffer_release(struct uvc_device *dev, unsigned int slot)
+{
+    struct buffer_slot *bs = &dev->buffers.slots[slot];
+
+    if (!bs->refs || --bs->refs)
+        return 0;
+
+    return buffer_queue_v4l2(dev->vdev, slot);
+}
+
+/* ---------------------------------------------------------------------------
+ * Local sinks
+ */
+
+/* Offer a frame going on to UVC to the local sinks, each taking a reference. */
+static void uvc_sinks_frame(struct uvc_device *dev, unsigned int slot)
+{
+    struct buffer_slot *bs = &dev->buffers.slots[slot];
+    struct share_message msg;
+
+    if (dev->recorder && recorder_submit(dev->recorder, bs->mem->start, bs->bytesused, slot) == 0)
+        bs->refs++;
+
+    if (dev->share) {
+        memset(&msg, 0, sizeof msg);
+        msg.type = SHARE_MSG_FRAME;
+        msg.index = slot;
+        msg.size = bs->bytesused;
+        msg.sequence = bs->sequence;
+        msg.timestamp = bs->mem->origin;
+        bs->refs += share_frame(dev->share, &msg);
     }
+}
 
-    return 0;
+static void uvc_record_handler(void *priv)
+{
+    struct uvc_device *dev = priv;
+    int slot;
+
+    while ((slot = recorder_complete(dev->recorder)) >= 0)
+        buffer_release(dev, slot);
+}
+
+static void uvc_share_release(void *priv, unsigned int index)
+{
+    struct uvc_device *dev = priv;
+
+    buffer_release(dev, index);
+}
+
+/*
+ * Start and stop the sinks with the data path, on its thread. Subscribers
+ * get the capture buffers as exported when they were allocated, they are
+ * the slots of the buffer table.
+ */
+static void uvc_sinks_start(struct uvc_device *dev)
+{
+    struct buffer_table *table = &dev->buffers;
+    struct share_message format;
+    int fds[SHARE_MAX_BUFFERS];
+    unsigned int i;
+
+    if (dev->recorder)
+        events_watch_fd(dev->events, dev->recorder->done[0], EVENT_READ, uvc_record_handler, dev);
+
+    if (!dev->share)
+        return;
+
+    memset(&format, 0, sizeof format);
+    format.count = table->nslots;
+    format.fourcc = dev->fcc;
+    format.width = dev->width;
+    format.height = dev->height;
+    format.bytesperline = uvc_bytesperline(dev->fcc, dev->width);
+    format.size = table->slots[0].mem->length;
+
+    for (i = 0; i < table->nslots; ++i)
+        fds[i] = table->slots[i].mem->dmabuf_fd;
+
+    if (share_start(dev->share, dev->events, &format, fds) < 0)
+        printf("SHARE: Unable to start sharing frames\n");
+}
+
+static void uvc_sinks_stop(struct uvc_device *dev)
+{
+    if (dev->recorder)
+        events_unwatch_fd(dev->events, dev->recorder->done[0], EVENT_READ);
+
+    if (dev->share)
+        share_stop(dev->share);
+}
+
+/*
+ * Wait for the recorder to write the frames it holds once the data path is
+ * stopped. Their slots are taken back along with the UVC side's.
+ */
+static void uvc_sinks_flush(struct uvc_device *dev)
+{
+    if (!dev->recorder)
+        return;
+
+    recorder_flush(dev->recorder);
+    while (recorder_complete(dev->recorder) >= 0)
+        ;
 }
 
 /* ---------------------------------------------------------------------------
- * V4L2 generic stuff
+ * Encoder stage
  */
 
-static int v4l2_get_format(struct v4l2_device *dev)
+static void uvc_encode_work(struct work *work)
 {
-    struct v4l2_format fmt;
+    struct encode_stripe *stripe = (struct encode_stripe *)work;
+    struct encode_job *job = stripe->job;
+    struct uvc_device *dev = job->dev;
+    char dummy = 0;
+    int done;
+
+    if (dev->encode_mode == ENCODE_MJPEG)
+        job->bytesused =
+            jpeg_encode_yuyv(&dev->jpeg, job->src.mem, job->src.bytesperline, job->dst.mem, job->dstsize);
+    else
+        convert_lines(&job->src, &job->dst, stripe->first, stripe->last);
+
+    pthread_mutex_lock(&dev->encode_lock);
+    done = --job->pending == 0;
+    if (done) {
+        job->done = 1;
+        pthread_cond_broadcast(&dev->encode_cond);
+    }
+    pthread_mutex_unlock(&dev->encode_lock);
+
+    if (done && write(dev->encode_done[1], &dummy, 1) != 1)
+        printf("UVC: unable to signal encoded frame: %s (%d).\n", strerror(errno), errno);
+}
+
+static int uvc_encode_queue_v4l2(struct v4l2_device *dev, unsigned int index)
+{
+    struct v4l2_buffer vbuf;
     int ret;
 
-    CLEAR(fmt);
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    CLEAR(vbuf);
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = V4L2_MEMORY_MMAP;
+    vbuf.index = index;
 
-    ret = ioctl(dev->v4l2_fd, VIDIOC_G_FMT, &fmt);
+    ret = ioctl(dev->v4l2_fd, VIDIOC_QBUF, &vbuf);
     if (ret < 0) {
+        printf("V4L2: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
         return ret;
     }
 
-    printf("V4L2: Getting current format: %c%c%c%c %ux%u\n", pixfmtstr(fmt.fmt.pix.pixelformat), fmt.fmt.pix.width,
-           fmt.fmt.pix.height);
+    dev->qbuf_count++;
 
     return 0;
 }
 
-static int v4l2_set_format(struct v4l2_device *dev, struct v4l2_format *fmt)
+static int uvc_encode_complete(struct uvc_device *dev);
+
+/*
+ * Hand a captured frame to the workers, or give it back to the capture
+ * device right away if no UVC buffer is free to receive it.
+ */
+static int uvc_encode_submit(struct uvc_device *dev, struct v4l2_buffer *vbuf)
 {
-    int ret;
+    struct encode_job *job;
+    unsigned int index, lines, i;
 
-    ret = ioctl(dev->v4l2_fd, VIDIOC_S_FMT, fmt);
-    if (ret < 0) {
-        printf("V4L2: Unable to set format %s (%d).\n", strerror(errno), errno);
-        return ret;
+    if (!dev->uvc_free || dev->job_count == dev->njobs) {
+        dev->encode_dropped++;
+        return uvc_encode_queue_v4l2(dev->vdev, vbuf->index);
     }
 
-    printf("V4L2: Setting format to: %c%c%c%c %ux%u\n", pixfmtstr(fmt->fmt.pix.pixelformat), fmt->fmt.pix.width,
-           fmt->fmt.pix.height);
+    index = __builtin_ctzll(dev->uvc_free);
+    dev->uvc_free &= ~(1ULL << index);
+
+    job = &dev->jobs[(dev->job_head + dev->job_count) % dev->njobs];
+    dev->job_count++;
+
+    uvc_latency_capture(&dev->mem[index], vbuf, pacer_now());
+
+    job->dev = dev;
+    job->v4l2_index = vbuf->index;
+    job->uvc_index = index;
+    job->src.fourcc = dev->capture_fmt.pixelformat;
+    job->src.width = dev->capture_fmt.width;
+    job->src.height = dev->capture_fmt.height;
+    job->src.bytesperline = dev->capture_fmt.bytesperline;
+    job->src.mem = dev->vdev->mem[vbuf->index].start;
+    job->dst.fourcc = dev->fcc;
+    job->dst.width = job->src.width;
+    job->dst.height = job->src.height;
+    job->dst.bytesperline = uvc_bytesperline(dev->fcc, job->dst.width);
+    job->dst.mem = dev->mem[index].start;
+    job->dstsize = dev->mem[index].length;
+    job->done = 0;
+
+    /* Converted frames are always complete, drop them if they don't fit. */
+    if (dev->encode_mode == ENCODE_CONVERT) {
+        job->bytesused = uvc_frame_size(dev, dev->fcc, job->dst.width, job->dst.height);
+        if (job->bytesused > job->dstsize) {
+            job->bytesused = 0;
+            job->done = 1;
+            return uvc_encode_complete(dev);
+        }
+    }
+
+    job->nstripes = dev->encode_stripes;
+    job->pending = job->nstripes;
+    lines = job->src.height / job->nstripes;
+
+    for (i = 0; i < job->nstripes; ++i) {
+        struct encode_stripe *stripe = &job->stripes[i];
+
+        stripe->work.func = uvc_encode_work;
+        stripe->job = job;
+        stripe->first = i * lines;
+        stripe->last = i == job->nstripes - 1 ? job->src.height : (i + 1) * lines;
+    }
+
+    for (i = 0; i < job->nstripes; ++i)
+        workers_queue(dev->workers, &job->stripes[i].work);
 
     return 0;
 }
 
-static int v4l2_set_ctrl(struct v4l2_device *dev, int new_val, int ctrl)
+/* Queue the frames completed at the head of the jobs ring to UVC. */
+static int uvc_encode_complete(struct uvc_device *dev)
 {
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control;
+    struct encode_job *job;
+    struct v4l2_buffer ubuf;
+    int done;
     int ret;
 
-    CLEAR(queryctrl);
+    while (dev->job_count) {
+        job = &dev->jobs[dev->job_head];
 
-    switch (ctrl) {
-    case V4L2_CID_BRIGHTNESS:
-        queryctrl.id = V4L2_CID_BRIGHTNESS;
-        ret = ioctl(dev->v4l2_fd, VIDIOC_QUERYCTRL, &queryctrl);
-        if (-1 == ret) {
-            if (errno != EINVAL)
-                printf(
-                    "V4L2: VIDIOC_QUERYCTRL"
-                    " failed: %s (%d).\n",
-                    strerror(errno), errno);
-            else
-                printf(
-                    "V4L2_CID_BRIGHTNESS is not"
-                    " supported: %s (%d).\n",
-                    strerror(errno), errno);
+        pthread_mutex_lock(&dev->encode_lock);
+        done = job->done;
+        pthread_mutex_unlock(&dev->encode_lock);
 
+        if (!done)
+            break;
+
+        dev->job_head = (dev->job_head + 1) % dev->njobs;
+        dev->job_count--;
+
+        ret = uvc_encode_queue_v4l2(dev->vdev, job->v4l2_index);
+        if (ret < 0)
             return ret;
-        } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-            printf("V4L2_CID_BRIGHTNESS is not supported.\n");
-            ret = -EINVAL;
-            return ret;
-        } else {
-            CLEAR(control);
-            control.id = V4L2_CID_BRIGHTNESS;
-            control.value = new_val;
 
-            ret = ioctl(dev->v4l2_fd, VIDIOC_S_CTRL, &control);
-            if (-1 == ret) {
-                printf("V4L2: VIDIOC_S_CTRL failed: %s (%d).\n", strerror(errno), errno);
-                return ret;
+        /* Frames that don't fit in a UVC buffer are dropped. */
+        if (!job->bytesused) {
+            dev->encode_dropped++;
+            dev->uvc_free |= 1ULL << job->uvc_index;
+            continue;
+        }
+
+        CLEAR(ubuf);
+        ubuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        ubuf.memory = V4L2_MEMORY_MMAP;
+        ubuf.index = job->uvc_index;
+        ubuf.bytesused = job->bytesused;
+
+        ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &ubuf);
+        if (ret < 0) {
+            dev->uvc_free |= 1ULL << job->uvc_index;
+
+            /* Check for a USB disconnect/shutdown event. */
+            if (errno == ENODEV) {
+                dev->uvc_shutdown_requested = 1;
+                printf(
+                    "UVC: Possible USB shutdown requested from "
+                    "Host, seen during VIDIOC_QBUF\n");
+                continue;
             }
+
+            printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+            return ret;
         }
-        printf("V4L2: Brightness control changed to value = 0x%x\n", new_val);
-        break;
 
-    default:
-        /* TODO: We don't support any other controls. */
-        return -EINVAL;
+        dev->mem[job->uvc_index].queued = pacer_now();
+        dev->qbuf_count++;
+
+        if (!dev->first_buffer_queued) {
+            uvc_video_stream(dev, 1);
+            dev->first_buffer_queued = 1;
+            dev->is_streaming = 1;
+            events_watch_fd(dev->events, dev->uvc_fd, EVENT_WRITE, uvc_video_handler, dev);
+        }
     }
 
     return 0;
 }
 
-static int v4l2_start_capturing(struct v4l2_device *dev)
+static void uvc_encode_handler(void *priv)
 {
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    struct uvc_device *dev = priv;
+    char dummy[64];
+
+    while (read(dev->encode_done[0], dummy, sizeof dummy) > 0)
+        ;
+
+    uvc_encode_complete(dev);
+}
+
+/* Reclaim a UVC buffer once it has been sent. */
+static int uvc_encode_dequeue(struct uvc_device *dev)
+{
+    struct v4l2_buffer ubuf;
     int ret;
 
-    ret = ioctl(dev->v4l2_fd, VIDIOC_STREAMON, &type);
+    CLEAR(ubuf);
+    ubuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    ubuf.memory = V4L2_MEMORY_MMAP;
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
     if (ret < 0) {
-        printf("V4L2: Unable to start streaming: %s (%d).\n", strerror(errno), errno);
+        printf("UVC: Unable to dequeue buffer: %s (%d).\n", strerror(errno), errno);
         return ret;
     }
 
-    printf("V4L2: Starting video stream.\n");
+    dev->dqbuf_count++;
+    dev->uvc_free |= 1ULL << ubuf.index;
+    uvc_stats_frame(dev, &ubuf);
+
+    if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
+        dev->uvc_shutdown_requested = 1;
+        printf(
+            "UVC: Possible USB shutdown requested from "
+            "Host, seen during VIDIOC_DQBUF\n");
+        return 0;
+    }
+
+    uvc_latency_complete(dev, &dev->mem[ubuf.index]);
 
     return 0;
 }
 
-static int v4l2_stop_capturing(struct v4l2_device *dev)
+/*
+ * Prepare the encoder for the committed format, and hand all capture
+ * buffers to the capture device. UVC buffers must have been allocated.
+ */
+static int uvc_encode_start(struct uvc_device *dev)
 {
-    enum v4l2_buf_type type;
+    struct v4l2_device *vdev = dev->vdev;
+    struct v4l2_format fmt;
+    unsigned int i;
     int ret;
 
-    switch (dev->io) {
-    case IO_METHOD_MMAP:
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    ret = ioctl(vdev->v4l2_fd, VIDIOC_G_FMT, &fmt);
+    if (ret < 0) {
+        printf("V4L2: Unable to get format: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    dev->capture_fmt = fmt.fmt.pix;
 
-        ret = ioctl(dev->v4l2_fd, VIDIOC_STREAMOFF, &type);
+    if (dev->fcc == V4L2_PIX_FMT_MJPEG && dev->encode_quality && fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV) {
+        ret = jpeg_encoder_init(&dev->jpeg, fmt.fmt.pix.width, fmt.fmt.pix.height, dev->encode_quality);
         if (ret < 0) {
-            printf("V4L2: VIDIOC_STREAMOFF failed: %s (%d).\n", strerror(errno), errno);
+            printf("UVC: Unable to encode %ux%u frames\n", fmt.fmt.pix.width, fmt.fmt.pix.height);
             return ret;
         }
 
-        break;
-    default:
-        /* Nothing to do. */
-        break;
-    }
+        dev->encode_mode = ENCODE_MJPEG;
+        dev->encode_stripes = 1;
 
-    return 0;
-}
-static int v4l2_open(struct v4l2_device **v4l2, char *devname, struct v4l2_format *s_fmt)
-{
-    struct v4l2_device *dev;
-    struct v4l2_capability cap;
-    int fd;
-    int ret = -EINVAL;
+        printf("UVC: Encoding %ux%u YUYV to MJPEG, quality %u, on %u thread(s)\n", fmt.fmt.pix.width,
+               fmt.fmt.pix.height, dev->encode_quality, dev->workers->nthreads);
+    } else if (convert_supported(fmt.fmt.pix.pixelformat, dev->fcc)) {
+        dev->encode_mode = ENCODE_CONVERT;
+        dev->encode_stripes = fmt.fmt.pix.sizeimage / ENCODE_STRIPE_SIZE;
+        dev->encode_stripes = clamp(dev->encode_stripes, 1U, min(dev->workers->nthreads, ENCODE_MAX_STRIPES));
 
-    fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (fd == -1) {
-        printf("V4L2: device open failed: %s (%d).\n", strerror(errno), errno);
-        return ret;
+        printf("UVC: Converting %ux%u %c%c%c%c to %c%c%c%c in %u stripe(s)\n", fmt.fmt.pix.width,
+               fmt.fmt.pix.height, pixfmtstr(fmt.fmt.pix.pixelformat), pixfmtstr(dev->fcc), dev->encode_stripes);
+    } else {
+        printf("UVC: No conversion from %c%c%c%c to %c%c%c%c\n", pixfmtstr(fmt.fmt.pix.pixelformat),
+               pixfmtstr(dev->fcc));
+        return -EINVAL;
     }
 
-    ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
-    if (ret < 0) {
-        printf("V4L2: VIDIOC_QUERYCAP failed: %s (%d).\n", strerror(errno), errno);
-        goto err;
+    if (dev->nbufs > BUFFER_MAX_INDEX) {
+        printf("UVC: Too many buffers to encode into\n");
+        return -EINVAL;
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        printf("V4L2: %s is no video capture device\n", devname);
-        goto err;
-    }
+    dev->jobs = calloc(dev->nbufs, sizeof dev->jobs[0]);
+    if (dev->jobs == NULL)
+        return -ENOMEM;
 
-    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-        printf("V4L2: %s does not support streaming i/o\n", devname);
-        goto err;
-    }
+    dev->njobs = dev->nbufs;
+    dev->job_head = 0;
+    dev->job_count = 0;
+    dev->uvc_free = dev->nbufs == 64 ? ~0ULL : (1ULL << dev->nbufs) - 1;
+    dev->encode_dropped = 0;
 
-    dev = calloc(1, sizeof *dev);
-    if (dev == NULL) {
-        ret = -ENOMEM;
-        goto err;
+    for (i = 0; i < vdev->nbufs; ++i) {
+        ret = uvc_encode_queue_v4l2(vdev, i);
+        if (ret < 0)
+            return ret;
     }
 
-    printf("V4L2 device is %s on bus %s\n", cap.card, cap.bus_info);
-
-    dev->v4l2_fd = fd;
-
-    /* Get the default image format supported. */
-    ret = v4l2_get_format(dev);
-    if (ret < 0)
-        goto err_free;
-
-    /*
-     * Set the desired image format.
-     * Note: VIDIOC_S_FMT may change width and height.
-     */
-    ret = v4l2_set_format(dev, s_fmt);
-    if (ret < 0)
-        goto err_free;
-
-    /* Get the changed image format. */
-    ret = v4l2_get_format(dev);
-    if (ret < 0)
-        goto err_free;
-
-    printf("v4l2 open succeeded, file descriptor = %d\n", fd);
-
-    *v4l2 = dev;
-
     return 0;
-
-err_free:
-    free(dev);
-err:
-    close(fd);
-
-    return ret;
-}
-
-static void v4l2_close(struct v4l2_device *dev)
-{
-    close(dev->v4l2_fd);
-    free(dev);
 }
 
-/* ---------------------------------------------------------------------------
- * UVC generic stuff
+/*
+ * Wait for the frames being encoded before the buffers they use go away.
+ * The data path must already have been stopped.
  */
-
-static int uvc_video_set_format(struct uvc_device *dev)
+static void uvc_encode_stop(struct uvc_device *dev)
 {
-    struct v4l2_format fmt;
-    int ret;
+    char dummy[64];
+    unsigned int i;
 
-    CLEAR(fmt);
+    if (dev->jobs == NULL)
+        return;
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    fmt.fmt.pix.width = dev->width;
-    fmt.fmt.pix.height = dev->height;
-    fmt.fmt.pix.pixelformat = dev->fcc;
-    fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    if (dev->fcc == V4L2_PIX_FMT_MJPEG)
-        fmt.fmt.pix.sizeimage = dev->imgsize * 1.5;
+    pthread_mutex_lock(&dev->encode_lock);
+    for (i = 0; i < dev->job_count; ++i) {
+        struct encode_job *job = &dev->jobs[(dev->job_head + i) % dev->njobs];
 
-    ret = ioctl(dev->uvc_fd, VIDIOC_S_FMT, &fmt);
-    if (ret < 0) {
-        printf("UVC: Unable to set format %s (%d).\n", strerror(errno), errno);
-        return ret;
+        while (!job->done)
+            pthread_cond_wait(&dev->encode_cond, &dev->encode_lock);
     }
+    pthread_mutex_unlock(&dev->encode_lock);
 
-    printf("UVC: Setting format to: %c%c%c%c %ux%u\n", pixfmtstr(dev->fcc), dev->width, dev->height);
+    while (read(dev->encode_done[0], dummy, sizeof dummy) > 0)
+        ;
 
-    return 0;
+    if (dev->encode_dropped)
+        printf("UVC: %llu frame(s) dropped by the encoder stage\n", dev->encode_dropped);
+
+    free(dev->jobs);
+    dev->jobs = NULL;
+    dev->njobs = 0;
+    dev->job_count = 0;
 }
 
-static int uvc_video_stream(struct uvc_device *dev, int enable)
+static int uvc_encode_init(struct uvc_device *dev, unsigned int quality, struct workers *workers)
 {
-    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    int ret;
-
-    if (!enable) {
-        ret = ioctl(dev->uvc_fd, VIDIOC_STREAMOFF, &type);
-        if (ret < 0) {
-            printf("UVC: VIDIOC_STREAMOFF failed: %s (%d).\n", strerror(errno), errno);
-            return ret;
-        }
-
-        printf("UVC: Stopping video stream.\n");
-
-        return 0;
+    if (pipe(dev->encode_done) < 0) {
+        printf("UVC: unable to create encoder pipe: %s (%d).\n", strerror(errno), errno);
+        return -errno;
     }
 
-    ret = ioctl(dev->uvc_fd, VIDIOC_STREAMON, &type);
-    if (ret < 0) {
-        printf("UVC: Unable to start streaming %s (%d).\n", strerror(errno), errno);
-        return ret;
-    }
+    fcntl(dev->encode_done[0], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&dev->encode_lock, NULL);
+    pthread_cond_init(&dev->encode_cond, NULL);
+    dev->workers = workers;
+    dev->encode_quality = quality;
 
-    printf("UVC: Starting video stream.\n");
+    return 0;
+}
 
-    dev->uvc_shutdown_requested = 0;
+static void uvc_encode_cleanup(struct uvc_device *dev)
+{
+    if (!dev->workers)
+        return;
 
-    return 0;
+    close(dev->encode_done[0]);
+    close(dev->encode_done[1]);
+    pthread_cond_destroy(&dev->encode_cond);
+    pthread_mutex_destroy(&dev->encode_lock);
+    dev->workers = NULL;
 }
 
-static int uvc_uninit_device(struct uvc_device *dev)
+/* ---------------------------------------------------------------------------
+ * V4L2 streaming related
+ */
+
+static int v4l2_uninit_device(struct v4l2_device *dev)
 {
     unsigned int i;
     int ret;
@@ -804,9 +1762,12 @@ static int uvc_uninit_device(struct uvc_device *dev)
     switch (dev->io) {
     case IO_METHOD_MMAP:
         for (i = 0; i < dev->nbufs; ++i) {
+            if (dev->mem[i].dmabuf_fd >= 0)
+                close(dev->mem[i].dmabuf_fd);
+
             ret = munmap(dev->mem[i].start, dev->mem[i].length);
             if (ret < 0) {
-                printf("UVC: munmap failed\n");
+                printf("V4L2: munmap failed\n");
                 return ret;
             }
         }
@@ -816,283 +1777,1471 @@ static int uvc_uninit_device(struct uvc_device *dev)
 
     case IO_METHOD_USERPTR:
     default:
-        if (dev->run_standalone) {
-            for (i = 0; i < dev->nbufs; ++i)
-                free(dev->dummy_buf[i].start);
-
-            free(dev->dummy_buf);
-        }
         break;
     }
 
     return 0;
 }
-static int uvc_open(struct uvc_device **uvc, char *devname)
+
+/*
+ * Export a capture buffer as a DMABUF file descriptor, so that the UVC side
+ * can import it without any CPU mapping or cache maintenance.
+ */
+static int v4l2_export_buffer(struct v4l2_device *dev, struct buffer *buffer)
 {
-    struct uvc_device *dev;
-    struct v4l2_capability cap;
-    int fd;
-    int ret = -EINVAL;
+    struct v4l2_exportbuffer expbuf;
+    int ret;
 
-    fd = open(devname, O_RDWR | O_NONBLOCK);
-    if (fd == -1) {
-        printf("UVC: device open failed: %s (%d).\n", strerror(errno), errno);
-        return ret;
-    }
+    CLEAR(expbuf);
+    expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    expbuf.index = buffer->buf.index;
+    expbuf.flags = O_RDWR | O_CLOEXEC;
 
-    ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
+    ret = ioctl(dev->v4l2_fd, VIDIOC_EXPBUF, &expbuf);
     if (ret < 0) {
-        printf("UVC: unable to query uvc device: %s (%d)\n", strerror(errno), errno);
-        goto err;
+        printf("V4L2: VIDIOC_EXPBUF failed for buf %u: %s (%d).\n", buffer->buf.index, strerror(errno), errno);
+        return ret;
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_OUTPUT)) {
-        printf("UVC: %s is no video output device\n", devname);
-        goto err;
-    }
+    buffer->dmabuf_fd = expbuf.fd;
+    printf("V4L2: Buffer %u exported as dmabuf fd %d.\n", buffer->buf.index, expbuf.fd);
 
-    dev = calloc(1, sizeof *dev);
-    if (dev == NULL) {
-        ret = -ENOMEM;
-        goto err;
-    }
+    return 0;
+}
 
-    printf("uvc device is %s on bus %s\n", cap.card, cap.bus_info);
-    printf("uvc open succeeded, file descriptor = %d\n", fd);
+static int v4l2_reqbufs_mmap(struct v4l2_device *dev, int nbufs)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int i = 0;
+    int ret;
 
-    dev->uvc_fd = fd;
-    *uvc = dev;
+    CLEAR(req);
+
+    req.count = nbufs;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_REQBUFS, &req);
+    if (ret < 0) {
+        if (ret == -EINVAL)
+            printf("V4L2: does not support memory mapping\n");
+        else
+            printf("V4L2: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
+        goto err;
+    }
+
+    if (!req.count)
+        return 0;
+
+    if (req.count < 2) {
+        printf("V4L2: Insufficient buffer memory.\n");
+        ret = -EINVAL;
+        goto err;
+    }
+
+    /* Map the buffers. */
+    dev->mem = calloc(req.count, sizeof dev->mem[0]);
+    if (!dev->mem) {
+        printf("V4L2: Out of memory\n");
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < req.count; ++i) {
+        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+
+        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
+        dev->mem[i].buf.index = i;
+
+        ret = ioctl(dev->v4l2_fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
+        if (ret < 0) {
+            printf(
+                "V4L2: VIDIOC_QUERYBUF failed for buf %d: "
+                "%s (%d).\n",
+                i, strerror(errno), errno);
+            ret = -EINVAL;
+            goto err_free;
+        }
+
+        dev->mem[i].start =
+            mmap(NULL /* start anywhere */, dev->mem[i].buf.length, PROT_READ | PROT_WRITE /* required */,
+                 MAP_SHARED /* recommended */, dev->v4l2_fd, dev->mem[i].buf.m.offset);
+
+        if (MAP_FAILED == dev->mem[i].start) {
+            printf("V4L2: Unable to map buffer %u: %s (%d).\n", i, strerror(errno), errno);
+            dev->mem[i].length = 0;
+            ret = -EINVAL;
+            goto err_free;
+        }
+
+        dev->mem[i].length = dev->mem[i].buf.length;
+        dev->mem[i].dmabuf_fd = -1;
+        printf("V4L2: Buffer %u mapped at address %p.\n", i, dev->mem[i].start);
+
+        /* UVC DMABUF imports the buffers, and subscribers map them. */
+        if (dev->udev->io == IO_METHOD_DMABUF || dev->udev->share) {
+            ret = v4l2_export_buffer(dev, &dev->mem[i]);
+            if (ret < 0)
+                goto err_free;
+        }
+    }
+
+    dev->nbufs = req.count;
+    printf("V4L2: %u buffers allocated.\n", req.count);
 
     return 0;
 
+err_free:
+    free(dev->mem);
 err:
-    close(fd);
     return ret;
 }
 
-static void uvc_close(struct uvc_device *dev)
+static int v4l2_reqbufs_userptr(struct v4l2_device *dev, int nbufs)
 {
-    close(dev->uvc_fd);
-    free(dev->imgdata);
-    free(dev);
-}
+    struct v4l2_requestbuffers req;
+    int ret;
 
-/* ---------------------------------------------------------------------------
- * UVC streaming related
- */
+    CLEAR(req);
 
-static void uvc_video_fill_buffer(struct uvc_device *dev, struct v4l2_buffer *buf)
+    req.count = nbufs;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_REQBUFS, &req);
+    if (ret < 0) {
+        if (ret == -EINVAL)
+            printf("V4L2: does not support user pointer i/o\n");
+        else
+            printf("V4L2: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    dev->nbufs = req.count;
+    printf("V4L2: %u buffers allocated.\n", req.count);
+
+    return 0;
+}
+
+static int v4l2_reqbufs(struct v4l2_device *dev, int nbufs)
 {
-    unsigned int bpl;
-    unsigned int i;
+    int ret = 0;
 
-    switch (dev->fcc) {
-    case V4L2_PIX_FMT_YUYV:
-        /* Fill the buffer with video data. */
-        bpl = dev->width * 2;
-        for (i = 0; i < dev->height; ++i)
-            memset(dev->mem[buf->index].start + i * bpl, dev->color++, bpl);
+    switch (dev->io) {
+    case IO_METHOD_MMAP:
+        ret = v4l2_reqbufs_mmap(dev, nbufs);
+        break;
 
-        buf->bytesused = bpl * dev->height;
+    case IO_METHOD_USERPTR:
+        ret = v4l2_reqbufs_userptr(dev, nbufs);
         break;
 
-    case V4L2_PIX_FMT_MJPEG:
-        memcpy(dev->mem[buf->index].start, dev->imgdata, dev->imgsize);
-        buf->bytesused = dev->imgsize;
+    default:
+        ret = -EINVAL;
         break;
     }
+
+    return ret;
 }
 
-static int uvc_video_process(struct uvc_device *dev)
+/*
+ * Build the buffer identity table from whichever side allocated the frame
+ * memory and hand all of it to the V4L2 capture side.
+ */
+static int v4l2_qbuf(struct v4l2_device *dev)
 {
-    struct v4l2_buffer ubuf;
-    struct v4l2_buffer vbuf;
+    struct uvc_device *udev = dev->udev;
+    struct buffer_table *table = &udev->buffers;
     unsigned int i;
     int ret;
-    /*
-     * Return immediately if UVC video output device has not started
-     * streaming yet.
-     */
-    if (!dev->is_streaming)
-        return 0;
-    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
-    CLEAR(ubuf);
 
-    ubuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     switch (dev->io) {
     case IO_METHOD_MMAP:
-        ubuf.memory = V4L2_MEMORY_MMAP;
+        ret = buffer_table_init(table, dev->mem, dev->nbufs, dev->nbufs, 1, udev->nbufs, 0);
         break;
 
     case IO_METHOD_USERPTR:
+        ret = buffer_table_init(table, udev->mem, udev->nbufs, dev->nbufs, 0, udev->nbufs, 1);
+        break;
+
     default:
-        ubuf.memory = V4L2_MEMORY_USERPTR;
+        ret = -EINVAL;
         break;
     }
-    if (dev->run_standalone) {
-        /* UVC stanalone setup. */
-        ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
-        if (ret < 0)
-            return ret;
 
-        dev->dqbuf_count++;
-#ifdef ENABLE_BUFFER_DEBUG
-        printf("DeQueued buffer at UVC side = %d\n", ubuf.index);
-#endif
-        uvc_video_fill_buffer(dev, &ubuf);
+    if (ret < 0)
+        return ret;
 
-        ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &ubuf);
+    if (udev->latest)
+        table->uvc_depth = min(table->uvc_depth, LATEST_UVC_DEPTH);
+
+    for (i = 0; i < table->nslots; ++i) {
+        ret = buffer_queue_v4l2(dev, i);
         if (ret < 0)
             return ret;
+    }
 
-        dev->qbuf_count++;
-
-#ifdef ENABLE_BUFFER_DEBUG
-        printf("ReQueueing buffer at UVC side = %d\n", ubuf.index);
-#endif
-    } else {
-        /* UVC - V4L2 integrated path. */
+    return 0;
+}
 
-        /*
-         * Return immediately if V4L2 video capture device has not
-         * started streaming yet or if QBUF was not called even once on
-         * the UVC side.
-         */
-        if (!dev->vdev->is_streaming || !dev->first_buffer_queued)
-            return 0;
+/* Hand a dequeued capture buffer straight back to the capture device. */
+static int v4l2_recycle(struct v4l2_device *dev, unsigned int index)
+{
+    struct buffer_table *table = &dev->udev->buffers;
+    int slot;
 
-        /*
-         * Do not dequeue buffers from UVC side until there are atleast
-         * 2 buffers available at UVC domain.
-         */
-        if (!dev->uvc_shutdown_requested)
-            if ((dev->dqbuf_count + 1) >= dev->qbuf_count)
-                return 0;
+    if (dev->udev->workers)
+        return uvc_encode_queue_v4l2(dev, index);
 
-        /* Dequeue the spent buffer from UVC domain */
-        ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
-        if (ret < 0) {
-            printf("UVC: Unable to dequeue buffer: %s (%d).\n", strerror(errno), errno);
-            return ret;
-        }
+    slot = buffer_side_release(&table->v4l2, index);
+    if (slot < 0) {
+        printf("V4L2: dequeued unknown buffer %u\n", index);
+        return -EINVAL;
+    }
 
-        if (dev->io == IO_METHOD_USERPTR)
-            for (i = 0; i < dev->nbufs; ++i)
-                if (ubuf.m.userptr == (unsigned long)dev->vdev->mem[i].start && ubuf.length == dev->vdev->mem[i].length)
-                    break;
+    return buffer_queue_v4l2(dev, slot);
+}
 
-        dev->dqbuf_count++;
+/*
+ * Latest-frame policy: dequeue the frames captured after vbuf as well, and
+ * keep the newest one only. The drain stops after one round of the capture
+ * buffers, a device that refills them as fast as they are recycled would
+ * otherwise keep it going forever.
+ */
+static int v4l2_dequeue_latest(struct v4l2_device *dev, struct v4l2_buffer *vbuf)
+{
+    struct v4l2_buffer next;
+    unsigned int i;
+    int ret;
 
-#ifdef ENABLE_BUFFER_DEBUG
-        printf("DeQueued buffer at UVC side=%d\n", ubuf.index);
-#endif
+    for (i = 1; i < dev->nbufs; ++i) {
+        CLEAR(next);
+        next.type = vbuf->type;
+        next.memory = vbuf->memory;
 
-        /*
-         * If the dequeued buffer was marked with state ERROR by the
-         * underlying UVC driver gadget, do not queue the same to V4l2
-         * and wait for a STREAMOFF event on UVC side corresponding to
-         * set_alt(0). So, now all buffers pending at UVC end will be
-         * dequeued one-by-one and we will enter a state where we once
-         * again wait for a set_alt(1) command from the USB host side.
-         */
-        if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
-            dev->uvc_shutdown_requested = 1;
-            printf(
-                "UVC: Possible USB shutdown requested from "
-                "Host, seen during VIDIOC_DQBUF\n");
+        if (ioctl(dev->v4l2_fd, VIDIOC_DQBUF, &next) < 0)
             return 0;
-        }
 
-        /* Queue the buffer to V4L2 domain */
-        CLEAR(vbuf);
-
-        vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vbuf.memory = V4L2_MEMORY_MMAP;
-        vbuf.index = ubuf.index;
+        dev->dqbuf_count++;
+        if (next.flags & V4L2_BUF_FLAG_ERROR)
+            dev->udev->errors++;
 
-        ret = ioctl(dev->vdev->v4l2_fd, VIDIOC_QBUF, &vbuf);
+        ret = v4l2_recycle(dev, vbuf->index);
         if (ret < 0)
             return ret;
 
-        dev->vdev->qbuf_count++;
-
-#ifdef ENABLE_BUFFER_DEBUG
-        printf("ReQueueing buffer at V4L2 side = %d\n", vbuf.index);
-#endif
+        dev->udev->latest_superseded++;
+        *vbuf = next;
     }
 
     return 0;
 }
 
-static int uvc_video_qbuf_mmap(struct uvc_device *dev)
+/* Whether a frame captured at origin is too old to be sent at now. */
+static int uvc_frame_stale(struct uvc_device *dev, unsigned long long origin, unsigned long long now)
 {
-    unsigned int i;
+    return dev->max_age && origin && now - origin > dev->max_age;
+}
+
+/* Queue the slots waiting for the V4L2 side while it has room for them. */
+static int buffer_refill_v4l2(struct v4l2_device *dev)
+{
+    struct buffer_table *table = &dev->udev->buffers;
+    unsigned int count;
     int ret;
 
-    for (i = 0; i < dev->nbufs; ++i) {
-        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+    for (count = table->to_v4l2.count; count && buffer_v4l2_room(table); --count) {
+        ret = buffer_queue_v4l2(dev, buffer_fifo_pop(&table->to_v4l2));
+        if (ret < 0)
+            return ret;
+    }
 
-        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index = i;
+    return 0;
+}
 
-        /* UVC standalone setup. */
-        if (dev->run_standalone)
-            uvc_video_fill_buffer(dev, &(dev->mem[i].buf));
+/*
+ * Queue the frames waiting for the UVC side while it has room for them,
+ * frames that have grown too old meanwhile go back to the capture device.
+ */
+static int buffer_refill_uvc(struct uvc_device *dev)
+{
+    struct buffer_table *table = &dev->buffers;
+    unsigned int count;
+    int slot;
+    int ret;
 
-        ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
-            return ret;
+    for (count = table->to_uvc.count; count && buffer_uvc_room(table); --count) {
+        slot = buffer_fifo_pop(&table->to_uvc);
+        if (uvc_frame_stale(dev, table->slots[slot].mem->origin, pacer_now())) {
+            dev->latest_stale++;
+            ret = buffer_release(dev, slot);
+        } else {
+            ret = buffer_queue_uvc(dev, slot);
         }
 
-        dev->qbuf_count++;
+        if (ret < 0)
+            return ret;
     }
 
     return 0;
 }
 
-static int uvc_video_qbuf_userptr(struct uvc_device *dev)
+/*
+ * Feed a capture dequeue to the capture side depth controller. The driver
+ * skips the sequence numbers of the frames it had no buffer for, which is an
+ * underrun unless the UVC side is full and holds the buffers back anyway.
+ */
+static void v4l2_depth_dequeue(struct v4l2_device *dev, const struct v4l2_buffer *vbuf)
 {
-    unsigned int i;
-    int ret;
+    struct uvc_device *udev = dev->udev;
+    struct buffer_table *table = &udev->buffers;
 
-    /* UVC standalone setup. */
-    if (dev->run_standalone) {
-        for (i = 0; i < dev->nbufs; ++i) {
+    if (udev->capture_depth.last && vbuf->sequence != udev->capture_sequence + 1) {
+        if (buffer_uvc_room(table))
+            table->v4l2_depth = depth_underrun(&udev->capture_depth);
+        else
+            udev->uvc_turned_away = 1;
+    }
+
+    table->v4l2_depth = depth_dequeue(&udev->capture_depth, pacer_now());
+    udev->capture_sequence = vbuf->sequence;
+}
+
+static int v4l2_process_data(struct v4l2_device *dev)
+{
+    struct uvc_device *udev = dev->udev;
+    struct buffer_table *table = &udev->buffers;
+    struct buffer_slot *bs;
+    struct v4l2_buffer vbuf;
+    unsigned long long now;
+    int slot, pending, queued;
+    int ret;
+
+    /* Return immediately if V4l2 streaming has not yet started. */
+    if (!dev->is_streaming)
+        return 0;
+
+    if (dev->udev->first_buffer_queued)
+        if (dev->dqbuf_count >= dev->qbuf_count)
+            return 0;
+
+    /* Dequeue spent buffer rom V4L2 domain. */
+    CLEAR(vbuf);
+
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    switch (dev->io) {
+    case IO_METHOD_USERPTR:
+        vbuf.memory = V4L2_MEMORY_USERPTR;
+        break;
+
+    case IO_METHOD_MMAP:
+    default:
+        vbuf.memory = V4L2_MEMORY_MMAP;
+        break;
+    }
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_DQBUF, &vbuf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    dev->dqbuf_count++;
+    if (vbuf.flags & V4L2_BUF_FLAG_ERROR)
+        dev->udev->errors++;
+
+#ifdef ENABLE_BUFFER_DEBUG
+    printf("Dequeueing buffer at V4L2 side = %d\n", vbuf.index);
+#endif
+
+    if (udev->depth_min && !udev->workers)
+        v4l2_depth_dequeue(dev, &vbuf);
+
+    if (udev->latest) {
+        ret = v4l2_dequeue_latest(dev, &vbuf);
+        if (ret < 0)
+            return ret;
+
+        udev->capture_sequence = vbuf.sequence;
+
+        now = pacer_now();
+        if (uvc_frame_stale(udev, uvc_capture_origin(&vbuf, now), now)) {
+            udev->latest_stale++;
+            return v4l2_recycle(dev, vbuf.index);
+        }
+    }
+
+    if (dev->udev->workers) {
+        if (!uvc_video_pace_admit(dev->udev))
+            return uvc_encode_queue_v4l2(dev, vbuf.index);
+        return uvc_encode_submit(dev->udev, &vbuf);
+    }
+
+    slot = buffer_side_release(&table->v4l2, vbuf.index);
+    if (slot < 0) {
+        printf("V4L2: dequeued unknown buffer %u\n", vbuf.index);
+        return -EINVAL;
+    }
+
+    bs = &table->slots[slot];
+    bs->owner = BUFFER_OWNER_APP;
+    bs->sequence = vbuf.sequence;
+    bs->bytesused = vbuf.bytesused;
+    bs->timestamp = vbuf.timestamp;
+    uvc_latency_capture(bs->mem, &vbuf, pacer_now());
+
+    /* Frames ahead of the committed frame rate go straight back. */
+    if (!uvc_video_pace_admit(dev->udev))
+        return buffer_queue_v4l2(dev, slot);
+
+    /* Frames still waiting for a UVC buffer are superseded. */
+    while (udev->latest && (pending = buffer_fifo_pop(&table->to_uvc)) >= 0) {
+        udev->latest_superseded++;
+        udev->uvc_turned_away = 1;
+        ret = buffer_release(udev, pending);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* The UVC side and the local sinks share the frame. */
+    bs->refs = 1;
+    uvc_sinks_frame(udev, slot);
+
+    /* Queue video buffer to UVC domain. */
+    queued = buffer_queue_uvc(dev->udev, slot);
+    if (queued < 0)
+        return queued;
+
+    /* The released V4L2 index can take a slot waiting for one. */
+    ret = buffer_refill_v4l2(dev);
+    if (ret < 0)
+        return ret;
+
+    if (queued && !dev->udev->first_buffer_queued && !dev->udev->run_standalone) {
+        uvc_video_stream(dev->udev, 1);
+        dev->udev->first_buffer_queued = 1;
+        dev->udev->is_streaming = 1;
+        events_watch_fd(dev->udev->events, dev->udev->uvc_fd, EVENT_WRITE, uvc_video_handler, dev->udev);
+    }
+
+    return 0;
+}
+
+/*
+ * Capture frames that arrive while a warm pipeline waits for STREAMON go
+ * straight back to the driver. The sensor keeps running, at the cost of a
+ * dequeue and queue per frame.
+ */
+static void v4l2_idle_handler(void *priv)
+{
+    struct v4l2_device *dev = priv;
+    struct v4l2_buffer vbuf;
+
+    CLEAR(vbuf);
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = dev->io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+
+    if (ioctl(dev->v4l2_fd, VIDIOC_DQBUF, &vbuf) < 0)
+        return;
+
+    dev->dqbuf_count++;
+    v4l2_recycle(dev, vbuf.index);
+}
+
+/* ---------------------------------------------------------------------------
+ * V4L2 generic stuff
+ */
+
+static int v4l2_get_format(struct v4l2_device *dev)
+{
+    struct v4l2_format fmt;
+    int ret;
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_G_FMT, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    printf("V4L2: Getting current format: %c%c%c%c %ux%u\n", pixfmtstr(fmt.fmt.pix.pixelformat), fmt.fmt.pix.width,
+           fmt.fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_set_format(struct v4l2_device *dev, struct v4l2_format *fmt)
+{
+    int ret;
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_S_FMT, fmt);
+    if (ret < 0) {
+        printf("V4L2: Unable to set format %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    printf("V4L2: Setting format to: %c%c%c%c %ux%u\n", pixfmtstr(fmt->fmt.pix.pixelformat), fmt->fmt.pix.width,
+           fmt->fmt.pix.height);
+
+    return 0;
+}
+
+/*
+ * Fall back to a capture format that can be converted to the requested one
+ * when the device doesn't support it.
+ */
+static void v4l2_select_format(struct v4l2_device *dev, struct v4l2_format *fmt)
+{
+    struct v4l2_fmtdesc desc;
+    unsigned int fallback = 0;
+
+    CLEAR(desc);
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (; ioctl(dev->v4l2_fd, VIDIOC_ENUM_FMT, &desc) == 0; ++desc.index) {
+        if (desc.pixelformat == fmt->fmt.pix.pixelformat)
+            return;
+
+        if (!fallback && convert_supported(desc.pixelformat, fmt->fmt.pix.pixelformat))
+            fallback = desc.pixelformat;
+    }
+
+    if (!fallback)
+        return;
+
+    printf("V4L2: %c%c%c%c not supported, capturing %c%c%c%c\n", pixfmtstr(fmt->fmt.pix.pixelformat),
+           pixfmtstr(fallback));
+
+    fmt->fmt.pix.pixelformat = fallback;
+    fmt->fmt.pix.bytesperline = 0;
+    fmt->fmt.pix.sizeimage = 0;
+}
+
+static int v4l2_set_ctrl(struct v4l2_device *dev, int new_val, int ctrl)
+{
+    struct v4l2_queryctrl queryctrl;
+    struct v4l2_control control;
+    int ret;
+
+    CLEAR(queryctrl);
+
+    switch (ctrl) {
+    case V4L2_CID_BRIGHTNESS:
+        queryctrl.id = V4L2_CID_BRIGHTNESS;
+        ret = ioctl(dev->v4l2_fd, VIDIOC_QUERYCTRL, &queryctrl);
+        if (-1 == ret) {
+            if (errno != EINVAL)
+                printf(
+                    "V4L2: VIDIOC_QUERYCTRL"
+                    " failed: %s (%d).\n",
+                    strerror(errno), errno);
+            else
+                printf(
+                    "V4L2_CID_BRIGHTNESS is not"
+                    " supported: %s (%d).\n",
+                    strerror(errno), errno);
+
+            return ret;
+        } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
+            printf("V4L2_CID_BRIGHTNESS is not supported.\n");
+            ret = -EINVAL;
+            return ret;
+        } else {
+            CLEAR(control);
+            control.id = V4L2_CID_BRIGHTNESS;
+            control.value = new_val;
+
+            ret = ioctl(dev->v4l2_fd, VIDIOC_S_CTRL, &control);
+            if (-1 == ret) {
+                printf("V4L2: VIDIOC_S_CTRL failed: %s (%d).\n", strerror(errno), errno);
+                return ret;
+            }
+        }
+        printf("V4L2: Brightness control changed to value = 0x%x\n", new_val);
+        break;
+
+    default:
+        /* TODO: We don't support any other controls. */
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int v4l2_start_capturing(struct v4l2_device *dev)
+{
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int ret;
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_STREAMON, &type);
+    if (ret < 0) {
+        printf("V4L2: Unable to start streaming: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    printf("V4L2: Starting video stream.\n");
+    dev->capturing = 1;
+
+    return 0;
+}
+
+static int v4l2_stop_capturing(struct v4l2_device *dev)
+{
+    enum v4l2_buf_type type;
+    int ret;
+
+    /*
+     * USERPTR buffers point to UVC memory that is about to be released,
+     * so the queue must be stopped for every IO method.
+     */
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    ret = ioctl(dev->v4l2_fd, VIDIOC_STREAMOFF, &type);
+    if (ret < 0) {
+        printf("V4L2: VIDIOC_STREAMOFF failed: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    /* STREAMOFF returns all queued buffers. */
+    dev->qbuf_count = 0;
+    dev->dqbuf_count = 0;
+    dev->capturing = 0;
+
+    return 0;
+}
+static int v4l2_open(struct v4l2_device **v4l2, char *devname, struct v4l2_format *s_fmt)
+{
+    struct v4l2_device *dev;
+    struct v4l2_capability cap;
+    int fd;
+    int ret = -EINVAL;
+
+    fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (fd == -1) {
+        printf("V4L2: device open failed: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
+    if (ret < 0) {
+        printf("V4L2: VIDIOC_QUERYCAP failed: %s (%d).\n", strerror(errno), errno);
+        goto err;
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        printf("V4L2: %s is no video capture device\n", devname);
+        goto err;
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+        printf("V4L2: %s does not support streaming i/o\n", devname);
+        goto err;
+    }
+
+    dev = calloc(1, sizeof *dev);
+    if (dev == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    printf("V4L2 device is %s on bus %s\n", cap.card, cap.bus_info);
+
+    dev->v4l2_fd = fd;
+
+    /* Get the default image format supported. */
+    ret = v4l2_get_format(dev);
+    if (ret < 0)
+        goto err_free;
+
+    /*
+     * Set the desired image format.
+     * Note: VIDIOC_S_FMT may change width and height.
+     */
+    v4l2_select_format(dev, s_fmt);
+    ret = v4l2_set_format(dev, s_fmt);
+    if (ret < 0)
+        goto err_free;
+
+    /* Get the changed image format. */
+    ret = v4l2_get_format(dev);
+    if (ret < 0)
+        goto err_free;
+
+    printf("v4l2 open succeeded, file descriptor = %d\n", fd);
+
+    *v4l2 = dev;
+
+    return 0;
+
+err_free:
+    free(dev);
+err:
+    close(fd);
+
+    return ret;
+}
+
+static void v4l2_close(struct v4l2_device *dev)
+{
+    close(dev->v4l2_fd);
+    free(dev);
+}
+
+/* ---------------------------------------------------------------------------
+ * UVC generic stuff
+ */
+
+static int uvc_video_set_format(struct uvc_device *dev)
+{
+    struct v4l2_format fmt;
+    int ret;
+
+    CLEAR(fmt);
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width = dev->width;
+    fmt.fmt.pix.height = dev->height;
+    fmt.fmt.pix.pixelformat = dev->fcc;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (dev->fcc == V4L2_PIX_FMT_MJPEG)
+        fmt.fmt.pix.sizeimage = dev->imgsize * 1.5;
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_S_FMT, &fmt);
+    if (ret < 0) {
+        printf("UVC: Unable to set format %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    printf("UVC: Setting format to: %c%c%c%c %ux%u\n", pixfmtstr(dev->fcc), dev->width, dev->height);
+
+    return 0;
+}
+
+static int uvc_video_stream(struct uvc_device *dev, int enable)
+{
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    int ret;
+
+    if (!enable) {
+        ret = ioctl(dev->uvc_fd, VIDIOC_STREAMOFF, &type);
+        if (ret < 0) {
+            printf("UVC: VIDIOC_STREAMOFF failed: %s (%d).\n", strerror(errno), errno);
+            return ret;
+        }
+
+        printf("UVC: Stopping video stream.\n");
+
+        return 0;
+    }
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_STREAMON, &type);
+    if (ret < 0) {
+        printf("UVC: Unable to start streaming %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    printf("UVC: Starting video stream.\n");
+
+    dev->uvc_shutdown_requested = 0;
+
+    return 0;
+}
+
+static int uvc_uninit_device(struct uvc_device *dev)
+{
+    unsigned int i;
+    int ret;
+
+    switch (dev->io) {
+    case IO_METHOD_MMAP:
+        for (i = 0; i < dev->nbufs; ++i) {
+            ret = munmap(dev->mem[i].start, dev->mem[i].length);
+            if (ret < 0) {
+                printf("UVC: munmap failed\n");
+                return ret;
+            }
+        }
+
+        free(dev->mem);
+        break;
+
+    case IO_METHOD_USERPTR:
+    default:
+        if (dev->run_standalone) {
+            for (i = 0; i < dev->nbufs; ++i)
+                free(dev->dummy_buf[i].start);
+
+            free(dev->dummy_buf);
+        }
+        break;
+    }
+
+    return 0;
+}
+static int uvc_open(struct uvc_device **uvc, char *devname)
+{
+    struct uvc_device *dev;
+    struct v4l2_capability cap;
+    int fd;
+    int ret = -EINVAL;
+
+    fd = open(devname, O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        printf("UVC: device open failed: %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
+    if (ret < 0) {
+        printf("UVC: unable to query uvc device: %s (%d)\n", strerror(errno), errno);
+        goto err;
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_OUTPUT)) {
+        printf("UVC: %s is no video output device\n", devname);
+        goto err;
+    }
+
+    dev = calloc(1, sizeof *dev);
+    if (dev == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    strcpy(dev->name, "UVC");
+
+    ret = pacer_init(&dev->pacer);
+    if (ret < 0) {
+        free(dev);
+        goto err;
+    }
+
+    stats_init(&dev->stats);
+
+    printf("uvc device is %s on bus %s\n", cap.card, cap.bus_info);
+    printf("uvc open succeeded, file descriptor = %d\n", fd);
+
+    dev->uvc_fd = fd;
+    *uvc = dev;
+
+    return 0;
+
+err:
+    close(fd);
+    return ret;
+}
+
+static void uvc_close(struct uvc_device *dev)
+{
+    close(dev->uvc_fd);
+    pacer_cleanup(&dev->pacer);
+    stats_cleanup(&dev->stats);
+    free(dev->pace_idle.slots);
+    pattern_cleanup(&dev->pattern);
+    clip_close(&dev->clip);
+    free(dev);
+}
+
+/* ---------------------------------------------------------------------------
+ * UVC streaming related
+ */
+
+/*
+ * Select the clip frame to show at the current time, so that clips play at
+ * the committed frame interval however fast buffers are consumed.
+ */
+static unsigned int uvc_video_clip_index(struct uvc_device *dev)
+{
+    unsigned long long elapsed;
+    struct timespec now;
+
+    if (dev->clip.nframes <= 1 || !dev->commit.dwFrameInterval)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - dev->stream_start.tv_sec) * 1000000000ULL + now.tv_nsec - dev->stream_start.tv_nsec;
+
+    return (elapsed / (dev->commit.dwFrameInterval * 100ULL)) % dev->clip.nframes;
+}
+
+/* Whether the loaded clip can be streamed with the committed format. */
+static int uvc_video_clip_usable(struct uvc_device *dev)
+{
+    if (!dev->clip.nframes)
+        return 0;
+
+    if (dev->clip.format == CLIP_FORMAT_MJPEG)
+        return dev->fcc == V4L2_PIX_FMT_MJPEG;
+
+    return dev->fcc == V4L2_PIX_FMT_YUYV && dev->clip.width == dev->width && dev->clip.height == dev->height;
+}
+
+static void uvc_video_fill_buffer(struct uvc_device *dev, struct v4l2_buffer *buf)
+{
+    struct buffer *mem = &dev->mem[buf->index];
+    const struct clip_frame *frame;
+
+    if (dev->clip_active && dev->clip.nframes > 1) {
+        dev->clip_index = uvc_video_clip_index(dev);
+        dev->content = dev->clip_content + dev->clip_index;
+    }
+
+    /* Raw YUYV clips are queued straight from the file mapping. */
+    if (dev->clip_zero_copy) {
+        frame = clip_frame(&dev->clip, dev->clip_index);
+        buf->m.userptr = (unsigned long)frame->data;
+        buf->length = frame->size;
+        buf->bytesused = frame->size;
+        return;
+    }
+
+    /* Output buffers keep their content, skip rewriting a static payload. */
+    if (dev->content && mem->content == dev->content) {
+        buf->bytesused = mem->bytesused;
+        return;
+    }
+
+    if (dev->clip_active)
+        buf->bytesused = clip_read_frame(&dev->clip, dev->clip_index, mem->start,
+                                         uvc_bytesperline(dev->fcc, dev->width));
+    else if (!uvc_format_compressed(dev->fcc))
+        buf->bytesused = pattern_fill(&dev->pattern, mem->start, uvc_bytesperline(dev->fcc, dev->width));
+    else
+        buf->bytesused = 0;
+
+    mem->content = dev->content;
+    mem->bytesused = buf->bytesused;
+}
+
+/* Fill a free standalone buffer with the current frame and queue it. */
+static int uvc_video_queue_frame(struct uvc_device *dev, struct v4l2_buffer *ubuf)
+{
+    struct buffer *mem = &dev->mem[ubuf->index];
+    int ret;
+
+    mem->origin = 0;
+    mem->dequeued = pacer_now();
+
+    uvc_video_fill_buffer(dev, ubuf);
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, ubuf);
+    if (ret < 0)
+        return ret;
+
+    mem->queued = pacer_now();
+    dev->qbuf_count++;
+
+#ifdef ENABLE_BUFFER_DEBUG
+    printf("ReQueueing buffer at UVC side = %d\n", ubuf->index);
+#endif
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame pacing
+ */
+
+/* Queue a parked buffer for the pending deadline, if there's one. */
+static int uvc_video_pace_release(struct uvc_device *dev)
+{
+    int index;
+
+    if (!dev->pace_due)
+        return 0;
+
+    index = buffer_fifo_pop(&dev->pace_idle);
+    if (index < 0)
+        return 0;
+
+    dev->pace_due = 0;
+    dev->pacer.released++;
+
+    return uvc_video_queue_frame(dev, &dev->mem[index].buf);
+}
+
+static void uvc_video_pace_handler(void *priv)
+{
+    struct uvc_device *dev = priv;
+
+    if (!pacer_expired(&dev->pacer))
+        return;
+
+    /*
+     * A deadline still waiting for a buffer is lost, a deadline without
+     * a parked buffer will be served late.
+     */
+    if (dev->pace_due)
+        dev->pacer.missed++;
+    else if (!dev->pace_idle.count)
+        dev->pacer.late++;
+
+    dev->pace_due = 1;
+    uvc_video_pace_release(dev);
+}
+
+static void uvc_video_pace_start(struct uvc_device *dev)
+{
+    dev->pace_due = 0;
+    pacer_start(&dev->pacer, dev->commit.dwFrameInterval * 100ULL);
+    pacer_arm(&dev->pacer);
+    events_watch_fd(dev->events, dev->pacer.fd, EVENT_READ, uvc_video_pace_handler, dev);
+}
+
+/*
+ * Whether a captured frame can be sent. The schedule starts with the first
+ * frame, as the capture device takes a while to deliver it.
+ */
+static int uvc_video_pace_admit(struct uvc_device *dev)
+{
+    if (!dev->pace)
+        return 1;
+
+    if (!dev->pacer.interval) {
+        pacer_start(&dev->pacer, dev->commit.dwFrameInterval * 100ULL);
+        return 1;
+    }
+
+    return pacer_admit(&dev->pacer, pacer_now());
+}
+
+static void uvc_video_pace_stop(struct uvc_device *dev)
+{
+    struct pacer *pacer = &dev->pacer;
+
+    if (!pacer->interval)
+        return;
+
+    printf("%s: Paced %llu frame(s) at %llu us intervals, %llu missed, %llu late, %llu dropped\n", dev->name,
+           pacer->released, pacer->interval / 1000, pacer->missed, pacer->late, pacer->dropped);
+
+    pacer_stop(pacer);
+    free(dev->pace_idle.slots);
+    memset(&dev->pace_idle, 0, sizeof dev->pace_idle);
+}
+
+static int uvc_video_process(struct uvc_device *dev)
+{
+    struct buffer_table *table = &dev->buffers;
+    struct v4l2_buffer ubuf;
+    int slot;
+    int ret;
+    /*
+     * Return immediately if UVC video output device has not started
+     * streaming yet.
+     */
+    if (!dev->is_streaming)
+        return 0;
+    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
+    CLEAR(ubuf);
+
+    ubuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    switch (dev->io) {
+    case IO_METHOD_MMAP:
+        ubuf.memory = V4L2_MEMORY_MMAP;
+        break;
+
+    case IO_METHOD_DMABUF:
+        ubuf.memory = V4L2_MEMORY_DMABUF;
+        break;
+
+    case IO_METHOD_USERPTR:
+    default:
+        ubuf.memory = V4L2_MEMORY_USERPTR;
+        break;
+    }
+    if (dev->run_standalone) {
+        /* UVC stanalone setup. */
+        ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
+        if (ret < 0)
+            return ret;
+
+        dev->dqbuf_count++;
+#ifdef ENABLE_BUFFER_DEBUG
+        printf("DeQueued buffer at UVC side = %d\n", ubuf.index);
+#endif
+        uvc_stats_frame(dev, &ubuf);
+        uvc_latency_complete(dev, &dev->mem[ubuf.index]);
+
+        if (!dev->pace)
+            return uvc_video_queue_frame(dev, &ubuf);
+
+        /* Park the buffer until a deadline needs it. */
+        dev->mem[ubuf.index].buf = ubuf;
+        buffer_fifo_push(&dev->pace_idle, ubuf.index);
+        return uvc_video_pace_release(dev);
+    } else {
+        /* UVC - V4L2 integrated path. */
+
+        /*
+         * Return immediately if V4L2 video capture device has not
+         * started streaming yet or if QBUF was not called even once on
+         * the UVC side.
+         */
+        if (!dev->vdev->is_streaming || !dev->first_buffer_queued)
+            return 0;
+
+        if (dev->workers)
+            return uvc_encode_dequeue(dev);
+
+        /*
+         * Do not dequeue buffers from UVC side until there are atleast
+         * 2 buffers available at UVC domain, and stop polling it until
+         * the next frame is queued. The latest-frame policy takes
+         * buffers back as soon as they are sent instead, to fill them
+         * with the freshest frame, and so does the adaptive queue
+         * depth, which keeps the UVC queue filled to its own limit.
+         */
+        if (!dev->uvc_shutdown_requested && !dev->latest && !dev->depth_min)
+            if ((dev->dqbuf_count + 1) >= dev->qbuf_count) {
+                events_unwatch_fd(dev->events, dev->uvc_fd, EVENT_WRITE);
+                dev->uvc_held_back = 1;
+                return 0;
+            }
+
+        /* Dequeue the spent buffer from UVC domain */
+        ret = ioctl(dev->uvc_fd, VIDIOC_DQBUF, &ubuf);
+        if (ret < 0) {
+            printf("UVC: Unable to dequeue buffer: %s (%d).\n", strerror(errno), errno);
+            return ret;
+        }
+
+        dev->dqbuf_count++;
+        uvc_stats_frame(dev, &ubuf);
+
+#ifdef ENABLE_BUFFER_DEBUG
+        printf("DeQueued buffer at UVC side=%d\n", ubuf.index);
+#endif
+
+        /*
+         * If the dequeued buffer was marked with state ERROR by the
+         * underlying UVC driver gadget, do not queue the same to V4l2
+         * and wait for a STREAMOFF event on UVC side corresponding to
+         * set_alt(0). So, now all buffers pending at UVC end will be
+         * dequeued one-by-one and we will enter a state where we once
+         * again wait for a set_alt(1) command from the USB host side.
+         */
+        if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
+            buffer_side_release(&table->uvc, ubuf.index);
+            dev->uvc_shutdown_requested = 1;
+            printf(
+                "UVC: Possible USB shutdown requested from "
+                "Host, seen during VIDIOC_DQBUF\n");
+            return 0;
+        }
+
+        slot = buffer_side_release(&table->uvc, ubuf.index);
+        if (slot < 0) {
+            printf("UVC: dequeued unknown buffer %u\n", ubuf.index);
+            return -EINVAL;
+        }
+
+        uvc_latency_complete(dev, table->slots[slot].mem);
+
+        if (dev->depth_min)
+            table->uvc_depth = depth_dequeue(&dev->uvc_depth, pacer_now());
+
+        /* The released UVC index can take a frame waiting for one. */
+        ret = buffer_refill_uvc(dev);
+        if (ret < 0)
+            return ret;
+
+        if (dev->depth_min && !buffer_side_busy(&table->uvc)) {
+            if (dev->uvc_turned_away)
+                table->uvc_depth = depth_underrun(&dev->uvc_depth);
+            dev->uvc_turned_away = 0;
+        }
+
+        /* Queue the buffer to V4L2 domain, once the local sinks are done. */
+        ret = buffer_release(dev, slot);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+static int uvc_video_qbuf_mmap(struct uvc_device *dev)
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+
+        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
+        dev->mem[i].buf.index = i;
+
+        /* Paced streams start with a single frame. */
+        if (dev->pace && i > 0) {
+            buffer_fifo_push(&dev->pace_idle, i);
+            continue;
+        }
+
+        uvc_video_fill_buffer(dev, &(dev->mem[i].buf));
+
+        ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &(dev->mem[i].buf));
+        if (ret < 0) {
+            printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+            return ret;
+        }
+
+        dev->qbuf_count++;
+    }
+
+    return 0;
+}
+
+static int uvc_video_qbuf_userptr(struct uvc_device *dev)
+{
+    unsigned int i;
+    int ret;
+
+    /* UVC standalone setup. */
+    if (dev->run_standalone) {
+        for (i = 0; i < dev->nbufs; ++i) {
             struct v4l2_buffer buf;
 
-            CLEAR(buf);
-            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-            buf.memory = V4L2_MEMORY_USERPTR;
-            buf.m.userptr = (unsigned long)dev->dummy_buf[i].start;
-            buf.length = dev->dummy_buf[i].length;
-            buf.index = i;
+            CLEAR(buf);
+            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            buf.memory = V4L2_MEMORY_USERPTR;
+            buf.m.userptr = (unsigned long)dev->dummy_buf[i].start;
+            buf.length = dev->dummy_buf[i].length;
+            buf.index = i;
+
+            if (dev->pace && i > 0) {
+                dev->dummy_buf[i].buf = buf;
+                buffer_fifo_push(&dev->pace_idle, i);
+                continue;
+            }
+
+            uvc_video_fill_buffer(dev, &buf);
+
+            ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &buf);
+            if (ret < 0) {
+                printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+                return ret;
+            }
+
+            dev->qbuf_count++;
+        }
+    }
+
+    return 0;
+}
+
+static int uvc_video_qbuf(struct uvc_device *dev)
+{
+    int ret = 0;
+
+    /*
+     * In the integrated path, buffers are queued to the UVC side as
+     * frames get captured into them.
+     */
+    if (!dev->run_standalone)
+        return 0;
+
+    switch (dev->io) {
+    case IO_METHOD_MMAP:
+        ret = uvc_video_qbuf_mmap(dev);
+        break;
+
+    case IO_METHOD_USERPTR:
+        ret = uvc_video_qbuf_userptr(dev);
+        break;
+
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    return ret;
+}
+
+static int uvc_video_reqbufs_mmap(struct uvc_device *dev, int nbufs)
+{
+    struct v4l2_requestbuffers rb;
+    unsigned int i;
+    int ret;
+
+    CLEAR(rb);
+
+    rb.count = nbufs;
+    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    rb.memory = V4L2_MEMORY_MMAP;
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_REQBUFS, &rb);
+    if (ret < 0) {
+        if (ret == -EINVAL)
+            printf("UVC: does not support memory mapping\n");
+        else
+            printf("UVC: Unable to allocate buffers: %s (%d).\n", strerror(errno), errno);
+        goto err;
+    }
+
+    if (!rb.count)
+        return 0;
+
+    if (rb.count < 2) {
+        printf("UVC: Insufficient buffer memory.\n");
+        ret = -EINVAL;
+        goto err;
+    }
+
+    /* Map the buffers. */
+    dev->mem = calloc(rb.count, sizeof dev->mem[0]);
+    if (!dev->mem) {
+        printf("UVC: Out of memory\n");
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < rb.count; ++i) {
+        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+
+        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
+        dev->mem[i].buf.index = i;
+
+        ret = ioctl(dev->uvc_fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
+        if (ret < 0) {
+            printf(
+                "UVC: VIDIOC_QUERYBUF failed for buf %d: "
+                "%s (%d).\n",
+                i, strerror(errno), errno);
+            ret = -EINVAL;
+            goto err_free;
+        }
+        dev->mem[i].start =
+            mmap(NULL /* start anywhere */, dev->mem[i].buf.length, PROT_READ | PROT_WRITE /* required */,
+                 MAP_SHARED /* recommended */, dev->uvc_fd, dev->mem[i].buf.m.offset);
+
+        if (MAP_FAILED == dev->mem[i].start) {
+            printf("UVC: Unable to map buffer %u: %s (%d).\n", i, strerror(errno), errno);
+            dev->mem[i].length = 0;
+            ret = -EINVAL;
+            goto err_free;
+        }
+
+        dev->mem[i].length = dev->mem[i].buf.length;
+        printf("UVC: Buffer %u mapped at address %p.\n", i, dev->mem[i].start);
+    }
+
+    dev->nbufs = rb.count;
+    printf("UVC: %u buffers allocated.\n", rb.count);
+
+    return 0;
+
+err_free:
+    free(dev->mem);
+err:
+    return ret;
+}
+
+static int uvc_video_reqbufs_userptr(struct uvc_device *dev, int nbufs)
+{
+    struct v4l2_requestbuffers rb;
+    unsigned int i, payload_size = 0;
+    int ret;
+
+    CLEAR(rb);
+
+    rb.count = nbufs;
+    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    rb.memory = V4L2_MEMORY_USERPTR;
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_REQBUFS, &rb);
+    if (ret < 0) {
+        if (ret == -EINVAL)
+            printf("UVC: does not support user pointer i/o\n");
+        else
+            printf("UVC: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
+        goto err;
+    }
+
+    if (!rb.count)
+        return 0;
+
+    dev->nbufs = rb.count;
+    printf("UVC: %u buffers allocated.\n", rb.count);
+
+    if (dev->run_standalone) {
+        /* Allocate buffers to hold dummy data pattern. */
+        dev->dummy_buf = calloc(rb.count, sizeof dev->dummy_buf[0]);
+        if (!dev->dummy_buf) {
+            printf("UVC: Out of memory\n");
+            ret = -ENOMEM;
+            goto err;
+        }
+
+        payload_size = uvc_frame_size(dev, dev->fcc, dev->width, dev->height);
+
+        dev->mem = dev->dummy_buf;
+
+        /* Zero-copy clips point the buffers to the file mapping. */
+        if (dev->clip_zero_copy)
+            return 0;
+
+        for (i = 0; i < rb.count; ++i) {
+            dev->dummy_buf[i].length = payload_size;
+            dev->dummy_buf[i].start = malloc(payload_size);
+            if (!dev->dummy_buf[i].start) {
+                printf("UVC: Out of memory\n");
+                ret = -ENOMEM;
+                goto err;
+            }
+        }
+    }
+
+    return 0;
 
-            ret = ioctl(dev->uvc_fd, VIDIOC_QBUF, &buf);
-            if (ret < 0) {
-                printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
-                return ret;
-            }
+err:
+    return ret;
+}
 
-            dev->qbuf_count++;
-        }
+static int uvc_video_reqbufs_dmabuf(struct uvc_device *dev, int nbufs)
+{
+    struct v4l2_requestbuffers rb;
+    int ret;
+
+    CLEAR(rb);
+
+    rb.count = nbufs;
+    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    rb.memory = V4L2_MEMORY_DMABUF;
+
+    ret = ioctl(dev->uvc_fd, VIDIOC_REQBUFS, &rb);
+    if (ret < 0) {
+        printf("UVC: does not support dmabuf i/o: %s (%d).\n", strerror(errno), errno);
+        return ret;
     }
 
+    if (!rb.count)
+        return 0;
+
+    dev->nbufs = rb.count;
+    printf("UVC: %u buffers allocated.\n", rb.count);
+
     return 0;
 }
 
-static int uvc_video_qbuf(struct uvc_device *dev)
+static int uvc_video_reqbufs(struct uvc_device *dev, int nbufs)
 {
     int ret = 0;
 
     switch (dev->io) {
     case IO_METHOD_MMAP:
-        ret = uvc_video_qbuf_mmap(dev);
+        ret = uvc_video_reqbufs_mmap(dev, nbufs);
         break;
 
     case IO_METHOD_USERPTR:
-        ret = uvc_video_qbuf_userptr(dev);
+        ret = uvc_video_reqbufs_userptr(dev, nbufs);
+        break;
+
+    case IO_METHOD_DMABUF:
+        ret = uvc_video_reqbufs_dmabuf(dev, nbufs);
         break;
 
     default:
@@ -1103,177 +3252,555 @@ static int uvc_video_qbuf(struct uvc_device *dev)
     return ret;
 }
 
-static int uvc_video_reqbufs_mmap(struct uvc_device *dev, int nbufs)
+/* ---------------------------------------------------------------------------
+ * Buffer pool
+ *
+ * STREAMOFF hands the UVC buffers back with their memory and mappings, and
+ * the next STREAMON reuses them as long as the committed format fits. Hosts
+ * that toggle streaming then restart without allocating memory or faulting
+ * pages in again.
+ */
+
+static void uvc_pool_release(struct uvc_device *dev)
 {
-    struct v4l2_requestbuffers rb;
+    if (!dev->pool_allocated)
+        return;
+
+    uvc_uninit_device(dev);
+    uvc_video_reqbufs(dev, 0);
+
+    dev->mem = NULL;
+    dev->dummy_buf = NULL;
+    dev->pool_allocated = 0;
+    dev->pool_size = 0;
+}
+
+static int uvc_pool_get(struct uvc_device *dev)
+{
+    unsigned int size = uvc_frame_size(dev, dev->fcc, dev->width, dev->height);
     unsigned int i;
     int ret;
 
-    CLEAR(rb);
+    if (dev->pool_allocated) {
+        if (dev->clip_zero_copy || dev->pool_size >= size) {
+            printf("UVC: Reusing %u buffers.\n", dev->nbufs);
+            return 0;
+        }
 
-    rb.count = nbufs;
-    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    rb.memory = V4L2_MEMORY_MMAP;
+        uvc_pool_release(dev);
+    }
 
-    ret = ioctl(dev->uvc_fd, VIDIOC_REQBUFS, &rb);
+    /* The driver sizes MMAP buffers for the format, or the encoder's output. */
+    if (dev->io == IO_METHOD_MMAP) {
+        ret = uvc_video_set_format(dev);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = uvc_video_reqbufs(dev, dev->nbufs);
+    if (ret < 0)
+        return ret;
+
+    /* Without memory of their own, buffers hold whatever is queued. */
+    dev->pool_allocated = 1;
+    dev->pool_size = ~0U;
+
+    if (dev->io == IO_METHOD_MMAP) {
+        for (i = 0; i < dev->nbufs; ++i)
+            dev->pool_size = min(dev->pool_size, (unsigned int)dev->mem[i].length);
+    } else if (dev->io == IO_METHOD_USERPTR && dev->run_standalone) {
+        dev->pool_size = dev->clip_zero_copy ? 0 : dev->dummy_buf[0].length;
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Data path
+ */
+
+enum data_command {
+    DATA_CMD_NONE,
+    DATA_CMD_START,
+    DATA_CMD_STOP,
+    DATA_CMD_DISCONNECT,
+    DATA_CMD_EXIT,
+};
+
+static void uvc_data_execute(struct uvc_device *dev, int cmd)
+{
+    switch (cmd) {
+    case DATA_CMD_START:
+        if (dev->run_standalone) {
+            uvc_video_stream(dev, 1);
+            dev->first_buffer_queued = 1;
+            dev->is_streaming = 1;
+            /*
+             * Only poll for free buffers while streaming, an idle output
+             * queue reports POLLERR and would keep waking the loop up.
+             */
+            events_watch_fd(dev->events, dev->uvc_fd, EVENT_WRITE, uvc_video_handler, dev);
+            if (dev->pace)
+                uvc_video_pace_start(dev);
+        } else {
+            /* The UVC side is started when the first frame is queued. */
+            dev->vdev->is_streaming = 1;
+            events_watch_fd(dev->events, dev->vdev->v4l2_fd, EVENT_READ, v4l2_data_handler, dev->vdev);
+            if (dev->workers)
+                events_watch_fd(dev->events, dev->encode_done[0], EVENT_READ, uvc_encode_handler, dev);
+            uvc_sinks_start(dev);
+        }
+        uvc_stats_publish(dev);
+        break;
+
+    case DATA_CMD_STOP:
+        events_unwatch_fd(dev->events, dev->uvc_fd, EVENT_WRITE);
+        dev->uvc_held_back = 0;
+        events_unwatch_fd(dev->events, dev->pacer.fd, EVENT_READ);
+        if (!dev->run_standalone)
+            events_unwatch_fd(dev->events, dev->vdev->v4l2_fd, EVENT_READ);
+        if (dev->workers)
+            events_unwatch_fd(dev->events, dev->encode_done[0], EVENT_READ);
+        uvc_sinks_stop(dev);
+        break;
+
+    case DATA_CMD_DISCONNECT:
+        dev->uvc_shutdown_requested = 1;
+        break;
+
+    case DATA_CMD_EXIT:
+        events_stop(dev->events);
+        break;
+    }
+}
+
+static void uvc_data_wakeup_handler(void *priv)
+{
+    struct uvc_device *dev = priv;
+    unsigned int seq;
+    char dummy;
+    int cmd;
+
+    if (read(dev->data_wakeup[0], &dummy, 1) != 1)
+        return;
+
+    pthread_mutex_lock(&dev->data_lock);
+    cmd = dev->data_cmd;
+    seq = dev->data_cmd_seq;
+    pthread_mutex_unlock(&dev->data_lock);
+
+    uvc_data_execute(dev, cmd);
+
+    pthread_mutex_lock(&dev->data_lock);
+    dev->data_ack_seq = seq;
+    pthread_cond_signal(&dev->data_cond);
+    pthread_mutex_unlock(&dev->data_lock);
+}
+
+/*
+ * Run a data path command and wait for it to complete. In threaded mode the
+ * command is handed to the data path thread; the mutex protected command and
+ * acknowledgement sequence numbers order all memory accesses made by either
+ * thread before the hand-off, so buffer state changes ownership cleanly.
+ */
+static void uvc_data_command(struct uvc_device *dev, int cmd)
+{
+    unsigned int seq;
+    char dummy = 0;
+
+    if (!dev->threaded) {
+        uvc_data_execute(dev, cmd);
+        return;
+    }
+
+    pthread_mutex_lock(&dev->data_lock);
+    dev->data_cmd = cmd;
+    seq = ++dev->data_cmd_seq;
+    pthread_mutex_unlock(&dev->data_lock);
+
+    if (write(dev->data_wakeup[1], &dummy, 1) != 1) {
+        printf("UVC: unable to wake up data path thread: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+
+    pthread_mutex_lock(&dev->data_lock);
+    while (dev->data_ack_seq != seq)
+        pthread_cond_wait(&dev->data_cond, &dev->data_lock);
+    pthread_mutex_unlock(&dev->data_lock);
+}
+
+static void *uvc_data_thread(void *arg)
+{
+    struct data_thread *data = arg;
+    struct sched_param param;
+    int ret;
+
+    /* Frame delivery must not wait behind anything else on the system. */
+    CLEAR(param);
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+    ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret)
+        printf("UVC: data path thread runs without real-time priority: %s (%d).\n", strerror(ret), ret);
+
+    events_loop(&data->events);
+
+    return NULL;
+}
+
+/* Hand the data path of a stream over to the data path thread, or back. */
+static int uvc_data_thread_attach(struct uvc_device *dev, struct data_thread *data)
+{
+    int ret;
+
+    if (pipe(dev->data_wakeup) < 0) {
+        printf("UVC: unable to create data path pipe: %s (%d).\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    ret = events_watch_fd(&data->events, dev->data_wakeup[0], EVENT_READ, uvc_data_wakeup_handler, dev);
     if (ret < 0) {
-        if (ret == -EINVAL)
-            printf("UVC: does not support memory mapping\n");
-        else
-            printf("UVC: Unable to allocate buffers: %s (%d).\n", strerror(errno), errno);
-        goto err;
+        close(dev->data_wakeup[0]);
+        close(dev->data_wakeup[1]);
+        return ret;
     }
 
-    if (!rb.count)
-        return 0;
+    pthread_mutex_init(&dev->data_lock, NULL);
+    pthread_cond_init(&dev->data_cond, NULL);
+    dev->events = &data->events;
 
-    if (rb.count < 2) {
-        printf("UVC: Insufficient buffer memory.\n");
-        ret = -EINVAL;
-        goto err;
+    return 0;
+}
+
+static void uvc_data_thread_detach(struct uvc_device *dev)
+{
+    close(dev->data_wakeup[0]);
+    close(dev->data_wakeup[1]);
+    pthread_cond_destroy(&dev->data_cond);
+    pthread_mutex_destroy(&dev->data_lock);
+    dev->events = dev->control_events;
+    dev->threaded = 0;
+}
+
+/*
+ * Start the data path thread for the streams devs. Their wakeup pipes are
+ * all watched before the thread starts, as its event engine then belongs to
+ * the thread.
+ */
+static int uvc_data_thread_start(struct data_thread *data, struct uvc_device **devs, unsigned int ndevs)
+{
+    unsigned int i;
+    int ret;
+
+    ret = events_init(&data->events);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < ndevs; ++i) {
+        ret = uvc_data_thread_attach(devs[i], data);
+        if (ret < 0)
+            goto err;
     }
 
-    /* Map the buffers. */
-    dev->mem = calloc(rb.count, sizeof dev->mem[0]);
-    if (!dev->mem) {
-        printf("UVC: Out of memory\n");
-        ret = -ENOMEM;
+    ret = pthread_create(&data->thread, NULL, uvc_data_thread, data);
+    if (ret) {
+        printf("UVC: unable to create data path thread: %s (%d).\n", strerror(ret), ret);
+        ret = -ret;
         goto err;
     }
 
-    for (i = 0; i < rb.count; ++i) {
-        memset(&dev->mem[i].buf, 0, sizeof(dev->mem[i].buf));
+    for (i = 0; i < ndevs; ++i)
+        devs[i]->threaded = 1;
 
-        dev->mem[i].buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index = i;
+    printf("UVC: data path of %u stream(s) running on a dedicated thread\n", ndevs);
 
-        ret = ioctl(dev->uvc_fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf(
-                "UVC: VIDIOC_QUERYBUF failed for buf %d: "
-                "%s (%d).\n",
-                i, strerror(errno), errno);
-            ret = -EINVAL;
-            goto err_free;
+    return 0;
+
+err:
+    while (i--)
+        uvc_data_thread_detach(devs[i]);
+    events_cleanup(&data->events);
+    return ret;
+}
+
+static void uvc_data_thread_stop(struct data_thread *data, struct uvc_device **devs, unsigned int ndevs)
+{
+    unsigned int i;
+
+    if (!ndevs || !devs[0]->threaded)
+        return;
+
+    uvc_data_command(devs[0], DATA_CMD_EXIT);
+    pthread_join(data->thread, NULL);
+
+    for (i = 0; i < ndevs; ++i)
+        uvc_data_thread_detach(devs[i]);
+    events_cleanup(&data->events);
+}
+
+/*
+ * Prepare the pipeline for the committed format, up to the point where the
+ * data path can take over: buffers allocated and queued on both sides. The
+ * capture device is started if capture is set. This runs on STREAMON, or
+ * ahead of it for a warm start.
+ */
+static int uvc_stream_prepare(struct uvc_device *dev, int capture)
+{
+    int ret;
+
+    if (dev->run_standalone) {
+        /*
+         * The committed format may have changed since last time. Clips
+         * that don't match it are replaced by a test pattern.
+         */
+        dev->clip_active = uvc_video_clip_usable(dev);
+        dev->clip_zero_copy = dev->clip_active && dev->clip.format == CLIP_FORMAT_YUYV && dev->io == IO_METHOD_USERPTR;
+
+        if (dev->clip_active) {
+            printf("UVC: Streaming %u frame(s) clip%s\n", dev->clip.nframes,
+                   dev->clip_zero_copy ? " from its file mapping" : "");
+        } else if (!uvc_format_compressed(dev->fcc)) {
+            if (dev->clip.nframes)
+                printf("UVC: Clip doesn't match %ux%u %c%c%c%c\n", dev->width, dev->height, pixfmtstr(dev->fcc));
+
+            ret = pattern_init(&dev->pattern, dev->pattern_type, dev->fcc, dev->width, dev->height);
+            if (ret < 0)
+                return ret;
+
+            printf("UVC: Streaming %s test pattern\n", pattern_name(dev->pattern_type));
         }
-        dev->mem[i].start =
-            mmap(NULL /* start anywhere */, dev->mem[i].buf.length, PROT_READ | PROT_WRITE /* required */,
-                 MAP_SHARED /* recommended */, dev->uvc_fd, dev->mem[i].buf.m.offset);
 
-        if (MAP_FAILED == dev->mem[i].start) {
-            printf("UVC: Unable to map buffer %u: %s (%d).\n", i, strerror(errno), errno);
-            dev->mem[i].length = 0;
-            ret = -EINVAL;
-            goto err_free;
+        /*
+         * A new stream starts with a new payload. Each frame of a clip
+         * gets its own generation.
+         */
+        if (dev->clip_active && dev->clip.nframes > 1) {
+            dev->clip_content = dev->content_gen + 1;
+            dev->content_gen += dev->clip.nframes;
+            dev->content = dev->clip_content;
+        } else if (dev->clip_active || uvc_format_compressed(dev->fcc) || pattern_is_static(&dev->pattern)) {
+            dev->content = ++dev->content_gen;
+        } else {
+            dev->content = 0;
+        }
+
+        dev->clip_index = 0;
+        clock_gettime(CLOCK_MONOTONIC, &dev->stream_start);
+    }
+
+    ret = uvc_pool_get(dev);
+    if (ret < 0)
+        return ret;
+
+    dev->pace = !dev->free_run && dev->commit.dwFrameInterval;
+    if (dev->pace && dev->run_standalone) {
+        free(dev->pace_idle.slots);
+        ret = buffer_fifo_init(&dev->pace_idle, dev->nbufs);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (!dev->run_standalone) {
+        /* UVC - V4L2 integrated path. */
+        if (IO_METHOD_USERPTR == dev->vdev->io) {
+            /*
+             * Ensure that the V4L2 video capture device has already
+             * some buffers queued.
+             */
+            ret = v4l2_reqbufs(dev->vdev, dev->vdev->nbufs);
+            if (ret < 0)
+                return ret;
+        }
+
+        if (dev->workers)
+            ret = uvc_encode_start(dev);
+        else
+            ret = v4l2_qbuf(dev->vdev);
+        if (ret < 0)
+            return ret;
+
+        if (capture) {
+            ret = v4l2_start_capturing(dev->vdev);
+            if (ret < 0)
+                return ret;
         }
+    }
+
+    /* Queue buffers to UVC domain. */
+    return uvc_video_qbuf(dev);
+}
+
+/* ---------------------------------------------------------------------------
+ * Warm start
+ *
+ * The state file holds the last committed format, frame size and interval
+ * on a single line, e.g. "YUYV 1280x720 333333". It is replaced atomically
+ * on every commit.
+ */
 
-        dev->mem[i].length = dev->mem[i].buf.length;
-        printf("UVC: Buffer %u mapped at address %p.\n", i, dev->mem[i].start);
-    }
+static int uvc_warm_load(const char *path, unsigned int *fcc, unsigned int *width, unsigned int *height,
+                         unsigned int *interval)
+{
+    char name[5];
+    FILE *file;
+    int ret;
 
-    dev->nbufs = rb.count;
-    printf("UVC: %u buffers allocated.\n", rb.count);
+    file = fopen(path, "r");
+    if (file == NULL)
+        return -errno;
 
-    return 0;
+    ret = fscanf(file, "%4s %ux%u %u", name, width, height, interval);
+    fclose(file);
 
-err_free:
-    free(dev->mem);
-err:
-    return ret;
+    if (ret != 4 || strlen(name) != 4)
+        return -EINVAL;
+
+    *fcc = v4l2_fourcc(name[0], name[1], name[2], name[3]);
+
+    return 0;
 }
 
-static int uvc_video_reqbufs_userptr(struct uvc_device *dev, int nbufs)
+static void uvc_warm_save(struct uvc_device *dev)
 {
-    struct v4l2_requestbuffers rb;
-    unsigned int i, j, bpl, payload_size;
+    char path[PATH_MAX];
+    FILE *file;
     int ret;
 
-    CLEAR(rb);
-
-    rb.count = nbufs;
-    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    rb.memory = V4L2_MEMORY_USERPTR;
+    ret = snprintf(path, sizeof path, "%s.tmp", dev->warm_state);
+    if (ret < 0 || ret >= (int)sizeof path)
+        return;
 
-    ret = ioctl(dev->uvc_fd, VIDIOC_REQBUFS, &rb);
-    if (ret < 0) {
-        if (ret == -EINVAL)
-            printf("UVC: does not support user pointer i/o\n");
-        else
-            printf("UVC: VIDIOC_REQBUFS error %s (%d).\n", strerror(errno), errno);
-        goto err;
+    file = fopen(path, "w");
+    if (file == NULL) {
+        printf("UVC: Unable to save the committed format to %s: %s (%d).\n", path, strerror(errno), errno);
+        return;
     }
 
-    if (!rb.count)
-        return 0;
+    fprintf(file, "%c%c%c%c %ux%u %u\n", pixfmtstr(dev->fcc), dev->width, dev->height, dev->commit.dwFrameInterval);
 
-    dev->nbufs = rb.count;
-    printf("UVC: %u buffers allocated.\n", rb.count);
+    if (fclose(file) != 0 || rename(path, dev->warm_state) < 0) {
+        printf("UVC: Unable to save the committed format to %s: %s (%d).\n", dev->warm_state, strerror(errno),
+               errno);
+        unlink(path);
+    }
+}
 
-    if (dev->run_standalone) {
-        /* Allocate buffers to hold dummy data pattern. */
-        dev->dummy_buf = calloc(rb.count, sizeof dev->dummy_buf[0]);
-        if (!dev->dummy_buf) {
-            printf("UVC: Out of memory\n");
-            ret = -ENOMEM;
-            goto err;
-        }
+/* Undo uvc_warm_prepare(), handing all buffers back to the application. */
+static void uvc_warm_cancel(struct uvc_device *dev)
+{
+    if (!dev->warm_ready)
+        return;
 
-        switch (dev->fcc) {
-        case V4L2_PIX_FMT_YUYV:
-            bpl = dev->width * 2;
-            payload_size = dev->width * dev->height * 2;
-            break;
-        case V4L2_PIX_FMT_MJPEG:
-            payload_size = dev->imgsize;
-            break;
-        }
+    dev->warm_ready = 0;
 
-        for (i = 0; i < rb.count; ++i) {
-            dev->dummy_buf[i].length = payload_size;
-            dev->dummy_buf[i].start = malloc(payload_size);
-            if (!dev->dummy_buf[i].start) {
-                printf("UVC: Out of memory\n");
-                ret = -ENOMEM;
-                goto err;
-            }
+    if (!dev->run_standalone) {
+        events_unwatch_fd(dev->control_events, dev->vdev->v4l2_fd, EVENT_READ);
+        uvc_encode_stop(dev);
+        v4l2_stop_capturing(dev->vdev);
+    } else {
+        uvc_video_stream(dev, 0);
+    }
 
-            if (V4L2_PIX_FMT_YUYV == dev->fcc)
-                for (j = 0; j < dev->height; ++j)
-                    memset(dev->dummy_buf[i].start + j * bpl, dev->color++, bpl);
+    dev->qbuf_count = 0;
+    dev->dqbuf_count = 0;
+    buffer_table_cleanup(&dev->buffers);
+}
 
-            if (V4L2_PIX_FMT_MJPEG == dev->fcc)
-                memcpy(dev->dummy_buf[i].start, dev->imgdata, dev->imgsize);
-        }
+static void uvc_warm_ready(struct uvc_device *dev, int ret)
+{
+    int capture = !dev->run_standalone && dev->vdev->capturing;
 
-        dev->mem = dev->dummy_buf;
+    dev->warm_ready = 1;
+
+    if (ret < 0) {
+        printf("UVC: Unable to prepare %c%c%c%c %ux%u ahead of STREAMON (%d)\n", pixfmtstr(dev->fcc), dev->width,
+               dev->height, ret);
+        uvc_warm_cancel(dev);
+        return;
     }
 
-    return 0;
+    /* The control loop owns the capture device until STREAMON. */
+    if (capture)
+        events_watch_fd(dev->control_events, dev->vdev->v4l2_fd, EVENT_READ, v4l2_idle_handler, dev->vdev);
 
-err:
-    return ret;
+    dev->warm_fcc = dev->fcc;
+    dev->warm_width = dev->width;
+    dev->warm_height = dev->height;
+
+    printf("UVC: Pipeline ready for %c%c%c%c %ux%u%s\n", pixfmtstr(dev->fcc), dev->width, dev->height,
+           capture ? ", capture running" : "");
 }
 
-static int uvc_video_reqbufs(struct uvc_device *dev, int nbufs)
+static void uvc_warm_prepare(struct uvc_device *dev)
 {
-    int ret = 0;
+    uvc_warm_ready(dev, uvc_stream_prepare(dev, dev->warm_capture && !dev->run_standalone));
+}
 
-    switch (dev->io) {
-    case IO_METHOD_MMAP:
-        ret = uvc_video_reqbufs_mmap(dev, nbufs);
-        break;
+/*
+ * Keep the prepared pipeline of a stream session that ended, with the
+ * capture device still running. The frames the UVC side returned or the
+ * data path held go back to the capture queue.
+ */
+static void uvc_warm_resume(struct uvc_device *dev)
+{
+    struct buffer_table *table = &dev->buffers;
+    unsigned int i;
+    int ret = 0;
 
-    case IO_METHOD_USERPTR:
-        ret = uvc_video_reqbufs_userptr(dev, nbufs);
-        break;
+    table->to_v4l2.count = 0;
+    table->to_uvc.count = 0;
+    for (i = 0; i < table->uvc.count; ++i)
+        buffer_side_release(&table->uvc, i);
 
-    default:
-        ret = -EINVAL;
-        break;
+    for (i = 0; i < table->nslots && ret >= 0; ++i) {
+        table->slots[i].refs = 0;
+        if (table->slots[i].owner != BUFFER_OWNER_V4L2)
+            ret = buffer_queue_v4l2(dev->vdev, i);
     }
 
-    return ret;
+    uvc_warm_ready(dev, ret);
+}
+
+/*
+ * Remember the committed format, and prepare the pipeline for it if another
+ * one was prepared. Hosts commit before they stream.
+ */
+static void uvc_warm_commit(struct uvc_device *dev)
+{
+    if (!dev->warm_state)
+        return;
+
+    uvc_warm_save(dev);
+
+    if (!dev->warm_ready ||
+        (dev->warm_fcc == dev->fcc && dev->warm_width == dev->width && dev->warm_height == dev->height))
+        return;
+
+    uvc_warm_cancel(dev);
+    uvc_warm_prepare(dev);
+}
+
+/*
+ * Start the queue depth controllers of a stream session from the whole pool,
+ * or from the UVC depth of the latest-frame policy, and queue the capture
+ * buffers a previous session held back.
+ */
+static int uvc_depth_start(struct uvc_device *dev)
+{
+    struct buffer_table *table = &dev->buffers;
+    unsigned int uvc_max, capture_max;
+
+    if (!dev->depth_min || dev->run_standalone || dev->workers)
+        return 0;
+
+    uvc_max = min(dev->depth_max, table->uvc.count);
+    capture_max = min(dev->depth_max, table->v4l2.count);
+    depth_init(&dev->uvc_depth, dev->depth_min, uvc_max, dev->latest ? LATEST_UVC_DEPTH : uvc_max);
+    depth_init(&dev->capture_depth, dev->depth_min, capture_max, capture_max);
+    table->uvc_depth = dev->uvc_depth.depth;
+    table->v4l2_depth = dev->capture_depth.depth;
+    dev->uvc_turned_away = 0;
+
+    return buffer_refill_v4l2(dev->vdev);
 }
 
 /*
@@ -1287,110 +3814,292 @@ static int uvc_video_reqbufs(struct uvc_device *dev, int nbufs)
  */
 static int uvc_handle_streamon_event(struct uvc_device *dev)
 {
+    unsigned int i;
     int ret;
 
-    ret = uvc_video_reqbufs(dev, dev->nbufs);
-    if (ret < 0)
-        goto err;
+    /* A pipeline prepared for another format is of no use. */
+    if (dev->warm_ready &&
+        (dev->warm_fcc != dev->fcc || dev->warm_width != dev->width || dev->warm_height != dev->height))
+        uvc_warm_cancel(dev);
 
-    if (!dev->run_standalone) {
-        /* UVC - V4L2 integrated path. */
-        if (IO_METHOD_USERPTR == dev->vdev->io) {
-            /*
-             * Ensure that the V4L2 video capture device has already
-             * some buffers queued.
-             */
-            ret = v4l2_reqbufs(dev->vdev, dev->vdev->nbufs);
-            if (ret < 0)
-                goto err;
-        }
+    dev->warm_session = dev->warm_ready;
 
-        ret = v4l2_qbuf(dev->vdev);
+    if (dev->warm_ready) {
+        dev->warm_ready = 0;
+        if (!dev->run_standalone)
+            events_unwatch_fd(dev->control_events, dev->vdev->v4l2_fd, EVENT_READ);
+    } else {
+        ret = uvc_stream_prepare(dev, 1);
         if (ret < 0)
-            goto err;
+            return ret;
+    }
 
+    if (dev->run_standalone) {
+        /* Clips play from the start of the stream, not of the preparation. */
+        clock_gettime(CLOCK_MONOTONIC, &dev->stream_start);
+    } else if (!dev->vdev->capturing) {
         /* Start V4L2 capturing now. */
         ret = v4l2_start_capturing(dev->vdev);
         if (ret < 0)
-            goto err;
-
-        dev->vdev->is_streaming = 1;
+            return ret;
     }
 
-    /* Common setup. */
-
-    /* Queue buffers to UVC domain and start streaming. */
-    ret = uvc_video_qbuf(dev);
+    ret = uvc_depth_start(dev);
     if (ret < 0)
-        goto err;
+        return ret;
 
-    if (dev->run_standalone) {
-        uvc_video_stream(dev, 1);
-        dev->first_buffer_queued = 1;
-        dev->is_streaming = 1;
-    }
+    for (i = 0; i < LATENCY_COUNT; ++i)
+        histogram_reset(&dev->latency[i]);
 
-    return 0;
+    /* Hand the queues over to the data path. */
+    uvc_data_command(dev, DATA_CMD_START);
 
-err:
-    return ret;
+    return 0;
 }
 
 /* ---------------------------------------------------------------------------
  * UVC Request processing
  */
 
-static void
-uvc_fill_streaming_control(struct uvc_device *dev, struct uvc_streaming_control *ctrl, int iframe, int iformat)
+/*
+ * Streaming parameters negotiation
+ *
+ * Isochronous endpoints reserve bus bandwidth for the payload size the host
+ * selects from dwMaxPayloadTransferSize, every service interval. Frames are
+ * spread over the service intervals of a frame period, so the payload only
+ * has to carry the frame size divided by their count, plus a payload header.
+ * Frame intervals that need more than the endpoint carries are skipped.
+ * Bulk endpoints reserve nothing, and carry a frame per payload.
+ */
+
+#define UVC_PAYLOAD_HEADER_MAX 12
+
+/*
+ * Streaming endpoint parameters at a bus speed. When the function settings
+ * are known, they follow the descriptors f_uvc derives from them, and
+ * override the -m and -t options.
+ */
+static void uvc_set_speed(struct uvc_device *dev, enum usb_device_speed speed)
 {
-    const struct uvc_format_info *format;
-    const struct uvc_frame_info *frame;
-    unsigned int nframes;
+    const struct uvc_function_config *fc = dev->fc;
+    unsigned int maxpacket = fc->streaming_maxpacket;
+
+    dev->speed = speed;
+    dev->isoc_interval = fc->streaming_interval ? fc->streaming_interval : 1;
 
-    if (iformat < 0)
-        iformat = ARRAY_SIZE(uvc_formats) + iformat;
-    if (iformat < 0 || iformat >= (int)ARRAY_SIZE(uvc_formats))
+    if (dev->bulk) {
+        dev->maxpkt = speed >= USB_SPEED_SUPER ? 1024 : speed == USB_SPEED_HIGH ? 512 : 64;
         return;
-    format = &uvc_formats[iformat];
+    }
 
-    nframes = 0;
-    while (format->frames[nframes].width != 0)
-        ++nframes;
+    if (!maxpacket) {
+        dev->maxpkt = speed == USB_SPEED_FULL ? 1023 : 1024;
+        return;
+    }
 
-    if (iframe < 0)
-        iframe = nframes + iframe;
-    if (iframe < 0 || iframe >= (int)nframes)
+    if (speed == USB_SPEED_FULL) {
+        dev->maxpkt = min(maxpacket, 1023U);
+        dev->mult = 0;
+        dev->burst = 0;
         return;
-    frame = &format->frames[iframe];
+    }
+
+    /* Above 1024 bytes, high-bandwidth endpoints split the packets. */
+    dev->mult = maxpacket <= 1024 ? 0 : maxpacket <= 2048 ? 1 : 2;
+    dev->maxpkt = maxpacket / (dev->mult + 1);
+    dev->burst = speed >= USB_SPEED_SUPER ? fc->streaming_maxburst : 0;
+}
+
+/* Payload bytes the isochronous endpoint carries per service interval. */
+static unsigned int uvc_isoc_capacity(struct uvc_device *dev)
+{
+    unsigned int mult = dev->speed >= USB_SPEED_HIGH ? dev->mult : 0;
+    unsigned int burst = dev->speed >= USB_SPEED_SUPER ? dev->burst : 0;
+
+    return dev->maxpkt * (mult + 1) * (burst + 1);
+}
+
+static unsigned int uvc_payload_size(struct uvc_device *dev, unsigned int frame_size, unsigned int interval)
+{
+    /* Service interval in 100 ns units, (micro)frames times 2^(bInterval-1). */
+    unsigned long long period = (dev->speed >= USB_SPEED_HIGH ? 1250ULL : 10000ULL) << (dev->isoc_interval - 1);
+    unsigned long long services;
+
+    if (dev->bulk)
+        return frame_size;
+
+    services = max(interval / period, 1ULL);
+    return (frame_size + services - 1) / services + UVC_PAYLOAD_HEADER_MAX;
+}
+
+static int uvc_interval_fits(struct uvc_device *dev, unsigned int frame_size, unsigned int interval)
+{
+    return dev->bulk || uvc_payload_size(dev, frame_size, interval) <= uvc_isoc_capacity(dev);
+}
+
+/*
+ * Pick the frame interval closest to the requested one among the ones the
+ * bus sustains, the next longer one first. Falls back to the longest frame
+ * interval when none fits.
+ */
+static unsigned int
+uvc_select_interval(struct uvc_device *dev, const struct uvc_function_frame *frame, unsigned int size, unsigned int req)
+{
+    unsigned int above = 0, below = 0, longest = 0;
+    unsigned int i;
+
+    for (i = 0; i < frame->num_intervals; ++i) {
+        unsigned int interval = frame->intervals[i];
+
+        longest = max(longest, interval);
+        if (!uvc_interval_fits(dev, size, interval))
+            continue;
+
+        if (interval >= req && (!above || interval < above))
+            above = interval;
+        if (interval < req && interval > below)
+            below = interval;
+    }
+
+    return above ? above : below ? below : longest;
+}
+
+/*
+ * Fill a streaming control for the format and frame at 1-based indices,
+ * brought to declared ones, with the frame interval closest to interval
+ * that the bus sustains.
+ */
+static void uvc_fill_streaming_control(struct uvc_device *dev, struct uvc_streaming_control *ctrl,
+                                       unsigned int iformat, unsigned int iframe, unsigned int interval)
+{
+    const struct uvc_function_format *format;
+    const struct uvc_function_frame *frame;
+
+    format = uvc_find_format(dev->fc, iformat);
+
+    iframe = clamp(iframe, 1U, format->num_frames);
+    frame = &format->frames[iframe - 1];
 
     memset(ctrl, 0, sizeof *ctrl);
 
     ctrl->bmHint = 1;
-    ctrl->bFormatIndex = iformat + 1;
-    ctrl->bFrameIndex = iframe + 1;
-    ctrl->dwFrameInterval = frame->intervals[0];
-    switch (format->fcc) {
-    case V4L2_PIX_FMT_YUYV:
-        ctrl->dwMaxVideoFrameSize = frame->width * frame->height * 2;
-        break;
-    case V4L2_PIX_FMT_MJPEG:
-        ctrl->dwMaxVideoFrameSize = dev->imgsize;
-        break;
-    }
+    ctrl->bFormatIndex = format->index;
+    ctrl->bFrameIndex = iframe;
+    ctrl->dwMaxVideoFrameSize = uvc_max_frame_size(dev, format, frame);
+    ctrl->dwFrameInterval = uvc_select_interval(dev, frame, ctrl->dwMaxVideoFrameSize, interval);
+    ctrl->dwMaxPayloadTransferSize = uvc_payload_size(dev, ctrl->dwMaxVideoFrameSize, ctrl->dwFrameInterval);
+    ctrl->bmFramingInfo = 3;
 
-    /* TODO: the UVC maxpayload transfer size should be filled
-     * by the driver.
+    /*
+     * Hosts refuse payloads larger than the endpoint, stream below the
+     * frame rate rather than not at all.
      */
     if (!dev->bulk)
-        ctrl->dwMaxPayloadTransferSize = (dev->maxpkt) * (dev->mult + 1) * (dev->burst + 1);
-    else
-        ctrl->dwMaxPayloadTransferSize = ctrl->dwMaxVideoFrameSize;
-
-    ctrl->bmFramingInfo = 3;
+        ctrl->dwMaxPayloadTransferSize = min(ctrl->dwMaxPayloadTransferSize, uvc_isoc_capacity(dev));
     ctrl->bPreferedVersion = 1;
     ctrl->bMaxVersion = 1;
 }
 
+/*
+ * GET_MIN and GET_MAX report the range of each field for the format and
+ * frame being probed: the shortest and longest sustainable frame intervals,
+ * and the payload sizes they need.
+ */
+static void uvc_fill_streaming_range(struct uvc_device *dev, struct uvc_streaming_control *ctrl, int maximum)
+{
+    struct uvc_streaming_control fastest, slowest;
+
+    uvc_fill_streaming_control(dev, &fastest, dev->probe.bFormatIndex, dev->probe.bFrameIndex, 0);
+    uvc_fill_streaming_control(dev, &slowest, dev->probe.bFormatIndex, dev->probe.bFrameIndex, ~0U);
+
+    *ctrl = maximum ? slowest : fastest;
+    ctrl->dwMaxPayloadTransferSize =
+        maximum ? fastest.dwMaxPayloadTransferSize : slowest.dwMaxPayloadTransferSize;
+}
+
+/*
+ * Default frame, the selected one, or the largest frame of the selected
+ * format that the bus sustains at some frame interval.
+ */
+static unsigned int uvc_default_frame(struct uvc_device *dev)
+{
+    const struct uvc_function_format *format = uvc_find_format(dev->fc, dev->default_format);
+    const struct uvc_function_frame *frame = &format->frames[dev->default_frame - 1];
+    const struct uvc_function_frame *best = NULL;
+    unsigned int i, j;
+
+    for (i = 0; i < frame->num_intervals; ++i) {
+        if (uvc_interval_fits(dev, uvc_max_frame_size(dev, format, frame), frame->intervals[i]))
+            return frame->index;
+    }
+
+    for (i = 0; i < format->num_frames; ++i) {
+        const struct uvc_function_frame *f = &format->frames[i];
+
+        if (best && f->width * f->height <= best->width * best->height)
+            continue;
+
+        for (j = 0; j < f->num_intervals; ++j) {
+            if (uvc_interval_fits(dev, uvc_max_frame_size(dev, format, f), f->intervals[j])) {
+                best = f;
+                break;
+            }
+        }
+    }
+
+    return best ? best->index : frame->index;
+}
+
+static void uvc_streaming_defaults(struct uvc_device *dev)
+{
+    unsigned int iframe = uvc_default_frame(dev);
+
+    uvc_fill_streaming_control(dev, &dev->probe, dev->default_format, iframe, dev->default_interval);
+    uvc_fill_streaming_control(dev, &dev->commit, dev->default_format, iframe, dev->default_interval);
+}
+
+/*
+ * The host connected at the given speed, before it probes anything. Derive
+ * the endpoint parameters from the actual speed, report the frame intervals
+ * it can't sustain, which negotiation skips, and start over from defaults
+ * that fit.
+ */
+static void uvc_events_connect(struct uvc_device *dev, enum usb_device_speed speed)
+{
+    static const char *const speeds[] = {
+        [USB_SPEED_UNKNOWN] = "unknown", [USB_SPEED_LOW] = "low",          [USB_SPEED_FULL] = "full",
+        [USB_SPEED_HIGH] = "high",       [USB_SPEED_WIRELESS] = "wireless", [USB_SPEED_SUPER] = "super",
+    };
+    const struct uvc_function_format *format;
+    const struct uvc_function_frame *frame;
+    unsigned int i, j, k;
+
+    if (speed == USB_SPEED_UNKNOWN)
+        return;
+
+    uvc_set_speed(dev, speed);
+
+    printf("UVC: Connected at %s speed, %u bytes per service interval\n",
+           (unsigned int)speed < ARRAY_SIZE(speeds) && speeds[speed] ? speeds[speed] : "super+",
+           dev->bulk ? (unsigned int)dev->maxpkt : uvc_isoc_capacity(dev));
+
+    for (i = 0; i < dev->fc->num_formats; ++i) {
+        format = &dev->fc->formats[i];
+
+        for (j = 0; j < format->num_frames; ++j) {
+            frame = &format->frames[j];
+
+            for (k = 0; k < frame->num_intervals; ++k) {
+                if (!uvc_interval_fits(dev, uvc_max_frame_size(dev, format, frame), frame->intervals[k]))
+                    printf("UVC:   %c%c%c%c %ux%u interval %u doesn't fit\n", pixfmtstr(format->fcc),
+                           frame->width, frame->height, frame->intervals[k]);
+            }
+        }
+    }
+
+    uvc_streaming_defaults(dev);
+}
+
 static void
 uvc_events_process_standard(struct uvc_device *dev, struct usb_ctrlrequest *ctrl, struct uvc_request_data *resp)
 {
@@ -1678,8 +4387,11 @@ static void uvc_events_process_streaming(struct uvc_device *dev, uint8_t req, ui
 
     case UVC_GET_MIN:
     case UVC_GET_MAX:
+        uvc_fill_streaming_range(dev, ctrl, req == UVC_GET_MAX);
+        break;
+
     case UVC_GET_DEF:
-        uvc_fill_streaming_control(dev, ctrl, req == UVC_GET_MAX ? -1 : 0, req == UVC_GET_MAX ? -1 : 0);
+        uvc_fill_streaming_control(dev, ctrl, dev->default_format, uvc_default_frame(dev), dev->default_interval);
         break;
 
     case UVC_GET_RES:
@@ -1799,11 +4511,8 @@ static int uvc_events_process_data(struct uvc_device *dev, struct uvc_request_da
     struct uvc_streaming_control *target;
     struct uvc_streaming_control *ctrl;
     struct v4l2_format fmt;
-    const struct uvc_format_info *format;
-    const struct uvc_frame_info *frame;
-    const unsigned int *interval;
-    unsigned int iformat, iframe;
-    unsigned int nframes;
+    const struct uvc_function_format *format;
+    const struct uvc_function_frame *frame;
     unsigned int *val = (unsigned int *)data->data;
     int ret;
 
@@ -1841,38 +4550,32 @@ static int uvc_events_process_data(struct uvc_device *dev, struct uvc_request_da
     }
 
     ctrl = (struct uvc_streaming_control *)&data->data;
-    iformat = clamp((unsigned int)ctrl->bFormatIndex, 1U, (unsigned int)ARRAY_SIZE(uvc_formats));
-    format = &uvc_formats[iformat - 1];
+    uvc_fill_streaming_control(dev, target, ctrl->bFormatIndex, ctrl->bFrameIndex, ctrl->dwFrameInterval);
 
-    nframes = 0;
-    while (format->frames[nframes].width != 0)
-        ++nframes;
+    format = uvc_find_format(dev->fc, target->bFormatIndex);
+    frame = &format->frames[target->bFrameIndex - 1];
 
-    iframe = clamp((unsigned int)ctrl->bFrameIndex, 1U, nframes);
-    frame = &format->frames[iframe - 1];
-    interval = frame->intervals;
+    if (uvc_format_compressed(format->fcc) && dev->imgsize == 0)
+        printf("WARNING: %c%c%c%c requested and no image loaded.\n", pixfmtstr(format->fcc));
 
-    while (interval[0] < ctrl->dwFrameInterval && interval[1])
-        ++interval;
+    if (target->dwFrameInterval != ctrl->dwFrameInterval && ctrl->dwFrameInterval)
+        printf("UVC: %c%c%c%c %ux%u frame interval %u adjusted to %u\n", pixfmtstr(format->fcc), frame->width,
+               frame->height, ctrl->dwFrameInterval, target->dwFrameInterval);
 
-    target->bFormatIndex = iformat;
-    target->bFrameIndex = iframe;
-    switch (format->fcc) {
-    case V4L2_PIX_FMT_YUYV:
-        target->dwMaxVideoFrameSize = frame->width * frame->height * 2;
-        break;
-    case V4L2_PIX_FMT_MJPEG:
-        if (dev->imgsize == 0)
-            printf("WARNING: MJPEG requested and no image loaded.\n");
-        target->dwMaxVideoFrameSize = dev->imgsize;
-        break;
-    }
-    target->dwFrameInterval = *interval;
+    if (!uvc_interval_fits(dev, target->dwMaxVideoFrameSize, target->dwFrameInterval))
+        printf("WARNING: %c%c%c%c %ux%u needs %u bytes per service interval, the endpoint carries %u\n",
+               pixfmtstr(format->fcc), frame->width, frame->height,
+               uvc_payload_size(dev, target->dwMaxVideoFrameSize, target->dwFrameInterval), uvc_isoc_capacity(dev));
+
+    printf("UVC: %s %c%c%c%c %ux%u interval %u payload %u\n",
+           dev->control == UVC_VS_COMMIT_CONTROL ? "commit" : "probe", pixfmtstr(format->fcc), frame->width,
+           frame->height, target->dwFrameInterval, target->dwMaxPayloadTransferSize);
 
     if (dev->control == UVC_VS_COMMIT_CONTROL) {
         dev->fcc = format->fcc;
         dev->width = frame->width;
         dev->height = frame->height;
+        uvc_warm_commit(dev);
     }
 
     return 0;
@@ -1894,15 +4597,19 @@ static void uvc_events_process(struct uvc_device *dev)
         return;
     }
 
+    if (v4l2_event.type >= UVC_EVENT_FIRST && v4l2_event.type <= UVC_EVENT_LAST)
+        dev->uvc_events[v4l2_event.type - UVC_EVENT_FIRST]++;
+
     memset(&resp, 0, sizeof resp);
     resp.length = -EL2HLT;
 
     switch (v4l2_event.type) {
     case UVC_EVENT_CONNECT:
+        uvc_events_connect(dev, uvc_event->speed);
         return;
 
     case UVC_EVENT_DISCONNECT:
-        dev->uvc_shutdown_requested = 1;
+        uvc_data_command(dev, DATA_CMD_DISCONNECT);
         printf(
             "UVC: Possible USB shutdown requested from "
             "Host, seen via UVC_EVENT_DISCONNECT\n");
@@ -1919,27 +4626,51 @@ static void uvc_events_process(struct uvc_device *dev)
         return;
 
     case UVC_EVENT_STREAMON:
+        dev->streamon_time = pacer_now();
+        dev->ttff = 0;
         if (!dev->bulk)
             uvc_handle_streamon_event(dev);
         return;
 
     case UVC_EVENT_STREAMOFF:
-        /* Stop V4L2 streaming... */
+        /* Nothing streams yet, keep the pipeline prepared. */
+        if (dev->warm_ready)
+            return;
+
+        /* Take the queues back from the data path... */
+        uvc_data_command(dev, DATA_CMD_STOP);
+        uvc_encode_stop(dev);
+        uvc_sinks_flush(dev);
+        uvc_video_pace_stop(dev);
+        uvc_latency_report(dev);
+
+        /* ... stop V4L2 streaming, unless kept running for a warm start... */
         if (!dev->run_standalone && dev->vdev->is_streaming) {
             /* UVC - V4L2 integrated path. */
-            v4l2_stop_capturing(dev->vdev);
+            if (!dev->warm_capture || dev->workers)
+                v4l2_stop_capturing(dev->vdev);
             dev->vdev->is_streaming = 0;
         }
 
-        /* ... and now UVC streaming.. */
+        /* ... and now UVC streaming, keeping the buffers for next time. */
         if (dev->is_streaming) {
             uvc_video_stream(dev, 0);
-            uvc_uninit_device(dev);
-            uvc_video_reqbufs(dev, 0);
             dev->is_streaming = 0;
             dev->first_buffer_queued = 0;
         }
 
+        dev->qbuf_count = 0;
+        dev->dqbuf_count = 0;
+        uvc_stats_stop(dev);
+
+        if (!dev->run_standalone && dev->vdev->capturing) {
+            uvc_warm_resume(dev);
+        } else {
+            buffer_table_cleanup(&dev->buffers);
+            if (dev->warm_state)
+                uvc_warm_prepare(dev);
+        }
+
         return;
     }
 
@@ -1953,26 +4684,30 @@ static void uvc_events_process(struct uvc_device *dev)
 static void uvc_events_init(struct uvc_device *dev)
 {
     struct v4l2_event_subscription sub;
-    unsigned int payload_size;
-
-    switch (dev->fcc) {
-    case V4L2_PIX_FMT_YUYV:
-        payload_size = dev->width * dev->height * 2;
-        break;
-    case V4L2_PIX_FMT_MJPEG:
-        payload_size = dev->imgsize;
-        break;
-    }
+    const struct uvc_function_format *format;
+    const struct uvc_function_frame *frame;
 
-    uvc_fill_streaming_control(dev, &dev->probe, 0, 0);
-    uvc_fill_streaming_control(dev, &dev->commit, 0, 0);
+    /* Default to the format and frame selected on the command line. */
+    dev->default_format = dev->fc->formats[0].index;
+    dev->default_frame = 1;
 
-    if (dev->bulk) {
-        /* FIXME Crude hack, must be negotiated with the driver. */
-        dev->probe.dwMaxPayloadTransferSize = dev->commit.dwMaxPayloadTransferSize = payload_size;
+    frame = uvc_find_frame(dev->fc, dev->fcc, dev->width, dev->height, &format);
+    if (frame) {
+        dev->default_format = format->index;
+        dev->default_frame = frame->index;
     }
 
+    uvc_streaming_defaults(dev);
+
+    /*
+     * Subscribe to connection events first, the host may connect as soon
+     * as the setup events are subscribed to.
+     */
     memset(&sub, 0, sizeof sub);
+    sub.type = UVC_EVENT_CONNECT;
+    ioctl(dev->uvc_fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+    sub.type = UVC_EVENT_DISCONNECT;
+    ioctl(dev->uvc_fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
     sub.type = UVC_EVENT_SETUP;
     ioctl(dev->uvc_fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
     sub.type = UVC_EVENT_DATA;
@@ -1987,286 +4722,671 @@ static void uvc_events_init(struct uvc_device *dev)
  * main
  */
 
+static void signal_handler(void *priv)
+{
+    struct events *events = priv;
+
+    printf("Terminating on signal\n");
+    events_stop(events);
+}
+
+/*
+ * Load an MJPEG still image or clip, or an uncompressed clip when streaming
+ * YUYV. Clips are streamed in order at the committed frame interval, and
+ * loop at the end.
+ */
 static void image_load(struct uvc_device *dev, const char *img)
 {
-    int fd = -1;
+    int ret;
 
     if (img == NULL)
         return;
 
-    fd = open(img, O_RDONLY);
-    if (fd == -1) {
-        printf("Unable to open MJPEG image '%s'\n", img);
+    if (dev->fcc == V4L2_PIX_FMT_YUYV) {
+        ret = clip_open_raw(&dev->clip, img, dev->width, dev->height);
+        if (ret < 0)
+            printf("Unable to load YUV clip '%s'\n", img);
+
+        /* MJPEG has nothing to stream. */
+        dev->imgsize = 0;
         return;
     }
 
-    dev->imgsize = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    dev->imgdata = malloc(dev->imgsize);
-    if (dev->imgdata == NULL) {
-        printf("Unable to allocate memory for MJPEG image\n");
+    ret = clip_open_mjpeg(&dev->clip, img);
+    if (ret < 0) {
+        printf("Unable to load MJPEG image '%s'\n", img);
         dev->imgsize = 0;
         return;
     }
 
-    read(fd, dev->imgdata, dev->imgsize);
-    close(fd);
+    dev->imgsize = dev->clip.max_frame_size;
 }
 
+#define UVC_MAX_STREAMS 8
+
 static void usage(const char *argv0)
 {
-    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "Usage: %s [options] [-- options]...\n", argv0);
+    fprintf(stderr, "Options after each -- configure another UVC function, served by the same\n");
+    fprintf(stderr, "process (up to %u). -T and -w apply to all of them.\n", UVC_MAX_STREAMS);
     fprintf(stderr, "Available options are\n");
     fprintf(stderr, " -b		Use bulk mode\n");
+    fprintf(stderr, " -c function	configfs directory of the UVC function, found from the UVC device by default\n");
     fprintf(stderr, " -d		Do not use any real V4L2 capture device\n");
+    fprintf(stderr, " -e quality	Encode YUYV capture to MJPEG with the given quality (b/w 1 and 100)\n");
     fprintf(stderr,
             " -f <format>    Select frame format\n\t"
             "0 = V4L2_PIX_FMT_YUYV\n\t"
-            "1 = V4L2_PIX_FMT_MJPEG\n");
+            "1 = V4L2_PIX_FMT_MJPEG\n\t"
+            "2 = V4L2_PIX_FMT_NV12\n\t"
+            "3 = V4L2_PIX_FMT_UYVY\n\t"
+            "4 = V4L2_PIX_FMT_GREY\n\t"
+            "5 = V4L2_PIX_FMT_Y16\n");
+    fprintf(stderr, " -F		Free run, don't pace frames to the committed frame interval\n");
     fprintf(stderr, " -h		Print this help screen and exit\n");
-    fprintf(stderr, " -i image	MJPEG image\n");
+    fprintf(stderr, " -i image	MJPEG image or clip (concatenated JPEGs or AVI-MJPEG),\n\t\tor raw YUYV/Y4M clip with -f 0\n");
+    fprintf(stderr, " -k		Keep the V4L2 capture device running between streams, with -W\n");
+    fprintf(stderr, " -L age		Latest-frame policy: only send the freshest captured frame, and drop\n\t\tframes older than age ms (0 for no age limit)\n");
     fprintf(stderr, " -m		Streaming mult for ISOC (b/w 0 and 2)\n");
     fprintf(stderr, " -n		Number of Video buffers (b/w 2 and 32)\n");
+    fprintf(stderr, " -N		Number of V4L2 capture buffers, defaults to -n (b/w 2 and 32)\n");
     fprintf(stderr,
             " -o <IO method> Select UVC IO method:\n\t"
             "0 = MMAP\n\t"
-            "1 = USER_PTR\n");
+            "1 = USER_PTR\n\t"
+            "2 = DMABUF (requires a V4L2 capture device)\n");
+    fprintf(stderr,
+            " -p <pattern>   Select test pattern for -d mode:\n\t"
+            "0 = SMPTE color bars\n\t"
+            "1 = Moving gradient\n\t"
+            "2 = Checkerboard with frame counter\n\t"
+            "3 = Noise\n");
+    fprintf(stderr, " -P socket	Share the captured frames with subscribers on a Unix socket, as DMABUFs\n\t\t(requires -o 1 or -o 2)\n");
+    fprintf(stderr, " -Q min[:max]	Adapt the buffers in flight on each side between min and max to the\n\t\tqueue jitter (b/w 1 and 32, max defaults to the pool)\n");
     fprintf(stderr,
-            " -r <resolution> Select frame resolution:\n\t"
+            " -r <resolution> Select frame resolution, WxH or:\n\t"
             "0 = 360p, VGA (640x360)\n\t"
             "1 = 720p, WXGA (1280x720)\n");
+    fprintf(stderr, " -R file	Record the captured frames to a file while streaming\n");
     fprintf(stderr,
-            " -s <speed>	Select USB bus speed (b/w 0 and 2)\n\t"
+            " -s <speed>	USB bus speed assumed until the host connects (b/w 0 and 2)\n\t"
             "0 = Full Speed (FS)\n\t"
             "1 = High Speed (HS)\n\t"
             "2 = Super Speed (SS)\n");
+    fprintf(stderr, " -S socket	Serve statistics in Prometheus text format on a Unix socket\n");
     fprintf(stderr, " -t		Streaming burst (b/w 0 and 15)\n");
+    fprintf(stderr, " -T		Run the data path on a dedicated real-time thread\n");
     fprintf(stderr, " -u device	UVC Video Output device\n");
     fprintf(stderr, " -v device	V4L2 Video Capture device\n");
+    fprintf(stderr, " -w workers	Number of encoder threads, defaults to one per CPU\n");
+    fprintf(stderr, " -W file	Warm start: prepare the pipeline before the host streams, for the\n\t\tformat last committed, remembered in file\n");
 }
 
-int main(int argc, char *argv[])
-{
-    struct uvc_device *udev;
-    struct v4l2_device *vdev;
-    struct timeval tv;
-    struct v4l2_format fmt;
-    char *uvc_devname = "/dev/video0";
-    char *v4l2_devname = "/dev/video1";
-    char *mjpeg_image = NULL;
-
-    fd_set fdsv, fdsu;
-    int ret, opt, nfds;
-    int bulk_mode = 0;
-    int dummy_data_gen_mode = 0;
+/* ---------------------------------------------------------------------------
+ * Streams
+ *
+ * A process serves one or more UVC functions, each with its own video
+ * source, buffers, options and statistics. All of them share the control
+ * event loop, the data path thread in threaded mode and the encoder worker
+ * pool.
+ */
+
+/* Command line options of a stream. */
+struct uvc_stream_options {
+    char *uvc_devname;
+    char *v4l2_devname;
+    char *mjpeg_image;
+    char *stats_path;
+    char *function_path;
+    char *warm_state;
+    char *record_path;
+    char *share_path;
+    int warm_capture;
+    int latest;
+    unsigned int max_age;
+    unsigned int depth_min;
+    unsigned int depth_max;
+    int bulk_mode;
+    int dummy_data_gen_mode;
+    int free_run;
+    int encode_quality;
     /* Frame format/resolution related params. */
-    int default_format = 0;     /* V4L2_PIX_FMT_YUYV */
-    int default_resolution = 0; /* VGA 360p */
-    int nbufs = 2;              /* Ping-Pong buffers */
+    int default_format;
+    unsigned int default_width;
+    unsigned int default_height;
+    int nbufs;
+    int v4l2_nbufs;
+    enum pattern_type pattern;
     /* USB speed related params */
-    int mult = 0;
-    int burst = 0;
-    enum usb_device_speed speed = USB_SPEED_SUPER; /* High-Speed */
-    enum io_method uvc_io_method = IO_METHOD_USERPTR;
+    int mult;
+    int burst;
+    enum usb_device_speed speed;
+    enum io_method uvc_io_method;
+};
+
+/* A UVC function and its video source. */
+struct uvc_stream {
+    struct uvc_stream_options opts;
+    struct uvc_function_config *function;
+    struct uvc_device *udev;
+    struct v4l2_device *vdev;
+    int encode_stage;
+    struct recorder recorder;
+    struct share share;
+};
+
+static void uvc_stream_defaults(struct uvc_stream_options *opts)
+{
+    memset(opts, 0, sizeof *opts);
+    opts->uvc_devname = "/dev/video0";
+    opts->v4l2_devname = "/dev/video1";
+    opts->default_format = 0;             /* V4L2_PIX_FMT_YUYV */
+    opts->default_width = 640;
+    opts->default_height = 360;
+    opts->nbufs = 2;                      /* Ping-Pong buffers */
+    opts->v4l2_nbufs = 0;                 /* Same as nbufs */
+    opts->pattern = PATTERN_BARS;
+    opts->speed = USB_SPEED_SUPER;        /* High-Speed */
+    opts->uvc_io_method = IO_METHOD_USERPTR;
+}
+
+/*
+ * Parse the options of one stream, from argv[0] up to the end of the command
+ * line or a "--" separator. -T and -w apply to the whole process. Returns the
+ * number of arguments consumed, separator included, or -1 after printing the
+ * usage.
+ */
+static int uvc_stream_parse(int argc, char *argv[], const char *argv0, struct uvc_stream_options *opts,
+                            int *threaded, int *nworkers)
+{
+    int opt;
+
+    uvc_stream_defaults(opts);
+
+    /* getopt() starts at argv[1], and resets its state with optind 0. */
+    --argv;
+    ++argc;
+    optind = 0;
 
-    while ((opt = getopt(argc, argv, "bdf:hi:m:n:o:r:s:t:u:v:")) != -1) {
+    while ((opt = getopt(argc, argv, "bc:de:f:Fhi:kL:m:n:N:o:p:P:Q:r:R:s:S:t:Tu:v:w:W:")) != -1) {
         switch (opt) {
         case 'b':
-            bulk_mode = 1;
+            opts->bulk_mode = 1;
+            break;
+
+        case 'c':
+            opts->function_path = optarg;
             break;
 
         case 'd':
-            dummy_data_gen_mode = 1;
+            opts->dummy_data_gen_mode = 1;
+            break;
+
+        case 'e':
+            if (atoi(optarg) < 1 || atoi(optarg) > 100) {
+                usage(argv0);
+                return -1;
+            }
+
+            opts->encode_quality = atoi(optarg);
             break;
 
         case 'f':
-            if (atoi(optarg) < 0 || atoi(optarg) > 1) {
-                usage(argv[0]);
-                return 1;
+            if (atoi(optarg) < 0 || atoi(optarg) >= (int)ARRAY_SIZE(uvc_formats_default)) {
+                usage(argv0);
+                return -1;
             }
 
-            default_format = atoi(optarg);
+            opts->default_format = atoi(optarg);
+            break;
+
+        case 'F':
+            opts->free_run = 1;
             break;
 
         case 'h':
-            usage(argv[0]);
-            return 1;
+            usage(argv0);
+            return -1;
 
         case 'i':
-            mjpeg_image = optarg;
+            opts->mjpeg_image = optarg;
+            break;
+
+        case 'k':
+            opts->warm_capture = 1;
+            break;
+
+        case 'L':
+            if (atoi(optarg) < 0) {
+                usage(argv0);
+                return -1;
+            }
+
+            opts->latest = 1;
+            opts->max_age = atoi(optarg);
             break;
 
         case 'm':
             if (atoi(optarg) < 0 || atoi(optarg) > 2) {
-                usage(argv[0]);
-                return 1;
+                usage(argv0);
+                return -1;
             }
 
-            mult = atoi(optarg);
-            printf("Requested Mult value = %d\n", mult);
+            opts->mult = atoi(optarg);
+            printf("Requested Mult value = %d\n", opts->mult);
             break;
 
         case 'n':
             if (atoi(optarg) < 2 || atoi(optarg) > 32) {
-                usage(argv[0]);
-                return 1;
+                usage(argv0);
+                return -1;
             }
 
-            nbufs = atoi(optarg);
-            printf("Number of buffers requested = %d\n", nbufs);
+            opts->nbufs = atoi(optarg);
+            printf("Number of buffers requested = %d\n", opts->nbufs);
+            break;
+
+        case 'N':
+            if (atoi(optarg) < 2 || atoi(optarg) > 32) {
+                usage(argv0);
+                return -1;
+            }
+
+            opts->v4l2_nbufs = atoi(optarg);
+            printf("Number of V4L2 buffers requested = %d\n", opts->v4l2_nbufs);
             break;
 
         case 'o':
-            if (atoi(optarg) < 0 || atoi(optarg) > 1) {
-                usage(argv[0]);
-                return 1;
+            if (atoi(optarg) < 0 || atoi(optarg) > 2) {
+                usage(argv0);
+                return -1;
+            }
+
+            opts->uvc_io_method = atoi(optarg);
+            printf("UVC: IO method requested is %s\n",
+                   (opts->uvc_io_method == IO_METHOD_MMAP)
+                       ? "MMAP"
+                       : (opts->uvc_io_method == IO_METHOD_USERPTR) ? "USER_PTR" : "DMABUF");
+            break;
+
+        case 'p':
+            if (atoi(optarg) < 0 || atoi(optarg) >= PATTERN_COUNT) {
+                usage(argv0);
+                return -1;
             }
 
-            uvc_io_method = atoi(optarg);
-            printf("UVC: IO method requested is %s\n", (uvc_io_method == IO_METHOD_MMAP) ? "MMAP" : "USER_PTR");
+            opts->pattern = atoi(optarg);
+            break;
+
+        case 'P':
+            opts->share_path = optarg;
+            break;
+
+        case 'Q':
+            opts->depth_max = 32;
+            if (sscanf(optarg, "%u:%u", &opts->depth_min, &opts->depth_max) < 1 || opts->depth_min < 1 ||
+                opts->depth_max < opts->depth_min || opts->depth_max > 32) {
+                usage(argv0);
+                return -1;
+            }
             break;
 
         case 'r':
+            if (strchr(optarg, 'x')) {
+                if (sscanf(optarg, "%ux%u", &opts->default_width, &opts->default_height) != 2 ||
+                    !opts->default_width || !opts->default_height) {
+                    usage(argv0);
+                    return -1;
+                }
+                break;
+            }
+
             if (atoi(optarg) < 0 || atoi(optarg) > 1) {
-                usage(argv[0]);
-                return 1;
+                usage(argv0);
+                return -1;
             }
 
-            default_resolution = atoi(optarg);
+            opts->default_width = atoi(optarg) == 0 ? 640 : 1280;
+            opts->default_height = atoi(optarg) == 0 ? 360 : 720;
+            break;
+
+        case 'R':
+            opts->record_path = optarg;
             break;
 
         case 's':
             if (atoi(optarg) < 0 || atoi(optarg) > 2) {
-                usage(argv[0]);
-                return 1;
+                usage(argv0);
+                return -1;
             }
 
-            speed = atoi(optarg);
+            opts->speed = atoi(optarg) == 0 ? USB_SPEED_FULL : atoi(optarg) == 1 ? USB_SPEED_HIGH : USB_SPEED_SUPER;
+            break;
+
+        case 'S':
+            opts->stats_path = optarg;
             break;
 
         case 't':
             if (atoi(optarg) < 0 || atoi(optarg) > 15) {
-                usage(argv[0]);
-                return 1;
+                usage(argv0);
+                return -1;
             }
 
-            burst = atoi(optarg);
-            printf("Requested Burst value = %d\n", burst);
+            opts->burst = atoi(optarg);
+            printf("Requested Burst value = %d\n", opts->burst);
+            break;
+
+        case 'T':
+            *threaded = 1;
             break;
 
         case 'u':
-            uvc_devname = optarg;
+            opts->uvc_devname = optarg;
             break;
 
         case 'v':
-            v4l2_devname = optarg;
+            opts->v4l2_devname = optarg;
+            break;
+
+        case 'w':
+            if (atoi(optarg) < 0 || atoi(optarg) > 64) {
+                usage(argv0);
+                return -1;
+            }
+
+            *nworkers = atoi(optarg);
+            break;
+
+        case 'W':
+            opts->warm_state = optarg;
             break;
 
         default:
             printf("Invalid option '-%c'\n", opt);
-            usage(argv[0]);
-            return 1;
+            usage(argv0);
+            return -1;
+        }
+    }
+
+    /* Anything left after a separator belongs to the next stream. */
+    if (optind < argc && !strcmp(argv[optind - 1], "--"))
+        return optind - 1;
+
+    return argc - 1;
+}
+
+/*
+ * Open the UVC device of a stream and its video source, and set them up as
+ * the options tell. The UVC events and statistics are served by the control
+ * loop events. Returns a negative error code after printing a message.
+ */
+static int uvc_stream_open(struct uvc_stream *stream, struct events *events)
+{
+    struct uvc_stream_options *opts = &stream->opts;
+    const struct uvc_function_config *fc = &uvc_config_default;
+    const struct uvc_function_format *format;
+    const struct uvc_function_frame *frame;
+    struct uvc_device *udev = NULL;
+    struct v4l2_device *vdev = NULL;
+    struct v4l2_format fmt;
+    char *function_path = opts->function_path;
+    unsigned int fcc, width, height, interval = 0;
+    unsigned int wfcc = 0, wwidth = 0, wheight = 0, winterval = 0;
+    unsigned int capture_format;
+    unsigned int i, j;
+    int standalone = opts->dummy_data_gen_mode || opts->mjpeg_image;
+    int ret;
+
+    if (opts->uvc_io_method == IO_METHOD_DMABUF && standalone) {
+        printf("UVC: DMABUF IO method requires a V4L2 capture device to export buffers\n");
+        return -EINVAL;
+    }
+
+    if (opts->warm_capture && !opts->warm_state) {
+        printf("UVC: Keeping the capture device running requires a warm start\n");
+        return -EINVAL;
+    }
+
+    if (opts->depth_min && standalone) {
+        printf("UVC: Adaptive queue depth only applies to a V4L2 capture device\n");
+        opts->depth_min = 0;
+    }
+
+    if ((opts->record_path || opts->share_path) && standalone) {
+        printf("UVC: Recording and sharing frames only apply to a V4L2 capture device\n");
+        opts->record_path = NULL;
+        opts->share_path = NULL;
+    }
+
+    if (opts->encode_quality) {
+        if (standalone) {
+            printf("UVC: Encoding requires a V4L2 capture device\n");
+            return -EINVAL;
+        }
+
+        /*
+         * The encoder writes into UVC buffers of its own, and the host
+         * gets MJPEG by default.
+         */
+        if (opts->uvc_io_method != IO_METHOD_MMAP)
+            printf("UVC: Encoding uses the MMAP IO method\n");
+        opts->uvc_io_method = IO_METHOD_MMAP;
+        opts->default_format = 1;
+    }
+
+    /*
+     * Declare the formats the host sees in the function descriptors,
+     * probe and commit fail on any other.
+     */
+    if (function_path) {
+        stream->function = configfs_parse_function(function_path);
+        if (!stream->function)
+            return -EINVAL;
+    } else {
+        function_path = configfs_find_function(opts->uvc_devname);
+        if (function_path)
+            stream->function = configfs_parse_function(function_path);
+        free(function_path);
+    }
+
+    if (stream->function) {
+        fc = stream->function;
+        printf("UVC: Streaming formats from %s\n", fc->path);
+        for (i = 0; i < fc->num_formats; ++i) {
+            format = &fc->formats[i];
+            for (j = 0; j < format->num_frames; ++j) {
+                frame = &format->frames[j];
+                printf("UVC:   %u.%u %c%c%c%c %ux%u, %u interval(s) from %u us\n", format->index, frame->index,
+                       pixfmtstr(format->fcc), frame->width, frame->height, frame->num_intervals,
+                       frame->intervals[0] / 10);
+            }
+        }
+    } else {
+        printf("UVC: configfs function not found, using built-in streaming formats\n");
+    }
+
+    fcc = uvc_formats_default[opts->default_format].fcc;
+    width = opts->default_width;
+    height = opts->default_height;
+
+    /*
+     * Start from the format the host last committed, if still declared,
+     * and still produced by the encoder when encoding.
+     */
+    if (opts->warm_state) {
+        ret = uvc_warm_load(opts->warm_state, &wfcc, &wwidth, &wheight, &winterval);
+        if (ret < 0 && ret != -ENOENT)
+            printf("UVC: Unable to load the committed format from %s (%d)\n", opts->warm_state, ret);
+
+        if (ret == 0 && uvc_find_frame(fc, wfcc, wwidth, wheight, &format) &&
+            (!opts->encode_quality || wfcc == V4L2_PIX_FMT_MJPEG)) {
+            printf("UVC: Warm start with %c%c%c%c %ux%u, interval %u\n", pixfmtstr(wfcc), wwidth, wheight,
+                   winterval);
+            fcc = wfcc;
+            width = wwidth;
+            height = wheight;
+            interval = winterval;
+        }
+    }
+
+    frame = uvc_find_frame(fc, fcc, width, height, &format);
+    if (!frame) {
+        for (i = 0, format = &fc->formats[0]; i < fc->num_formats; ++i) {
+            if (fc->formats[i].fcc == fcc) {
+                format = &fc->formats[i];
+                break;
+            }
         }
+
+        frame = &format->frames[0];
+        printf("UVC: %c%c%c%c %ux%u not declared, using %c%c%c%c %ux%u\n", pixfmtstr(fcc), width, height,
+               pixfmtstr(format->fcc), frame->width, frame->height);
+
+        fcc = format->fcc;
+        width = frame->width;
+        height = frame->height;
     }
 
-    if (!dummy_data_gen_mode && !mjpeg_image) {
+    if (!standalone) {
         /*
          * Try to set the default format at the V4L2 video capture
          * device as requested by the user.
          */
         CLEAR(fmt);
         fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        fmt.fmt.pix.width = (default_resolution == 0) ? 640 : 1280;
-        fmt.fmt.pix.height = (default_resolution == 0) ? 360 : 720;
-        fmt.fmt.pix.sizeimage = (default_format == 0) ? (fmt.fmt.pix.width * fmt.fmt.pix.height * 2)
-                                                      : (fmt.fmt.pix.width * fmt.fmt.pix.height * 1.5);
-        fmt.fmt.pix.pixelformat = (default_format == 0) ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_MJPEG;
+        fmt.fmt.pix.width = width;
+        fmt.fmt.pix.height = height;
+        fmt.fmt.pix.pixelformat = fcc;
+        fmt.fmt.pix.sizeimage = uvc_format_compressed(fmt.fmt.pix.pixelformat)
+                                    ? fmt.fmt.pix.width * fmt.fmt.pix.height * 1.5
+                                    : format_frame_size(format_info(fmt.fmt.pix.pixelformat),
+                                                        uvc_bytesperline(fmt.fmt.pix.pixelformat, fmt.fmt.pix.width),
+                                                        fmt.fmt.pix.height);
         fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
+        if (opts->encode_quality) {
+            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+            fmt.fmt.pix.sizeimage = fmt.fmt.pix.width * fmt.fmt.pix.height * 2;
+        }
+
         /* Open the V4L2 device. */
-        ret = v4l2_open(&vdev, v4l2_devname, &fmt);
+        capture_format = fmt.fmt.pix.pixelformat;
+        ret = v4l2_open(&vdev, opts->v4l2_devname, &fmt);
         if (vdev == NULL || ret < 0)
-            return 1;
+            return ret < 0 ? ret : -ENODEV;
+
+        stream->vdev = vdev;
+
+        /*
+         * Other capture formats go through the encoder stage for
+         * conversion, which needs UVC buffers of its own.
+         */
+        stream->encode_stage = opts->encode_quality || fmt.fmt.pix.pixelformat != capture_format;
+        if (stream->encode_stage && opts->uvc_io_method != IO_METHOD_MMAP) {
+            printf("UVC: Format conversion uses the MMAP IO method\n");
+            opts->uvc_io_method = IO_METHOD_MMAP;
+        }
+        if (stream->encode_stage && opts->depth_min) {
+            printf("UVC: Adaptive queue depth is not available with the encoder stage\n");
+            opts->depth_min = 0;
+        }
+        if (stream->encode_stage && (opts->record_path || opts->share_path)) {
+            printf("UVC: Recording and sharing frames are not available with the encoder stage\n");
+            opts->record_path = NULL;
+            opts->share_path = NULL;
+        }
     }
 
     /* Open the UVC device. */
-    ret = uvc_open(&udev, uvc_devname);
+    ret = uvc_open(&udev, opts->uvc_devname);
     if (udev == NULL || ret < 0)
-        return 1;
+        return ret < 0 ? ret : -ENODEV;
 
-    udev->uvc_devname = uvc_devname;
+    stream->udev = udev;
+    udev->uvc_devname = opts->uvc_devname;
+    udev->events = events;
+    udev->control_events = events;
 
-    if (!dummy_data_gen_mode && !mjpeg_image) {
-        vdev->v4l2_devname = v4l2_devname;
+    if (!standalone) {
+        vdev->v4l2_devname = opts->v4l2_devname;
         /* Bind UVC and V4L2 devices. */
         udev->vdev = vdev;
         vdev->udev = udev;
     }
 
     /* Set parameters as passed by user. */
-    udev->width = (default_resolution == 0) ? 640 : 1280;
-    udev->height = (default_resolution == 0) ? 360 : 720;
-    udev->imgsize = (default_format == 0) ? (udev->width * udev->height * 2) : (udev->width * udev->height * 1.5);
-    udev->fcc = (default_format == 0) ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_MJPEG;
-    udev->io = uvc_io_method;
-    udev->bulk = bulk_mode;
-    udev->nbufs = nbufs;
-    udev->mult = mult;
-    udev->burst = burst;
-    udev->speed = speed;
-
-    if (dummy_data_gen_mode || mjpeg_image)
+    udev->fc = fc;
+    udev->width = width;
+    udev->height = height;
+    udev->fcc = fcc;
+    udev->imgsize = uvc_format_compressed(udev->fcc) ? (udev->width * udev->height * 1.5) : (udev->width * udev->height * 2);
+    udev->io = opts->uvc_io_method;
+    udev->bulk = opts->bulk_mode;
+    udev->nbufs = opts->nbufs;
+    udev->mult = opts->mult;
+    udev->burst = opts->burst;
+    udev->speed = opts->speed;
+    udev->pattern_type = opts->pattern;
+    udev->free_run = opts->free_run;
+    udev->default_interval = interval;
+    udev->warm_state = opts->warm_state;
+    udev->warm_capture = opts->warm_capture;
+    udev->latest = opts->latest;
+    udev->max_age = opts->max_age * 1000000ULL;
+    udev->depth_min = opts->depth_min;
+    udev->depth_max = opts->depth_max;
+
+    if (standalone)
         /* UVC standalone setup. */
         udev->run_standalone = 1;
 
-    if (!dummy_data_gen_mode && !mjpeg_image) {
+    if (!standalone) {
         /* UVC - V4L2 integrated path */
-        vdev->nbufs = nbufs;
+        vdev->nbufs = opts->v4l2_nbufs ? opts->v4l2_nbufs : opts->nbufs;
 
         /*
          * IO methods used at UVC and V4L2 domains must be
-         * complementary to avoid any memcpy from the CPU.
+         * complementary to avoid any memcpy from the CPU. With DMABUF,
+         * the V4L2 side allocates and exports the buffers.
          */
-        switch (uvc_io_method) {
+        switch (opts->uvc_io_method) {
         case IO_METHOD_MMAP:
             vdev->io = IO_METHOD_USERPTR;
             break;
 
+        case IO_METHOD_DMABUF:
+            vdev->io = IO_METHOD_MMAP;
+            break;
+
         case IO_METHOD_USERPTR:
         default:
             vdev->io = IO_METHOD_MMAP;
             break;
         }
-    }
 
-    switch (speed) {
-    case USB_SPEED_FULL:
-        /* Full Speed. */
-        if (bulk_mode)
-            udev->maxpkt = 64;
-        else
-            udev->maxpkt = 1023;
-        break;
+        /* The encoder reads from capture buffers of their own. */
+        if (stream->encode_stage)
+            vdev->io = IO_METHOD_MMAP;
 
-    case USB_SPEED_HIGH:
-        /* High Speed. */
-        if (bulk_mode)
-            udev->maxpkt = 512;
-        else
-            udev->maxpkt = 1024;
-        break;
+        /* Subscribers map the capture buffers, the UVC ones can't be shared. */
+        if (opts->share_path && vdev->io != IO_METHOD_MMAP) {
+            printf("UVC: Sharing frames requires capture buffers, with -o 1 or -o 2\n");
+            opts->share_path = NULL;
+        }
+    }
 
-    case USB_SPEED_SUPER:
-    default:
-        /* Super Speed. */
-        if (bulk_mode)
-            udev->maxpkt = 1024;
-        else
-            udev->maxpkt = 1024;
-        break;
+    if (opts->share_path) {
+        ret = share_init(&stream->share, opts->share_path, uvc_share_release, udev);
+        if (ret < 0)
+            return ret;
+
+        udev->share = &stream->share;
     }
 
-    if (!dummy_data_gen_mode && !mjpeg_image && (IO_METHOD_MMAP == vdev->io)) {
+    uvc_set_speed(udev, opts->speed);
+
+    if (!standalone && (IO_METHOD_MMAP == vdev->io)) {
         /*
          * Ensure that the V4L2 video capture device has already some
          * buffers queued.
@@ -2274,62 +5394,72 @@ int main(int argc, char *argv[])
         v4l2_reqbufs(vdev, vdev->nbufs);
     }
 
-    if (mjpeg_image)
-        image_load(udev, mjpeg_image);
+    if (opts->mjpeg_image) {
+        image_load(udev, opts->mjpeg_image);
+
+        for (i = 0; i < fc->num_formats; ++i) {
+            format = &fc->formats[i];
+            for (j = 0; j < format->num_frames; ++j) {
+                frame = &format->frames[j];
+                if (uvc_format_compressed(format->fcc) && frame->max_size && udev->imgsize > frame->max_size)
+                    printf("WARNING: %u bytes image larger than the %ux%u frame buffer size %u\n", udev->imgsize,
+                           frame->width, frame->height, frame->max_size);
+            }
+        }
+    }
 
     /* Init UVC events. */
     uvc_events_init(udev);
 
-    while (1) {
-        if (!dummy_data_gen_mode && !mjpeg_image)
-            FD_ZERO(&fdsv);
-
-        FD_ZERO(&fdsu);
-
-        /* We want both setup and data events on UVC interface.. */
-        FD_SET(udev->uvc_fd, &fdsu);
-
-        fd_set efds = fdsu;
-        fd_set dfds = fdsu;
+    /* The recorder thread inherits the blocked signals. */
+    if (opts->record_path) {
+        ret = recorder_init(&stream->recorder, opts->record_path);
+        if (ret < 0)
+            return ret;
 
-        /* ..but only data events on V4L2 interface */
-        if (!dummy_data_gen_mode && !mjpeg_image)
-            FD_SET(vdev->v4l2_fd, &fdsv);
+        udev->recorder = &stream->recorder;
+    }
 
-        /* Timeout. */
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
+    /*
+     * UVC events are always watched. Buffer availability on the UVC and
+     * V4L2 sides is watched only while the respective queue is streaming.
+     */
+    ret = events_watch_fd(events, udev->uvc_fd, EVENT_EXCEPTION, uvc_events_handler, udev);
+    if (ret < 0)
+        return ret;
 
-        if (!dummy_data_gen_mode && !mjpeg_image) {
-            nfds = max(vdev->v4l2_fd, udev->uvc_fd);
-            ret = select(nfds + 1, &fdsv, &dfds, &efds, &tv);
-        } else {
-            ret = select(udev->uvc_fd + 1, NULL, &dfds, &efds, NULL);
-        }
+    /* Scrapes are served by the control loop, away from the data path. */
+    if (opts->stats_path) {
+        uvc_stats_publish(udev);
 
-        if (-1 == ret) {
-            printf("select error %d, %s\n", errno, strerror(errno));
-            if (EINTR == errno)
-                continue;
+        ret = stats_listen(&udev->stats, opts->stats_path);
+        if (ret < 0)
+            return ret;
 
-            break;
-        }
+        ret = events_watch_fd(events, udev->stats.fd, EVENT_READ, uvc_stats_accept_handler, udev);
+        if (ret < 0)
+            return ret;
+    }
 
-        if (0 == ret) {
-            printf("select timeout\n");
-            break;
-        }
+    return 0;
+}
 
-        if (FD_ISSET(udev->uvc_fd, &efds))
-            uvc_events_process(udev);
-        if (FD_ISSET(udev->uvc_fd, &dfds))
-            uvc_video_process(udev);
-        if (!dummy_data_gen_mode && !mjpeg_image)
-            if (FD_ISSET(vdev->v4l2_fd, &fdsv))
-                v4l2_process_data(vdev);
+/* Stop streaming and release everything, for a stream opened in part too. */
+static void uvc_stream_close(struct uvc_stream *stream)
+{
+    struct uvc_device *udev = stream->udev;
+    struct v4l2_device *vdev = stream->vdev;
+
+    if (udev) {
+        uvc_warm_cancel(udev);
+        uvc_encode_stop(udev);
+        if (udev->recorder)
+            recorder_cleanup(&stream->recorder);
+        if (udev->share)
+            share_cleanup(&stream->share);
     }
 
-    if (!dummy_data_gen_mode && !mjpeg_image && vdev->is_streaming) {
+    if (vdev && vdev->is_streaming) {
         /* Stop V4L2 streaming... */
         v4l2_stop_capturing(vdev);
         v4l2_uninit_device(vdev);
@@ -2337,17 +5467,138 @@ int main(int argc, char *argv[])
         vdev->is_streaming = 0;
     }
 
-    if (udev->is_streaming) {
-        /* ... and now UVC streaming.. */
-        uvc_video_stream(udev, 0);
-        uvc_uninit_device(udev);
-        uvc_video_reqbufs(udev, 0);
-        udev->is_streaming = 0;
+    if (udev) {
+        if (udev->is_streaming) {
+            /* ... and now UVC streaming.. */
+            uvc_video_stream(udev, 0);
+            udev->is_streaming = 0;
+        }
+
+        uvc_pool_release(udev);
     }
 
-    if (!dummy_data_gen_mode && !mjpeg_image)
+    if (vdev)
         v4l2_close(vdev);
 
-    uvc_close(udev);
-    return 0;
+    if (udev) {
+        buffer_table_cleanup(&udev->buffers);
+        uvc_encode_cleanup(udev);
+        uvc_close(udev);
+    }
+
+    configfs_free_function(stream->function);
+}
+
+int main(int argc, char *argv[])
+{
+    struct uvc_stream streams[UVC_MAX_STREAMS];
+    struct uvc_device *devs[UVC_MAX_STREAMS];
+    struct data_thread data;
+    struct events events;
+    struct workers workers;
+    sigset_t sigmask;
+    int sigfd;
+    unsigned int nstreams = 0;
+    unsigned int ndevs = 0;
+    unsigned int i;
+    int threaded = 0;
+    int encode_stage = 0;
+    int nworkers = 0;
+    int ret, next;
+
+    /* Streams are separated by "--" on the command line. */
+    memset(streams, 0, sizeof streams);
+    for (next = 1; next < argc || !nstreams; next += ret) {
+        if (nstreams == UVC_MAX_STREAMS) {
+            printf("UVC: At most %u streams are supported\n", UVC_MAX_STREAMS);
+            return 1;
+        }
+
+        ret = uvc_stream_parse(argc - next, argv + next, argv[0], &streams[nstreams].opts, &threaded, &nworkers);
+        if (ret < 0)
+            return 1;
+
+        nstreams++;
+    }
+
+    ret = events_init(&events);
+    if (ret < 0)
+        return 1;
+
+    /*
+     * Stop the event loop cleanly on SIGINT and SIGTERM. Signals are
+     * blocked before any thread is created, so that they all inherit it.
+     */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigmask, NULL);
+    sigfd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+    if (sigfd < 0) {
+        printf("Unable to create signalfd: %s (%d).\n", strerror(errno), errno);
+        events_cleanup(&events);
+        return 1;
+    }
+
+    for (i = 0; i < nstreams; ++i) {
+        if (nstreams > 1)
+            printf("UVC: Stream %u on %s\n", i, streams[i].opts.uvc_devname);
+
+        ret = uvc_stream_open(&streams[i], &events);
+        if (ret < 0)
+            goto done;
+
+        if (nstreams > 1)
+            snprintf(streams[i].udev->name, sizeof streams[i].udev->name, "UVC%u", i);
+
+        devs[ndevs++] = streams[i].udev;
+        encode_stage |= streams[i].encode_stage;
+    }
+
+    /* The encoder stages of all streams share a worker pool. */
+    if (encode_stage) {
+        ret = workers_init(&workers, nworkers);
+        if (ret < 0) {
+            encode_stage = 0;
+            goto done;
+        }
+
+        for (i = 0; i < nstreams; ++i) {
+            if (!streams[i].encode_stage)
+                continue;
+
+            ret = uvc_encode_init(streams[i].udev, streams[i].opts.encode_quality, &workers);
+            if (ret < 0)
+                goto done;
+        }
+    }
+
+    if (threaded) {
+        ret = uvc_data_thread_start(&data, devs, ndevs);
+        if (ret < 0)
+            goto done;
+    }
+
+    ret = events_watch_fd(&events, sigfd, EVENT_READ, signal_handler, &events);
+    if (ret < 0)
+        goto done;
+
+    for (i = 0; i < nstreams; ++i) {
+        if (streams[i].opts.warm_state)
+            uvc_warm_prepare(streams[i].udev);
+    }
+
+    events_loop(&events);
+
+done:
+    uvc_data_thread_stop(&data, devs, ndevs);
+
+    for (i = 0; i < nstreams; ++i)
+        uvc_stream_close(&streams[i]);
+
+    if (encode_stage)
+        workers_cleanup(&workers);
+    events_cleanup(&events);
+    close(sigfd);
+    return ret < 0 ? 1 : 0;
 }
@@ -0,0 +1,232 @@
+#!/bin/sh
+#
+# UVC gadget test application - dummy_hcd loopback benchmark
+#
+# Binds a UVC function to the dummy_hcd virtual USB device controller, streams
+# the checkerboard test pattern from uvc-gadget to the uvcvideo driver of the
+# same machine, and measures what arrives with uvc-capture: sustained frame
+# rate and throughput, frame integrity (errors, corrupted, dropped and
+# repeated frames, read back from the frame counter) and latency, on the host
+# side and through the gadget.
+#
+# Needs root, configfs and the dummy_hcd, libcomposite, usb_f_uvc and
+# uvcvideo modules. The gadget is torn down on exit. The exit status is
+# non-zero if a run fails or shows integrity errors.
+#
+# Environment:
+#   LOOPBACK_MODES   Formats and frame sizes to run, among the ones the
+#                    gadget descriptors below declare
+#                    (yuyv:640x360 yuyv:1280x720 yuyv:1920x1080)
+#   LOOPBACK_IO      UVC IO methods, 0 = MMAP, 1 = USERPTR (0 1)
+#   LOOPBACK_FRAMES  Frames measured per run (300)
+#   LOOPBACK_IMAGE   MJPEG image or clip, required by mjpeg:WxH modes
+#   LOOPBACK_ARGS    Extra uvc-gadget options
+
+dir=$(cd "$(dirname "$0")" && pwd)
+modes=${LOOPBACK_MODES:-"yuyv:640x360 yuyv:1280x720 yuyv:1920x1080"}
+ios=${LOOPBACK_IO:-"0 1"}
+frames=${LOOPBACK_FRAMES:-300}
+
+configfs=/sys/kernel/config
+gadget=$configfs/usb_gadget/uvc-loopback
+function=$gadget/functions/uvc.0
+logs=$(mktemp -d)
+gadget_pid=
+status=0
+
+# ---------------------------------------------------------------------------
+# Gadget setup
+
+# Frame descriptor: directory, width, height, then frame intervals. uvc-gadget
+# reads them back from configfs.
+frame() {
+	path=$1
+	width=$2
+	height=$3
+	shift 3
+
+	mkdir -p "$path"
+	echo "$width" > "$path/wWidth"
+	echo "$height" > "$path/wHeight"
+	echo $((width * height * 2)) > "$path/dwMaxVideoFrameBufferSize"
+	printf '%s\n' "$@" > "$path/dwFrameInterval"
+}
+
+setup() {
+	for module in dummy_hcd libcomposite usb_f_uvc uvcvideo ; do
+		modprobe $module || return 1
+	done
+
+	grep -q " $configfs configfs" /proc/mounts || mount -t configfs none $configfs || return 1
+
+	udc=$(ls /sys/class/udc | grep dummy_udc | head -n 1)
+	if [ -z "$udc" ] ; then
+		echo "No dummy_hcd device controller found"
+		return 1
+	fi
+
+	mkdir "$gadget" || return 1
+	echo 0x1d6b > "$gadget/idVendor"
+	echo 0x0104 > "$gadget/idProduct"
+	mkdir "$gadget/strings/0x409"
+	echo "uvc-gadget" > "$gadget/strings/0x409/manufacturer"
+	echo "UVC loopback" > "$gadget/strings/0x409/product"
+	mkdir "$gadget/configs/c.1"
+
+	mkdir "$function"
+	echo 3072 > "$function/streaming_maxpacket"
+
+	frame "$function/streaming/uncompressed/u/360p" 640 360 666666 10000000 50000000
+	frame "$function/streaming/uncompressed/u/720p" 1280 720 333333 666666
+	frame "$function/streaming/uncompressed/u/1080p" 1920 1080 333333 666666
+	frame "$function/streaming/mjpeg/m/360p" 640 360 666666 10000000 50000000
+	frame "$function/streaming/mjpeg/m/720p" 1280 720 333333 666666
+	frame "$function/streaming/mjpeg/m/1080p" 1920 1080 333333 666666
+
+	mkdir "$function/control/header/h"
+	ln -s "$function/control/header/h" "$function/control/class/fs/h"
+	ln -s "$function/control/header/h" "$function/control/class/ss/h"
+
+	mkdir "$function/streaming/header/h"
+	ln -s "$function/streaming/uncompressed/u" "$function/streaming/header/h/u"
+	ln -s "$function/streaming/mjpeg/m" "$function/streaming/header/h/m"
+	for speed in fs hs ss ; do
+		ln -s "$function/streaming/header/h" "$function/streaming/class/$speed/h"
+	done
+
+	ln -s "$function" "$gadget/configs/c.1/uvc.0"
+	echo "$udc" > "$gadget/UDC"
+}
+
+teardown() {
+	[ -n "$gadget_pid" ] && kill $gadget_pid 2>/dev/null && wait $gadget_pid
+
+	if [ -d "$gadget" ] ; then
+		echo "" > "$gadget/UDC" 2>/dev/null
+		rm -f "$gadget/configs/c.1/uvc.0"
+		rm -f "$function"/streaming/class/*/h "$function"/control/class/*/h
+		rm -f "$function"/streaming/header/h/*
+		rmdir "$function/streaming/header/h" "$function/control/header/h"
+		rmdir "$function"/streaming/uncompressed/u/* "$function"/streaming/mjpeg/m/*
+		rmdir "$function/streaming/uncompressed/u" "$function/streaming/mjpeg/m"
+		rmdir "$function" "$gadget/configs/c.1" "$gadget/strings/0x409" "$gadget"
+	fi
+
+	rm -rf "$logs"
+}
+
+# Video nodes of the gadget function, and of uvcvideo on the host side.
+find_nodes() {
+	gadget_node=
+	host_node=
+
+	for node in /sys/class/video4linux/video* ; do
+		[ -e "$node" ] || continue
+
+		if grep -q dummy_udc "$node/name" ; then
+			gadget_node=/dev/$(basename "$node")
+		elif [ "$(basename "$(readlink "$node/device/driver")")" = uvcvideo ] &&
+		     [ "$(cat "$node/index")" = 0 ] ; then
+			host_node=/dev/$(basename "$node")
+		fi
+	done
+
+	[ -n "$gadget_node" ] && [ -n "$host_node" ]
+}
+
+# ---------------------------------------------------------------------------
+# Benchmark
+
+value() {
+	echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+run() {
+	format=${1%%:*}
+	size=${1#*:}
+	io=$2
+
+	case $format in
+	yuyv)
+		fourcc=YUYV
+		source="-d -p 2 -f 0"
+		;;
+	mjpeg)
+		fourcc=MJPG
+		if [ -z "$LOOPBACK_IMAGE" ] ; then
+			printf '%-20s %3s  skipped, LOOPBACK_IMAGE not set\n' "$1" "$io"
+			return
+		fi
+		source="-i $LOOPBACK_IMAGE -f 1"
+		;;
+	*)
+		printf '%-20s %3s  unsupported format\n' "$1" "$io"
+		status=1
+		return
+		;;
+	esac
+
+	"$dir/uvc-gadget" -u $gadget_node -s 1 -m 2 -F -r $size -o $io $source $LOOPBACK_ARGS \
+		> "$logs/gadget.log" 2>&1 &
+	gadget_pid=$!
+	sleep 1
+
+	"$dir/uvc-capture" -c -f $fourcc -s $size -n $frames $host_node > "$logs/capture.log" 2>&1
+
+	# The gadget reports its latency when the host stops streaming.
+	sleep 1
+	kill $gadget_pid 2>/dev/null
+	wait $gadget_pid
+	gadget_pid=
+
+	report=$(grep '^uvc-capture:' "$logs/capture.log")
+	if [ -z "$report" ] ; then
+		printf '%-20s %3s  failed\n' "$1" "$io"
+		sed 's/^/    /' "$logs/capture.log"
+		status=1
+		return
+	fi
+
+	latency=$(sed -n 's/^UVC: total latency p50 \([0-9]*\) us.*/\1/p' "$logs/gadget.log" | tail -n 1)
+	errors=$(($(value errors "$report") + $(value corrupt "$report")))
+
+	printf '%-20s %3s %8s %8s %7s %7s %7s %8s %8s %8s\n' "$1" "$io" "$(value fps "$report")" \
+		"$(value mb_per_s "$report")" $errors "$(value dropped "$report")" "$(value repeated "$report")" \
+		"$(value latency_p50_us "$report")" "$(value latency_p99_us "$report")" "${latency:--}"
+
+	if [ $errors != 0 ] || [ $(value frames "$report") -lt $frames ] ; then
+		status=1
+	fi
+}
+
+trap teardown EXIT
+trap 'exit 1' INT TERM
+
+if [ "$(id -u)" != 0 ] ; then
+	echo "The loopback benchmark must run as root"
+	exit 1
+fi
+
+setup || exit 1
+
+for i in $(seq 10) ; do
+	find_nodes && break
+	sleep 1
+done
+
+if ! find_nodes ; then
+	echo "The UVC function didn't show up on the host side"
+	exit 1
+fi
+
+echo "Gadget $gadget_node, host $host_node, $frames frames per run"
+printf '%-20s %3s %8s %8s %7s %7s %7s %8s %8s %8s\n' "mode" "io" "fps" "MB/s" "errors" "dropped" "repeat" \
+	"host p50" "host p99" "gadget"
+
+for mode in $modes ; do
+	for io in $ios ; do
+		run $mode $io
+	done
+done
+
+exit $status
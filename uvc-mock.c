@@ -0,0 +1,1642 @@
+/*
+ * UVC gadget test application - UVC gadget and V4L2 capture ioctl mock
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * LD_PRELOAD library standing in for the UVC gadget video output device and
+ * a V4L2 capture device, so that the streaming loop can be run, measured and
+ * regression-tested on a machine without a USB device controller:
+ *
+ *   LD_PRELOAD=./uvc-mock.so ./uvc-gadget -u /dev/video0 -v /dev/video1
+ *
+ * Opening the configured device paths returns a memfd which backs the MMAP
+ * buffers of the device, so the application maps them with a plain mmap().
+ * Readiness is emulated at the epoll level: each registration of a mock
+ * device in an epoll instance is replaced by an eventfd that is kept readable
+ * while the device is ready for one of the requested events, and
+ * epoll_wait() reports the events the application asked for.
+ *
+ * A host thread plays the USB host side. It runs an event script (connect,
+ * probe/commit negotiation, streamon, ...), consumes UVC buffers and fills
+ * capture buffers at configurable rates, and reports frames, CPU time and
+ * intercepted system calls per frame and time to first frame on exit. Time
+ * to first frame runs from the first streamon command to the first UVC
+ * buffer the host reads.
+ *
+ * Several UVC functions, each a UVC device and a capture device, can be
+ * mocked for a process serving them all. Script commands then apply to each
+ * function, and the frame counts are per function.
+ *
+ * Configuration is read from the environment:
+ *
+ *   UVC_MOCK_UVC           Comma-separated UVC device paths, one per
+ *                          function (/dev/video0)
+ *   UVC_MOCK_V4L2          Comma-separated capture device paths, in the
+ *                          same order (/dev/video1)
+ *   UVC_MOCK_FPS           UVC buffers consumed per second, 0 for as fast
+ *                          as they are queued (0)
+ *   UVC_MOCK_CAPTURE_FPS   Capture frames per second, 0 for as fast as
+ *                          buffers are queued (0)
+ *   UVC_MOCK_JITTER        Random delay of each UVC buffer consumption in
+ *                          ms, from 0 up to the given value (0)
+ *   UVC_MOCK_CAPTURE_JITTER
+ *                          Random delay of each capture frame in ms (0)
+ *   UVC_MOCK_CAPTURE_STARTUP
+ *                          Sensor start-up time in ms, from capture
+ *                          STREAMON to the first frame (0)
+ *   UVC_MOCK_FRAMES        Frames streamed by the default script (300)
+ *   UVC_MOCK_SCRIPT        Event script file, replaces the default script
+ *   UVC_MOCK_TIMEOUT       Script step timeout in seconds (10)
+ *
+ * Script files hold one command per line, # starts a comment:
+ *
+ *   connect [speed]               UVC_EVENT_CONNECT (USB_SPEED_* value)
+ *   probe [format [frame [ival]]] SET_CUR and GET_CUR of the probe control
+ *   commit                        SET_CUR of the commit control with the
+ *                                 last probe result
+ *   streamon                      UVC_EVENT_STREAMON
+ *   frames <count>                Wait for count UVC buffers to complete
+ *                                 on each function
+ *   sleep <ms>                    Wait for the given time
+ *   streamoff                     UVC_EVENT_STREAMOFF
+ *   disconnect                    UVC_EVENT_DISCONNECT, queued buffers
+ *                                 complete with V4L2_BUF_FLAG_ERROR
+ *   exit                          Send SIGTERM to the process
+ *
+ * Every command waits for the application to dequeue its events and answer
+ * its control requests before the next one runs.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/video.h>
+#include <linux/videodev2.h>
+
+#include "uvc.h"
+
+#define MOCK_MAX_BUFFERS 64
+#define MOCK_MAX_EVENTS 16
+#define MOCK_MAX_EXPORTS 64
+#define MOCK_MAX_FUNCTIONS 4
+
+#define MOCK_DEFAULT_SCRIPT                                                                                            \
+    "connect\n"                                                                                                        \
+    "probe\n"                                                                                                          \
+    "commit\n"                                                                                                         \
+    "streamon\n"                                                                                                       \
+    "frames %u\n"                                                                                                      \
+    "streamoff\n"                                                                                                      \
+    "exit\n"
+
+enum mock_type {
+    MOCK_UVC,
+    MOCK_CAPTURE,
+};
+
+struct mock_buffer {
+    struct v4l2_buffer buf;
+    void *mem;
+};
+
+struct mock_fifo {
+    unsigned int slots[MOCK_MAX_BUFFERS];
+    unsigned int head;
+    unsigned int count;
+};
+
+struct mock_device {
+    enum mock_type type;
+    const char *name;
+    const char *path;
+    int fd;
+    struct mock_function *function;
+
+    struct v4l2_pix_format format;
+
+    /* Buffers, and the memfd mapping backing the MMAP ones. */
+    unsigned int memory;
+    unsigned int nbufs;
+    size_t buf_size;
+    void *map;
+    size_t map_size;
+    struct mock_buffer bufs[MOCK_MAX_BUFFERS];
+    struct mock_fifo queued;
+    struct mock_fifo done;
+    unsigned int sequence;
+    int streaming;
+
+    /*
+     * Consumer or producer rate, 0 when buffers complete when queued. Each
+     * tick is delayed by a random delay below jitter, the schedule doesn't
+     * drift.
+     */
+    unsigned long long period;
+    unsigned long long next_tick;
+    unsigned long long jitter;
+    unsigned long long delay;
+    unsigned int seed;
+    unsigned long long misses;
+
+    /* Start-up time, buffers are held until ready_time while starting. */
+    unsigned long long startup;
+    unsigned long long ready_time;
+    int starting;
+
+    /* UVC events. */
+    struct v4l2_event events[MOCK_MAX_EVENTS];
+    unsigned int event_head;
+    unsigned int event_count;
+    unsigned int event_sequence;
+
+    /* Readiness, as EPOLLIN/EPOLLOUT/EPOLLPRI. */
+    uint32_t ready;
+};
+
+/* A UVC function, with the control request in flight on its UVC device. */
+struct mock_function {
+    struct mock_device uvc;
+    struct mock_device capture;
+
+    /*
+     * Control request in flight, the GET_CUR request that completes a probe
+     * and the last GET_CUR probe answer.
+     */
+    int setup_pending;
+    int setup_set;
+    int probe_get;
+    struct uvc_streaming_control setup_data;
+    struct uvc_streaming_control probe;
+
+    /* UVC buffers read by the host, and the count a frames command waits for. */
+    unsigned long long frames;
+    unsigned long long wait_frames;
+};
+
+/* A mock device registered in an epoll instance, through an eventfd. */
+struct mock_watch {
+    struct mock_device *dev;
+    int epfd;
+    int doorbell;
+    int armed;
+    uint32_t mask;
+    uint64_t data;
+    struct mock_watch *next;
+};
+
+/* A capture buffer exported with VIDIOC_EXPBUF. */
+struct mock_export {
+    int fd;
+    struct mock_device *dev;
+    unsigned int index;
+};
+
+enum mock_wait {
+    MOCK_WAIT_NONE,
+    MOCK_WAIT_IDLE,
+    MOCK_WAIT_FRAMES,
+    MOCK_WAIT_TIME,
+};
+
+static struct mock {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int started;
+    int stop;
+
+    struct mock_function functions[MOCK_MAX_FUNCTIONS];
+    unsigned int nfunctions;
+    char *paths;
+    struct mock_export exports[MOCK_MAX_EXPORTS];
+    struct mock_watch *watches;
+    unsigned int nwatches;
+
+    /* Event script. */
+    char *script;
+    char *line;
+    unsigned int lineno;
+    enum mock_wait wait;
+    unsigned long long wait_until;
+    unsigned long long deadline;
+    unsigned long long timeout;
+
+    /* Measurements. */
+    unsigned long long syscalls;
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long errors;
+    int measuring;
+    unsigned long long window_frames;
+    unsigned long long window_syscalls;
+    unsigned long long window_cpu;
+    unsigned long long window_time;
+    unsigned long long window_start;
+    unsigned long long start_frames;
+    unsigned long long start_syscalls;
+    unsigned long long start_cpu;
+    unsigned long long streamon_time;
+    unsigned long long first_frame;
+} mock = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int (*real_open)(const char *path, int flags, ...);
+static int (*real_close)(int fd);
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+static ssize_t (*real_read)(int fd, void *buf, size_t count);
+static ssize_t (*real_write)(int fd, const void *buf, size_t count);
+static int (*real_epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+static int (*real_epoll_wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+static unsigned long long mock_clock(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long mock_now(void)
+{
+    return mock_clock(CLOCK_MONOTONIC);
+}
+
+static unsigned long long mock_env(const char *name, unsigned long long def)
+{
+    const char *value = getenv(name);
+
+    return value && *value ? strtoull(value, NULL, 0) : def;
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffer queues and readiness
+ */
+
+static void mock_fifo_push(struct mock_fifo *fifo, unsigned int index)
+{
+    fifo->slots[(fifo->head + fifo->count++) % MOCK_MAX_BUFFERS] = index;
+}
+
+static int mock_fifo_pop(struct mock_fifo *fifo)
+{
+    unsigned int index;
+
+    if (!fifo->count)
+        return -1;
+
+    index = fifo->slots[fifo->head];
+    fifo->head = (fifo->head + 1) % MOCK_MAX_BUFFERS;
+    fifo->count--;
+
+    return index;
+}
+
+/* Ring the doorbell of the registrations the device is ready for. */
+static void mock_update(struct mock_device *dev)
+{
+    struct mock_watch *watch;
+    uint64_t value = 1;
+    uint32_t ready = 0;
+
+    if (dev->done.count)
+        ready |= dev->type == MOCK_UVC ? EPOLLOUT : EPOLLIN;
+    if (dev->event_count)
+        ready |= EPOLLPRI;
+
+    dev->ready = ready;
+
+    for (watch = mock.watches; watch; watch = watch->next) {
+        int want = !!(ready & watch->mask);
+
+        if (watch->dev != dev || want == watch->armed)
+            continue;
+
+        if (want)
+            real_write(watch->doorbell, &value, sizeof value);
+        else
+            real_read(watch->doorbell, &value, sizeof value);
+        watch->armed = want;
+    }
+}
+
+static void mock_event_queue(struct mock_device *dev, unsigned int type, const void *data, size_t size)
+{
+    struct v4l2_event *event;
+
+    if (dev->event_count == MOCK_MAX_EVENTS) {
+        fprintf(stderr, "uvc-mock: event queue overflow\n");
+        return;
+    }
+
+    event = &dev->events[(dev->event_head + dev->event_count++) % MOCK_MAX_EVENTS];
+    memset(event, 0, sizeof *event);
+    event->type = type;
+    event->sequence = dev->event_sequence++;
+    clock_gettime(CLOCK_MONOTONIC, &event->timestamp);
+    if (data)
+        memcpy(event->u.data, data, size);
+
+    mock_update(dev);
+}
+
+/*
+ * The host only reads UVC buffers while the script waits for frames or
+ * time, so that frame counts don't depend on when the script thread gets to
+ * run. Buffers queued meanwhile are held.
+ */
+static int mock_host_reading(const struct mock_function *fn)
+{
+    switch (mock.wait) {
+    case MOCK_WAIT_FRAMES:
+        return fn->frames < fn->wait_frames;
+    case MOCK_WAIT_TIME:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Hand a queued buffer back to the application. */
+static void mock_complete(struct mock_device *dev, unsigned int flags)
+{
+    struct mock_function *fn = dev->function;
+    struct mock_buffer *buffer;
+    unsigned long long now;
+    int index;
+
+    if (dev->type == MOCK_UVC && !flags && !mock_host_reading(fn))
+        return;
+    if (dev->starting && !flags)
+        return;
+
+    index = mock_fifo_pop(&dev->queued);
+    if (index < 0)
+        return;
+
+    buffer = &dev->bufs[index];
+    now = mock_now();
+
+    buffer->buf.flags &= ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_ERROR);
+    buffer->buf.flags |= V4L2_BUF_FLAG_DONE | flags;
+    buffer->buf.sequence = dev->sequence++;
+    buffer->buf.timestamp.tv_sec = now / 1000000000ULL;
+    buffer->buf.timestamp.tv_usec = now % 1000000000ULL / 1000;
+
+    if (dev->type == MOCK_CAPTURE) {
+        buffer->buf.flags |= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        buffer->buf.bytesused = dev->format.pixelformat == V4L2_PIX_FMT_MJPEG ? dev->format.sizeimage / 8
+                                                                               : dev->format.sizeimage;
+    } else if (flags & V4L2_BUF_FLAG_ERROR) {
+        mock.errors++;
+    } else {
+        fn->frames++;
+        mock.frames++;
+        mock.bytes += buffer->buf.bytesused;
+        if (mock.measuring && !mock.first_frame)
+            mock.first_frame = now;
+        if (mock.wait == MOCK_WAIT_FRAMES && fn->frames >= fn->wait_frames)
+            pthread_cond_signal(&mock.cond);
+    }
+
+    mock_fifo_push(&dev->done, index);
+    mock_update(dev);
+}
+
+/* Complete buffers for the rate ticks that are due. */
+static void mock_tick(struct mock_device *dev, unsigned long long now)
+{
+    unsigned int count;
+
+    if (!dev->streaming)
+        return;
+
+    if (dev->starting) {
+        if (now < dev->ready_time)
+            return;
+
+        dev->starting = 0;
+        if (!dev->period) {
+            for (count = dev->queued.count; count; --count)
+                mock_complete(dev, 0);
+        }
+    }
+
+    if (!dev->period)
+        return;
+
+    while (dev->next_tick + dev->delay <= now) {
+        if (dev->queued.count) {
+            mock_complete(dev, 0);
+        } else {
+            /* Capture drivers skip the sequence number of a lost frame. */
+            dev->misses++;
+            if (dev->type == MOCK_CAPTURE)
+                dev->sequence++;
+        }
+
+        dev->next_tick += dev->period;
+        dev->delay = dev->jitter ? rand_r(&dev->seed) % dev->jitter : 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Device ioctls
+ */
+
+static void mock_format_fill(struct v4l2_pix_format *pix)
+{
+    if (!pix->width || !pix->height) {
+        pix->width = 640;
+        pix->height = 360;
+    }
+
+    switch (pix->pixelformat) {
+    case V4L2_PIX_FMT_NV12:
+        pix->bytesperline = pix->width;
+        pix->sizeimage = pix->width * pix->height * 3 / 2;
+        break;
+
+    case V4L2_PIX_FMT_GREY:
+        pix->bytesperline = pix->width;
+        pix->sizeimage = pix->width * pix->height;
+        break;
+
+    case V4L2_PIX_FMT_MJPEG:
+        pix->bytesperline = 0;
+        if (!pix->sizeimage)
+            pix->sizeimage = pix->width * pix->height * 2;
+        break;
+
+    default:
+        pix->bytesperline = pix->width * 2;
+        pix->sizeimage = pix->bytesperline * pix->height;
+        break;
+    }
+
+    pix->field = V4L2_FIELD_NONE;
+}
+
+static const unsigned int mock_capture_formats[] = {
+    V4L2_PIX_FMT_YUYV,
+    V4L2_PIX_FMT_UYVY,
+    V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_MJPEG,
+};
+
+static int mock_set_format(struct mock_device *dev, struct v4l2_format *fmt)
+{
+    struct v4l2_pix_format *pix = &fmt->fmt.pix;
+    unsigned int i;
+
+    if (dev->type == MOCK_CAPTURE) {
+        for (i = 0; i < sizeof mock_capture_formats / sizeof mock_capture_formats[0]; ++i) {
+            if (mock_capture_formats[i] == pix->pixelformat)
+                break;
+        }
+
+        if (i == sizeof mock_capture_formats / sizeof mock_capture_formats[0])
+            pix->pixelformat = V4L2_PIX_FMT_YUYV;
+
+        pix->sizeimage = 0;
+    }
+
+    mock_format_fill(pix);
+    dev->format = *pix;
+
+    return 0;
+}
+
+static int mock_reqbufs(struct mock_device *dev, struct v4l2_requestbuffers *rb)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size;
+    unsigned int i;
+
+    if (dev->streaming)
+        return -EBUSY;
+
+    if (rb->memory != V4L2_MEMORY_MMAP && rb->memory != V4L2_MEMORY_USERPTR && rb->memory != V4L2_MEMORY_DMABUF)
+        return -EINVAL;
+
+    if (rb->count > MOCK_MAX_BUFFERS)
+        rb->count = MOCK_MAX_BUFFERS;
+
+    memset(dev->bufs, 0, sizeof dev->bufs);
+    memset(&dev->queued, 0, sizeof dev->queued);
+    memset(&dev->done, 0, sizeof dev->done);
+    dev->memory = rb->memory;
+    dev->nbufs = rb->count;
+    dev->buf_size = (dev->format.sizeimage + page - 1) & ~(page - 1);
+
+    if (rb->memory == V4L2_MEMORY_MMAP && rb->count) {
+        size = dev->buf_size * rb->count;
+
+        /*
+         * The memfd only grows, the application may still have buffers
+         * of a previous allocation mapped.
+         */
+        if (size > dev->map_size) {
+            if (dev->map)
+                munmap(dev->map, dev->map_size);
+
+            if (ftruncate(dev->fd, size) < 0)
+                return -errno;
+
+            dev->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+            if (dev->map == MAP_FAILED) {
+                dev->map = NULL;
+                dev->map_size = 0;
+                return -ENOMEM;
+            }
+
+            dev->map_size = size;
+
+            /* Capture buffers hold a mid-grey frame. */
+            if (dev->type == MOCK_CAPTURE)
+                memset(dev->map, 0x80, size);
+        }
+    }
+
+    for (i = 0; i < rb->count; ++i) {
+        struct v4l2_buffer *buf = &dev->bufs[i].buf;
+
+        buf->index = i;
+        buf->type = rb->type;
+        buf->memory = rb->memory;
+        buf->length = dev->format.sizeimage;
+        buf->field = V4L2_FIELD_NONE;
+        if (rb->memory == V4L2_MEMORY_MMAP) {
+            buf->m.offset = i * dev->buf_size;
+            dev->bufs[i].mem = (uint8_t *)dev->map + buf->m.offset;
+        }
+    }
+
+    return 0;
+}
+
+static void mock_buffer_copy(struct v4l2_buffer *buf, const struct v4l2_buffer *src)
+{
+    buf->index = src->index;
+    buf->type = src->type;
+    buf->memory = src->memory;
+    buf->flags = src->flags;
+    buf->field = src->field;
+    buf->timestamp = src->timestamp;
+    buf->sequence = src->sequence;
+    buf->bytesused = src->bytesused;
+    buf->length = src->length;
+    buf->m = src->m;
+}
+
+static void *mock_export_mem(int fd)
+{
+    struct mock_export *export;
+    unsigned int i;
+
+    for (i = 0; i < MOCK_MAX_EXPORTS; ++i) {
+        export = &mock.exports[i];
+        if (export->dev && export->fd == fd)
+            return export->dev->bufs[export->index].mem;
+    }
+
+    return NULL;
+}
+
+static int mock_qbuf(struct mock_device *dev, struct v4l2_buffer *buf)
+{
+    struct mock_buffer *buffer;
+
+    if (buf->index >= dev->nbufs || buf->memory != dev->memory)
+        return -EINVAL;
+
+    buffer = &dev->bufs[buf->index];
+    if (buffer->buf.flags & V4L2_BUF_FLAG_QUEUED)
+        return -EINVAL;
+
+    switch (dev->memory) {
+    case V4L2_MEMORY_USERPTR:
+        buffer->mem = (void *)buf->m.userptr;
+        buffer->buf.m.userptr = buf->m.userptr;
+        buffer->buf.length = buf->length;
+        break;
+
+    case V4L2_MEMORY_DMABUF:
+        buffer->mem = mock_export_mem(buf->m.fd);
+        if (!buffer->mem)
+            return -EINVAL;
+        buffer->buf.m.fd = buf->m.fd;
+        break;
+
+    default:
+        break;
+    }
+
+    buffer->buf.bytesused = dev->type == MOCK_UVC ? buf->bytesused : 0;
+    buffer->buf.flags = V4L2_BUF_FLAG_QUEUED;
+    buf->flags = buffer->buf.flags;
+    mock_fifo_push(&dev->queued, buf->index);
+
+    if (dev->streaming && !dev->period)
+        mock_complete(dev, 0);
+
+    return 0;
+}
+
+static int mock_dqbuf(struct mock_device *dev, struct v4l2_buffer *buf)
+{
+    struct mock_buffer *buffer;
+    int index;
+
+    index = mock_fifo_pop(&dev->done);
+    if (index < 0)
+        return -EAGAIN;
+
+    buffer = &dev->bufs[index];
+    buffer->buf.flags &= ~V4L2_BUF_FLAG_DONE;
+    mock_buffer_copy(buf, &buffer->buf);
+    buf->flags |= V4L2_BUF_FLAG_DONE;
+
+    mock_update(dev);
+    return 0;
+}
+
+static int mock_streamon(struct mock_device *dev)
+{
+    unsigned int count;
+
+    dev->streaming = 1;
+    dev->starting = dev->startup != 0;
+    dev->ready_time = mock_now() + dev->startup;
+    dev->next_tick = dev->ready_time + dev->period;
+    dev->delay = 0;
+
+    if (!dev->period && !dev->starting) {
+        for (count = dev->queued.count; count; --count)
+            mock_complete(dev, 0);
+    } else {
+        pthread_cond_signal(&mock.cond);
+    }
+
+    return 0;
+}
+
+static int mock_streamoff(struct mock_device *dev)
+{
+    unsigned int i;
+
+    dev->streaming = 0;
+    dev->starting = 0;
+    memset(&dev->queued, 0, sizeof dev->queued);
+    memset(&dev->done, 0, sizeof dev->done);
+    for (i = 0; i < dev->nbufs; ++i)
+        dev->bufs[i].buf.flags = 0;
+
+    mock_update(dev);
+    return 0;
+}
+
+static int mock_expbuf(struct mock_device *dev, struct v4l2_exportbuffer *expbuf)
+{
+    struct mock_export *export = NULL;
+    unsigned int i;
+    int fd;
+
+    if (dev->memory != V4L2_MEMORY_MMAP || expbuf->index >= dev->nbufs)
+        return -EINVAL;
+
+    for (i = 0; i < MOCK_MAX_EXPORTS; ++i) {
+        if (!mock.exports[i].dev) {
+            export = &mock.exports[i];
+            break;
+        }
+    }
+
+    if (!export)
+        return -ENOMEM;
+
+    fd = fcntl(dev->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    export->fd = fd;
+    export->dev = dev;
+    export->index = expbuf->index;
+    expbuf->fd = fd;
+
+    return 0;
+}
+
+static int mock_dqevent(struct mock_device *dev, struct v4l2_event *event)
+{
+    if (!dev->event_count)
+        return -ENOENT;
+
+    *event = dev->events[dev->event_head];
+    dev->event_head = (dev->event_head + 1) % MOCK_MAX_EVENTS;
+    dev->event_count--;
+    event->pending = dev->event_count;
+
+    mock_update(dev);
+
+    if (mock.wait == MOCK_WAIT_IDLE && !dev->event_count && !dev->function->setup_pending)
+        pthread_cond_signal(&mock.cond);
+
+    return 0;
+}
+
+/*
+ * The data stage of a SET_CUR request follows the response to its setup
+ * stage, the answer to a GET_CUR probe request is kept for the commit.
+ */
+static int mock_send_response(struct mock_device *dev, const struct uvc_request_data *resp)
+{
+    struct mock_function *fn = dev->function;
+    struct uvc_request_data data;
+
+    if (!fn->setup_pending)
+        return 0;
+
+    fn->setup_pending = 0;
+
+    if (resp->length < 0) {
+        fprintf(stderr, "uvc-mock: control request stalled (%d)\n", resp->length);
+    } else if (fn->setup_set) {
+        memset(&data, 0, sizeof data);
+        data.length = sizeof fn->setup_data;
+        memcpy(data.data, &fn->setup_data, sizeof fn->setup_data);
+        mock_event_queue(dev, UVC_EVENT_DATA, &data, sizeof data);
+    } else {
+        memcpy(&fn->probe, resp->data, sizeof fn->probe);
+    }
+
+    if (mock.wait == MOCK_WAIT_IDLE && !dev->event_count)
+        pthread_cond_signal(&mock.cond);
+
+    return 0;
+}
+
+static int mock_ioctl(struct mock_device *dev, unsigned long request, void *arg)
+{
+    struct v4l2_capability *cap;
+    struct v4l2_fmtdesc *desc;
+    struct v4l2_buffer *buf;
+
+    switch (request) {
+    case VIDIOC_QUERYCAP:
+        cap = arg;
+        memset(cap, 0, sizeof *cap);
+        strcpy((char *)cap->driver, "uvc-mock");
+        snprintf((char *)cap->card, sizeof cap->card, "uvc-mock %s", dev->name);
+        strcpy((char *)cap->bus_info, "platform:uvc-mock");
+        cap->capabilities = V4L2_CAP_STREAMING | V4L2_CAP_DEVICE_CAPS |
+                            (dev->type == MOCK_UVC ? V4L2_CAP_VIDEO_OUTPUT : V4L2_CAP_VIDEO_CAPTURE);
+        cap->device_caps = cap->capabilities & ~V4L2_CAP_DEVICE_CAPS;
+        return 0;
+
+    case VIDIOC_ENUM_FMT:
+        desc = arg;
+        if (dev->type != MOCK_CAPTURE || desc->index >= sizeof mock_capture_formats / sizeof mock_capture_formats[0])
+            return -EINVAL;
+        desc->pixelformat = mock_capture_formats[desc->index];
+        desc->flags = desc->pixelformat == V4L2_PIX_FMT_MJPEG ? V4L2_FMT_FLAG_COMPRESSED : 0;
+        snprintf((char *)desc->description, sizeof desc->description, "%.4s", (char *)&desc->pixelformat);
+        return 0;
+
+    case VIDIOC_G_FMT:
+        ((struct v4l2_format *)arg)->fmt.pix = dev->format;
+        return 0;
+
+    case VIDIOC_S_FMT:
+        return mock_set_format(dev, arg);
+
+    case VIDIOC_REQBUFS:
+        return mock_reqbufs(dev, arg);
+
+    case VIDIOC_QUERYBUF:
+        buf = arg;
+        if (buf->index >= dev->nbufs)
+            return -EINVAL;
+        mock_buffer_copy(buf, &dev->bufs[buf->index].buf);
+        return 0;
+
+    case VIDIOC_QBUF:
+        return mock_qbuf(dev, arg);
+
+    case VIDIOC_DQBUF:
+        return mock_dqbuf(dev, arg);
+
+    case VIDIOC_STREAMON:
+        return mock_streamon(dev);
+
+    case VIDIOC_STREAMOFF:
+        return mock_streamoff(dev);
+
+    case VIDIOC_EXPBUF:
+        return mock_expbuf(dev, arg);
+
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_UNSUBSCRIBE_EVENT:
+        return dev->type == MOCK_UVC ? 0 : -EINVAL;
+
+    case VIDIOC_DQEVENT:
+        return dev->type == MOCK_UVC ? mock_dqevent(dev, arg) : -EINVAL;
+
+    case UVCIOC_SEND_RESPONSE:
+        return dev->type == MOCK_UVC ? mock_send_response(dev, arg) : -EINVAL;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Measurements
+ */
+
+/* Process CPU time, less the host thread's own which isn't the application's. */
+static unsigned long long mock_app_cpu(void)
+{
+    clockid_t clock;
+
+    if (pthread_getcpuclockid(mock.thread, &clock))
+        return mock_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+    return mock_clock(CLOCK_PROCESS_CPUTIME_ID) - mock_clock(clock);
+}
+
+static void mock_measure_start(void)
+{
+    mock.measuring = 1;
+    mock.start_frames = mock.frames;
+    mock.start_syscalls = __atomic_load_n(&mock.syscalls, __ATOMIC_RELAXED);
+    mock.window_start = mock_now();
+    mock.start_cpu = mock_app_cpu();
+}
+
+static void mock_measure_stop(void)
+{
+    if (!mock.measuring)
+        return;
+
+    mock.measuring = 0;
+    mock.window_frames += mock.frames - mock.start_frames;
+    mock.window_syscalls += __atomic_load_n(&mock.syscalls, __ATOMIC_RELAXED) - mock.start_syscalls;
+    mock.window_time += mock_now() - mock.window_start;
+    mock.window_cpu += mock_app_cpu() - mock.start_cpu;
+}
+
+/* Totals over all functions, followed by the frames of each with several. */
+static void mock_report(void)
+{
+    unsigned long long frames = mock.window_frames;
+    double seconds = mock.window_time / 1e9;
+    unsigned long long uvc_misses = 0;
+    unsigned long long capture_misses = 0;
+    struct mock_function *fn;
+    unsigned int i;
+
+    for (i = 0; i < mock.nfunctions; ++i) {
+        uvc_misses += mock.functions[i].uvc.misses;
+        capture_misses += mock.functions[i].capture.misses;
+    }
+
+    fprintf(stderr,
+            "uvc-mock: frames=%llu bytes=%llu errors=%llu fps=%.1f cpu_us_per_frame=%.2f syscalls_per_frame=%.2f "
+            "ttff_us=%llu uvc_misses=%llu capture_misses=%llu\n",
+            mock.frames, mock.bytes, mock.errors, seconds > 0 ? frames / seconds : 0.0,
+            frames ? mock.window_cpu / 1e3 / frames : 0.0, frames ? (double)mock.window_syscalls / frames : 0.0,
+            mock.first_frame ? (mock.first_frame - mock.streamon_time) / 1000 : 0, uvc_misses, capture_misses);
+
+    if (mock.nfunctions < 2)
+        return;
+
+    for (i = 0; i < mock.nfunctions; ++i) {
+        fn = &mock.functions[i];
+        fprintf(stderr, "uvc-mock: function %u %s frames=%llu uvc_misses=%llu capture_misses=%llu\n", i,
+                fn->uvc.path, fn->frames, fn->uvc.misses, fn->capture.misses);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Host side script
+ */
+
+static void mock_setup(struct mock_function *fn, int set, unsigned int cs, const struct uvc_streaming_control *ctrl)
+{
+    struct usb_ctrlrequest req;
+
+    memset(&req, 0, sizeof req);
+    req.bRequestType = (set ? USB_DIR_OUT : USB_DIR_IN) | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    req.bRequest = set ? UVC_SET_CUR : UVC_GET_CUR;
+    req.wValue = cs << 8;
+    req.wIndex = UVC_INTF_STREAMING;
+    req.wLength = sizeof *ctrl;
+
+    fn->setup_pending = 1;
+    fn->setup_set = set;
+    if (ctrl)
+        fn->setup_data = *ctrl;
+
+    mock_event_queue(&fn->uvc, UVC_EVENT_SETUP, &req, sizeof req);
+}
+
+/* Run a host side command on one function. */
+static void mock_function_command(struct mock_function *fn, const char *cmd, const unsigned int *args, int n)
+{
+    struct uvc_streaming_control ctrl;
+    enum usb_device_speed speed;
+
+    if (!strcmp(cmd, "connect")) {
+        speed = n > 1 ? args[0] : USB_SPEED_SUPER;
+        mock_event_queue(&fn->uvc, UVC_EVENT_CONNECT, &speed, sizeof speed);
+    } else if (!strcmp(cmd, "probe")) {
+        memset(&ctrl, 0, sizeof ctrl);
+        ctrl.bmHint = 1;
+        ctrl.bFormatIndex = args[0];
+        ctrl.bFrameIndex = args[1];
+        ctrl.dwFrameInterval = args[2];
+        mock_setup(fn, 1, UVC_VS_PROBE_CONTROL, &ctrl);
+        fn->probe_get = 1;
+    } else if (!strcmp(cmd, "commit")) {
+        mock_setup(fn, 1, UVC_VS_COMMIT_CONTROL, &fn->probe);
+    } else if (!strcmp(cmd, "streamon")) {
+        mock_event_queue(&fn->uvc, UVC_EVENT_STREAMON, NULL, 0);
+    } else if (!strcmp(cmd, "streamoff")) {
+        mock_event_queue(&fn->uvc, UVC_EVENT_STREAMOFF, NULL, 0);
+    } else if (!strcmp(cmd, "disconnect")) {
+        while (fn->uvc.queued.count)
+            mock_complete(&fn->uvc, V4L2_BUF_FLAG_ERROR);
+        mock_event_queue(&fn->uvc, UVC_EVENT_DISCONNECT, NULL, 0);
+    } else if (!strcmp(cmd, "frames")) {
+        fn->wait_frames = fn->frames + args[0];
+    }
+}
+
+/* Run one script command, returns 0 when the script is over. */
+static int mock_script_command(const char *line)
+{
+    unsigned int args[3] = {1, 1, 0};
+    struct mock_function *fn;
+    unsigned int held;
+    unsigned int i;
+    char cmd[32];
+    int n;
+
+    n = sscanf(line, "%31s %u %u %u", cmd, &args[0], &args[1], &args[2]);
+    if (n < 1 || cmd[0] == '#')
+        return 1;
+
+    mock.wait = MOCK_WAIT_IDLE;
+
+    if (!strcmp(cmd, "connect") || !strcmp(cmd, "probe") || !strcmp(cmd, "commit")) {
+        for (i = 0; i < mock.nfunctions; ++i)
+            mock_function_command(&mock.functions[i], cmd, args, n);
+    } else if (!strcmp(cmd, "streamon")) {
+        mock_measure_start();
+        if (!mock.streamon_time)
+            mock.streamon_time = mock_now();
+        for (i = 0; i < mock.nfunctions; ++i)
+            mock_function_command(&mock.functions[i], cmd, args, n);
+    } else if (!strcmp(cmd, "streamoff") || !strcmp(cmd, "disconnect")) {
+        mock_measure_stop();
+        for (i = 0; i < mock.nfunctions; ++i)
+            mock_function_command(&mock.functions[i], cmd, args, n);
+    } else if (!strcmp(cmd, "frames") && n > 1) {
+        mock.wait = MOCK_WAIT_FRAMES;
+        for (i = 0; i < mock.nfunctions; ++i)
+            mock_function_command(&mock.functions[i], cmd, args, n);
+    } else if (!strcmp(cmd, "sleep") && n > 1) {
+        mock.wait = MOCK_WAIT_TIME;
+        mock.wait_until = mock_now() + args[0] * 1000000ULL;
+    } else if (!strcmp(cmd, "exit")) {
+        mock_measure_stop();
+        mock.wait = MOCK_WAIT_NONE;
+        kill(getpid(), SIGTERM);
+        return 0;
+    } else {
+        fprintf(stderr, "uvc-mock: line %u: unknown command '%s'\n", mock.lineno, cmd);
+        mock.wait = MOCK_WAIT_NONE;
+    }
+
+    /* Read the buffers held until now. */
+    for (i = 0; i < mock.nfunctions; ++i) {
+        fn = &mock.functions[i];
+        if (!fn->uvc.streaming || fn->uvc.period)
+            continue;
+
+        for (held = fn->uvc.queued.count; held; --held)
+            mock_complete(&fn->uvc, 0);
+    }
+
+    return 1;
+}
+
+static int mock_script_blocked(unsigned long long now)
+{
+    struct mock_function *fn;
+    unsigned int i;
+
+    for (i = 0; i < mock.nfunctions; ++i) {
+        fn = &mock.functions[i];
+
+        switch (mock.wait) {
+        case MOCK_WAIT_IDLE:
+            if (fn->uvc.event_count || fn->setup_pending)
+                return 1;
+            break;
+        case MOCK_WAIT_FRAMES:
+            if (fn->frames < fn->wait_frames)
+                return 1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    switch (mock.wait) {
+    case MOCK_WAIT_TIME:
+        return now < mock.wait_until;
+    case MOCK_WAIT_NONE:
+    default:
+        return 0;
+    }
+}
+
+/* Run script commands until one has to wait, returns the wake up time. */
+static unsigned long long mock_script_run(unsigned long long now)
+{
+    struct mock_function *fn;
+    unsigned int i;
+    int probing;
+    char *end;
+
+    while (mock.line) {
+        if (mock_script_blocked(now)) {
+            if (now < mock.deadline)
+                return mock.wait == MOCK_WAIT_TIME ? mock.wait_until : mock.deadline;
+
+            fprintf(stderr, "uvc-mock: line %u: timeout, stopping\n", mock.lineno);
+            mock.wait = MOCK_WAIT_NONE;
+            mock_script_command("exit");
+            mock.line = NULL;
+            break;
+        }
+
+        for (i = 0, probing = 0; i < mock.nfunctions; ++i) {
+            fn = &mock.functions[i];
+            if (!fn->probe_get)
+                continue;
+
+            fn->probe_get = 0;
+            mock_setup(fn, 0, UVC_VS_PROBE_CONTROL, NULL);
+            probing = 1;
+        }
+
+        if (probing)
+            continue;
+
+        end = strchr(mock.line, '\n');
+        if (end)
+            *end = '\0';
+
+        mock.lineno++;
+        mock.deadline = now + mock.timeout;
+        if (!mock_script_command(mock.line))
+            end = NULL;
+
+        mock.line = end ? end + 1 : NULL;
+    }
+
+    return ~0ULL;
+}
+
+static char *mock_script_load(void)
+{
+    const char *path = getenv("UVC_MOCK_SCRIPT");
+    char *script;
+    size_t size;
+    FILE *file;
+    long len;
+
+    if (!path || !*path) {
+        size = sizeof MOCK_DEFAULT_SCRIPT + 16;
+        script = malloc(size);
+        if (script)
+            snprintf(script, size, MOCK_DEFAULT_SCRIPT, (unsigned int)mock_env("UVC_MOCK_FRAMES", 300));
+        return script;
+    }
+
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "uvc-mock: unable to open script '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    rewind(file);
+
+    script = calloc(1, len + 1);
+    if (script && fread(script, 1, len, file) != (size_t)len) {
+        free(script);
+        script = NULL;
+    }
+
+    fclose(file);
+    return script;
+}
+
+/* Bring the wake up time forward to the next tick of the device, if earlier. */
+static unsigned long long mock_deadline(const struct mock_device *dev, unsigned long long deadline)
+{
+    if (dev->streaming && dev->period && dev->next_tick + dev->delay < deadline)
+        deadline = dev->next_tick + dev->delay;
+    if (dev->starting && dev->ready_time < deadline)
+        deadline = dev->ready_time;
+
+    return deadline;
+}
+
+static void *mock_thread(void *arg)
+{
+    unsigned long long deadline;
+    unsigned long long now;
+    struct mock_function *fn;
+    struct timespec ts;
+    unsigned int i;
+
+    (void)arg;
+
+    pthread_mutex_lock(&mock.lock);
+
+    while (!mock.stop) {
+        now = mock_now();
+
+        for (i = 0; i < mock.nfunctions; ++i) {
+            mock_tick(&mock.functions[i].uvc, now);
+            mock_tick(&mock.functions[i].capture, now);
+        }
+
+        deadline = mock_script_run(now);
+
+        for (i = 0; i < mock.nfunctions; ++i) {
+            fn = &mock.functions[i];
+            deadline = mock_deadline(&fn->uvc, deadline);
+            deadline = mock_deadline(&fn->capture, deadline);
+        }
+
+        if (deadline == ~0ULL) {
+            pthread_cond_wait(&mock.cond, &mock.lock);
+        } else {
+            ts.tv_sec = deadline / 1000000000ULL;
+            ts.tv_nsec = deadline % 1000000000ULL;
+            pthread_cond_timedwait(&mock.cond, &mock.lock, &ts);
+        }
+    }
+
+    pthread_mutex_unlock(&mock.lock);
+    return NULL;
+}
+
+/* Start the host thread with all signals blocked, they belong to the application. */
+static void mock_start(void)
+{
+    pthread_condattr_t attr;
+    sigset_t mask, old;
+
+    if (mock.started)
+        return;
+
+    mock.script = mock_script_load();
+    mock.line = mock.script;
+    mock.timeout = mock_env("UVC_MOCK_TIMEOUT", 10) * 1000000000ULL;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mock.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    if (pthread_create(&mock.thread, NULL, mock_thread, NULL) == 0)
+        mock.started = 1;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* ---------------------------------------------------------------------------
+ * Interposed functions
+ */
+
+static struct mock_device *mock_device(int fd)
+{
+    struct mock_function *fn;
+    unsigned int i;
+
+    if (fd < 0)
+        return NULL;
+
+    for (i = 0; i < mock.nfunctions; ++i) {
+        fn = &mock.functions[i];
+        if (fd == fn->uvc.fd)
+            return &fn->uvc;
+        if (fd == fn->capture.fd)
+            return &fn->capture;
+    }
+
+    return NULL;
+}
+
+static int mock_open(const char *path)
+{
+    struct mock_device *dev = NULL;
+    struct mock_function *fn;
+    unsigned int i;
+
+    for (i = 0; i < mock.nfunctions && !dev; ++i) {
+        fn = &mock.functions[i];
+        if (fn->uvc.path && !strcmp(path, fn->uvc.path))
+            dev = &fn->uvc;
+        else if (fn->capture.path && !strcmp(path, fn->capture.path))
+            dev = &fn->capture;
+    }
+
+    if (!dev)
+        return -2;
+
+    pthread_mutex_lock(&mock.lock);
+
+    if (dev->fd >= 0) {
+        pthread_mutex_unlock(&mock.lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    dev->fd = memfd_create(path, MFD_CLOEXEC);
+    if (dev->fd >= 0) {
+        dev->format.pixelformat = V4L2_PIX_FMT_YUYV;
+        mock_format_fill(&dev->format);
+        mock_start();
+    }
+
+    pthread_mutex_unlock(&mock.lock);
+    return dev->fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list ap;
+    int fd;
+
+    fd = mock_open(path);
+    if (fd != -2)
+        return fd;
+
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int close(int fd)
+{
+    struct mock_device *dev;
+    struct mock_watch **watch;
+    struct mock_watch *dead;
+    unsigned int i;
+
+    pthread_mutex_lock(&mock.lock);
+
+    for (i = 0; i < MOCK_MAX_EXPORTS; ++i) {
+        if (mock.exports[i].dev && mock.exports[i].fd == fd)
+            mock.exports[i].dev = NULL;
+    }
+
+    dev = mock_device(fd);
+    if (dev) {
+        for (watch = &mock.watches; *watch;) {
+            if ((*watch)->dev != dev) {
+                watch = &(*watch)->next;
+                continue;
+            }
+
+            dead = *watch;
+            *watch = dead->next;
+            real_close(dead->doorbell);
+            free(dead);
+            mock.nwatches--;
+        }
+
+        mock_streamoff(dev);
+        if (dev->map)
+            munmap(dev->map, dev->map_size);
+        dev->map = NULL;
+        dev->map_size = 0;
+        dev->nbufs = 0;
+        dev->fd = -1;
+    }
+
+    pthread_mutex_unlock(&mock.lock);
+
+    return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    struct mock_device *dev;
+    va_list ap;
+    void *arg;
+    int ret;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    __atomic_fetch_add(&mock.syscalls, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&mock.lock);
+    dev = mock_device(fd);
+    if (!dev) {
+        pthread_mutex_unlock(&mock.lock);
+        return real_ioctl(fd, request, arg);
+    }
+
+    ret = mock_ioctl(dev, request, arg);
+    pthread_mutex_unlock(&mock.lock);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    __atomic_fetch_add(&mock.syscalls, 1, __ATOMIC_RELAXED);
+    return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    __atomic_fetch_add(&mock.syscalls, 1, __ATOMIC_RELAXED);
+    return real_write(fd, buf, count);
+}
+
+static struct mock_watch *mock_watch_find(int epfd, int fd)
+{
+    struct mock_watch *watch;
+
+    for (watch = mock.watches; watch; watch = watch->next) {
+        if (watch->epfd == epfd && watch->dev->fd == fd)
+            return watch;
+    }
+
+    return NULL;
+}
+
+static int mock_epoll_ctl(struct mock_device *dev, int epfd, int op, struct epoll_event *event)
+{
+    struct mock_watch *watch = mock_watch_find(epfd, dev->fd);
+    struct mock_watch **link;
+    struct epoll_event ev;
+
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if (watch)
+            return -EEXIST;
+
+        watch = calloc(1, sizeof *watch);
+        if (!watch)
+            return -ENOMEM;
+
+        watch->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (watch->doorbell < 0) {
+            free(watch);
+            return -errno;
+        }
+
+        watch->dev = dev;
+        watch->epfd = epfd;
+        watch->mask = event->events;
+        watch->data = event->data.u64;
+
+        ev.events = EPOLLIN;
+        ev.data = event->data;
+        if (real_epoll_ctl(epfd, EPOLL_CTL_ADD, watch->doorbell, &ev) < 0) {
+            real_close(watch->doorbell);
+            free(watch);
+            return -errno;
+        }
+
+        watch->next = mock.watches;
+        mock.watches = watch;
+        mock.nwatches++;
+        break;
+
+    case EPOLL_CTL_MOD:
+        if (!watch)
+            return -ENOENT;
+
+        watch->mask = event->events;
+        watch->data = event->data.u64;
+        ev.events = EPOLLIN;
+        ev.data = event->data;
+        real_epoll_ctl(epfd, EPOLL_CTL_MOD, watch->doorbell, &ev);
+        break;
+
+    case EPOLL_CTL_DEL:
+        if (!watch)
+            return -ENOENT;
+
+        for (link = &mock.watches; *link != watch; link = &(*link)->next)
+            ;
+        *link = watch->next;
+        mock.nwatches--;
+
+        real_epoll_ctl(epfd, EPOLL_CTL_DEL, watch->doorbell, NULL);
+        real_close(watch->doorbell);
+        free(watch);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    struct mock_device *dev;
+    int ret;
+
+    __atomic_fetch_add(&mock.syscalls, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&mock.lock);
+    dev = mock_device(fd);
+    if (!dev) {
+        pthread_mutex_unlock(&mock.lock);
+        return real_epoll_ctl(epfd, op, fd, event);
+    }
+
+    ret = mock_epoll_ctl(dev, epfd, op, event);
+    mock_update(dev);
+    pthread_mutex_unlock(&mock.lock);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Report the events mock devices are ready for in place of their doorbells. */
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    struct mock_watch *watch;
+    int nevents;
+    int i, n;
+
+    __atomic_fetch_add(&mock.syscalls, 1, __ATOMIC_RELAXED);
+
+    nevents = real_epoll_wait(epfd, events, maxevents, timeout);
+    if (nevents <= 0 || !__atomic_load_n(&mock.nwatches, __ATOMIC_RELAXED))
+        return nevents;
+
+    pthread_mutex_lock(&mock.lock);
+
+    for (i = 0, n = 0; i < nevents; ++i) {
+        for (watch = mock.watches; watch; watch = watch->next) {
+            if (watch->epfd == epfd && watch->data == events[i].data.u64)
+                break;
+        }
+
+        if (watch) {
+            events[i].events = watch->dev->ready & watch->mask;
+            if (!events[i].events)
+                continue;
+        }
+
+        events[n++] = events[i];
+    }
+
+    pthread_mutex_unlock(&mock.lock);
+
+    return n;
+}
+
+static void mock_device_init(struct mock_device *dev, struct mock_function *fn, enum mock_type type,
+                             const char *path)
+{
+    dev->type = type;
+    dev->name = type == MOCK_UVC ? "uvc" : "capture";
+    dev->path = path;
+    dev->fd = -1;
+    dev->function = fn;
+}
+
+/*
+ * Set the functions up from the device path lists, a capture device path
+ * missing from its list is left unmocked.
+ */
+static void mock_functions_init(void)
+{
+    const char *uvc = getenv("UVC_MOCK_UVC") ? getenv("UVC_MOCK_UVC") : "/dev/video0";
+    const char *capture = getenv("UVC_MOCK_V4L2") ? getenv("UVC_MOCK_V4L2") : "/dev/video1";
+    char *uvc_paths, *capture_paths;
+    char *uvc_path, *capture_path;
+    struct mock_function *fn;
+    unsigned int i;
+
+    mock.paths = malloc(strlen(uvc) + strlen(capture) + 2);
+    if (!mock.paths)
+        return;
+
+    uvc_paths = strcpy(mock.paths, uvc);
+    capture_paths = strcpy(mock.paths + strlen(uvc) + 1, capture);
+
+    for (i = 0; i < MOCK_MAX_FUNCTIONS; ++i) {
+        uvc_path = strsep(&uvc_paths, ",");
+        capture_path = strsep(&capture_paths, ",");
+        if (!uvc_path || !*uvc_path)
+            break;
+
+        fn = &mock.functions[i];
+        mock_device_init(&fn->uvc, fn, MOCK_UVC, uvc_path);
+        mock_device_init(&fn->capture, fn, MOCK_CAPTURE, capture_path && *capture_path ? capture_path : NULL);
+
+        if (mock_env("UVC_MOCK_FPS", 0))
+            fn->uvc.period = 1000000000ULL / mock_env("UVC_MOCK_FPS", 0);
+        if (mock_env("UVC_MOCK_CAPTURE_FPS", 0))
+            fn->capture.period = 1000000000ULL / mock_env("UVC_MOCK_CAPTURE_FPS", 0);
+        fn->uvc.jitter = mock_env("UVC_MOCK_JITTER", 0) * 1000000ULL;
+        fn->capture.jitter = mock_env("UVC_MOCK_CAPTURE_JITTER", 0) * 1000000ULL;
+        fn->uvc.seed = 1 + 2 * i;
+        fn->capture.seed = 2 + 2 * i;
+        fn->capture.startup = mock_env("UVC_MOCK_CAPTURE_STARTUP", 0) * 1000000ULL;
+    }
+
+    mock.nfunctions = i;
+}
+
+__attribute__((constructor)) static void mock_init(void)
+{
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_write = dlsym(RTLD_NEXT, "write");
+    real_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+    real_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+
+    mock_functions_init();
+}
+
+__attribute__((destructor)) static void mock_exit(void)
+{
+    if (!mock.started)
+        return;
+
+    pthread_mutex_lock(&mock.lock);
+    mock_measure_stop();
+    mock.stop = 1;
+    pthread_cond_signal(&mock.cond);
+    pthread_mutex_unlock(&mock.lock);
+
+    pthread_join(mock.thread, NULL);
+    mock_report();
+    free(mock.script);
+    free(mock.paths);
+}
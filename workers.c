@@ -0,0 +1,117 @@
+/*
+ * UVC gadget test application - worker thread pool
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+static void *workers_thread(void *arg)
+{
+    struct workers *workers = arg;
+    struct work *work;
+
+    pthread_mutex_lock(&workers->lock);
+
+    while (1) {
+        while (!workers->head && !workers->stop)
+            pthread_cond_wait(&workers->cond, &workers->lock);
+
+        if (!workers->head)
+            break;
+
+        work = workers->head;
+        workers->head = work->next;
+        if (!workers->head)
+            workers->tail = &workers->head;
+
+        pthread_mutex_unlock(&workers->lock);
+        work->func(work);
+        pthread_mutex_lock(&workers->lock);
+    }
+
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+int workers_init(struct workers *workers, unsigned int nthreads)
+{
+    unsigned int i;
+    long ncpus;
+    int ret;
+
+    memset(workers, 0, sizeof *workers);
+
+    if (!nthreads) {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+
+    workers->threads = calloc(nthreads, sizeof workers->threads[0]);
+    if (workers->threads == NULL)
+        return -ENOMEM;
+
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->cond, NULL);
+    workers->tail = &workers->head;
+
+    for (i = 0; i < nthreads; ++i) {
+        ret = pthread_create(&workers->threads[i], NULL, workers_thread, workers);
+        if (ret) {
+            printf("WORKERS: Unable to create thread: %s (%d).\n", strerror(ret), ret);
+            workers_cleanup(workers);
+            return -ret;
+        }
+
+        workers->nthreads++;
+    }
+
+    printf("WORKERS: %u thread(s) started\n", nthreads);
+
+    return 0;
+}
+
+/* Pending work items are run before the threads exit. */
+void workers_cleanup(struct workers *workers)
+{
+    unsigned int i;
+
+    if (workers->threads == NULL)
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->stop = 1;
+    pthread_cond_broadcast(&workers->cond);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->nthreads; ++i)
+        pthread_join(workers->threads[i], NULL);
+
+    pthread_cond_destroy(&workers->cond);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->threads);
+    workers->threads = NULL;
+    workers->nthreads = 0;
+}
+
+void workers_queue(struct workers *workers, struct work *work)
+{
+    work->next = NULL;
+
+    pthread_mutex_lock(&workers->lock);
+    *workers->tail = work;
+    workers->tail = &work->next;
+    pthread_cond_signal(&workers->cond);
+    pthread_mutex_unlock(&workers->lock);
+}
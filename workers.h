@@ -0,0 +1,42 @@
+/*
+ * UVC gadget test application - worker thread pool
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include <pthread.h>
+
+/*
+ * A unit of work, embedded in the caller's own job structure. Work items are
+ * run in submission order, but complete in any order when the pool has more
+ * than one thread.
+ */
+struct work {
+    void (*func)(struct work *work);
+    struct work *next;
+};
+
+struct workers {
+    pthread_t *threads;
+    unsigned int nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct work *head;
+    struct work **tail;
+    int stop;
+};
+
+/* Start a pool of nthreads threads, or one per online CPU if nthreads is 0. */
+int workers_init(struct workers *workers, unsigned int nthreads);
+void workers_cleanup(struct workers *workers);
+
+void workers_queue(struct workers *workers, struct work *work);
+
+#endif /* _WORKERS_H_ */